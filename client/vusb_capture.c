@@ -278,11 +278,12 @@ void UsbCaptureCloseDevice(PUSB_CAPTURED_DEVICE device)
         device->WinUsbHandle = NULL;
     }
 
-    /* Close device handle */
+    /* Close device handle, which also drops any completion port binding */
     if (device->DeviceHandle != INVALID_HANDLE_VALUE) {
         CloseHandle(device->DeviceHandle);
         device->DeviceHandle = INVALID_HANDLE_VALUE;
     }
+    device->CompletionPort = NULL;
 
     device->Opened = FALSE;
 }
@@ -539,8 +540,11 @@ int UsbCaptureAsyncBulkTransfer(
 
     if (!device || !device->Opened || !transfer) return -1;
 
+    /* With a completion port bound the port is notified, not an event */
     memset(&transfer->Overlapped, 0, sizeof(OVERLAPPED));
-    transfer->Overlapped.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+    if (!device->CompletionPort) {
+        transfer->Overlapped.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+    }
     transfer->Device = device;
     transfer->Endpoint = endpoint;
     transfer->Buffer = data;
@@ -555,13 +559,73 @@ int UsbCaptureAsyncBulkTransfer(
     }
 
     if (!result && GetLastError() != ERROR_IO_PENDING) {
-        CloseHandle(transfer->Overlapped.hEvent);
+        if (transfer->Overlapped.hEvent) {
+            CloseHandle(transfer->Overlapped.hEvent);
+            transfer->Overlapped.hEvent = NULL;
+        }
         return -1;
     }
 
     return 0;
 }
 
+/**
+ * UsbCaptureBindCompletionPort - Route async transfer completions to a port
+ *
+ * The completion key is the device. The binding lasts until the device is
+ * closed.
+ */
+int UsbCaptureBindCompletionPort(PUSB_CAPTURED_DEVICE device, HANDLE port)
+{
+    if (!device || !device->Opened || !port) return -1;
+
+    if (device->CompletionPort == port) {
+        return 0;
+    }
+
+    if (!CreateIoCompletionPort(device->DeviceHandle, port, (ULONG_PTR)device, 0)) {
+        printf("[Capture] Failed to bind completion port: %lu\n", GetLastError());
+        return -1;
+    }
+
+    device->CompletionPort = port;
+    return 0;
+}
+
+/**
+ * UsbCaptureFinishTransfer - Collect the result of a finished async transfer
+ *
+ * Runs the transfer's callback with 0 or the Win32 error of the transfer.
+ */
+void UsbCaptureFinishTransfer(PUSB_ASYNC_TRANSFER transfer)
+{
+    PUSB_CAPTURED_DEVICE device = transfer->Device;
+    ULONG transferred = 0;
+    uint32_t status = 0;
+
+    if (!WinUsb_GetOverlappedResult(device->WinUsbHandle, &transfer->Overlapped,
+                                    &transferred, FALSE)) {
+        status = GetLastError();
+        device->TransferErrors++;
+    } else {
+        device->TransfersCompleted++;
+        if (transfer->Endpoint & 0x80) {
+            device->BytesIn += transferred;
+        } else {
+            device->BytesOut += transferred;
+        }
+    }
+
+    if (transfer->Overlapped.hEvent) {
+        CloseHandle(transfer->Overlapped.hEvent);
+        transfer->Overlapped.hEvent = NULL;
+    }
+
+    if (transfer->Callback) {
+        transfer->Callback(transfer, status, transferred, transfer->CallbackContext);
+    }
+}
+
 /**
  * UsbCaptureCancelTransfer - Cancel an asynchronous transfer
  */
@@ -57,6 +57,7 @@ typedef struct _USB_CAPTURED_DEVICE {
     HANDLE              DeviceHandle;
     WINUSB_INTERFACE_HANDLE WinUsbHandle;
     WINUSB_INTERFACE_HANDLE InterfaceHandles[MAX_USB_INTERFACES];
+    HANDLE              CompletionPort;     /* Async transfers complete here, if bound */
     
     /* Device information */
     VUSB_DEVICE_INFO    DeviceInfo;
@@ -162,6 +163,12 @@ int UsbCaptureAsyncBulkTransfer(
 
 int UsbCaptureCancelTransfer(PUSB_ASYNC_TRANSFER transfer);
 
+/* Route async transfer completions to an I/O completion port */
+int UsbCaptureBindCompletionPort(PUSB_CAPTURED_DEVICE device, HANDLE port);
+
+/* Collect the result of a finished async transfer and run its callback */
+void UsbCaptureFinishTransfer(PUSB_ASYNC_TRANSFER transfer);
+
 /* Utility functions */
 const char* UsbCaptureGetSpeedString(uint8_t speed);
 const char* UsbCaptureGetClassString(uint8_t deviceClass);
@@ -8,11 +8,14 @@
 #ifdef _WIN32
 #include <winsock2.h>
 #include <ws2tcpip.h>
+#include <afunix.h>
 #include <windows.h>
 #pragma comment(lib, "ws2_32.lib")
 #else
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <unistd.h>
 #include <netdb.h>
@@ -25,10 +28,15 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stddef.h>
 #include <stdint.h>
 
 #include "vusb_client.h"
 #include "../protocol/vusb_protocol.h"
+#include "../protocol/vusb_hash.h"
+#ifdef _WIN32
+#include "../protocol/vusb_shm.h"
+#endif
 
 /* Global client context */
 static VUSB_CLIENT_CONTEXT g_ClientContext = {0};
@@ -49,6 +57,7 @@ int main(int argc, char* argv[])
     strcpy(config.ServerAddress, "127.0.0.1");
     config.ServerPort = VUSB_DEFAULT_PORT;
     strcpy(config.ClientName, "VUSBClient");
+    config.Capabilities = VUSB_CAP_DESC_BUNDLE;
 
     /* Parse command line arguments */
     for (int i = 1; i < argc; i++) {
@@ -58,19 +67,31 @@ int main(int argc, char* argv[])
             config.ServerPort = (uint16_t)atoi(argv[++i]);
         } else if (strcmp(argv[i], "--name") == 0 && i + 1 < argc) {
             strncpy(config.ClientName, argv[++i], sizeof(config.ClientName) - 1);
+        } else if (strcmp(argv[i], "--shm") == 0 && i + 1 < argc) {
+            strncpy(config.ShmName, argv[++i], sizeof(config.ShmName) - 1);
+        } else if (strcmp(argv[i], "--local-socket") == 0 && i + 1 < argc) {
+            strncpy(config.LocalSocket, argv[++i], sizeof(config.LocalSocket) - 1);
         } else if (strcmp(argv[i], "--help") == 0 || strcmp(argv[i], "-h") == 0) {
             printf("Usage: vusb_client [options]\n");
             printf("Options:\n");
             printf("  --server <address>    Server address (default: 127.0.0.1)\n");
             printf("  --port <port>         Server port (default: %d)\n", VUSB_DEFAULT_PORT);
             printf("  --name <name>         Client name (default: VUSBClient)\n");
+            printf("  --shm <name>          Attach to a server on this machine by shared memory\n");
+            printf("  --local-socket <path> Connect to a server's AF_UNIX socket ('@name' = abstract)\n");
             printf("  --help, -h            Show this help\n");
             return 0;
         }
     }
 
     printf("Configuration:\n");
-    printf("  Server: %s:%d\n", config.ServerAddress, config.ServerPort);
+    if (config.ShmName[0]) {
+        printf("  Server: shared memory %s\n", config.ShmName);
+    } else if (config.LocalSocket[0]) {
+        printf("  Server: local socket %s\n", config.LocalSocket);
+    } else {
+        printf("  Server: %s:%d\n", config.ServerAddress, config.ServerPort);
+    }
     printf("  Client name: %s\n\n", config.ClientName);
 
     /* Initialize client */
@@ -123,13 +144,62 @@ int VusbClientInit(PVUSB_CLIENT_CONTEXT ctx, PVUSB_CLIENT_CONFIG config)
 }
 
 /**
- * VusbClientConnect - Connect to server
+ * VusbClientSend - Send over the connection, like send()
  */
-int VusbClientConnect(PVUSB_CLIENT_CONTEXT ctx)
+int VusbClientSend(PVUSB_CLIENT_CONTEXT ctx, const void* data, uint32_t length)
+{
+#ifdef _WIN32
+    if (ctx->Shm) {
+        WSABUF buffer;
+
+        buffer.buf = (char*)data;
+        buffer.len = length;
+        return VusbShmSend(ctx->Shm, &buffer, 1) == 0 ? (int)length : SOCKET_ERROR;
+    }
+#endif
+    return send(ctx->Socket, (const char*)data, (int)length, 0);
+}
+
+/**
+ * VusbClientRecv - Receive all of a buffer from the connection, like
+ * recv() with MSG_WAITALL
+ */
+int VusbClientRecv(PVUSB_CLIENT_CONTEXT ctx, void* buffer, uint32_t length)
+{
+#ifdef _WIN32
+    if (ctx->Shm) {
+        return VusbShmRecv(ctx->Shm, buffer, length, TRUE);
+    }
+#endif
+    return recv(ctx->Socket, (char*)buffer, (int)length, MSG_WAITALL);
+}
+
+/**
+ * VusbClientClose - Close the connection; a receive blocked on it returns
+ *
+ * Shared memory stays mapped, for such a receive, until the next connect
+ * or cleanup.
+ */
+void VusbClientClose(PVUSB_CLIENT_CONTEXT ctx)
+{
+#ifdef _WIN32
+    if (ctx->Shm) {
+        VusbShmShutdown(ctx->Shm);
+    }
+#endif
+    if (ctx->Socket != INVALID_SOCKET) {
+        closesocket(ctx->Socket);
+        ctx->Socket = INVALID_SOCKET;
+    }
+}
+
+/**
+ * VusbClientOpenSocket - Make the TCP connection to the server
+ */
+static int VusbClientOpenSocket(PVUSB_CLIENT_CONTEXT ctx)
 {
     struct sockaddr_in serverAddr;
-    VUSB_CONNECT_REQUEST request;
-    VUSB_CONNECT_RESPONSE response;
+    int nodelay = 1;
     int result;
 
     /* Create socket */
@@ -149,8 +219,7 @@ int VusbClientConnect(PVUSB_CLIENT_CONTEXT ctx)
         struct hostent* host = gethostbyname(ctx->Config.ServerAddress);
         if (host == NULL) {
             fprintf(stderr, "Invalid server address: %s\n", ctx->Config.ServerAddress);
-            closesocket(ctx->Socket);
-            ctx->Socket = INVALID_SOCKET;
+            VusbClientClose(ctx);
             return -1;
         }
         memcpy(&serverAddr.sin_addr, host->h_addr_list[0], host->h_length);
@@ -162,8 +231,115 @@ int VusbClientConnect(PVUSB_CLIENT_CONTEXT ctx)
     result = connect(ctx->Socket, (struct sockaddr*)&serverAddr, sizeof(serverAddr));
     if (result == SOCKET_ERROR) {
         fprintf(stderr, "connect() failed\n");
-        closesocket(ctx->Socket);
-        ctx->Socket = INVALID_SOCKET;
+        VusbClientClose(ctx);
+        return -1;
+    }
+
+    /* Completions are batched by the sender itself; never let TCP delay them */
+    setsockopt(ctx->Socket, IPPROTO_TCP, TCP_NODELAY, (char*)&nodelay, sizeof(nodelay));
+    return 0;
+}
+
+/**
+ * VusbClientOpenLocal - Connect to the server's AF_UNIX socket on this host
+ *
+ * A name starting with '@' is abstract.
+ */
+static int VusbClientOpenLocal(PVUSB_CLIENT_CONTEXT ctx)
+{
+    struct sockaddr_un serverAddr;
+    size_t length = strlen(ctx->Config.LocalSocket);
+    int addrLength = (int)sizeof(serverAddr);
+
+    ctx->Socket = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (ctx->Socket == INVALID_SOCKET) {
+        fprintf(stderr, "socket() failed\n");
+        return -1;
+    }
+
+    memset(&serverAddr, 0, sizeof(serverAddr));
+    serverAddr.sun_family = AF_UNIX;
+    if (length >= sizeof(serverAddr.sun_path)) {
+        length = sizeof(serverAddr.sun_path) - 1;
+    }
+    memcpy(serverAddr.sun_path, ctx->Config.LocalSocket, length);
+    if (ctx->Config.LocalSocket[0] == '@') {
+        serverAddr.sun_path[0] = '\0';
+        addrLength = (int)(offsetof(struct sockaddr_un, sun_path) + length);
+    }
+
+    printf("Connecting to %s...\n", ctx->Config.LocalSocket);
+
+    if (connect(ctx->Socket, (struct sockaddr*)&serverAddr, addrLength) == SOCKET_ERROR) {
+        fprintf(stderr, "connect() failed\n");
+        VusbClientClose(ctx);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * VusbClientReleaseShm - Unmap the shared memory of an earlier connection
+ */
+static void VusbClientReleaseShm(PVUSB_CLIENT_CONTEXT ctx)
+{
+#ifdef _WIN32
+    if (ctx->Shm) {
+        VusbShmClose(ctx->Shm);
+        free(ctx->Shm);
+        ctx->Shm = NULL;
+    }
+#else
+    (void)ctx;
+#endif
+}
+
+/**
+ * VusbClientOpenShm - Attach to the server's shared memory on this host
+ */
+static int VusbClientOpenShm(PVUSB_CLIENT_CONTEXT ctx)
+{
+#ifdef _WIN32
+    PVUSB_SHM_CHANNEL shm;
+
+    VusbClientReleaseShm(ctx);
+
+    shm = (PVUSB_SHM_CHANNEL)malloc(sizeof(VUSB_SHM_CHANNEL));
+    if (!shm) {
+        return -1;
+    }
+
+    printf("Attaching to shared memory %s...\n", ctx->Config.ShmName);
+    if (VusbShmConnect(shm, ctx->Config.ShmName) != 0) {
+        free(shm);
+        return -1;
+    }
+
+    ctx->Shm = shm;
+    return 0;
+#else
+    fprintf(stderr, "Shared memory is only available on Windows\n");
+    return -1;
+#endif
+}
+
+/**
+ * VusbClientConnect - Connect to server
+ */
+int VusbClientConnect(PVUSB_CLIENT_CONTEXT ctx)
+{
+    VUSB_CONNECT_REQUEST request;
+    VUSB_CONNECT_RESPONSE response;
+    int result;
+
+    if (ctx->Config.ShmName[0]) {
+        result = VusbClientOpenShm(ctx);
+    } else if (ctx->Config.LocalSocket[0]) {
+        result = VusbClientOpenLocal(ctx);
+    } else {
+        result = VusbClientOpenSocket(ctx);
+    }
+    if (result != 0) {
         return -1;
     }
 
@@ -171,37 +347,105 @@ int VusbClientConnect(PVUSB_CLIENT_CONTEXT ctx)
     VusbInitHeader(&request.Header, VUSB_CMD_CONNECT, 
                    sizeof(request) - sizeof(VUSB_HEADER), ++ctx->Sequence);
     request.ClientVersion = 0x00010000;
-    request.Capabilities = 0;
+    request.Capabilities = ctx->Config.Capabilities;
     strncpy(request.ClientName, ctx->Config.ClientName, sizeof(request.ClientName) - 1);
+    request.UrbCredits = VUSB_CLIENT_URB_CREDITS;
+    request.ByteCredits = VUSB_CLIENT_BYTE_CREDITS;
+    request.EndpointCredits = VUSB_CLIENT_ENDPOINT_CREDITS;
 
-    result = send(ctx->Socket, (char*)&request, sizeof(request), 0);
+    result = VusbClientSend(ctx, &request, sizeof(request));
     if (result != sizeof(request)) {
         fprintf(stderr, "Failed to send connect request\n");
-        closesocket(ctx->Socket);
-        ctx->Socket = INVALID_SOCKET;
+        VusbClientClose(ctx);
         return -1;
     }
 
     /* Receive response */
-    result = recv(ctx->Socket, (char*)&response, sizeof(response), MSG_WAITALL);
+    result = VusbClientRecv(ctx, &response, sizeof(response));
     if (result != sizeof(response)) {
         fprintf(stderr, "Failed to receive connect response\n");
-        closesocket(ctx->Socket);
-        ctx->Socket = INVALID_SOCKET;
+        VusbClientClose(ctx);
         return -1;
     }
 
     if (!VusbValidateHeader(&response.Header) || response.Status != VUSB_STATUS_SUCCESS) {
         fprintf(stderr, "Connect rejected by server\n");
-        closesocket(ctx->Socket);
-        ctx->Socket = INVALID_SOCKET;
+        VusbClientClose(ctx);
         return -1;
     }
 
     ctx->Connected = 1;
     ctx->SessionId = response.SessionId;
+    ctx->Capabilities = response.Capabilities & ctx->Config.Capabilities;
+    memcpy(ctx->ResumeToken, response.ResumeToken, VUSB_RESUME_TOKEN_SIZE);
+    ctx->ResumeGraceMs = response.ResumeGraceMs;
+    if (ctx->ResumeGraceMs == 0) {
+        ctx->Capabilities &= ~VUSB_CAP_SESSION_RESUME;
+    }
+    if (ctx->Capabilities & VUSB_CAP_CREDITS) {
+        ctx->UrbCredits = response.UrbCredits;
+        ctx->ByteCredits = response.ByteCredits;
+        ctx->EndpointCredits = response.EndpointCredits;
+    }
 
     printf("Connected! Session ID: %u\n", ctx->SessionId);
+    if (ctx->Capabilities & VUSB_CAP_CREDITS) {
+        printf("Credits: %u URBs, %u bytes, %u per endpoint\n",
+               ctx->UrbCredits, ctx->ByteCredits, ctx->EndpointCredits);
+    }
+    return 0;
+}
+
+/**
+ * VusbClientResume - Reconnect and take back the devices of the current session
+ * @return: 0 if resumed, 1 if connected but the session had expired,
+ *          -1 if the server could not be reached
+ *
+ * Makes a fresh connection, then presents the old session's token. Once
+ * the server has answered it re-sends the URBs it has not seen completed.
+ */
+int VusbClientResume(PVUSB_CLIENT_CONTEXT ctx)
+{
+    VUSB_SESSION_RESUME_REQUEST request;
+    VUSB_SESSION_RESUME_RESPONSE response;
+    int result;
+
+    request.SessionId = ctx->SessionId;
+    memcpy(request.ResumeToken, ctx->ResumeToken, VUSB_RESUME_TOKEN_SIZE);
+
+    VusbClientClose(ctx);
+    ctx->Connected = 0;
+
+    if (VusbClientConnect(ctx) != 0) {
+        return -1;
+    }
+
+    VusbInitHeader(&request.Header, VUSB_CMD_SESSION_RESUME,
+                   sizeof(request) - sizeof(VUSB_HEADER), ++ctx->Sequence);
+
+    result = VusbClientSend(ctx, &request, sizeof(request));
+    if (result == sizeof(request)) {
+        result = VusbClientRecv(ctx, &response, sizeof(response));
+    }
+
+    if (result != sizeof(response) || !VusbValidateHeader(&response.Header)) {
+        /* Retry with the old session; the new one owns nothing */
+        fprintf(stderr, "Failed to resume session %u\n", request.SessionId);
+        ctx->SessionId = request.SessionId;
+        memcpy(ctx->ResumeToken, request.ResumeToken, VUSB_RESUME_TOKEN_SIZE);
+        VusbClientClose(ctx);
+        ctx->Connected = 0;
+        return -1;
+    }
+
+    if (response.Status != VUSB_STATUS_SUCCESS) {
+        printf("Session %u expired (status %u), devices must be attached again\n",
+               request.SessionId, response.Status);
+        return 1;
+    }
+
+    printf("Resumed session %u: %u devices, %u URBs to replay\n",
+           request.SessionId, response.DeviceCount, response.UrbsReplayed);
     return 0;
 }
 
@@ -210,22 +454,50 @@ int VusbClientConnect(PVUSB_CLIENT_CONTEXT ctx)
  */
 void VusbClientDisconnect(PVUSB_CLIENT_CONTEXT ctx)
 {
-    if (ctx->Socket != INVALID_SOCKET) {
+    if (ctx->Socket != INVALID_SOCKET || ctx->Shm) {
         /* Send disconnect notification */
         VUSB_HEADER disconnect;
         VusbInitHeader(&disconnect, VUSB_CMD_DISCONNECT, 0, ++ctx->Sequence);
-        send(ctx->Socket, (char*)&disconnect, sizeof(disconnect), 0);
+        VusbClientSend(ctx, &disconnect, sizeof(disconnect));
 
-        closesocket(ctx->Socket);
-        ctx->Socket = INVALID_SOCKET;
+        VusbClientClose(ctx);
     }
 
     ctx->Connected = 0;
     printf("Disconnected from server.\n");
 }
 
+/**
+ * VusbClientRequestAttach - Send an attach request and wait for the response
+ */
+static int VusbClientRequestAttach(
+    PVUSB_CLIENT_CONTEXT ctx,
+    const void* request,
+    size_t requestSize,
+    VUSB_DEVICE_ATTACH_RESPONSE* response)
+{
+    int result;
+
+    result = VusbClientSend(ctx, request, (uint32_t)requestSize);
+    if (result != (int)requestSize) {
+        fprintf(stderr, "Failed to send attach request\n");
+        return -1;
+    }
+
+    result = VusbClientRecv(ctx, response, sizeof(*response));
+    if (result != sizeof(*response)) {
+        fprintf(stderr, "Failed to receive attach response\n");
+        return -1;
+    }
+
+    return 0;
+}
+
 /**
  * VusbClientAttachDevice - Attach a device to the server
+ *
+ * A server offering VUSB_CAP_DESC_BUNDLE is first asked whether it already
+ * holds the descriptors; they are only sent if it does not.
  */
 int VusbClientAttachDevice(
     PVUSB_CLIENT_CONTEXT ctx,
@@ -246,6 +518,31 @@ int VusbClientAttachDevice(
 
     *remoteDeviceId = 0;
 
+    if ((ctx->Capabilities & VUSB_CAP_DESC_BUNDLE) && descriptorLength > 0) {
+        VUSB_DEVICE_ATTACH_HASH_REQUEST hashRequest;
+
+        VusbInitHeader(&hashRequest.Header, VUSB_CMD_DEVICE_ATTACH_HASH,
+                       sizeof(hashRequest) - sizeof(VUSB_HEADER), ++ctx->Sequence);
+        memcpy(&hashRequest.DeviceInfo, deviceInfo, sizeof(VUSB_DEVICE_INFO));
+        hashRequest.DescriptorLength = descriptorLength;
+        VusbHash(descriptors, descriptorLength, hashRequest.DescriptorHash);
+
+        if (VusbClientRequestAttach(ctx, &hashRequest, sizeof(hashRequest), &response) != 0) {
+            return -1;
+        }
+
+        if (response.Status == VUSB_STATUS_SUCCESS) {
+            *remoteDeviceId = response.DeviceId;
+            printf("Device attached with remote ID: %u (descriptors already known)\n",
+                   *remoteDeviceId);
+            return 0;
+        }
+        if (response.Status != VUSB_STATUS_BUNDLE_UNKNOWN) {
+            fprintf(stderr, "Attach failed with status %u\n", response.Status);
+            return -1;
+        }
+    }
+
     /* Build attach request */
     requestSize = sizeof(VUSB_HEADER) + sizeof(VUSB_DEVICE_INFO) + sizeof(uint32_t) + descriptorLength;
     requestBuffer = (uint8_t*)malloc(requestSize);
@@ -265,19 +562,11 @@ int VusbClientAttachDevice(
                descriptors, descriptorLength);
     }
 
-    /* Send request */
-    result = send(ctx->Socket, (char*)requestBuffer, (int)requestSize, 0);
+    /* Send request and receive response */
+    result = VusbClientRequestAttach(ctx, requestBuffer, requestSize, &response);
     free(requestBuffer);
 
-    if (result != (int)requestSize) {
-        fprintf(stderr, "Failed to send attach request\n");
-        return -1;
-    }
-
-    /* Receive response */
-    result = recv(ctx->Socket, (char*)&response, sizeof(response), MSG_WAITALL);
-    if (result != sizeof(response)) {
-        fprintf(stderr, "Failed to receive attach response\n");
+    if (result != 0) {
         return -1;
     }
 
@@ -309,13 +598,13 @@ int VusbClientDetachDevice(PVUSB_CLIENT_CONTEXT ctx, uint32_t remoteDeviceId)
     VusbInitHeader(header, VUSB_CMD_DEVICE_DETACH, sizeof(uint32_t), ++ctx->Sequence);
     memcpy(buffer + sizeof(VUSB_HEADER), &remoteDeviceId, sizeof(uint32_t));
 
-    result = send(ctx->Socket, (char*)buffer, sizeof(buffer), 0);
+    result = VusbClientSend(ctx, buffer, sizeof(buffer));
     if (result != sizeof(buffer)) {
         return -1;
     }
 
     /* Receive acknowledgment */
-    result = recv(ctx->Socket, (char*)&response, sizeof(response), MSG_WAITALL);
+    result = VusbClientRecv(ctx, &response, sizeof(response));
     if (result != sizeof(response)) {
         fprintf(stderr, "Failed to receive detach response\n");
         return -1;
@@ -325,6 +614,42 @@ int VusbClientDetachDevice(PVUSB_CLIENT_CONTEXT ctx, uint32_t remoteDeviceId)
     return 0;
 }
 
+/**
+ * VusbClientResetDevice - Tell the server a device was reset
+ *
+ * The server drops what it remembers of the device's state, such as
+ * cached status and configuration answers.
+ */
+int VusbClientResetDevice(PVUSB_CLIENT_CONTEXT ctx, uint32_t remoteDeviceId)
+{
+    uint8_t buffer[sizeof(VUSB_HEADER) + sizeof(uint32_t)];
+    VUSB_HEADER* header = (VUSB_HEADER*)buffer;
+    VUSB_HEADER response;
+    int result;
+
+    if (!ctx->Connected) {
+        return -1;
+    }
+
+    VusbInitHeader(header, VUSB_CMD_DEVICE_RESET, sizeof(uint32_t), ++ctx->Sequence);
+    memcpy(buffer + sizeof(VUSB_HEADER), &remoteDeviceId, sizeof(uint32_t));
+
+    result = VusbClientSend(ctx, buffer, sizeof(buffer));
+    if (result != sizeof(buffer)) {
+        return -1;
+    }
+
+    /* Receive acknowledgment */
+    result = VusbClientRecv(ctx, &response, sizeof(response));
+    if (result != sizeof(response)) {
+        fprintf(stderr, "Failed to receive reset response\n");
+        return -1;
+    }
+
+    printf("Device %u reset.\n", remoteDeviceId);
+    return 0;
+}
+
 /**
  * VusbClientRunInteractive - Run interactive command loop
  */
@@ -335,6 +660,7 @@ int VusbClientRunInteractive(PVUSB_CLIENT_CONTEXT ctx)
     printf("\nInteractive mode. Commands:\n");
     printf("  attach <vid> <pid>   - Attach a simulated USB device\n");
     printf("  detach <id>          - Detach a device\n");
+    printf("  reset <id>           - Reset a device\n");
     printf("  list                 - List attached devices\n");
     printf("  ping                 - Ping server\n");
     printf("  quit                 - Exit\n\n");
@@ -368,6 +694,13 @@ int VusbClientRunInteractive(PVUSB_CLIENT_CONTEXT ctx)
             } else {
                 printf("Usage: detach <id>\n");
             }
+        } else if (strncmp(command, "reset", 5) == 0) {
+            uint32_t id;
+            if (sscanf(command + 5, "%u", &id) == 1) {
+                VusbClientResetDevice(ctx, id);
+            } else {
+                printf("Usage: reset <id>\n");
+            }
         } else if (strcmp(command, "list") == 0) {
             VusbClientListDevices(ctx);
         } else if (strcmp(command, "ping") == 0) {
@@ -447,12 +780,12 @@ int VusbClientListDevices(PVUSB_CLIENT_CONTEXT ctx)
 
     VusbInitHeader(&request, VUSB_CMD_DEVICE_LIST, 0, ++ctx->Sequence);
 
-    result = send(ctx->Socket, (char*)&request, sizeof(request), 0);
+    result = VusbClientSend(ctx, &request, sizeof(request));
     if (result != sizeof(request)) {
         return -1;
     }
 
-    result = recv(ctx->Socket, (char*)&response, sizeof(response), MSG_WAITALL);
+    result = VusbClientRecv(ctx, &response, sizeof(response));
     if (result != sizeof(response)) {
         return -1;
     }
@@ -462,7 +795,7 @@ int VusbClientListDevices(PVUSB_CLIENT_CONTEXT ctx)
     /* Receive device info */
     for (uint32_t i = 0; i < response.DeviceCount; i++) {
         VUSB_DEVICE_INFO info;
-        result = recv(ctx->Socket, (char*)&info, sizeof(info), MSG_WAITALL);
+        result = VusbClientRecv(ctx, &info, sizeof(info));
         if (result == sizeof(info)) {
             printf("  [%u] VID:%04X PID:%04X - %s %s\n",
                    info.DeviceId, info.VendorId, info.ProductId,
@@ -487,12 +820,12 @@ int VusbClientPing(PVUSB_CLIENT_CONTEXT ctx)
 
     VusbInitHeader(&request, VUSB_CMD_PING, 0, ++ctx->Sequence);
 
-    result = send(ctx->Socket, (char*)&request, sizeof(request), 0);
+    result = VusbClientSend(ctx, &request, sizeof(request));
     if (result != sizeof(request)) {
         return -1;
     }
 
-    result = recv(ctx->Socket, (char*)&response, sizeof(response), MSG_WAITALL);
+    result = VusbClientRecv(ctx, &response, sizeof(response));
     if (result == sizeof(response) && response.Command == VUSB_CMD_PONG) {
         printf("Pong received.\n");
         return 0;
@@ -508,6 +841,7 @@ int VusbClientPing(PVUSB_CLIENT_CONTEXT ctx)
 void VusbClientCleanup(PVUSB_CLIENT_CONTEXT ctx)
 {
     VusbClientDisconnect(ctx);
+    VusbClientReleaseShm(ctx);
 
 #ifdef _WIN32
     WSACleanup();
@@ -15,11 +15,19 @@ typedef SOCKET socket_t;
 typedef int socket_t;
 #endif
 
+/* What the client takes in flight at once, offered with VUSB_CAP_CREDITS */
+#define VUSB_CLIENT_URB_CREDITS         64
+#define VUSB_CLIENT_BYTE_CREDITS        (4 * 1024 * 1024)
+#define VUSB_CLIENT_ENDPOINT_CREDITS    8
+
 /* Client configuration */
 typedef struct _VUSB_CLIENT_CONFIG {
     char        ServerAddress[256];
     uint16_t    ServerPort;
     char        ClientName[64];
+    uint32_t    Capabilities;       /* VUSB_CAP_* flags to offer the server */
+    char        ShmName[64];        /* Server's shared memory on this host, empty = TCP */
+    char        LocalSocket[108];   /* Server's AF_UNIX socket on this host, '@' first = abstract */
 } VUSB_CLIENT_CONFIG, *PVUSB_CLIENT_CONFIG;
 
 /* Local device tracking */
@@ -34,8 +42,15 @@ typedef struct _VUSB_LOCAL_DEVICE {
 typedef struct _VUSB_CLIENT_CONTEXT {
     VUSB_CLIENT_CONFIG  Config;
     socket_t            Socket;
+    struct _VUSB_SHM_CHANNEL* Shm;  /* Shared memory transport instead, or NULL */
     int                 Connected;
     uint32_t            SessionId;
+    uint32_t            Capabilities;   /* Negotiated VUSB_CAP_* flags */
+    uint8_t             ResumeToken[VUSB_RESUME_TOKEN_SIZE];    /* For SESSION_RESUME */
+    uint32_t            ResumeGraceMs;  /* How long the server keeps a dropped session */
+    uint32_t            UrbCredits;     /* Windows the server keeps to, 0 = no limit */
+    uint32_t            ByteCredits;
+    uint32_t            EndpointCredits;
     uint32_t            Sequence;
     uint32_t            NextDeviceId;
     VUSB_LOCAL_DEVICE   Devices[VUSB_MAX_DEVICES];
@@ -45,8 +60,14 @@ typedef struct _VUSB_CLIENT_CONTEXT {
 int VusbClientInit(PVUSB_CLIENT_CONTEXT ctx, PVUSB_CLIENT_CONFIG config);
 int VusbClientConnect(PVUSB_CLIENT_CONTEXT ctx);
 void VusbClientDisconnect(PVUSB_CLIENT_CONTEXT ctx);
+int VusbClientResume(PVUSB_CLIENT_CONTEXT ctx);
 void VusbClientCleanup(PVUSB_CLIENT_CONTEXT ctx);
 
+/* Transport, TCP or shared memory; return like send() and recv() with MSG_WAITALL */
+int VusbClientSend(PVUSB_CLIENT_CONTEXT ctx, const void* data, uint32_t length);
+int VusbClientRecv(PVUSB_CLIENT_CONTEXT ctx, void* buffer, uint32_t length);
+void VusbClientClose(PVUSB_CLIENT_CONTEXT ctx);
+
 /* Device operations */
 int VusbClientAttachDevice(
     PVUSB_CLIENT_CONTEXT ctx,
@@ -56,6 +77,7 @@ int VusbClientAttachDevice(
     uint32_t* remoteDeviceId);
 
 int VusbClientDetachDevice(PVUSB_CLIENT_CONTEXT ctx, uint32_t remoteDeviceId);
+int VusbClientResetDevice(PVUSB_CLIENT_CONTEXT ctx, uint32_t remoteDeviceId);
 
 /* Interactive mode */
 int VusbClientRunInteractive(PVUSB_CLIENT_CONTEXT ctx);
@@ -17,6 +17,10 @@
 #include "vusb_capture.h"
 #include "vusb_client_urb.h"
 #include "../protocol/vusb_protocol.h"
+#include "../protocol/vusb_coalesce.h"
+#include "../protocol/vusb_compress.h"
+#include "../protocol/vusb_report.h"
+#include "../protocol/vusb_shm.h"
 
 #pragma comment(lib, "ws2_32.lib")
 #pragma comment(lib, "winusb.lib")
@@ -30,6 +34,30 @@ typedef struct _VUSB_CLIENT_CONTEXT_EX {
     HANDLE                  ReceiveThread;
     HANDLE                  UrbThread;
     volatile BOOL           Running;
+    
+    /* Serializes sends from the receive and URB completion threads */
+    CRITICAL_SECTION        SendLock;
+    
+    /* URB_COMPLETE batch, open while a SUBMIT_URB_BATCH or a burst of
+     * asynchronous completions is processed; guarded by SendLock */
+    LONG                    Batching;
+    uint8_t*                BatchBuffer;
+    uint32_t                BatchLength;
+    uint32_t                BatchCount;
+    
+    /* Bulk completions held in the batch between bursts, and whether the
+     * open batch is to be sent when it closes; guarded by SendLock */
+    VUSB_COALESCE           Coalesce;
+    BOOL                    BatchDue;
+    VUSB_FLUSH_REASON       BatchReason;
+    
+    /* Which endpoints' IN data is worth compressing, and the last interrupt
+     * report of each endpoint as the server knows it; guarded by SendLock */
+    VUSB_COMPRESS_TABLE     Compression;
+    VUSB_REPORT_TABLE       Reports;
+    
+    /* Segmented SUBMIT_URB being received */
+    VUSB_REASSEMBLY         Reassembly;
 } VUSB_CLIENT_CONTEXT_EX, *PVUSB_CLIENT_CONTEXT_EX;
 
 /* Global context */
@@ -41,7 +69,18 @@ static DWORD WINAPI UrbProcessThread(LPVOID param);
 static void ProcessServerMessage(PVUSB_CLIENT_CONTEXT_EX ctx, PVUSB_HEADER header, 
                                   uint8_t* payload, uint32_t payloadLength);
 static int SendUrbCompletion(void* ctx, uint32_t deviceId, uint32_t urbId,
+                             uint8_t endpointAddress, uint8_t transferType,
                              uint32_t status, uint32_t actualLength, uint8_t* data);
+static int FlushUrbCompletions(PVUSB_CLIENT_CONTEXT_EX ctx, VUSB_FLUSH_REASON reason);
+static void BeginUrbCompletions(void* clientCtx);
+static void EndUrbCompletions(void* clientCtx);
+static DWORD FlushDueCompletions(void* clientCtx);
+static void PrintCoalesceStats(PVUSB_CLIENT_CONTEXT_EX ctx);
+static int SendVectored(PVUSB_CLIENT_CONTEXT base, WSABUF* buffers, DWORD count);
+static int SendSegmented(PVUSB_CLIENT_CONTEXT base, const void* head, uint32_t headLength,
+                         const uint8_t* data, uint32_t dataLength, uint32_t sequence);
+static int ReceiveFragment(PVUSB_CLIENT_CONTEXT_EX ctx, PVUSB_HEADER header);
+static int ResumeSession(PVUSB_CLIENT_CONTEXT_EX ctx);
 void RunEnhancedInteractive(PVUSB_CLIENT_CONTEXT_EX ctx);
 
 /**
@@ -52,6 +91,8 @@ int main(int argc, char* argv[])
     VUSB_CLIENT_CONFIG config = {0};
     int result;
     PVUSB_CLIENT_CONTEXT_EX ctx = &g_ClientContextEx;
+    ULONG coalesceBytes = VUSB_COALESCE_BYTES;
+    ULONG coalesceUs = VUSB_COALESCE_DELAY_US;
 
     printf("Virtual USB Client v2.0 (with USB Capture)\n");
     printf("==========================================\n\n");
@@ -60,6 +101,9 @@ int main(int argc, char* argv[])
     strcpy(config.ServerAddress, "127.0.0.1");
     config.ServerPort = VUSB_DEFAULT_PORT;
     strcpy(config.ClientName, "VUSBClient");
+    config.Capabilities = VUSB_CAP_URB_BATCH | VUSB_CAP_SEGMENTED | VUSB_CAP_DESC_BUNDLE |
+                          VUSB_CAP_SESSION_RESUME | VUSB_CAP_CREDITS | VUSB_CAP_COMPRESSION |
+                          VUSB_CAP_REPORT_DELTA;
 
     /* Parse command line arguments */
     for (int i = 1; i < argc; i++) {
@@ -69,19 +113,42 @@ int main(int argc, char* argv[])
             config.ServerPort = (uint16_t)atoi(argv[++i]);
         } else if (strcmp(argv[i], "--name") == 0 && i + 1 < argc) {
             strncpy(config.ClientName, argv[++i], sizeof(config.ClientName) - 1);
+        } else if (strcmp(argv[i], "--shm") == 0 && i + 1 < argc) {
+            strncpy(config.ShmName, argv[++i], sizeof(config.ShmName) - 1);
+        } else if (strcmp(argv[i], "--local-socket") == 0 && i + 1 < argc) {
+            strncpy(config.LocalSocket, argv[++i], sizeof(config.LocalSocket) - 1);
+        } else if (strcmp(argv[i], "--coalesce-bytes") == 0 && i + 1 < argc) {
+            coalesceBytes = (ULONG)atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--coalesce-us") == 0 && i + 1 < argc) {
+            coalesceUs = (ULONG)atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--no-compress") == 0) {
+            config.Capabilities &= ~VUSB_CAP_COMPRESSION;
         } else if (strcmp(argv[i], "--help") == 0 || strcmp(argv[i], "-h") == 0) {
             printf("Usage: vusb_client [options]\n");
             printf("Options:\n");
             printf("  --server <address>    Server address (default: 127.0.0.1)\n");
             printf("  --port <port>         Server port (default: %d)\n", VUSB_DEFAULT_PORT);
             printf("  --name <name>         Client name (default: VUSBClient)\n");
+            printf("  --shm <name>          Attach to a server on this machine by shared memory\n");
+            printf("  --local-socket <path> Connect to a server's AF_UNIX socket ('@name' = abstract)\n");
+            printf("  --coalesce-bytes <n>  Bulk completion bytes held for one send (default: %d, 0 = off)\n",
+                   VUSB_COALESCE_BYTES);
+            printf("  --coalesce-us <us>    Longest a bulk completion is held (default: %d)\n",
+                   VUSB_COALESCE_DELAY_US);
+            printf("  --no-compress         Never compress bulk payloads\n");
             printf("  --help, -h            Show this help\n");
             return 0;
         }
     }
 
     printf("Configuration:\n");
-    printf("  Server: %s:%d\n", config.ServerAddress, config.ServerPort);
+    if (config.ShmName[0]) {
+        printf("  Server: shared memory %s\n", config.ShmName);
+    } else if (config.LocalSocket[0]) {
+        printf("  Server: local socket %s\n", config.LocalSocket);
+    } else {
+        printf("  Server: %s:%d\n", config.ServerAddress, config.ServerPort);
+    }
     printf("  Client name: %s\n\n", config.ClientName);
 
     /* Initialize Winsock */
@@ -96,11 +163,13 @@ int main(int argc, char* argv[])
     memset(ctx, 0, sizeof(VUSB_CLIENT_CONTEXT_EX));
     ctx->Base.Config = config;
     ctx->Base.Socket = INVALID_SOCKET;
+    InitializeCriticalSection(&ctx->SendLock);
 
     /* Initialize USB capture */
     result = UsbCaptureInit(&ctx->Capture);
     if (result != 0) {
         fprintf(stderr, "Failed to initialize USB capture: %d\n", result);
+        DeleteCriticalSection(&ctx->SendLock);
         WSACleanup();
         return 1;
     }
@@ -110,11 +179,15 @@ int main(int argc, char* argv[])
     if (result != 0) {
         fprintf(stderr, "Failed to initialize URB handler: %d\n", result);
         UsbCaptureCleanup(&ctx->Capture);
+        DeleteCriticalSection(&ctx->SendLock);
         WSACleanup();
         return 1;
     }
     ctx->UrbHandler.ClientContext = ctx;
     ctx->UrbHandler.SendCompletion = SendUrbCompletion;
+    ctx->UrbHandler.BeginCompletions = BeginUrbCompletions;
+    ctx->UrbHandler.EndCompletions = EndUrbCompletions;
+    ctx->UrbHandler.FlushCompletions = FlushDueCompletions;
 
     /* Enumerate USB devices */
     printf("Scanning for USB devices...\n");
@@ -124,11 +197,21 @@ int main(int argc, char* argv[])
     result = VusbClientConnect(&ctx->Base);
     if (result != 0) {
         fprintf(stderr, "Failed to connect to server: %d\n", result);
+        ClientUrbCleanup(&ctx->UrbHandler);
         UsbCaptureCleanup(&ctx->Capture);
+        DeleteCriticalSection(&ctx->SendLock);
         WSACleanup();
         return 1;
     }
 
+    ctx->UrbHandler.KeepCompletions = (ctx->Base.Capabilities & VUSB_CAP_SESSION_RESUME) != 0;
+
+    /* Held completions need a batch to wait in and the completion thread to time them out */
+    if ((ctx->Base.Capabilities & VUSB_CAP_URB_BATCH) && ctx->UrbHandler.CompletionThread) {
+        ctx->BatchBuffer = (uint8_t*)malloc(VUSB_MAX_PACKET_SIZE);
+        ctx->BatchLength = sizeof(VUSB_URB_BATCH);
+    }
+    VusbCoalesceInit(&ctx->Coalesce, ctx->BatchBuffer ? coalesceBytes : 0, coalesceUs);
     ctx->Running = TRUE;
 
     /* Start receive thread */
@@ -139,15 +222,20 @@ int main(int argc, char* argv[])
 
     /* Cleanup */
     ctx->Running = FALSE;
-    closesocket(ctx->Base.Socket);
+    VusbClientClose(&ctx->Base);
     
     if (ctx->ReceiveThread) {
         WaitForSingleObject(ctx->ReceiveThread, 2000);
         CloseHandle(ctx->ReceiveThread);
     }
 
+    ClientUrbCleanup(&ctx->UrbHandler);
     UsbCaptureCleanup(&ctx->Capture);
     WSACleanup();
+    PrintCoalesceStats(ctx);
+    free(ctx->BatchBuffer);
+    free(ctx->Reassembly.Buffer);
+    DeleteCriticalSection(&ctx->SendLock);
 
     printf("Client shutdown complete.\n");
     return 0;
@@ -170,38 +258,55 @@ static DWORD WINAPI ReceiveThread(LPVOID param)
         return 1;
     }
 
-    while (ctx->Running && ctx->Base.Connected) {
-        /* Receive header */
-        result = recv(ctx->Base.Socket, (char*)&header, sizeof(header), MSG_WAITALL);
-        if (result != sizeof(header)) {
-            if (ctx->Running) {
-                printf("[Recv] Connection closed\n");
+    for (;;) {
+        while (ctx->Running && ctx->Base.Connected) {
+            /* Receive header */
+            result = VusbClientRecv(&ctx->Base, &header, sizeof(header));
+            if (result != sizeof(header)) {
+                if (ctx->Running) {
+                    printf("[Recv] Connection closed\n");
+                }
+                break;
             }
-            break;
-        }
 
-        /* Validate header */
-        if (!VusbValidateHeader(&header)) {
-            printf("[Recv] Invalid protocol header\n");
-            continue;
-        }
+            /* Validate header */
+            if (!VusbValidateHeader(&header)) {
+                printf("[Recv] Invalid protocol header\n");
+                continue;
+            }
 
-        /* Receive payload */
-        if (header.Length > 0) {
-            if (header.Length > VUSB_MAX_PACKET_SIZE) {
-                printf("[Recv] Payload too large: %u\n", header.Length);
-                break;
+            /* Fragments go straight into the reassembled transfer */
+            if (header.Command == VUSB_CMD_URB_FRAGMENT ||
+                header.Command == VUSB_CMD_URB_CONTINUE) {
+                if (ReceiveFragment(ctx, &header) != 0) {
+                    printf("[Recv] Bad segmented transfer\n");
+                    break;
+                }
+                continue;
             }
 
-            result = recv(ctx->Base.Socket, (char*)payload, header.Length, MSG_WAITALL);
-            if (result != (int)header.Length) {
-                printf("[Recv] Failed to receive payload\n");
-                break;
+            /* Receive payload */
+            if (header.Length > 0) {
+                if (header.Length > VUSB_MAX_PACKET_SIZE) {
+                    printf("[Recv] Payload too large: %u\n", header.Length);
+                    break;
+                }
+
+                result = VusbClientRecv(&ctx->Base, payload, header.Length);
+                if (result != (int)header.Length) {
+                    printf("[Recv] Failed to receive payload\n");
+                    break;
+                }
             }
+
+            /* Process message */
+            ProcessServerMessage(ctx, &header, payload, header.Length);
         }
 
-        /* Process message */
-        ProcessServerMessage(ctx, &header, payload, header.Length);
+        /* The server keeps a dropped session's devices for a while */
+        if (!ctx->Running || ResumeSession(ctx) != 0) {
+            break;
+        }
     }
 
     free(payload);
@@ -210,6 +315,108 @@ static DWORD WINAPI ReceiveThread(LPVOID param)
     return 0;
 }
 
+/**
+ * ResumeSession - Reconnect after a dropped connection and take the session back
+ * @return: 0 if receiving can go on over a new connection, -1 otherwise
+ *
+ * Retried until the server's grace period runs out. Transfers still running
+ * complete over the new connection; the server re-sends the ones it lost.
+ */
+static int ResumeSession(PVUSB_CLIENT_CONTEXT_EX ctx)
+{
+    ULONGLONG deadline = GetTickCount64() + ctx->Base.ResumeGraceMs;
+    int result = -1;
+
+    if (!(ctx->Base.Capabilities & VUSB_CAP_SESSION_RESUME)) {
+        return -1;
+    }
+
+    printf("[Recv] Connection lost, resuming session %u\n", ctx->Base.SessionId);
+
+    /* A segmented message cut off by the drop is not continued */
+    free(ctx->Reassembly.Buffer);
+    memset(&ctx->Reassembly, 0, sizeof(ctx->Reassembly));
+
+    while (ctx->Running && GetTickCount64() < deadline) {
+        /* Senders hold SendLock, so none of them sees the socket change */
+        EnterCriticalSection(&ctx->SendLock);
+        /* Held completions go to the lost connection, not the new one; the
+         * server replays their URBs. Reports then start over on both sides. */
+        FlushUrbCompletions(ctx, VUSB_FLUSH_IDLE);
+        result = VusbClientResume(&ctx->Base);
+        if (result >= 0) {
+            memset(ctx->Reports.Devices, 0, sizeof(ctx->Reports.Devices));
+        }
+        LeaveCriticalSection(&ctx->SendLock);
+
+        if (result >= 0) {
+            return 0;
+        }
+        Sleep(250);
+    }
+
+    printf("[Recv] Session %u could not be resumed\n", ctx->Base.SessionId);
+    return -1;
+}
+
+/**
+ * ReceiveFragment - Receive a fragment directly into the reassembly buffer
+ */
+static int ReceiveFragment(PVUSB_CLIENT_CONTEXT_EX ctx, PVUSB_HEADER header)
+{
+    PVUSB_REASSEMBLY reassembly = &ctx->Reassembly;
+    VUSB_URB_FRAGMENT fragment;
+    PVUSB_HEADER message;
+    int dataLength;
+    int result;
+
+    if (header->Length < VUSB_FRAGMENT_FIELDS_SIZE) {
+        return -1;
+    }
+
+    fragment.Header = *header;
+    result = VusbClientRecv(&ctx->Base, &fragment.TotalLength, VUSB_FRAGMENT_FIELDS_SIZE);
+    if (result != VUSB_FRAGMENT_FIELDS_SIZE) {
+        return -1;
+    }
+
+    dataLength = VusbFragmentCheck(reassembly, &fragment);
+    if (dataLength < 0) {
+        return -1;
+    }
+
+    if (header->Command == VUSB_CMD_URB_FRAGMENT) {
+        reassembly->Buffer = (uint8_t*)malloc(fragment.TotalLength);
+        if (!reassembly->Buffer) {
+            return -1;
+        }
+        reassembly->TotalLength = fragment.TotalLength;
+        reassembly->Received = 0;
+    }
+
+    if (dataLength > 0) {
+        result = VusbClientRecv(&ctx->Base, reassembly->Buffer + fragment.Offset,
+                                dataLength);
+        if (result != dataLength) {
+            return -1;
+        }
+        reassembly->Received += (uint32_t)dataLength;
+    }
+
+    if (reassembly->Received < reassembly->TotalLength) {
+        return 0;
+    }
+
+    message = VusbReassembledMessage(reassembly);
+    if (message) {
+        ProcessServerMessage(ctx, message, (uint8_t*)(message + 1), message->Length);
+    }
+
+    free(reassembly->Buffer);
+    memset(reassembly, 0, sizeof(VUSB_REASSEMBLY));
+    return message ? 0 : -1;
+}
+
 /**
  * ProcessServerMessage - Process a message from the server
  */
@@ -221,7 +428,9 @@ static void ProcessServerMessage(PVUSB_CLIENT_CONTEXT_EX ctx, PVUSB_HEADER heade
         {
             VUSB_HEADER pong;
             VusbInitHeader(&pong, VUSB_CMD_PONG, 0, header->Sequence);
-            send(ctx->Base.Socket, (char*)&pong, sizeof(pong), 0);
+            EnterCriticalSection(&ctx->SendLock);
+            VusbClientSend(&ctx->Base, &pong, sizeof(pong));
+            LeaveCriticalSection(&ctx->SendLock);
         }
         break;
 
@@ -229,27 +438,76 @@ static void ProcessServerMessage(PVUSB_CLIENT_CONTEXT_EX ctx, PVUSB_HEADER heade
         {
             /* URB request from server - forward to real device */
             if (payloadLength >= sizeof(VUSB_URB_SUBMIT) - sizeof(VUSB_HEADER)) {
-                VUSB_URB_SUBMIT* urbSubmit = (VUSB_URB_SUBMIT*)payload;
+                VUSB_URB_SUBMIT urbSubmit;
                 uint8_t* outData = NULL;
                 uint32_t outDataLen = 0;
+                uint8_t* expanded = NULL;
+
+                /* The payload starts after the header */
+                urbSubmit.Header = *header;
+                memcpy((uint8_t*)&urbSubmit + sizeof(VUSB_HEADER), payload,
+                       sizeof(VUSB_URB_SUBMIT) - sizeof(VUSB_HEADER));
 
                 /* Check for OUT data following the header */
-                if (urbSubmit->Direction == VUSB_DIR_OUT && 
-                    urbSubmit->TransferBufferLength > 0) {
+                if (urbSubmit.Direction == VUSB_DIR_OUT && 
+                    urbSubmit.TransferBufferLength > 0) {
                     outData = payload + sizeof(VUSB_URB_SUBMIT) - sizeof(VUSB_HEADER);
-                    outDataLen = urbSubmit->TransferBufferLength;
+                    outDataLen = urbSubmit.TransferBufferLength;
+                }
+
+                /* Compressed OUT data expands to the transfer length */
+                if (outData && (urbSubmit.Flags & VUSB_SUBMIT_COMPRESSED)) {
+                    expanded = (uint8_t*)VusbBufferAlloc(&ctx->UrbHandler.BufferPool, outDataLen);
+                    if (!expanded ||
+                        VusbLz4Decompress(outData, payloadLength -
+                                          (uint32_t)(sizeof(VUSB_URB_SUBMIT) - sizeof(VUSB_HEADER)),
+                                          expanded, outDataLen) != 0) {
+                        printf("[URB] Bad compressed data for URB %u\n", urbSubmit.UrbId);
+                        SendUrbCompletion(ctx, urbSubmit.DeviceId, urbSubmit.UrbId,
+                                          urbSubmit.EndpointAddress, urbSubmit.TransferType,
+                                          VUSB_STATUS_ERROR, 0, NULL);
+                        VusbBufferFree(&ctx->UrbHandler.BufferPool, expanded);
+                        break;
+                    }
+                    outData = expanded;
                 }
 
-                ClientUrbProcess(&ctx->UrbHandler, urbSubmit, outData, outDataLen);
+                ClientUrbProcess(&ctx->UrbHandler, &urbSubmit, outData, outDataLen);
+                VusbBufferFree(&ctx->UrbHandler.BufferPool, expanded);
             }
         }
         break;
 
+    case VUSB_CMD_SUBMIT_URB_BATCH:
+        {
+            PVUSB_HEADER entry;
+            uint32_t offset = 0;
+
+            if (payloadLength < sizeof(uint32_t)) break;
+
+            /* Collect the synchronous completions and answer with one frame */
+            BeginUrbCompletions(ctx);
+
+            while ((entry = VusbBatchNext(payload + sizeof(uint32_t),
+                                          payloadLength - sizeof(uint32_t), &offset)) != NULL) {
+                if (entry->Command == VUSB_CMD_SUBMIT_URB) {
+                    ProcessServerMessage(ctx, entry, (uint8_t*)(entry + 1), entry->Length);
+                }
+            }
+
+            EndUrbCompletions(ctx);
+        }
+        break;
+
     case VUSB_CMD_CANCEL_URB:
         {
             if (payloadLength >= sizeof(VUSB_URB_CANCEL) - sizeof(VUSB_HEADER)) {
-                VUSB_URB_CANCEL* cancel = (VUSB_URB_CANCEL*)payload;
-                ClientUrbCancel(&ctx->UrbHandler, cancel->DeviceId, cancel->UrbId);
+                VUSB_URB_CANCEL cancel;
+
+                /* The payload starts after the header */
+                memcpy((uint8_t*)&cancel + sizeof(VUSB_HEADER), payload,
+                       sizeof(VUSB_URB_CANCEL) - sizeof(VUSB_HEADER));
+                ClientUrbCancel(&ctx->UrbHandler, cancel.DeviceId, cancel.UrbId);
             }
         }
         break;
@@ -271,21 +529,94 @@ static void ProcessServerMessage(PVUSB_CLIENT_CONTEXT_EX ctx, PVUSB_HEADER heade
 
 /**
  * SendUrbCompletion - Send URB completion back to server
+ *
+ * Completions join the batch while one is open, or while bulk completions
+ * are being held (see vusb_coalesce.h). One that is due with nothing to go
+ * with is sent straight from the caller's buffer. Bulk IN data goes out
+ * compressed when the server takes it and the endpoint's data pays off;
+ * interrupt IN reports go out as changes to the endpoint's last one.
  */
 static int SendUrbCompletion(void* clientCtx, uint32_t deviceId, uint32_t urbId,
-                             uint32_t status, uint32_t actualLength, uint8_t* data)
+                             uint8_t endpointAddress, uint8_t transferType, uint32_t status,
+                             uint32_t actualLength, uint8_t* data)
 {
     PVUSB_CLIENT_CONTEXT_EX ctx = (PVUSB_CLIENT_CONTEXT_EX)clientCtx;
-    uint8_t* buffer;
+    VUSB_URB_COMPLETE header;
     VUSB_URB_COMPLETE* completion;
+    VUSB_FLUSH_REASON reason = VUSB_FLUSH_URGENT;
+    WSABUF buffers[2];
+    uint8_t* packed = NULL;
+    uint8_t delta[VUSB_REPORT_MAX];
+    uint32_t dataLength = actualLength;
+    uint8_t flags = 0;
     size_t totalSize;
+    BOOL batched;
+    BOOL due = TRUE;
     int result;
 
-    totalSize = sizeof(VUSB_URB_COMPLETE) + actualLength;
-    buffer = (uint8_t*)malloc(totalSize);
-    if (!buffer) return -1;
+    if ((ctx->Base.Capabilities & VUSB_CAP_COMPRESSION) && data &&
+        transferType == VUSB_TRANSFER_BULK && actualLength >= VUSB_COMPRESS_MIN_LENGTH) {
+        packed = (uint8_t*)VusbBufferAlloc(&ctx->UrbHandler.BufferPool, actualLength);
+    }
+
+    EnterCriticalSection(&ctx->SendLock);
+
+    /* The completion still reports the expanded length */
+    if (packed) {
+        uint32_t packedLength = VusbCompressPayload(&ctx->Compression, deviceId, endpointAddress,
+                                                    transferType, data, actualLength, packed);
+        if (packedLength > 0) {
+            data = packed;
+            dataLength = packedLength;
+            flags = VUSB_COMPLETE_COMPRESSED;
+        }
+    }
+
+    if ((ctx->Base.Capabilities & VUSB_CAP_REPORT_DELTA) && data &&
+        transferType == VUSB_TRANSFER_INTERRUPT) {
+        uint32_t deltaLength;
+
+        flags = VusbReportEncode(&ctx->Reports, deviceId, endpointAddress, data, actualLength,
+                                 delta, &deltaLength);
+        if (flags == VUSB_COMPLETE_SAME) {
+            data = NULL;
+            dataLength = 0;
+        } else if (flags == VUSB_COMPLETE_DELTA) {
+            data = delta;
+            dataLength = deltaLength;
+        }
+    }
+
+    totalSize = sizeof(VUSB_URB_COMPLETE) + dataLength;
+
+    /* Without segmentation the server cannot take more than one frame */
+    if (totalSize > VUSB_MAX_PACKET_SIZE && !(ctx->Base.Capabilities & VUSB_CAP_SEGMENTED)) {
+        status = VUSB_STATUS_NOT_SUPPORTED;
+        actualLength = 0;
+        dataLength = 0;
+        data = NULL;
+        flags = 0;
+        totalSize = sizeof(VUSB_URB_COMPLETE);
+    }
+
+    batched = ctx->BatchBuffer && totalSize <= VUSB_MAX_PACKET_SIZE - sizeof(VUSB_URB_BATCH);
+    if (!batched) {
+        /* Too large to batch: what is held goes first, to keep the order */
+        FlushUrbCompletions(ctx, VUSB_FLUSH_BYTES);
+        VusbCoalesceSentAlone(&ctx->Coalesce, (uint32_t)totalSize);
+    } else {
+        if (ctx->BatchLength + totalSize > VUSB_MAX_PACKET_SIZE ||
+            ctx->BatchCount == VUSB_URB_BATCH_MAX_ENTRIES) {
+            FlushUrbCompletions(ctx, VUSB_FLUSH_BYTES);
+        }
+        due = VusbCoalesceAdd(&ctx->Coalesce, transferType, (uint32_t)totalSize, &reason);
+        batched = ctx->Batching > 0 || !due || ctx->BatchCount > 0;
+    }
+
+    /* A batch collects the completion; otherwise it is sent gathered from
+     * the header and the caller's data buffer */
+    completion = batched ? (VUSB_URB_COMPLETE*)(ctx->BatchBuffer + ctx->BatchLength) : &header;
 
-    completion = (VUSB_URB_COMPLETE*)buffer;
     VusbInitHeader(&completion->Header, VUSB_CMD_URB_COMPLETE,
                    (uint32_t)(totalSize - sizeof(VUSB_HEADER)), ++ctx->Base.Sequence);
     completion->DeviceId = deviceId;
@@ -293,15 +624,267 @@ static int SendUrbCompletion(void* clientCtx, uint32_t deviceId, uint32_t urbId,
     completion->Status = status;
     completion->ActualLength = actualLength;
     completion->ErrorCount = 0;
+    completion->Flags = flags;
+    completion->EndpointAddress = endpointAddress;
+
+    if (batched) {
+        if (data && dataLength > 0) {
+            memcpy(completion + 1, data, dataLength);
+        }
+        ctx->BatchLength += (uint32_t)totalSize;
+        ctx->BatchCount++;
+
+        result = 0;
+        if (ctx->Batching > 0) {
+            /* Sent when the batch closes */
+            if (due && !ctx->BatchDue) {
+                ctx->BatchDue = TRUE;
+                ctx->BatchReason = reason;
+            }
+        } else if (due) {
+            result = FlushUrbCompletions(ctx, reason);
+        } else if (ctx->BatchCount == 1) {
+            /* First one held: have the completion thread time it out */
+            ClientUrbWake(&ctx->UrbHandler);
+        }
+        LeaveCriticalSection(&ctx->SendLock);
+        VusbBufferFree(&ctx->UrbHandler.BufferPool, packed);
+        return result;
+    }
+
+    if (totalSize > VUSB_MAX_PACKET_SIZE) {
+        result = SendSegmented(&ctx->Base, completion, sizeof(VUSB_URB_COMPLETE),
+                               data, dataLength, completion->Header.Sequence);
+    } else {
+        buffers[0].buf = (char*)completion;
+        buffers[0].len = sizeof(VUSB_URB_COMPLETE);
+        buffers[1].buf = (char*)data;
+        buffers[1].len = (data && dataLength > 0) ? dataLength : 0;
+
+        result = SendVectored(&ctx->Base, buffers, buffers[1].len ? 2 : 1);
+    }
+    VusbCoalesceSent(&ctx->Coalesce, reason);
+
+    LeaveCriticalSection(&ctx->SendLock);
+    VusbBufferFree(&ctx->UrbHandler.BufferPool, packed);
+    return result;
+}
+
+/**
+ * BeginUrbCompletions - Open a completion batch
+ *
+ * Batches nest; the receive thread and the URB completion thread may both
+ * hold one open, and the collected completions go out when the last closes.
+ */
+static void BeginUrbCompletions(void* clientCtx)
+{
+    PVUSB_CLIENT_CONTEXT_EX ctx = (PVUSB_CLIENT_CONTEXT_EX)clientCtx;
+
+    EnterCriticalSection(&ctx->SendLock);
+    if (!ctx->BatchBuffer && (ctx->Base.Capabilities & VUSB_CAP_URB_BATCH)) {
+        ctx->BatchBuffer = (uint8_t*)malloc(VUSB_MAX_PACKET_SIZE);
+        ctx->BatchLength = sizeof(VUSB_URB_BATCH);
+        ctx->BatchCount = 0;
+    }
+    ctx->Batching++;
+    LeaveCriticalSection(&ctx->SendLock);
+}
+
+/**
+ * EndUrbCompletions - Close a completion batch, sending it if it was the last
+ *
+ * Bulk completions still within their budget stay held.
+ */
+static void EndUrbCompletions(void* clientCtx)
+{
+    PVUSB_CLIENT_CONTEXT_EX ctx = (PVUSB_CLIENT_CONTEXT_EX)clientCtx;
+
+    EnterCriticalSection(&ctx->SendLock);
+    if (--ctx->Batching == 0) {
+        if (ctx->BatchDue) {
+            FlushUrbCompletions(ctx, ctx->BatchReason);
+        } else if (VusbCoalesceDue(&ctx->Coalesce)) {
+            FlushUrbCompletions(ctx, VUSB_FLUSH_DELAY);
+        } else if (ctx->BatchCount > 0) {
+            ClientUrbWake(&ctx->UrbHandler);
+        }
+    }
+    LeaveCriticalSection(&ctx->SendLock);
+}
+
+/**
+ * FlushDueCompletions - Send completions held past their time budget
+ * @return: Milliseconds until the next held completion is due, or INFINITE
+ *
+ * Called by the URB completion thread between bursts.
+ */
+static DWORD FlushDueCompletions(void* clientCtx)
+{
+    PVUSB_CLIENT_CONTEXT_EX ctx = (PVUSB_CLIENT_CONTEXT_EX)clientCtx;
+    DWORD waitMs = INFINITE;
+
+    EnterCriticalSection(&ctx->SendLock);
+    if (ctx->Batching == 0) {
+        if (VusbCoalesceDue(&ctx->Coalesce)) {
+            FlushUrbCompletions(ctx, VUSB_FLUSH_DELAY);
+        }
+        waitMs = VusbCoalesceWaitMs(&ctx->Coalesce);
+    }
+    LeaveCriticalSection(&ctx->SendLock);
+
+    return waitMs;
+}
+
+/**
+ * PrintCoalesceStats - Report the batching and encoding achieved on completions
+ */
+static void PrintCoalesceStats(PVUSB_CLIENT_CONTEXT_EX ctx)
+{
+    PVUSB_COALESCE c = &ctx->Coalesce;
+
+    EnterCriticalSection(&ctx->SendLock);
+    printf("Completions: %llu sent in %llu sends (%.1f per send, %llu bytes)\n",
+           c->Messages, c->Frames, c->Frames ? (double)c->Messages / c->Frames : 0.0, c->Bytes);
+    printf("  Sends: %llu urgent, %llu sparse, %llu full, %llu timed out, %llu at idle\n",
+           c->Flushes[VUSB_FLUSH_URGENT], c->Flushes[VUSB_FLUSH_SPARSE],
+           c->Flushes[VUSB_FLUSH_BYTES], c->Flushes[VUSB_FLUSH_DELAY],
+           c->Flushes[VUSB_FLUSH_IDLE]);
+    printf("  Holding: %s (budget %u bytes, %u us)\n",
+           c->Holding ? "yes" : "no", c->MaxBytes, c->MaxDelayUs);
+    if (ctx->Compression.Tried > 0) {
+        printf("  Compressed: %llu of %llu tried, %llu bytes as %llu\n",
+               ctx->Compression.Kept, ctx->Compression.Tried,
+               ctx->Compression.RawBytes, ctx->Compression.PackedBytes);
+    }
+    if (ctx->Reports.Reports > 0) {
+        printf("  Reports: %llu, %llu unchanged, %llu as deltas, %llu bytes as %llu\n",
+               ctx->Reports.Reports, ctx->Reports.Same, ctx->Reports.Delta,
+               ctx->Reports.RawBytes, ctx->Reports.SentBytes);
+    }
+    LeaveCriticalSection(&ctx->SendLock);
+}
+
+/**
+ * SendSegmented - Send a message larger than one frame as URB_FRAGMENT
+ * followed by URB_CONTINUE pieces
+ * @head: Message header structure
+ * @data: Transfer data following it
+ */
+static int SendSegmented(PVUSB_CLIENT_CONTEXT base, const void* head, uint32_t headLength,
+                         const uint8_t* data, uint32_t dataLength, uint32_t sequence)
+{
+    uint32_t totalLength = headLength + dataLength;
+    uint32_t offset = 0;
+
+    while (offset < totalLength) {
+        VUSB_URB_FRAGMENT fragment;
+        WSABUF buffers[3];
+        DWORD count = 1;
+        uint32_t end;
+
+        end = offset + (uint32_t)VUSB_FRAGMENT_DATA_MAX;
+        if (end > totalLength) {
+            end = totalLength;
+        }
+
+        VusbInitHeader(&fragment.Header,
+                       offset == 0 ? VUSB_CMD_URB_FRAGMENT : VUSB_CMD_URB_CONTINUE,
+                       (uint32_t)VUSB_FRAGMENT_FIELDS_SIZE + (end - offset), sequence);
+        fragment.TotalLength = totalLength;
+        fragment.Offset = offset;
+
+        buffers[0].buf = (char*)&fragment;
+        buffers[0].len = sizeof(fragment);
+
+        /* The piece may span the end of the header structure */
+        if (offset < headLength) {
+            buffers[count].buf = (char*)head + offset;
+            buffers[count].len = (end < headLength ? end : headLength) - offset;
+            count++;
+        }
+        if (end > headLength) {
+            uint32_t start = offset > headLength ? offset - headLength : 0;
+            buffers[count].buf = (char*)data + start;
+            buffers[count].len = end - headLength - start;
+            count++;
+        }
 
-    if (data && actualLength > 0) {
-        memcpy(buffer + sizeof(VUSB_URB_COMPLETE), data, actualLength);
+        if (SendVectored(base, buffers, count) != 0) {
+            return -1;
+        }
+        offset = end;
     }
 
-    result = send(ctx->Base.Socket, (char*)buffer, (int)totalSize, 0);
-    free(buffer);
+    return 0;
+}
+
+/**
+ * SendVectored - Send one message gathered from several buffers
+ *
+ * Buffers are advanced in place when the socket takes a partial write.
+ */
+static int SendVectored(PVUSB_CLIENT_CONTEXT base, WSABUF* buffers, DWORD count)
+{
+    DWORD sent;
+
+    if (base->Shm) {
+        return VusbShmSend(base->Shm, buffers, count);
+    }
 
-    return (result == (int)totalSize) ? 0 : -1;
+    while (count > 0) {
+        if (WSASend(base->Socket, buffers, count, &sent, 0, NULL, NULL) == SOCKET_ERROR) {
+            return -1;
+        }
+
+        while (count > 0 && sent >= buffers->len) {
+            sent -= buffers->len;
+            buffers++;
+            count--;
+        }
+        if (count > 0) {
+            buffers->buf += sent;
+            buffers->len -= sent;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * FlushUrbCompletions - Send the collected completions as one frame
+ * (SendLock held)
+ * @reason: Why they are sent, counted in the coalescing statistics
+ */
+static int FlushUrbCompletions(PVUSB_CLIENT_CONTEXT_EX ctx, VUSB_FLUSH_REASON reason)
+{
+    PVUSB_URB_BATCH frame = (PVUSB_URB_BATCH)ctx->BatchBuffer;
+    uint8_t* data = ctx->BatchBuffer;
+    uint32_t length = ctx->BatchLength;
+    WSABUF buffer;
+    int result;
+
+    if (!ctx->BatchBuffer || ctx->BatchCount == 0) return 0;
+
+    if (ctx->BatchCount == 1) {
+        /* A lone completion goes out as a plain URB_COMPLETE */
+        data += sizeof(VUSB_URB_BATCH);
+        length -= sizeof(VUSB_URB_BATCH);
+    } else {
+        VusbInitHeader(&frame->Header, VUSB_CMD_URB_COMPLETE_BATCH,
+                       length - sizeof(VUSB_HEADER), ++ctx->Base.Sequence);
+        frame->Count = ctx->BatchCount;
+    }
+
+    buffer.buf = (char*)data;
+    buffer.len = length;
+    result = SendVectored(&ctx->Base, &buffer, 1);
+    VusbCoalesceSent(&ctx->Coalesce, reason);
+
+    ctx->BatchLength = sizeof(VUSB_URB_BATCH);
+    ctx->BatchCount = 0;
+    ctx->BatchDue = FALSE;
+
+    return result;
 }
 
 /**
@@ -353,9 +936,11 @@ void RunEnhancedInteractive(PVUSB_CLIENT_CONTEXT_EX ctx)
     printf("  info <id>            - Show device info\n");
     printf("  attach <id>          - Attach device to server\n");
     printf("  detach <id>          - Detach device from server\n");
+    printf("  reset <id>           - Tell the server a device was reset\n");
     printf("  remote               - List remote (server) devices\n");
     printf("  sim <vid> <pid>      - Attach a simulated device\n");
     printf("  ping                 - Ping server\n");
+    printf("  stats                - Show completion batching counters\n");
     printf("  quit                 - Exit\n\n");
 
     while (ctx->Running && ctx->Base.Connected) {
@@ -421,6 +1006,14 @@ void RunEnhancedInteractive(PVUSB_CLIENT_CONTEXT_EX ctx)
                 printf("Usage: detach <remote_id>\n");
             }
         }
+        else if (strncmp(command, "reset", 5) == 0) {
+            uint32_t id;
+            if (sscanf(command + 5, "%u", &id) == 1) {
+                VusbClientResetDevice(&ctx->Base, id);
+            } else {
+                printf("Usage: reset <remote_id>\n");
+            }
+        }
         else if (strcmp(command, "remote") == 0) {
             VusbClientListDevices(&ctx->Base);
         }
@@ -435,6 +1028,9 @@ void RunEnhancedInteractive(PVUSB_CLIENT_CONTEXT_EX ctx)
         else if (strcmp(command, "ping") == 0) {
             VusbClientPing(&ctx->Base);
         }
+        else if (strcmp(command, "stats") == 0) {
+            PrintCoalesceStats(ctx);
+        }
         else if (strcmp(command, "quit") == 0 || strcmp(command, "exit") == 0) {
             break;
         }
@@ -13,6 +13,19 @@
 #include "vusb_capture.h"
 #include "../protocol/vusb_protocol.h"
 
+/* Forward declarations */
+static DWORD WINAPI UrbCompletionThread(LPVOID param);
+static int SubmitAsyncUrb(PCLIENT_URB_CONTEXT ctx, PUSB_CAPTURED_DEVICE device,
+                          PVUSB_URB_SUBMIT urbSubmit, uint8_t* outData, uint32_t outDataLength);
+static void UrbTransferDone(PUSB_ASYNC_TRANSFER transfer, uint32_t error,
+                            uint32_t actualLength, void* context);
+static void UnlinkPendingUrb(PCLIENT_URB_CONTEXT ctx, PCLIENT_PENDING_URB urb);
+static void FreePendingUrb(PCLIENT_URB_CONTEXT ctx, PCLIENT_PENDING_URB urb);
+static void RememberCompletion(PCLIENT_URB_CONTEXT ctx, uint32_t deviceId, uint32_t urbId,
+                               uint8_t endpointAddress, uint8_t transferType, uint32_t status,
+                               uint32_t actualLength, const uint8_t* data);
+static BOOL ReplayKnownUrb(PCLIENT_URB_CONTEXT ctx, PVUSB_URB_SUBMIT urbSubmit);
+
 /**
  * ClientUrbInit - Initialize URB handler
  */
@@ -22,10 +35,67 @@ int ClientUrbInit(PCLIENT_URB_CONTEXT ctx, PUSB_CAPTURE_CONTEXT captureCtx)
     
     memset(ctx, 0, sizeof(CLIENT_URB_CONTEXT));
     ctx->CaptureContext = captureCtx;
+    VusbBufferPoolInit(&ctx->BufferPool);
+    VusbPoolInit(&ctx->PendingPool, sizeof(CLIENT_PENDING_URB), CLIENT_URB_POOL_SLAB);
+    InitializeCriticalSection(&ctx->PendingLock);
+    
+    /* Without a completion thread every transfer runs synchronously */
+    ctx->CompletionPort = CreateIoCompletionPort(INVALID_HANDLE_VALUE, NULL, 0, 1);
+    if (ctx->CompletionPort) {
+        ctx->CompletionThread = CreateThread(NULL, 0, UrbCompletionThread, ctx, 0, NULL);
+        if (!ctx->CompletionThread) {
+            CloseHandle(ctx->CompletionPort);
+            ctx->CompletionPort = NULL;
+        }
+    }
     
     return 0;
 }
 
+/**
+ * ClientUrbCleanup - Abort transfers in flight and release the URB handler
+ */
+void ClientUrbCleanup(PCLIENT_URB_CONTEXT ctx)
+{
+    PCLIENT_PENDING_URB urb;
+    
+    if (!ctx) return;
+    
+    if (ctx->CompletionThread) {
+        /* Aborted transfers still complete through the port */
+        EnterCriticalSection(&ctx->PendingLock);
+        for (urb = ctx->PendingList; urb; urb = urb->Next) {
+            CancelIoEx(urb->AsyncTransfer.Device->DeviceHandle, &urb->AsyncTransfer.Overlapped);
+        }
+        LeaveCriticalSection(&ctx->PendingLock);
+        
+        for (int i = 0; i < 100 && ctx->PendingCount > 0; i++) {
+            Sleep(10);
+        }
+        
+        PostQueuedCompletionStatus(ctx->CompletionPort, 0, 0, NULL);
+        WaitForSingleObject(ctx->CompletionThread, 5000);
+        CloseHandle(ctx->CompletionThread);
+        ctx->CompletionThread = NULL;
+    }
+    
+    if (ctx->CompletionPort) {
+        CloseHandle(ctx->CompletionPort);
+        ctx->CompletionPort = NULL;
+    }
+    
+    for (int i = 0; i < CLIENT_URB_RECENT_COMPLETIONS; i++) {
+        VusbBufferFree(&ctx->BufferPool, ctx->Recent[i].Data);
+    }
+    
+    DeleteCriticalSection(&ctx->PendingLock);
+    VusbPoolDestroy(&ctx->PendingPool);
+    
+    printf("[URB] Buffer pool made %u heap allocations\n",
+           VusbBufferPoolHeapAllocs(&ctx->BufferPool));
+    VusbBufferPoolDestroy(&ctx->BufferPool);
+}
+
 /**
  * ClientUrbProcess - Process an incoming URB request
  */
@@ -43,6 +113,10 @@ int ClientUrbProcess(
     
     if (!ctx || !urbSubmit) return -1;
     
+    if ((urbSubmit->Flags & VUSB_SUBMIT_REPLAYED) && ReplayKnownUrb(ctx, urbSubmit)) {
+        return 0;
+    }
+    
     printf("[URB] Processing URB %u for device %u, EP=0x%02X, Type=%d, Dir=%d, Len=%u\n",
            urbSubmit->UrbId, urbSubmit->DeviceId, urbSubmit->EndpointAddress,
            urbSubmit->TransferType, urbSubmit->Direction, urbSubmit->TransferBufferLength);
@@ -55,7 +129,9 @@ int ClientUrbProcess(
         /* Send error completion */
         if (ctx->SendCompletion) {
             ctx->SendCompletion(ctx->ClientContext, urbSubmit->DeviceId, 
-                               urbSubmit->UrbId, VUSB_STATUS_NO_DEVICE, 0, NULL);
+                               urbSubmit->UrbId, urbSubmit->EndpointAddress,
+                               urbSubmit->TransferType,
+                               VUSB_STATUS_NO_DEVICE, 0, NULL);
         }
         return -1;
     }
@@ -66,19 +142,32 @@ int ClientUrbProcess(
             printf("[URB] Failed to open device\n");
             if (ctx->SendCompletion) {
                 ctx->SendCompletion(ctx->ClientContext, urbSubmit->DeviceId,
-                                   urbSubmit->UrbId, VUSB_STATUS_ERROR, 0, NULL);
+                                   urbSubmit->UrbId, urbSubmit->EndpointAddress,
+                                   urbSubmit->TransferType,
+                                   VUSB_STATUS_ERROR, 0, NULL);
             }
             return -1;
         }
     }
     
+    /* Bulk and interrupt transfers run asynchronously, many per endpoint */
+    if (ctx->CompletionPort &&
+        (urbSubmit->TransferType == VUSB_TRANSFER_BULK ||
+         urbSubmit->TransferType == VUSB_TRANSFER_INTERRUPT) &&
+        SubmitAsyncUrb(ctx, device, urbSubmit, outData, outDataLength) == 0) {
+        return 0;
+    }
+    
     /* Allocate response buffer for IN transfers */
     if (urbSubmit->Direction == VUSB_DIR_IN && urbSubmit->TransferBufferLength > 0) {
-        responseData = (uint8_t*)malloc(urbSubmit->TransferBufferLength);
+        responseData = (uint8_t*)VusbBufferAlloc(&ctx->BufferPool,
+                                                 urbSubmit->TransferBufferLength);
         if (!responseData) {
             if (ctx->SendCompletion) {
                 ctx->SendCompletion(ctx->ClientContext, urbSubmit->DeviceId,
-                                   urbSubmit->UrbId, VUSB_STATUS_NO_MEMORY, 0, NULL);
+                                   urbSubmit->UrbId, urbSubmit->EndpointAddress,
+                                   urbSubmit->TransferType,
+                                   VUSB_STATUS_NO_MEMORY, 0, NULL);
             }
             return -1;
         }
@@ -159,11 +248,18 @@ int ClientUrbProcess(
     
     if (ctx->SendCompletion) {
         ctx->SendCompletion(ctx->ClientContext, urbSubmit->DeviceId, urbSubmit->UrbId,
+                           urbSubmit->EndpointAddress, urbSubmit->TransferType, status,
+                           responseDataLength, responseData);
+    }
+    
+    if (ctx->KeepCompletions) {
+        RememberCompletion(ctx, urbSubmit->DeviceId, urbSubmit->UrbId,
+                           urbSubmit->EndpointAddress, urbSubmit->TransferType,
                            status, responseDataLength, responseData);
     }
     
     if (responseData) {
-        free(responseData);
+        VusbBufferFree(&ctx->BufferPool, responseData);
     }
     
     return result;
@@ -174,7 +270,292 @@ int ClientUrbProcess(
  */
 int ClientUrbCancel(PCLIENT_URB_CONTEXT ctx, uint32_t deviceId, uint32_t urbId)
 {
-    /* For now, cancellation is not fully implemented for sync transfers */
+    PCLIENT_PENDING_URB urb;
+    int result = -1;
+    
     printf("[URB] Cancel request for URB %u on device %u\n", urbId, deviceId);
+    
+    /* Only asynchronous transfers can be cancelled; the completion follows */
+    EnterCriticalSection(&ctx->PendingLock);
+    for (urb = ctx->PendingList; urb; urb = urb->Next) {
+        if (urb->DeviceId == deviceId && urb->UrbId == urbId) {
+            CancelIoEx(urb->AsyncTransfer.Device->DeviceHandle, &urb->AsyncTransfer.Overlapped);
+            result = 0;
+            break;
+        }
+    }
+    LeaveCriticalSection(&ctx->PendingLock);
+    
+    return result;
+}
+
+/* ============ Asynchronous Transfers ============ */
+
+/**
+ * SubmitAsyncUrb - Start a bulk or interrupt transfer without waiting for it
+ * @return: 0 if started; otherwise the caller runs it synchronously
+ */
+static int SubmitAsyncUrb(PCLIENT_URB_CONTEXT ctx, PUSB_CAPTURED_DEVICE device,
+                          PVUSB_URB_SUBMIT urbSubmit, uint8_t* outData, uint32_t outDataLength)
+{
+    PCLIENT_PENDING_URB urb;
+    uint32_t length;
+    
+    if (UsbCaptureBindCompletionPort(device, ctx->CompletionPort) != 0) {
+        return -1;
+    }
+    
+    urb = (PCLIENT_PENDING_URB)VusbPoolAlloc(&ctx->PendingPool);
+    if (!urb) {
+        return -1;
+    }
+    memset(urb, 0, sizeof(CLIENT_PENDING_URB));
+    
+    urb->UrbId = urbSubmit->UrbId;
+    urb->DeviceId = urbSubmit->DeviceId;
+    urb->LocalDeviceId = device->LocalId;
+    urb->EndpointAddress = urbSubmit->EndpointAddress;
+    urb->TransferType = urbSubmit->TransferType;
+    urb->Direction = urbSubmit->Direction;
+    urb->TransferBufferLength = urbSubmit->TransferBufferLength;
+    
+    /* OUT data lives in the receive buffer, which is reused right away */
+    length = (urb->Direction == VUSB_DIR_IN) ? urbSubmit->TransferBufferLength : outDataLength;
+    if (length > 0) {
+        urb->Buffer = (uint8_t*)VusbBufferAlloc(&ctx->BufferPool, length);
+        if (!urb->Buffer) {
+            VusbPoolFree(&ctx->PendingPool, urb);
+            return -1;
+        }
+        if (urb->Direction == VUSB_DIR_OUT) {
+            memcpy(urb->Buffer, outData, length);
+        }
+    }
+    
+    urb->AsyncTransfer.UrbId = urb->UrbId;
+    urb->AsyncTransfer.Callback = UrbTransferDone;
+    urb->AsyncTransfer.CallbackContext = ctx;
+    
+    /* Link first, the completion may run before the submit returns */
+    EnterCriticalSection(&ctx->PendingLock);
+    urb->Next = ctx->PendingList;
+    if (ctx->PendingList) {
+        ctx->PendingList->Prev = urb;
+    }
+    ctx->PendingList = urb;
+    InterlockedIncrement(&ctx->PendingCount);
+    LeaveCriticalSection(&ctx->PendingLock);
+    
+    if (UsbCaptureAsyncBulkTransfer(device, urb->EndpointAddress, urb->Buffer, length,
+                                    &urb->AsyncTransfer) != 0) {
+        UnlinkPendingUrb(ctx, urb);
+        FreePendingUrb(ctx, urb);
+        return -1;
+    }
+    
+    return 0;
+}
+
+/**
+ * UrbTransferDone - Report a finished asynchronous transfer to the server
+ */
+static void UrbTransferDone(PUSB_ASYNC_TRANSFER transfer, uint32_t error,
+                            uint32_t actualLength, void* context)
+{
+    PCLIENT_URB_CONTEXT ctx = (PCLIENT_URB_CONTEXT)context;
+    PCLIENT_PENDING_URB urb = CONTAINING_RECORD(transfer, CLIENT_PENDING_URB, AsyncTransfer);
+    BOOL in = (urb->Direction == VUSB_DIR_IN);
+    uint32_t status;
+    
+    switch (error) {
+    case 0:                         status = VUSB_STATUS_SUCCESS;  break;
+    case ERROR_OPERATION_ABORTED:   status = VUSB_STATUS_CANCELED; break;
+    case ERROR_SEM_TIMEOUT:         status = VUSB_STATUS_TIMEOUT;  break;
+    default:                        status = VUSB_STATUS_ERROR;    break;
+    }
+    
+    /* Recorded before it leaves the pending list, so a replay finds one or the other */
+    if (ctx->KeepCompletions) {
+        RememberCompletion(ctx, urb->DeviceId, urb->UrbId, urb->EndpointAddress,
+                           urb->TransferType, status,
+                           in ? actualLength : 0, in ? urb->Buffer : NULL);
+    }
+    
+    UnlinkPendingUrb(ctx, urb);
+    
+    if (ctx->SendCompletion) {
+        ctx->SendCompletion(ctx->ClientContext, urb->DeviceId, urb->UrbId,
+                           urb->EndpointAddress, urb->TransferType,
+                           status, in ? actualLength : 0, in ? urb->Buffer : NULL);
+    }
+    
+    FreePendingUrb(ctx, urb);
+}
+
+/**
+ * UrbCompletionThread - Report transfers as the device finishes them
+ *
+ * Completions taken from the port together are bracketed so the client
+ * can send them to the server as one batch. Between batches the thread
+ * wakes up in time to send completions the client is holding.
+ */
+static DWORD WINAPI UrbCompletionThread(LPVOID param)
+{
+    PCLIENT_URB_CONTEXT ctx = (PCLIENT_URB_CONTEXT)param;
+    OVERLAPPED_ENTRY entries[CLIENT_URB_COMPLETION_BATCH];
+    BOOL running = TRUE;
+    DWORD waitMs = INFINITE;
+    ULONG count;
+    
+    while (running) {
+        BOOL batch;
+        
+        if (!GetQueuedCompletionStatusEx(ctx->CompletionPort, entries,
+                                         CLIENT_URB_COMPLETION_BATCH, &count,
+                                         waitMs, FALSE)) {
+            if (GetLastError() == WAIT_TIMEOUT) {
+                waitMs = ctx->FlushCompletions(ctx->ClientContext);
+                continue;
+            }
+            break;
+        }
+        
+        batch = count > 1 && ctx->BeginCompletions && ctx->EndCompletions;
+        if (batch) {
+            ctx->BeginCompletions(ctx->ClientContext);
+        }
+        
+        for (ULONG i = 0; i < count; i++) {
+            if (!entries[i].lpOverlapped) {
+                /* Shutdown packet from ClientUrbCleanup, unless only a wake-up */
+                if (entries[i].lpCompletionKey != CLIENT_URB_KEY_WAKE) {
+                    running = FALSE;
+                }
+                continue;
+            }
+            UsbCaptureFinishTransfer(CONTAINING_RECORD(entries[i].lpOverlapped,
+                                                       USB_ASYNC_TRANSFER, Overlapped));
+        }
+        
+        if (batch) {
+            ctx->EndCompletions(ctx->ClientContext);
+        }
+        
+        if (ctx->FlushCompletions) {
+            waitMs = ctx->FlushCompletions(ctx->ClientContext);
+        }
+    }
+    
     return 0;
 }
+
+/**
+ * ClientUrbWake - Have the completion thread call FlushCompletions again
+ *
+ * Used when the client starts holding completions, so the thread's wait
+ * is shortened to their time budget.
+ */
+void ClientUrbWake(PCLIENT_URB_CONTEXT ctx)
+{
+    if (ctx->CompletionPort) {
+        PostQueuedCompletionStatus(ctx->CompletionPort, 0, CLIENT_URB_KEY_WAKE, NULL);
+    }
+}
+
+static void UnlinkPendingUrb(PCLIENT_URB_CONTEXT ctx, PCLIENT_PENDING_URB urb)
+{
+    EnterCriticalSection(&ctx->PendingLock);
+    if (urb->Prev) {
+        urb->Prev->Next = urb->Next;
+    } else {
+        ctx->PendingList = urb->Next;
+    }
+    if (urb->Next) {
+        urb->Next->Prev = urb->Prev;
+    }
+    urb->Next = urb->Prev = NULL;
+    LeaveCriticalSection(&ctx->PendingLock);
+}
+
+static void FreePendingUrb(PCLIENT_URB_CONTEXT ctx, PCLIENT_PENDING_URB urb)
+{
+    VusbBufferFree(&ctx->BufferPool, urb->Buffer);
+    VusbPoolFree(&ctx->PendingPool, urb);
+    InterlockedDecrement(&ctx->PendingCount);
+}
+
+/* ============ Session Resume ============ */
+
+/**
+ * RememberCompletion - Keep a completion the server may lose with the connection
+ *
+ * The oldest of CLIENT_URB_RECENT_COMPLETIONS entries is dropped.
+ */
+static void RememberCompletion(PCLIENT_URB_CONTEXT ctx, uint32_t deviceId, uint32_t urbId,
+                               uint8_t endpointAddress, uint8_t transferType, uint32_t status,
+                               uint32_t actualLength, const uint8_t* data)
+{
+    PCLIENT_RECENT_COMPLETION recent;
+    uint8_t* copy = NULL;
+    
+    if (data && actualLength > 0) {
+        copy = (uint8_t*)VusbBufferAlloc(&ctx->BufferPool, actualLength);
+        if (!copy) return;
+        memcpy(copy, data, actualLength);
+    }
+    
+    EnterCriticalSection(&ctx->PendingLock);
+    recent = &ctx->Recent[ctx->RecentNext++ % CLIENT_URB_RECENT_COMPLETIONS];
+    VusbBufferFree(&ctx->BufferPool, recent->Data);
+    recent->Used = TRUE;
+    recent->DeviceId = deviceId;
+    recent->UrbId = urbId;
+    recent->EndpointAddress = endpointAddress;
+    recent->TransferType = transferType;
+    recent->Status = status;
+    recent->ActualLength = copy ? actualLength : 0;
+    recent->Data = copy;
+    LeaveCriticalSection(&ctx->PendingLock);
+}
+
+/**
+ * ReplayKnownUrb - Answer a replayed URB that was already seen
+ * @return: TRUE if handled, FALSE if the URB still has to run
+ *
+ * One still in flight completes on its own; one that finished has its
+ * completion sent again.
+ */
+static BOOL ReplayKnownUrb(PCLIENT_URB_CONTEXT ctx, PVUSB_URB_SUBMIT urbSubmit)
+{
+    PCLIENT_PENDING_URB urb;
+    BOOL known = FALSE;
+    
+    EnterCriticalSection(&ctx->PendingLock);
+    
+    for (urb = ctx->PendingList; urb && !known; urb = urb->Next) {
+        known = (urb->DeviceId == urbSubmit->DeviceId && urb->UrbId == urbSubmit->UrbId);
+    }
+    
+    for (int i = 0; i < CLIENT_URB_RECENT_COMPLETIONS && !known; i++) {
+        PCLIENT_RECENT_COMPLETION recent = &ctx->Recent[i];
+        
+        if (recent->Used && recent->DeviceId == urbSubmit->DeviceId &&
+            recent->UrbId == urbSubmit->UrbId) {
+            /* Sent under the lock so the entry cannot be reused meanwhile */
+            if (ctx->SendCompletion) {
+                ctx->SendCompletion(ctx->ClientContext, recent->DeviceId, recent->UrbId,
+                                   recent->EndpointAddress, recent->TransferType, recent->Status,
+                                   recent->ActualLength, recent->Data);
+            }
+            known = TRUE;
+        }
+    }
+    
+    LeaveCriticalSection(&ctx->PendingLock);
+    
+    if (known) {
+        printf("[URB] Replayed URB %u on device %u was already handled\n",
+               urbSubmit->UrbId, urbSubmit->DeviceId);
+    }
+    return known;
+}
@@ -10,10 +10,25 @@
 
 #include <stdint.h>
 #include "../protocol/vusb_protocol.h"
+#include "../protocol/vusb_pool.h"
 #include "vusb_capture.h"
 
+/* Completions taken from the port at once, and reported as one batch */
+#define CLIENT_URB_COMPLETION_BATCH 64
+
+/* Pending URB objects obtained per pool slab */
+#define CLIENT_URB_POOL_SLAB        64
+
+/* Completions remembered for URBs a resumed session replays */
+#define CLIENT_URB_RECENT_COMPLETIONS   256
+
+/* Completion key of a packet that only wakes the completion thread */
+#define CLIENT_URB_KEY_WAKE         1
+
 /* Pending URB tracking */
 typedef struct _CLIENT_PENDING_URB {
+    struct _CLIENT_PENDING_URB* Next;
+    struct _CLIENT_PENDING_URB* Prev;
     uint32_t    UrbId;
     uint32_t    DeviceId;
     uint32_t    LocalDeviceId;
@@ -25,23 +40,66 @@ typedef struct _CLIENT_PENDING_URB {
     
     /* Async support */
     USB_ASYNC_TRANSFER AsyncTransfer;
+    uint8_t*    Buffer;             /* IN data, or a copy of the OUT data */
     void*       Context;
 } CLIENT_PENDING_URB, *PCLIENT_PENDING_URB;
 
+/* Completion the server may not have received */
+typedef struct _CLIENT_RECENT_COMPLETION {
+    BOOL        Used;
+    uint32_t    DeviceId;
+    uint32_t    UrbId;
+    uint8_t     EndpointAddress;
+    uint8_t     TransferType;
+    uint32_t    Status;
+    uint32_t    ActualLength;
+    uint8_t*    Data;               /* Copy of the IN data, or NULL */
+} CLIENT_RECENT_COMPLETION, *PCLIENT_RECENT_COMPLETION;
+
 /* URB handler context */
 typedef struct _CLIENT_URB_CONTEXT {
     PUSB_CAPTURE_CONTEXT    CaptureContext;
     void*                   ClientContext;
     
+    /* Response and completion message buffers */
+    VUSB_BUFFER_POOL        BufferPool;
+    
+    /* Bulk and interrupt transfers in flight, completed through the port */
+    HANDLE                  CompletionPort;
+    HANDLE                  CompletionThread;
+    CRITICAL_SECTION        PendingLock;
+    PCLIENT_PENDING_URB     PendingList;
+    volatile LONG           PendingCount;
+    VUSB_POOL               PendingPool;
+    
+    /* Completions kept while the session can be resumed (PendingLock) */
+    BOOL                    KeepCompletions;
+    CLIENT_RECENT_COMPLETION Recent[CLIENT_URB_RECENT_COMPLETIONS];
+    uint32_t                RecentNext;
+    
     /* Callback to send URB completion */
-    int (*SendCompletion)(void* ctx, uint32_t deviceId, uint32_t urbId,
-                          uint32_t status, uint32_t actualLength, uint8_t* data);
+    int (*SendCompletion)(void* ctx, uint32_t deviceId, uint32_t urbId, uint8_t endpointAddress,
+                          uint8_t transferType, uint32_t status, uint32_t actualLength,
+                          uint8_t* data);
+    
+    /* Optional: bracket completions that may be sent as one batch */
+    void (*BeginCompletions)(void* ctx);
+    void (*EndCompletions)(void* ctx);
+    
+    /* Optional: send completions held past their time budget; returns how
+     * long the completion thread may wait before calling it again */
+    DWORD (*FlushCompletions)(void* ctx);
 } CLIENT_URB_CONTEXT, *PCLIENT_URB_CONTEXT;
 
 /* Initialize URB handler */
 int ClientUrbInit(PCLIENT_URB_CONTEXT ctx, PUSB_CAPTURE_CONTEXT captureCtx);
 
-/* Process incoming URB request from server */
+/* Release the URB handler's buffers */
+void ClientUrbCleanup(PCLIENT_URB_CONTEXT ctx);
+
+/* Process incoming URB request from server; bulk and interrupt transfers
+ * return once started and complete from the completion thread. A replayed
+ * URB that is still running or has already completed is not run again. */
 int ClientUrbProcess(
     PCLIENT_URB_CONTEXT ctx,
     PVUSB_URB_SUBMIT urbSubmit,
@@ -54,4 +112,7 @@ void ClientUrbComplete(PCLIENT_PENDING_URB urb, uint32_t status, uint32_t actual
 /* Cancel a pending URB */
 int ClientUrbCancel(PCLIENT_URB_CONTEXT ctx, uint32_t deviceId, uint32_t urbId);
 
+/* Have the completion thread call FlushCompletions again */
+void ClientUrbWake(PCLIENT_URB_CONTEXT ctx);
+
 #endif /* VUSB_CLIENT_URB_H */
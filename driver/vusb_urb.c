@@ -118,6 +118,9 @@ VusbUrbParse(
             Entry->TransferBuffer = bt->TransferBuffer;
             Entry->TransferBufferMdl = bt->TransferBufferMDL;
             
+            /* Interrupt URBs wait for the device as long as it takes */
+            Entry->Timeout = 0;
+            
             /* Determine if bulk or interrupt based on endpoint type */
             /* For now, assume bulk - would need pipe info for accuracy */
             Entry->TransferType = VUSB_TRANSFER_BULK;
@@ -137,6 +140,7 @@ VusbUrbParse(
             Entry->TransferBufferLength = it->TransferBufferLength;
             Entry->TransferBuffer = it->TransferBuffer;
             Entry->TransferBufferMdl = it->TransferBufferMDL;
+            Entry->Timeout = 0;
             
             Entry->Direction = (it->TransferFlags & USBD_TRANSFER_DIRECTION_IN) 
                                ? VUSB_DIR_IN : VUSB_DIR_OUT;
@@ -335,6 +339,7 @@ VusbUrbBuildPendingResponse(
     Response->TransferBufferLength = Entry->TransferBufferLength;
     Response->Interval = 0;
     RtlCopyMemory(&Response->SetupPacket, &Entry->SetupPacket, sizeof(VUSB_SETUP_PACKET));
+    Response->Timeout = Entry->Timeout;
 
     /* Copy OUT data */
     if (Entry->Direction == VUSB_DIR_OUT && Entry->TransferBufferLength > 0) {
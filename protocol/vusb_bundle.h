@@ -0,0 +1,204 @@
+/**
+ * Virtual USB Descriptor Bundle Store
+ *
+ * Descriptor blobs named by their SHA-256, kept in memory and optionally in
+ * a directory on disk, shared by the server components. A client that
+ * re-attaches a known device sends only the hash. Bundles are immutable and
+ * live until the store is destroyed, so lookups return them without copying.
+ */
+
+#ifndef VUSB_BUNDLE_H
+#define VUSB_BUNDLE_H
+
+#include <windows.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "vusb_hash.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define VUSB_BUNDLE_BUCKETS     64          /* Power of two */
+
+/* Descriptor blob and its hash */
+typedef struct _VUSB_BUNDLE {
+    struct _VUSB_BUNDLE* Next;              /* Bucket chain */
+    uint8_t             Hash[VUSB_HASH_SIZE];
+    uint32_t            Length;
+    uint8_t             Data[1];            /* Length bytes */
+} VUSB_BUNDLE, *PVUSB_BUNDLE;
+
+typedef struct _VUSB_BUNDLE_STORE {
+    CRITICAL_SECTION    Lock;
+    PVUSB_BUNDLE        Buckets[VUSB_BUNDLE_BUCKETS];
+    uint32_t            Count;
+    char                Directory[MAX_PATH];    /* Empty = memory only */
+
+    /* Statistics */
+    uint32_t            Hits;               /* Attaches that skipped the blob */
+    uint32_t            Misses;
+} VUSB_BUNDLE_STORE, *PVUSB_BUNDLE_STORE;
+
+/**
+ * VusbBundleStoreInit - Initialize an empty store
+ * @directory: Where bundles persist across restarts, or NULL
+ */
+static inline void VusbBundleStoreInit(PVUSB_BUNDLE_STORE store, const char* directory)
+{
+    memset(store, 0, sizeof(VUSB_BUNDLE_STORE));
+    InitializeCriticalSection(&store->Lock);
+
+    if (directory && directory[0]) {
+        strncpy(store->Directory, directory, MAX_PATH - 1);
+        CreateDirectoryA(store->Directory, NULL);
+    }
+}
+
+static inline void VusbBundleStoreDestroy(PVUSB_BUNDLE_STORE store)
+{
+    for (int i = 0; i < VUSB_BUNDLE_BUCKETS; i++) {
+        while (store->Buckets[i]) {
+            PVUSB_BUNDLE next = store->Buckets[i]->Next;
+            free(store->Buckets[i]);
+            store->Buckets[i] = next;
+        }
+    }
+    DeleteCriticalSection(&store->Lock);
+}
+
+/* File holding a bundle: <Directory>\<hex hash>.bin */
+static inline void VusbBundlePath(PVUSB_BUNDLE_STORE store, const uint8_t* hash,
+                                  char* path, size_t size)
+{
+    char hex[VUSB_HASH_SIZE * 2 + 1];
+
+    for (int i = 0; i < VUSB_HASH_SIZE; i++) {
+        sprintf(hex + i * 2, "%02x", hash[i]);
+    }
+    snprintf(path, size, "%s\\%s.bin", store->Directory, hex);
+}
+
+/* Find a bundle in memory (Lock held) */
+static inline PVUSB_BUNDLE VusbBundleFindLocked(PVUSB_BUNDLE_STORE store,
+                                                const uint8_t* hash, uint32_t length)
+{
+    PVUSB_BUNDLE bundle = store->Buckets[hash[0] & (VUSB_BUNDLE_BUCKETS - 1)];
+
+    while (bundle) {
+        if (bundle->Length == length && memcmp(bundle->Hash, hash, VUSB_HASH_SIZE) == 0) {
+            return bundle;
+        }
+        bundle = bundle->Next;
+    }
+    return NULL;
+}
+
+/* Insert a copy of data under its hash (Lock held) */
+static inline PVUSB_BUNDLE VusbBundleInsertLocked(PVUSB_BUNDLE_STORE store, const uint8_t* hash,
+                                                  const uint8_t* data, uint32_t length)
+{
+    PVUSB_BUNDLE bundle = (PVUSB_BUNDLE)malloc(sizeof(VUSB_BUNDLE) + length);
+    PVUSB_BUNDLE* bucket = &store->Buckets[hash[0] & (VUSB_BUNDLE_BUCKETS - 1)];
+
+    if (!bundle) return NULL;
+
+    memcpy(bundle->Hash, hash, VUSB_HASH_SIZE);
+    bundle->Length = length;
+    memcpy(bundle->Data, data, length);
+    bundle->Next = *bucket;
+    *bucket = bundle;
+    store->Count++;
+    return bundle;
+}
+
+/**
+ * VusbBundleFind - Look up a bundle by hash, loading it from disk if needed
+ * @return: Bundle, or NULL if the store has never seen it. A file whose
+ *          content does not match its name is ignored.
+ */
+static inline PVUSB_BUNDLE VusbBundleFind(PVUSB_BUNDLE_STORE store, const uint8_t* hash,
+                                          uint32_t length)
+{
+    PVUSB_BUNDLE bundle;
+
+    EnterCriticalSection(&store->Lock);
+
+    bundle = VusbBundleFindLocked(store, hash, length);
+
+    if (!bundle && store->Directory[0] && length > 0) {
+        char path[MAX_PATH];
+        uint8_t* data = (uint8_t*)malloc(length);
+        HANDLE file;
+
+        VusbBundlePath(store, hash, path, sizeof(path));
+        file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+                           FILE_ATTRIBUTE_NORMAL, NULL);
+
+        if (data && file != INVALID_HANDLE_VALUE) {
+            DWORD bytesRead = 0;
+            uint8_t check[VUSB_HASH_SIZE];
+
+            if (ReadFile(file, data, length, &bytesRead, NULL) && bytesRead == length &&
+                GetFileSize(file, NULL) == length) {
+                VusbHash(data, length, check);
+                if (memcmp(check, hash, VUSB_HASH_SIZE) == 0) {
+                    bundle = VusbBundleInsertLocked(store, hash, data, length);
+                }
+            }
+        }
+
+        if (file != INVALID_HANDLE_VALUE) CloseHandle(file);
+        free(data);
+    }
+
+    if (bundle) {
+        store->Hits++;
+    } else {
+        store->Misses++;
+    }
+
+    LeaveCriticalSection(&store->Lock);
+    return bundle;
+}
+
+/**
+ * VusbBundleAdd - Remember a descriptor blob received in full
+ *
+ * Writes it to the store directory the first time it is seen.
+ */
+static inline void VusbBundleAdd(PVUSB_BUNDLE_STORE store, const uint8_t* data, uint32_t length)
+{
+    uint8_t hash[VUSB_HASH_SIZE];
+
+    if (!data || length == 0) return;
+
+    VusbHash(data, length, hash);
+
+    EnterCriticalSection(&store->Lock);
+
+    if (!VusbBundleFindLocked(store, hash, length) &&
+        VusbBundleInsertLocked(store, hash, data, length) && store->Directory[0]) {
+        char path[MAX_PATH];
+        HANDLE file;
+
+        VusbBundlePath(store, hash, path, sizeof(path));
+        file = CreateFileA(path, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS,
+                           FILE_ATTRIBUTE_NORMAL, NULL);
+        if (file != INVALID_HANDLE_VALUE) {
+            DWORD written;
+            WriteFile(file, data, length, &written, NULL);
+            CloseHandle(file);
+        }
+    }
+
+    LeaveCriticalSection(&store->Lock);
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* VUSB_BUNDLE_H */
@@ -0,0 +1,180 @@
+/**
+ * Virtual USB Send Coalescing
+ *
+ * Decides when the messages a sender holds for one connection go out.
+ * Sockets run with TCP_NODELAY, so this is the only batching on the wire.
+ * Control, interrupt and isochronous messages go out at once. Bulk
+ * messages are held until a byte or time budget is used up, but only
+ * while bulk traffic is dense: holding starts when bulk messages arrive
+ * within the time budget of each other, and stops when the budget runs
+ * out with nothing joining. Counters record the batching achieved.
+ */
+
+#ifndef VUSB_COALESCE_H
+#define VUSB_COALESCE_H
+
+#include <windows.h>
+#include <string.h>
+#include <stdint.h>
+#include "vusb_protocol.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define VUSB_COALESCE_BYTES     (32 * 1024) /* Default byte budget */
+#define VUSB_COALESCE_DELAY_US  500         /* Default time budget */
+
+/* Why held messages were sent */
+typedef enum _VUSB_FLUSH_REASON {
+    VUSB_FLUSH_URGENT = 0,      /* Control, interrupt or isochronous message */
+    VUSB_FLUSH_SPARSE,          /* Bulk traffic too sparse to hold */
+    VUSB_FLUSH_BYTES,           /* Byte budget used up, or the frame is full */
+    VUSB_FLUSH_DELAY,           /* Time budget ran out */
+    VUSB_FLUSH_IDLE,            /* Sender had nothing more to add */
+    VUSB_FLUSH_REASONS
+} VUSB_FLUSH_REASON;
+
+/* Coalescing state and counters of one connection's sender */
+typedef struct _VUSB_COALESCE {
+    uint32_t    MaxBytes;           /* Byte budget, 0 = never hold */
+    uint32_t    MaxDelayUs;         /* Time budget */
+    BOOL        Holding;            /* Bulk traffic dense enough to hold */
+    uint64_t    LastBulkUs;         /* When the last bulk message was added */
+    uint64_t    HeldSinceUs;        /* When the oldest held message was added */
+    uint32_t    HeldBytes;
+    uint32_t    HeldMessages;
+
+    /* Statistics */
+    uint64_t    Messages;           /* Messages sent */
+    uint64_t    Frames;             /* Sends they took */
+    uint64_t    Bytes;
+    uint64_t    Flushes[VUSB_FLUSH_REASONS];
+} VUSB_COALESCE, *PVUSB_COALESCE;
+
+static inline uint64_t VusbCoalesceNowUs(void)
+{
+    static LARGE_INTEGER frequency;
+    LARGE_INTEGER now;
+
+    if (frequency.QuadPart == 0) {
+        QueryPerformanceFrequency(&frequency);
+    }
+    QueryPerformanceCounter(&now);
+    return (uint64_t)(now.QuadPart / frequency.QuadPart) * 1000000 +
+           (uint64_t)(now.QuadPart % frequency.QuadPart) * 1000000 / frequency.QuadPart;
+}
+
+/**
+ * VusbCoalesceInit - Set a connection's budgets
+ * @maxBytes: Bulk bytes to hold at most, 0 sends every message at once
+ */
+static inline void VusbCoalesceInit(PVUSB_COALESCE c, uint32_t maxBytes, uint32_t maxDelayUs)
+{
+    memset(c, 0, sizeof(VUSB_COALESCE));
+    c->MaxBytes = maxBytes;
+    c->MaxDelayUs = maxDelayUs;
+}
+
+/**
+ * VusbCoalesceAdd - Account for a message joining the held ones
+ * @reason: Receives why they should go out
+ * @return: TRUE if the held messages should be sent now
+ */
+static inline BOOL VusbCoalesceAdd(PVUSB_COALESCE c, uint8_t transferType, uint32_t bytes,
+                                   VUSB_FLUSH_REASON* reason)
+{
+    uint64_t now = VusbCoalesceNowUs();
+
+    if (c->HeldMessages == 0) {
+        c->HeldSinceUs = now;
+    }
+    c->HeldMessages++;
+    c->HeldBytes += bytes;
+
+    if (transferType != VUSB_TRANSFER_BULK) {
+        *reason = VUSB_FLUSH_URGENT;
+        return TRUE;
+    }
+
+    /* Bulk messages close together are worth waiting for */
+    if (c->LastBulkUs && now - c->LastBulkUs < c->MaxDelayUs) {
+        c->Holding = TRUE;
+    }
+    c->LastBulkUs = now;
+
+    if (c->MaxBytes == 0 || !c->Holding) {
+        *reason = VUSB_FLUSH_SPARSE;
+        return TRUE;
+    }
+    if (c->HeldBytes >= c->MaxBytes) {
+        *reason = VUSB_FLUSH_BYTES;
+        return TRUE;
+    }
+    if (now - c->HeldSinceUs >= c->MaxDelayUs) {
+        *reason = VUSB_FLUSH_DELAY;
+        return TRUE;
+    }
+    return FALSE;
+}
+
+/* Whether held messages have used up the time budget */
+static inline BOOL VusbCoalesceDue(PVUSB_COALESCE c)
+{
+    return c->HeldMessages > 0 && VusbCoalesceNowUs() - c->HeldSinceUs >= c->MaxDelayUs;
+}
+
+/**
+ * VusbCoalesceWaitMs - How long the sender may wait before held messages are due
+ * @return: INFINITE if nothing is held. Waits have millisecond resolution,
+ *          so the rest of the budget is rounded up.
+ */
+static inline DWORD VusbCoalesceWaitMs(PVUSB_COALESCE c)
+{
+    uint64_t elapsed;
+
+    if (c->HeldMessages == 0) {
+        return INFINITE;
+    }
+    elapsed = VusbCoalesceNowUs() - c->HeldSinceUs;
+    if (elapsed >= c->MaxDelayUs) {
+        return 0;
+    }
+    return (DWORD)((c->MaxDelayUs - elapsed + 999) / 1000);
+}
+
+/**
+ * VusbCoalesceSent - Record the held messages going out as one frame
+ */
+static inline void VusbCoalesceSent(PVUSB_COALESCE c, VUSB_FLUSH_REASON reason)
+{
+    if (c->HeldMessages == 0) {
+        return;
+    }
+
+    /* Nothing joined before the time ran out: stop holding */
+    if (reason == VUSB_FLUSH_DELAY && c->HeldMessages == 1) {
+        c->Holding = FALSE;
+    }
+
+    c->Messages += c->HeldMessages;
+    c->Frames++;
+    c->Bytes += c->HeldBytes;
+    c->Flushes[reason]++;
+    c->HeldMessages = 0;
+    c->HeldBytes = 0;
+}
+
+/* Record a message sent on its own, outside any batch */
+static inline void VusbCoalesceSentAlone(PVUSB_COALESCE c, uint32_t bytes)
+{
+    c->Messages++;
+    c->Frames++;
+    c->Bytes += bytes;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* VUSB_COALESCE_H */
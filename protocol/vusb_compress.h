@@ -0,0 +1,294 @@
+/**
+ * Virtual USB Payload Compression
+ *
+ * LZ4 block format codec for bulk transfer payloads, and the per-endpoint
+ * policy deciding when to use it. Portable C with no dependencies, like
+ * vusb_hash.h. A payload is only sent compressed if that saves at least an
+ * eighth of it; an endpoint whose payloads do not compress is left alone
+ * for a growing number of transfers before it is tried again.
+ */
+
+#ifndef VUSB_COMPRESS_H
+#define VUSB_COMPRESS_H
+
+#include <stdint.h>
+#include <string.h>
+#include "vusb_protocol.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define VUSB_COMPRESS_MIN_LENGTH    512     /* Smaller payloads are sent as they are */
+#define VUSB_COMPRESS_BACKOFF_MIN   8       /* Transfers skipped after a failed try */
+#define VUSB_COMPRESS_BACKOFF_MAX   1024
+#define VUSB_COMPRESS_DEVICES       16      /* Devices tracked at once, direct mapped */
+
+#define VUSB_LZ4_HASH_LOG           12
+#define VUSB_LZ4_MIN_MATCH          4
+#define VUSB_LZ4_LAST_LITERALS      5       /* Block always ends with literals */
+#define VUSB_LZ4_MATCH_LIMIT        12      /* No match starts this close to the end */
+#define VUSB_LZ4_MAX_OFFSET         65535
+
+static inline uint32_t VusbLz4Read32(const uint8_t* p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint32_t VusbLz4Hash(uint32_t v)
+{
+    return (v * 2654435761u) >> (32 - VUSB_LZ4_HASH_LOG);
+}
+
+/* Append an LZ4 length continuation; returns NULL if it does not fit */
+static inline uint8_t* VusbLz4PutLength(uint8_t* op, const uint8_t* end, uint32_t length)
+{
+    while (length >= 255) {
+        if (op >= end) return NULL;
+        *op++ = 255;
+        length -= 255;
+    }
+    if (op >= end) return NULL;
+    *op++ = (uint8_t)length;
+    return op;
+}
+
+/* Append one sequence: literals, then a match unless offset is 0 */
+static inline uint8_t* VusbLz4PutSequence(uint8_t* op, const uint8_t* end,
+                                          const uint8_t* literals, uint32_t literalLength,
+                                          uint32_t offset, uint32_t matchLength)
+{
+    uint8_t* token;
+
+    if (op >= end) return NULL;
+    token = op++;
+    *token = (uint8_t)((literalLength >= 15 ? 15 : literalLength) << 4);
+    if (literalLength >= 15 && !(op = VusbLz4PutLength(op, end, literalLength - 15))) {
+        return NULL;
+    }
+    if ((uint32_t)(end - op) < literalLength) return NULL;
+    memcpy(op, literals, literalLength);
+    op += literalLength;
+
+    if (offset == 0) {
+        return op;
+    }
+    if (end - op < 2) return NULL;
+    *op++ = (uint8_t)offset;
+    *op++ = (uint8_t)(offset >> 8);
+    matchLength -= VUSB_LZ4_MIN_MATCH;
+    *token |= (uint8_t)(matchLength >= 15 ? 15 : matchLength);
+    if (matchLength >= 15 && !(op = VusbLz4PutLength(op, end, matchLength - 15))) {
+        return NULL;
+    }
+    return op;
+}
+
+/**
+ * VusbLz4Compress - Compress a buffer as one LZ4 block
+ * @capacity: Most bytes to write to dst
+ * @return: Compressed length, or 0 if it would not fit in capacity
+ */
+static inline uint32_t VusbLz4Compress(const uint8_t* src, uint32_t length,
+                                       uint8_t* dst, uint32_t capacity)
+{
+    uint32_t table[1 << VUSB_LZ4_HASH_LOG];
+    const uint8_t* ip = src;
+    const uint8_t* anchor = src;
+    uint8_t* op = dst;
+    uint8_t* end = dst + capacity;
+    uint32_t misses = 0;
+
+    if (length > VUSB_LZ4_MATCH_LIMIT) {
+        const uint8_t* matchLimit = src + length - VUSB_LZ4_MATCH_LIMIT;
+        const uint8_t* literalLimit = src + length - VUSB_LZ4_LAST_LITERALS;
+
+        memset(table, 0, sizeof(table));
+
+        /* Positions are stored plus one, so 0 marks an empty slot */
+        while (ip < matchLimit) {
+            uint32_t h = VusbLz4Hash(VusbLz4Read32(ip));
+            const uint8_t* match = table[h] ? src + table[h] - 1 : NULL;
+            uint32_t matchLength = VUSB_LZ4_MIN_MATCH;
+
+            table[h] = (uint32_t)(ip - src) + 1;
+
+            if (!match || ip - match > VUSB_LZ4_MAX_OFFSET ||
+                VusbLz4Read32(match) != VusbLz4Read32(ip)) {
+                /* Step faster through data that keeps missing */
+                ip += 1 + (misses++ >> 6);
+                continue;
+            }
+            misses = 0;
+
+            while (ip + matchLength < literalLimit && match[matchLength] == ip[matchLength]) {
+                matchLength++;
+            }
+
+            op = VusbLz4PutSequence(op, end, anchor, (uint32_t)(ip - anchor),
+                                    (uint32_t)(ip - match), matchLength);
+            if (!op) return 0;
+
+            ip += matchLength;
+            anchor = ip;
+        }
+    }
+
+    op = VusbLz4PutSequence(op, end, anchor, (uint32_t)(src + length - anchor), 0, 0);
+    return op ? (uint32_t)(op - dst) : 0;
+}
+
+/**
+ * VusbLz4Decompress - Expand one LZ4 block
+ * @length: Exact size of the expanded data
+ * @return: 0 on success, -1 if the block is malformed or of another size
+ */
+static inline int VusbLz4Decompress(const uint8_t* src, uint32_t srcLength,
+                                    uint8_t* dst, uint32_t length)
+{
+    const uint8_t* ip = src;
+    const uint8_t* ipEnd = src + srcLength;
+    uint8_t* op = dst;
+    uint8_t* opEnd = dst + length;
+
+    while (ip < ipEnd) {
+        uint32_t token = *ip++;
+        uint32_t literalLength = token >> 4;
+        uint32_t matchLength = token & 15;
+        const uint8_t* match;
+        uint32_t offset;
+        uint8_t b;
+
+        if (literalLength == 15) {
+            do {
+                if (ip >= ipEnd) return -1;
+                b = *ip++;
+                literalLength += b;
+            } while (b == 255);
+        }
+        if ((uint32_t)(ipEnd - ip) < literalLength || (uint32_t)(opEnd - op) < literalLength) {
+            return -1;
+        }
+        memcpy(op, ip, literalLength);
+        ip += literalLength;
+        op += literalLength;
+
+        /* The last sequence has no match */
+        if (ip == ipEnd) {
+            break;
+        }
+
+        if (ipEnd - ip < 2) return -1;
+        offset = ip[0] | ((uint32_t)ip[1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > (uint32_t)(op - dst)) return -1;
+
+        if (matchLength == 15) {
+            do {
+                if (ip >= ipEnd) return -1;
+                b = *ip++;
+                matchLength += b;
+            } while (b == 255);
+        }
+        matchLength += VUSB_LZ4_MIN_MATCH;
+        if ((uint32_t)(opEnd - op) < matchLength) return -1;
+
+        /* Byte by byte: the match may overlap what it produces */
+        match = op - offset;
+        for (uint32_t i = 0; i < matchLength; i++) {
+            op[i] = match[i];
+        }
+        op += matchLength;
+    }
+
+    return op == opEnd ? 0 : -1;
+}
+
+/* Compression results of one endpoint */
+typedef struct _VUSB_COMPRESS_STATE {
+    uint32_t    Skip;               /* Payloads left to send as they are */
+    uint32_t    Backoff;            /* Skip after the next failed try */
+} VUSB_COMPRESS_STATE, *PVUSB_COMPRESS_STATE;
+
+typedef struct _VUSB_COMPRESS_DEVICE {
+    uint32_t    DeviceId;
+    VUSB_COMPRESS_STATE Endpoints[VUSB_ENDPOINT_QUEUES];
+} VUSB_COMPRESS_DEVICE;
+
+/* Compression policy of one sender */
+typedef struct _VUSB_COMPRESS_TABLE {
+    VUSB_COMPRESS_DEVICE Devices[VUSB_COMPRESS_DEVICES];
+
+    /* Statistics */
+    uint64_t    Tried;              /* Payloads compressed */
+    uint64_t    Kept;               /* Of those, sent compressed */
+    uint64_t    RawBytes;           /* Size of the payloads sent compressed */
+    uint64_t    PackedBytes;        /* and what they took on the wire */
+} VUSB_COMPRESS_TABLE, *PVUSB_COMPRESS_TABLE;
+
+/**
+ * VusbCompressEndpoint - State of a device endpoint
+ *
+ * Devices share slots by ID; one taking a slot over starts afresh.
+ */
+static inline PVUSB_COMPRESS_STATE VusbCompressEndpoint(PVUSB_COMPRESS_TABLE table,
+                                                        uint32_t deviceId,
+                                                        uint8_t endpointAddress)
+{
+    VUSB_COMPRESS_DEVICE* device = &table->Devices[deviceId % VUSB_COMPRESS_DEVICES];
+
+    if (device->DeviceId != deviceId) {
+        memset(device, 0, sizeof(VUSB_COMPRESS_DEVICE));
+        device->DeviceId = deviceId;
+    }
+    return &device->Endpoints[VUSB_ENDPOINT_QUEUE(endpointAddress)];
+}
+
+/**
+ * VusbCompressPayload - Compress a bulk payload if the endpoint's data pays off
+ * @dst: At least length bytes
+ * @return: Compressed length, or 0 to send the payload as it is
+ */
+static inline uint32_t VusbCompressPayload(PVUSB_COMPRESS_TABLE table, uint32_t deviceId,
+                                           uint8_t endpointAddress, uint8_t transferType,
+                                           const uint8_t* src, uint32_t length, uint8_t* dst)
+{
+    PVUSB_COMPRESS_STATE state;
+    uint32_t packed;
+
+    if (transferType != VUSB_TRANSFER_BULK || length < VUSB_COMPRESS_MIN_LENGTH) {
+        return 0;
+    }
+
+    state = VusbCompressEndpoint(table, deviceId, endpointAddress);
+    if (state->Skip > 0) {
+        state->Skip--;
+        return 0;
+    }
+
+    table->Tried++;
+    packed = VusbLz4Compress(src, length, dst, length - length / 8);
+    if (packed == 0) {
+        /* Not worth it: leave the endpoint alone for longer each time */
+        state->Backoff = state->Backoff ? state->Backoff * 2 : VUSB_COMPRESS_BACKOFF_MIN;
+        if (state->Backoff > VUSB_COMPRESS_BACKOFF_MAX) {
+            state->Backoff = VUSB_COMPRESS_BACKOFF_MAX;
+        }
+        state->Skip = state->Backoff;
+        return 0;
+    }
+
+    state->Backoff = 0;
+    table->Kept++;
+    table->RawBytes += length;
+    table->PackedBytes += packed;
+    return packed;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* VUSB_COMPRESS_H */
@@ -0,0 +1,112 @@
+/**
+ * Virtual USB Content Hash
+ *
+ * SHA-256, used to name descriptor bundles by their content. Portable C
+ * with no dependencies, so the client can use it on every platform.
+ */
+
+#ifndef VUSB_HASH_H
+#define VUSB_HASH_H
+
+#include <stdint.h>
+#include <string.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define VUSB_HASH_SIZE  32
+
+static const uint32_t g_VusbHashK[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define VUSB_HASH_ROR(x, n)     (((x) >> (n)) | ((x) << (32 - (n))))
+
+/* Mix one 64-byte block into the state */
+static inline void VusbHashBlock(uint32_t state[8], const uint8_t* block)
+{
+    uint32_t w[64];
+    uint32_t a, b, c, d, e, f, g, h;
+    int i;
+
+    for (i = 0; i < 16; i++) {
+        w[i] = ((uint32_t)block[i * 4] << 24) | ((uint32_t)block[i * 4 + 1] << 16) |
+               ((uint32_t)block[i * 4 + 2] << 8) | block[i * 4 + 3];
+    }
+    for (i = 16; i < 64; i++) {
+        uint32_t s0 = VUSB_HASH_ROR(w[i - 15], 7) ^ VUSB_HASH_ROR(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = VUSB_HASH_ROR(w[i - 2], 17) ^ VUSB_HASH_ROR(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    a = state[0]; b = state[1]; c = state[2]; d = state[3];
+    e = state[4]; f = state[5]; g = state[6]; h = state[7];
+
+    for (i = 0; i < 64; i++) {
+        uint32_t t1 = h + (VUSB_HASH_ROR(e, 6) ^ VUSB_HASH_ROR(e, 11) ^ VUSB_HASH_ROR(e, 25)) +
+                      ((e & f) ^ (~e & g)) + g_VusbHashK[i] + w[i];
+        uint32_t t2 = (VUSB_HASH_ROR(a, 2) ^ VUSB_HASH_ROR(a, 13) ^ VUSB_HASH_ROR(a, 22)) +
+                      ((a & b) ^ (a & c) ^ (b & c));
+        h = g; g = f; f = e; e = d + t1;
+        d = c; c = b; b = a; a = t1 + t2;
+    }
+
+    state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+    state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+}
+
+/**
+ * VusbHash - SHA-256 of a buffer
+ * @hash: Receives VUSB_HASH_SIZE bytes
+ */
+static inline void VusbHash(const uint8_t* data, uint32_t length, uint8_t hash[VUSB_HASH_SIZE])
+{
+    uint32_t state[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+        0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+    uint8_t tail[128] = {0};
+    uint64_t bits = (uint64_t)length * 8;
+    uint32_t done = length & ~63u;
+    uint32_t rest = length - done;
+    uint32_t tailLength = rest < 56 ? 64 : 128;
+    int i;
+
+    for (uint32_t offset = 0; offset < done; offset += 64) {
+        VusbHashBlock(state, data + offset);
+    }
+
+    /* Last partial block, the 0x80 marker and the bit count */
+    if (rest > 0) {
+        memcpy(tail, data + done, rest);
+    }
+    tail[rest] = 0x80;
+    for (i = 0; i < 8; i++) {
+        tail[tailLength - 1 - i] = (uint8_t)(bits >> (i * 8));
+    }
+    VusbHashBlock(state, tail);
+    if (tailLength == 128) {
+        VusbHashBlock(state, tail + 64);
+    }
+
+    for (i = 0; i < 8; i++) {
+        hash[i * 4] = (uint8_t)(state[i] >> 24);
+        hash[i * 4 + 1] = (uint8_t)(state[i] >> 16);
+        hash[i * 4 + 2] = (uint8_t)(state[i] >> 8);
+        hash[i * 4 + 3] = (uint8_t)state[i];
+    }
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* VUSB_HASH_H */
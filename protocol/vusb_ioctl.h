@@ -105,6 +105,7 @@ typedef struct _VUSB_PENDING_URB {
     uint32_t            TransferBufferLength;
     uint32_t            Interval;
     VUSB_SETUP_PACKET   SetupPacket;
+    uint32_t            Timeout;            /* Milliseconds, 0 = none */
     /* For OUT transfers, data follows */
 } VUSB_PENDING_URB, *PVUSB_PENDING_URB;
 
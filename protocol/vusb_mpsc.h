@@ -0,0 +1,76 @@
+/**
+ * Virtual USB Completion Queue
+ *
+ * Intrusive multi-producer, single-consumer queue for handing finished work
+ * from network threads to a consumer. Producers push with one compare-exchange
+ * and never wait on the consumer; the consumer takes everything queued so far
+ * with one exchange and walks it oldest first. Taking the whole list at once
+ * leaves no ABA window, which popping single entries would have.
+ */
+
+#ifndef VUSB_MPSC_H
+#define VUSB_MPSC_H
+
+#include <windows.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Link, embedded in the queued object */
+typedef struct _VUSB_MPSC_NODE {
+    struct _VUSB_MPSC_NODE* Next;
+} VUSB_MPSC_NODE, *PVUSB_MPSC_NODE;
+
+/* Zeroed means empty */
+typedef struct _VUSB_MPSC_QUEUE {
+    PVUSB_MPSC_NODE volatile Head;          /* Newest first */
+} VUSB_MPSC_QUEUE, *PVUSB_MPSC_QUEUE;
+
+/**
+ * VusbMpscPush - Queue a node; any thread
+ * @return: TRUE if the queue was empty, so the consumer may need waking
+ */
+static inline BOOL VusbMpscPush(PVUSB_MPSC_QUEUE queue, PVUSB_MPSC_NODE node)
+{
+    PVUSB_MPSC_NODE head;
+
+    do {
+        head = queue->Head;
+        node->Next = head;
+    } while (InterlockedCompareExchangePointer((PVOID volatile*)&queue->Head,
+                                               node, head) != head);
+
+    return head == NULL;
+}
+
+/**
+ * VusbMpscTake - Take every queued node; consumer only
+ * @return: The nodes oldest first, chained through Next, or NULL
+ */
+static inline PVUSB_MPSC_NODE VusbMpscTake(PVUSB_MPSC_QUEUE queue)
+{
+    PVUSB_MPSC_NODE node;
+    PVUSB_MPSC_NODE oldest = NULL;
+
+    if (!queue->Head) {
+        return NULL;
+    }
+
+    node = (PVUSB_MPSC_NODE)InterlockedExchangePointer((PVOID volatile*)&queue->Head, NULL);
+    while (node) {
+        PVUSB_MPSC_NODE next = node->Next;
+
+        node->Next = oldest;
+        oldest = node;
+        node = next;
+    }
+
+    return oldest;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* VUSB_MPSC_H */
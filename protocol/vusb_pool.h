@@ -0,0 +1,248 @@
+/**
+ * Virtual USB Object and Buffer Pools
+ *
+ * Fixed-size block pools for URB tracking objects and size-classed pools
+ * for message and transfer buffers, shared by the user-mode components.
+ * Blocks are carved from slabs and recycled through a lock-free list, so
+ * once a workload has warmed up, allocation never reaches the heap. Blocks
+ * may be freed on a different thread than the one that allocated them.
+ */
+
+#ifndef VUSB_POOL_H
+#define VUSB_POOL_H
+
+#include <windows.h>
+#include <malloc.h>
+#include <string.h>
+#include <stdint.h>
+#include "vusb_protocol.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Block pool */
+typedef struct _VUSB_POOL {
+    SLIST_HEADER        FreeList;           /* Must stay the first member */
+    uint32_t            BlockSize;          /* Rounded to MEMORY_ALLOCATION_ALIGNMENT */
+    uint32_t            BlocksPerSlab;
+    CRITICAL_SECTION    SlabLock;           /* Held only while growing */
+    void*               Slabs;              /* Chain of slabs, released with the pool */
+
+    /* Statistics */
+    volatile LONG       SlabAllocs;         /* Heap allocations made by the pool */
+    volatile LONG       InUse;
+} VUSB_POOL, *PVUSB_POOL;
+
+/* Buffer size classes; the largest holds a full packet plus headers */
+#define VUSB_BUFFER_CLASS_COUNT     4
+#define VUSB_BUFFER_MAX_CLASS_SIZE  (VUSB_MAX_PACKET_SIZE + 256)
+
+/* Size-classed buffer pool */
+typedef struct _VUSB_BUFFER_POOL {
+    VUSB_POOL           Classes[VUSB_BUFFER_CLASS_COUNT];
+    volatile LONG       Oversize;           /* Requests served by malloc */
+} VUSB_BUFFER_POOL, *PVUSB_BUFFER_POOL;
+
+/* Header in front of every buffer, keeps payloads aligned */
+typedef struct DECLSPEC_ALIGN(MEMORY_ALLOCATION_ALIGNMENT) _VUSB_BUFFER_HEADER {
+    uint32_t            Class;              /* VUSB_BUFFER_CLASS_COUNT = malloc */
+} VUSB_BUFFER_HEADER;
+
+static const uint32_t g_VusbBufferClassSizes[VUSB_BUFFER_CLASS_COUNT] = {
+    512, 4096, 16384, VUSB_BUFFER_MAX_CLASS_SIZE
+};
+
+/* ============================================================
+ * Block Pool
+ * ============================================================ */
+
+/**
+ * VusbPoolInit - Initialize a pool of fixed-size blocks
+ * @blockSize: Size of each block
+ * @blocksPerSlab: Blocks obtained per heap allocation when the pool grows
+ */
+static inline void VusbPoolInit(PVUSB_POOL pool, uint32_t blockSize, uint32_t blocksPerSlab)
+{
+    memset(pool, 0, sizeof(VUSB_POOL));
+    InitializeSListHead(&pool->FreeList);
+    InitializeCriticalSection(&pool->SlabLock);
+
+    if (blockSize < sizeof(SLIST_ENTRY)) {
+        blockSize = sizeof(SLIST_ENTRY);
+    }
+    pool->BlockSize = (blockSize + MEMORY_ALLOCATION_ALIGNMENT - 1) &
+                      ~(uint32_t)(MEMORY_ALLOCATION_ALIGNMENT - 1);
+    pool->BlocksPerSlab = blocksPerSlab ? blocksPerSlab : 1;
+}
+
+/**
+ * VusbPoolDestroy - Release every slab; all blocks must have been freed
+ */
+static inline void VusbPoolDestroy(PVUSB_POOL pool)
+{
+    while (pool->Slabs) {
+        void* next = *(void**)pool->Slabs;
+        _aligned_free(pool->Slabs);
+        pool->Slabs = next;
+    }
+    InitializeSListHead(&pool->FreeList);
+    DeleteCriticalSection(&pool->SlabLock);
+}
+
+/**
+ * VusbPoolGrow - Carve a new slab into free blocks
+ *
+ * The first block of each slab links the slab chain and is never handed out.
+ */
+static inline int VusbPoolGrow(PVUSB_POOL pool)
+{
+    uint8_t* slab;
+
+    EnterCriticalSection(&pool->SlabLock);
+
+    /* Another thread may have grown the pool while we waited */
+    if (QueryDepthSList(&pool->FreeList) > 0) {
+        LeaveCriticalSection(&pool->SlabLock);
+        return 0;
+    }
+
+    slab = (uint8_t*)_aligned_malloc((size_t)pool->BlockSize * (pool->BlocksPerSlab + 1),
+                                     MEMORY_ALLOCATION_ALIGNMENT);
+    if (!slab) {
+        LeaveCriticalSection(&pool->SlabLock);
+        return -1;
+    }
+    memset(slab, 0, (size_t)pool->BlockSize * (pool->BlocksPerSlab + 1));
+
+    *(void**)slab = pool->Slabs;
+    pool->Slabs = slab;
+    InterlockedIncrement(&pool->SlabAllocs);
+
+    for (uint32_t i = 1; i <= pool->BlocksPerSlab; i++) {
+        InterlockedPushEntrySList(&pool->FreeList,
+                                  (PSLIST_ENTRY)(slab + (size_t)i * pool->BlockSize));
+    }
+
+    LeaveCriticalSection(&pool->SlabLock);
+    return 0;
+}
+
+/**
+ * VusbPoolAlloc - Take a block from the pool
+ * @return: Block, or NULL if the pool could not grow. Only the bytes
+ *          overlaid by the free-list link are not preserved across reuse.
+ */
+static inline void* VusbPoolAlloc(PVUSB_POOL pool)
+{
+    PSLIST_ENTRY entry;
+
+    while ((entry = InterlockedPopEntrySList(&pool->FreeList)) == NULL) {
+        if (VusbPoolGrow(pool) != 0) {
+            return NULL;
+        }
+    }
+
+    InterlockedIncrement(&pool->InUse);
+    memset(entry, 0, sizeof(SLIST_ENTRY));
+    return entry;
+}
+
+/**
+ * VusbPoolFree - Return a block to the pool
+ */
+static inline void VusbPoolFree(PVUSB_POOL pool, void* block)
+{
+    if (!block) return;
+    InterlockedDecrement(&pool->InUse);
+    InterlockedPushEntrySList(&pool->FreeList, (PSLIST_ENTRY)block);
+}
+
+/* ============================================================
+ * Buffer Pool
+ * ============================================================ */
+
+static inline void VusbBufferPoolInit(PVUSB_BUFFER_POOL pool)
+{
+    for (int i = 0; i < VUSB_BUFFER_CLASS_COUNT; i++) {
+        uint32_t size = g_VusbBufferClassSizes[i];
+
+        /* About 64 KB per slab for small classes, one block for the largest */
+        uint32_t perSlab = size < 65536 ? 65536 / size : 1;
+
+        VusbPoolInit(&pool->Classes[i], sizeof(VUSB_BUFFER_HEADER) + size, perSlab);
+    }
+    pool->Oversize = 0;
+}
+
+static inline void VusbBufferPoolDestroy(PVUSB_BUFFER_POOL pool)
+{
+    for (int i = 0; i < VUSB_BUFFER_CLASS_COUNT; i++) {
+        VusbPoolDestroy(&pool->Classes[i]);
+    }
+}
+
+/**
+ * VusbBufferAlloc - Get a buffer of at least size bytes (contents undefined)
+ */
+static inline void* VusbBufferAlloc(PVUSB_BUFFER_POOL pool, size_t size)
+{
+    VUSB_BUFFER_HEADER* header = NULL;
+    uint32_t cls;
+
+    for (cls = 0; cls < VUSB_BUFFER_CLASS_COUNT; cls++) {
+        if (size <= g_VusbBufferClassSizes[cls]) {
+            header = (VUSB_BUFFER_HEADER*)VusbPoolAlloc(&pool->Classes[cls]);
+            break;
+        }
+    }
+
+    if (cls == VUSB_BUFFER_CLASS_COUNT) {
+        header = (VUSB_BUFFER_HEADER*)_aligned_malloc(sizeof(VUSB_BUFFER_HEADER) + size,
+                                                      MEMORY_ALLOCATION_ALIGNMENT);
+        InterlockedIncrement(&pool->Oversize);
+    }
+
+    if (!header) return NULL;
+
+    header->Class = cls;
+    return header + 1;
+}
+
+/**
+ * VusbBufferFree - Return a buffer obtained from VusbBufferAlloc
+ */
+static inline void VusbBufferFree(PVUSB_BUFFER_POOL pool, void* buffer)
+{
+    VUSB_BUFFER_HEADER* header;
+
+    if (!buffer) return;
+
+    header = (VUSB_BUFFER_HEADER*)buffer - 1;
+    if (header->Class < VUSB_BUFFER_CLASS_COUNT) {
+        VusbPoolFree(&pool->Classes[header->Class], header);
+    } else {
+        _aligned_free(header);
+    }
+}
+
+/**
+ * VusbBufferPoolHeapAllocs - Heap allocations made so far (slabs + oversize)
+ *
+ * Stops increasing once the pool has warmed up to the workload.
+ */
+static inline uint32_t VusbBufferPoolHeapAllocs(PVUSB_BUFFER_POOL pool)
+{
+    uint32_t total = (uint32_t)pool->Oversize;
+
+    for (int i = 0; i < VUSB_BUFFER_CLASS_COUNT; i++) {
+        total += (uint32_t)pool->Classes[i].SlabAllocs;
+    }
+    return total;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* VUSB_POOL_H */
@@ -27,6 +27,7 @@ extern "C" {
 #define VUSB_PROTOCOL_VERSION   0x0100      /* Version 1.0 */
 #define VUSB_DEFAULT_PORT       7575
 #define VUSB_MAX_PACKET_SIZE    65536
+#define VUSB_MAX_SEGMENTED_SIZE (16 * 1024 * 1024)  /* Largest reassembled message */
 #define VUSB_MAX_DEVICES        16
 
 /* Command Types */
@@ -36,17 +37,24 @@ typedef enum _VUSB_COMMAND {
     VUSB_CMD_DISCONNECT         = 0x0002,   /* Client disconnects */
     VUSB_CMD_PING               = 0x0003,   /* Keep-alive ping */
     VUSB_CMD_PONG               = 0x0004,   /* Keep-alive response */
+    VUSB_CMD_SESSION_RESUME     = 0x0005,   /* Take over a dropped session */
     
     /* Device Management */
     VUSB_CMD_DEVICE_ATTACH      = 0x0010,   /* Attach a new USB device */
     VUSB_CMD_DEVICE_DETACH      = 0x0011,   /* Detach a USB device */
     VUSB_CMD_DEVICE_LIST        = 0x0012,   /* List available devices */
     VUSB_CMD_DEVICE_INFO        = 0x0013,   /* Get device information */
+    VUSB_CMD_DEVICE_ATTACH_HASH = 0x0014,   /* Attach naming a known descriptor bundle */
+    VUSB_CMD_DEVICE_RESET       = 0x0015,   /* A USB device was reset */
     
     /* USB Transfers */
     VUSB_CMD_SUBMIT_URB         = 0x0020,   /* Submit USB Request Block */
     VUSB_CMD_URB_COMPLETE       = 0x0021,   /* URB completion notification */
     VUSB_CMD_CANCEL_URB         = 0x0022,   /* Cancel pending URB */
+    VUSB_CMD_SUBMIT_URB_BATCH   = 0x0023,   /* Several URB submits in one frame */
+    VUSB_CMD_URB_COMPLETE_BATCH = 0x0024,   /* Several URB completions in one frame */
+    VUSB_CMD_URB_FRAGMENT       = 0x0025,   /* First piece of a segmented message */
+    VUSB_CMD_URB_CONTINUE       = 0x0026,   /* Further piece of a segmented message */
     
     /* Descriptor Requests */
     VUSB_CMD_GET_DESCRIPTOR     = 0x0030,   /* Get USB descriptor */
@@ -83,8 +91,34 @@ typedef enum _VUSB_STATUS {
     VUSB_STATUS_NO_MEMORY       = 0x0008,
     VUSB_STATUS_NOT_SUPPORTED   = 0x0009,
     VUSB_STATUS_DISCONNECTED    = 0x000A,
+    VUSB_STATUS_BUNDLE_UNKNOWN  = 0x000B,   /* Descriptor bundle not known, send it */
+    VUSB_STATUS_SESSION_EXPIRED = 0x000C,   /* Nothing left to resume */
 } VUSB_STATUS;
 
+/* Capability Flags (VUSB_CONNECT_REQUEST/RESPONSE Capabilities) */
+#define VUSB_CAP_URB_BATCH          0x00000001  /* SUBMIT_URB_BATCH / URB_COMPLETE_BATCH */
+#define VUSB_CAP_SEGMENTED          0x00000002  /* URB_FRAGMENT / URB_CONTINUE */
+#define VUSB_CAP_DESC_BUNDLE        0x00000004  /* DEVICE_ATTACH_HASH */
+#define VUSB_CAP_SESSION_RESUME     0x00000008  /* SESSION_RESUME */
+#define VUSB_CAP_CREDITS            0x00000010  /* Credit windows in CONNECT */
+#define VUSB_CAP_COMPRESSION        0x00000020  /* LZ4 bulk payloads, see vusb_compress.h */
+#define VUSB_CAP_REPORT_DELTA       0x00000040  /* Interrupt IN reports, see vusb_report.h */
+
+#define VUSB_DESCRIPTOR_HASH_SIZE   32          /* SHA-256, see vusb_hash.h */
+#define VUSB_RESUME_TOKEN_SIZE      16
+
+/* VUSB_URB_SUBMIT Flags */
+#define VUSB_SUBMIT_REPLAYED        0x01        /* Re-sent after a session resume */
+#define VUSB_SUBMIT_COMPRESSED      0x02        /* OUT data is an LZ4 block */
+
+/* VUSB_URB_COMPLETE Flags */
+#define VUSB_COMPLETE_COMPRESSED    0x01        /* IN data is an LZ4 block */
+#define VUSB_COMPLETE_REPORT        0x02        /* IN data is a report to remember */
+#define VUSB_COMPLETE_SAME          0x04        /* No data: same as the last report */
+#define VUSB_COMPLETE_DELTA         0x08        /* IN data is a delta to the last report */
+#define VUSB_COMPLETE_REPORTS       (VUSB_COMPLETE_REPORT | VUSB_COMPLETE_SAME | \
+                                     VUSB_COMPLETE_DELTA)
+
 /* USB Speed */
 typedef enum _VUSB_SPEED {
     VUSB_SPEED_UNKNOWN          = 0,
@@ -109,6 +143,10 @@ typedef enum _VUSB_DIRECTION {
     VUSB_DIR_IN                 = 1,    /* Device to host */
 } VUSB_DIRECTION;
 
+/* Per-endpoint queue index: OUT endpoints 0-15, IN endpoints 16-31 */
+#define VUSB_ENDPOINT_QUEUES            32
+#define VUSB_ENDPOINT_QUEUE(address)    (((address) & 0x0F) | (((address) & 0x80) >> 3))
+
 #pragma pack(push, 1)
 
 /* Protocol Header - All messages start with this */
@@ -161,8 +199,16 @@ typedef struct _VUSB_CONNECT_REQUEST {
     uint32_t    ClientVersion;      /* Client software version */
     uint32_t    Capabilities;       /* Client capabilities flags */
     char        ClientName[64];     /* Client identifier/name */
+
+    /* What the client takes in flight at once, 0 = no limit (VUSB_CAP_CREDITS) */
+    uint32_t    UrbCredits;         /* SUBMIT_URBs not yet completed */
+    uint32_t    ByteCredits;        /* Their TransferBufferLength total */
+    uint32_t    EndpointCredits;    /* SUBMIT_URBs per endpoint */
 } VUSB_CONNECT_REQUEST;
 
+/* Payload of a request without the credit fields, as sent by older clients */
+#define VUSB_CONNECT_BASE_SIZE      (sizeof(uint32_t) * 2 + 64)
+
 /* Connect Response */
 typedef struct _VUSB_CONNECT_RESPONSE {
     VUSB_HEADER Header;
@@ -170,8 +216,38 @@ typedef struct _VUSB_CONNECT_RESPONSE {
     uint32_t    ServerVersion;      /* Server software version */
     uint32_t    Capabilities;       /* Server capabilities flags */
     uint32_t    SessionId;          /* Assigned session ID */
+    uint8_t     ResumeToken[VUSB_RESUME_TOKEN_SIZE];    /* Zero unless SESSION_RESUME */
+    uint32_t    ResumeGraceMs;      /* How long a dropped session is kept */
+
+    /* Windows the server keeps to, the smaller of both sides' (VUSB_CAP_CREDITS).
+     * A completion returns the credits of its URB. */
+    uint32_t    UrbCredits;
+    uint32_t    ByteCredits;
+    uint32_t    EndpointCredits;
 } VUSB_CONNECT_RESPONSE;
 
+/* Session Resume Request - sent on a fresh connection, right after its
+ * CONNECT, to take over the devices of a session whose connection dropped.
+ * The server answers with a SESSION_RESUME_RESPONSE, then re-sends every
+ * URB the old connection had not completed (flagged VUSB_SUBMIT_REPLAYED)
+ * followed by the URBs held back while the session was parked. The token of
+ * the new connection is the one to present if it drops in turn. Only sent
+ * once both sides have advertised VUSB_CAP_SESSION_RESUME. */
+typedef struct _VUSB_SESSION_RESUME_REQUEST {
+    VUSB_HEADER Header;
+    uint32_t    SessionId;          /* Session of the dropped connection */
+    uint8_t     ResumeToken[VUSB_RESUME_TOKEN_SIZE];    /* Its token */
+} VUSB_SESSION_RESUME_REQUEST;
+
+/* Session Resume Response */
+typedef struct _VUSB_SESSION_RESUME_RESPONSE {
+    VUSB_HEADER Header;
+    uint32_t    Status;             /* VUSB_STATUS */
+    uint32_t    SessionId;          /* Session resumed */
+    uint32_t    DeviceCount;        /* Devices moved to this connection */
+    uint32_t    UrbsReplayed;       /* In-flight URBs about to be re-sent */
+} VUSB_SESSION_RESUME_RESPONSE;
+
 /* Device Attach Request - sent by client when USB device is connected */
 typedef struct _VUSB_DEVICE_ATTACH_REQUEST {
     VUSB_HEADER         Header;
@@ -180,6 +256,17 @@ typedef struct _VUSB_DEVICE_ATTACH_REQUEST {
     /* Followed by: uint8_t Descriptors[DescriptorLength] - all USB descriptors */
 } VUSB_DEVICE_ATTACH_REQUEST;
 
+/* Device Attach by Hash - an attach whose descriptor blob the server may
+ * already hold. The server answers with a DEVICE_ATTACH_RESPONSE; on
+ * VUSB_STATUS_BUNDLE_UNKNOWN the client sends a full DEVICE_ATTACH instead.
+ * Only sent once both sides have advertised VUSB_CAP_DESC_BUNDLE. */
+typedef struct _VUSB_DEVICE_ATTACH_HASH_REQUEST {
+    VUSB_HEADER         Header;
+    VUSB_DEVICE_INFO    DeviceInfo;
+    uint32_t            DescriptorLength;   /* Length of the descriptors named */
+    uint8_t             DescriptorHash[VUSB_DESCRIPTOR_HASH_SIZE];  /* SHA-256 of them */
+} VUSB_DEVICE_ATTACH_HASH_REQUEST;
+
 /* Device Attach Response */
 typedef struct _VUSB_DEVICE_ATTACH_RESPONSE {
     VUSB_HEADER Header;
@@ -193,6 +280,12 @@ typedef struct _VUSB_DEVICE_DETACH_REQUEST {
     uint32_t    DeviceId;           /* Device to detach */
 } VUSB_DEVICE_DETACH_REQUEST;
 
+/* Device Reset Request: the device is back in its default state */
+typedef struct _VUSB_DEVICE_RESET_REQUEST {
+    VUSB_HEADER Header;
+    uint32_t    DeviceId;           /* Device that was reset */
+} VUSB_DEVICE_RESET_REQUEST;
+
 /* USB Setup Packet (for control transfers) */
 typedef struct _VUSB_SETUP_PACKET {
     uint8_t     bmRequestType;
@@ -210,12 +303,14 @@ typedef struct _VUSB_URB_SUBMIT {
     uint8_t             EndpointAddress;    /* Endpoint address */
     uint8_t             TransferType;       /* VUSB_TRANSFER_TYPE */
     uint8_t             Direction;          /* VUSB_DIRECTION */
-    uint8_t             Reserved;
+    uint8_t             Flags;              /* VUSB_SUBMIT_* */
     uint32_t            TransferFlags;      /* Transfer flags */
     uint32_t            TransferBufferLength;
     uint32_t            Interval;           /* For interrupt/iso */
     VUSB_SETUP_PACKET   SetupPacket;        /* For control transfers */
-    /* Followed by: uint8_t TransferBuffer[TransferBufferLength] for OUT transfers */
+    /* Followed by: uint8_t TransferBuffer[TransferBufferLength] for OUT transfers,
+       or with VUSB_SUBMIT_COMPRESSED the rest of the message as an LZ4 block
+       expanding to TransferBufferLength bytes */
 } VUSB_URB_SUBMIT, *PVUSB_URB_SUBMIT;
 
 /* URB Completion */
@@ -225,10 +320,36 @@ typedef struct _VUSB_URB_COMPLETE {
     uint32_t    UrbId;              /* Matching URB identifier */
     uint32_t    Status;             /* VUSB_STATUS */
     uint32_t    ActualLength;       /* Actual bytes transferred */
-    uint32_t    ErrorCount;         /* For isochronous */
-    /* Followed by: uint8_t TransferBuffer[ActualLength] for IN transfers */
+    uint16_t    ErrorCount;         /* For isochronous */
+    uint8_t     Flags;              /* VUSB_COMPLETE_* */
+    uint8_t     EndpointAddress;    /* Endpoint of the URB */
+    /* Followed by: uint8_t TransferBuffer[ActualLength] for IN transfers, or
+       with VUSB_COMPLETE_COMPRESSED the rest of the message as an LZ4 block
+       expanding to ActualLength bytes, or with VUSB_COMPLETE_DELTA the
+       changes to the endpoint's last report (see vusb_report.h) */
 } VUSB_URB_COMPLETE, *PVUSB_URB_COMPLETE;
 
+/* URB Batch - several SUBMIT_URB or URB_COMPLETE messages in one frame.
+ * Only sent once both sides have advertised VUSB_CAP_URB_BATCH. */
+typedef struct _VUSB_URB_BATCH {
+    VUSB_HEADER Header;
+    uint32_t    Count;              /* Number of embedded messages */
+    /* Followed by: Count complete messages (each with its own header and
+       data), back to back, exactly as they would be sent on their own */
+} VUSB_URB_BATCH, *PVUSB_URB_BATCH;
+
+/* URB Fragment - one piece of a SUBMIT_URB or URB_COMPLETE message larger
+ * than VUSB_MAX_PACKET_SIZE. The full message, header included, is cut into
+ * consecutive pieces: the first is sent as URB_FRAGMENT, the rest as
+ * URB_CONTINUE, back to back on the connection. Only sent once both sides
+ * have advertised VUSB_CAP_SEGMENTED. */
+typedef struct _VUSB_URB_FRAGMENT {
+    VUSB_HEADER Header;
+    uint32_t    TotalLength;        /* Length of the full message */
+    uint32_t    Offset;             /* Position of this piece in the full message */
+    /* Followed by: the message bytes [Offset, Offset + piece length) */
+} VUSB_URB_FRAGMENT, *PVUSB_URB_FRAGMENT;
+
 /* Cancel URB Request */
 typedef struct _VUSB_URB_CANCEL {
     VUSB_HEADER Header;
@@ -266,6 +387,16 @@ typedef struct _VUSB_DEVICE_LIST_RESPONSE {
 #define VUSB_MAKE_ENDPOINT(num, dir) (((dir) << 7) | ((num) & 0x0F))
 #define VUSB_ENDPOINT_NUMBER(ep)    ((ep) & 0x0F)
 #define VUSB_ENDPOINT_DIRECTION(ep) (((ep) >> 7) & 0x01)
+#define VUSB_URB_BATCH_MAX_ENTRIES  64
+#define VUSB_FRAGMENT_FIELDS_SIZE   (sizeof(VUSB_URB_FRAGMENT) - sizeof(VUSB_HEADER))
+#define VUSB_FRAGMENT_DATA_MAX      (VUSB_MAX_PACKET_SIZE - sizeof(VUSB_URB_FRAGMENT))
+
+/* Receiver state for the segmented message being reassembled */
+typedef struct _VUSB_REASSEMBLY {
+    uint8_t*    Buffer;             /* TotalLength bytes, NULL when idle */
+    uint32_t    TotalLength;
+    uint32_t    Received;
+} VUSB_REASSEMBLY, *PVUSB_REASSEMBLY;
 
 /* Initialize a protocol header */
 static inline void VusbInitHeader(VUSB_HEADER* header, uint16_t command, 
@@ -283,6 +414,72 @@ static inline int VusbValidateHeader(const VUSB_HEADER* header) {
             header->Version == VUSB_PROTOCOL_VERSION);
 }
 
+/* Return the next message embedded in a batch, NULL at the end or if malformed.
+ * @entries: Data following VUSB_URB_BATCH.Count; @offset: Cursor, start at 0 */
+static inline VUSB_HEADER* VusbBatchNext(uint8_t* entries, uint32_t length,
+                                         uint32_t* offset) {
+    VUSB_HEADER* entry;
+    
+    if (*offset > length || length - *offset < sizeof(VUSB_HEADER)) {
+        return 0;
+    }
+    entry = (VUSB_HEADER*)(entries + *offset);
+    if (!VusbValidateHeader(entry) ||
+        entry->Length > length - *offset - sizeof(VUSB_HEADER)) {
+        return 0;
+    }
+    *offset += sizeof(VUSB_HEADER) + entry->Length;
+    return entry;
+}
+
+/* Check a fragment against the reassembly in progress.
+ * Returns the number of message bytes the fragment carries, or -1 if it is
+ * malformed or out of order. The caller allocates Buffer when a valid
+ * URB_FRAGMENT starts a message, then stores the bytes at Offset. */
+static inline int VusbFragmentCheck(const VUSB_REASSEMBLY* reassembly,
+                                    const VUSB_URB_FRAGMENT* fragment) {
+    uint32_t dataLength;
+    
+    if (fragment->Header.Length < VUSB_FRAGMENT_FIELDS_SIZE) {
+        return -1;
+    }
+    dataLength = fragment->Header.Length - VUSB_FRAGMENT_FIELDS_SIZE;
+    
+    if (fragment->Header.Command == VUSB_CMD_URB_FRAGMENT) {
+        if (reassembly->Buffer || fragment->Offset != 0 ||
+            fragment->TotalLength <= sizeof(VUSB_HEADER) ||
+            fragment->TotalLength > VUSB_MAX_SEGMENTED_SIZE) {
+            return -1;
+        }
+    } else if (!reassembly->Buffer ||
+               fragment->TotalLength != reassembly->TotalLength ||
+               fragment->Offset != reassembly->Received) {
+        return -1;
+    }
+    
+    if (dataLength > fragment->TotalLength - fragment->Offset) {
+        return -1;
+    }
+    return (int)dataLength;
+}
+
+/* Return the reassembled message once all of it has arrived, NULL while
+ * incomplete or if it is not a well-formed SUBMIT_URB / URB_COMPLETE */
+static inline VUSB_HEADER* VusbReassembledMessage(const VUSB_REASSEMBLY* reassembly) {
+    VUSB_HEADER* message = (VUSB_HEADER*)reassembly->Buffer;
+    
+    if (!message || reassembly->Received != reassembly->TotalLength) {
+        return 0;
+    }
+    if (!VusbValidateHeader(message) ||
+        message->Length != reassembly->TotalLength - sizeof(VUSB_HEADER) ||
+        (message->Command != VUSB_CMD_SUBMIT_URB &&
+         message->Command != VUSB_CMD_URB_COMPLETE)) {
+        return 0;
+    }
+    return message;
+}
+
 #ifdef __cplusplus
 }
 #endif
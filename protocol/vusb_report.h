@@ -0,0 +1,182 @@
+/**
+ * Virtual USB Interrupt Report Encoding
+ *
+ * HID devices keep resending the same, or nearly the same, interrupt IN
+ * report at their polling rate. The sender remembers the last report of
+ * each endpoint and sends the next one as "the same again" or as an XOR
+ * delta against it; the receiver remembers the same reports and rebuilds
+ * the full buffer. Both sides must see the same reports in the same order,
+ * so a table lives as long as one connection.
+ */
+
+#ifndef VUSB_REPORT_H
+#define VUSB_REPORT_H
+
+#include <stdint.h>
+#include <string.h>
+#include "vusb_protocol.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define VUSB_REPORT_MAX         64      /* Larger reports are sent as they are */
+#define VUSB_REPORT_DEVICES     16      /* Devices tracked at once, direct mapped */
+
+/* Delta layout: one bit per report byte that changed, then the changed
+ * bytes XORed with the last report, in order */
+#define VUSB_REPORT_BITMAP(length)  (((length) + 7) / 8)
+
+/* Last reports of one device's endpoints */
+typedef struct _VUSB_REPORT_DEVICE {
+    uint32_t    DeviceId;
+    uint8_t     Lengths[VUSB_ENDPOINT_QUEUES];      /* 0 = no report yet */
+    uint8_t     Reports[VUSB_ENDPOINT_QUEUES][VUSB_REPORT_MAX];
+} VUSB_REPORT_DEVICE;
+
+/* Last reports seen on one connection, in one direction */
+typedef struct _VUSB_REPORT_TABLE {
+    VUSB_REPORT_DEVICE Devices[VUSB_REPORT_DEVICES];
+
+    /* Statistics */
+    uint64_t    Reports;            /* Reports encoded */
+    uint64_t    Same;               /* Of those, sent as VUSB_COMPLETE_SAME */
+    uint64_t    Delta;              /* and as VUSB_COMPLETE_DELTA */
+    uint64_t    RawBytes;           /* Size of the reports */
+    uint64_t    SentBytes;          /* and what they took on the wire */
+} VUSB_REPORT_TABLE, *PVUSB_REPORT_TABLE;
+
+/**
+ * VusbReportDevice - Reports of a device
+ *
+ * Devices share slots by ID; one taking a slot over starts afresh. Sender
+ * and receiver look up the same devices in the same order, so they agree.
+ */
+static inline VUSB_REPORT_DEVICE* VusbReportDevice(PVUSB_REPORT_TABLE table, uint32_t deviceId)
+{
+    VUSB_REPORT_DEVICE* device = &table->Devices[deviceId % VUSB_REPORT_DEVICES];
+
+    if (device->DeviceId != deviceId) {
+        memset(device, 0, sizeof(VUSB_REPORT_DEVICE));
+        device->DeviceId = deviceId;
+    }
+    return device;
+}
+
+/**
+ * VusbReportEncode - Encode an interrupt IN report against the endpoint's last one
+ * @dst: At least VUSB_REPORT_MAX bytes, receives a delta
+ * @dstLength: Receives the delta length
+ * @return: VUSB_COMPLETE_SAME, VUSB_COMPLETE_DELTA, VUSB_COMPLETE_REPORT to
+ *          send the report as it is and have it remembered, or 0 for a
+ *          report too large to track
+ */
+static inline uint8_t VusbReportEncode(PVUSB_REPORT_TABLE table, uint32_t deviceId,
+                                       uint8_t endpointAddress, const uint8_t* data,
+                                       uint32_t length, uint8_t* dst, uint32_t* dstLength)
+{
+    VUSB_REPORT_DEVICE* device;
+    uint32_t queue = VUSB_ENDPOINT_QUEUE(endpointAddress);
+    uint8_t* last;
+    uint32_t bitmap = VUSB_REPORT_BITMAP(length);
+    uint32_t changed = 0;
+    uint8_t flags;
+
+    *dstLength = 0;
+    if (length == 0 || length > VUSB_REPORT_MAX) {
+        return 0;
+    }
+
+    device = VusbReportDevice(table, deviceId);
+    last = device->Reports[queue];
+    flags = VUSB_COMPLETE_REPORT;
+
+    if (device->Lengths[queue] == length) {
+        memset(dst, 0, bitmap);
+        for (uint32_t i = 0; i < length; i++) {
+            if (data[i] != last[i]) {
+                dst[i / 8] |= (uint8_t)(1 << (i % 8));
+                changed++;
+            }
+        }
+
+        if (changed == 0) {
+            flags = VUSB_COMPLETE_SAME;
+        } else if (bitmap + changed < length) {
+            uint8_t* op = dst + bitmap;
+
+            for (uint32_t i = 0; i < length; i++) {
+                if (data[i] != last[i]) {
+                    *op++ = data[i] ^ last[i];
+                }
+            }
+            *dstLength = bitmap + changed;
+            flags = VUSB_COMPLETE_DELTA;
+        }
+    }
+
+    memcpy(last, data, length);
+    device->Lengths[queue] = (uint8_t)length;
+
+    table->Reports++;
+    table->Same += (flags == VUSB_COMPLETE_SAME);
+    table->Delta += (flags == VUSB_COMPLETE_DELTA);
+    table->RawBytes += length;
+    table->SentBytes += flags == VUSB_COMPLETE_REPORT ? length : *dstLength;
+    return flags;
+}
+
+/**
+ * VusbReportDecode - Rebuild a report sent with VUSB_COMPLETE_REPORT, _SAME or _DELTA
+ * @dst: At least VUSB_REPORT_MAX bytes
+ * @length: Size of the rebuilt report
+ * @return: 0 on success, -1 if it cannot be rebuilt from what was received
+ */
+static inline int VusbReportDecode(PVUSB_REPORT_TABLE table, uint32_t deviceId,
+                                   uint8_t endpointAddress, uint8_t flags,
+                                   const uint8_t* src, uint32_t srcLength,
+                                   uint8_t* dst, uint32_t length)
+{
+    VUSB_REPORT_DEVICE* device;
+    uint32_t queue = VUSB_ENDPOINT_QUEUE(endpointAddress);
+    uint8_t* last;
+    uint32_t bitmap = VUSB_REPORT_BITMAP(length);
+
+    if (length == 0 || length > VUSB_REPORT_MAX) {
+        return -1;
+    }
+
+    device = VusbReportDevice(table, deviceId);
+    last = device->Reports[queue];
+
+    if (flags & VUSB_COMPLETE_REPORT) {
+        if (srcLength < length) return -1;
+        memcpy(dst, src, length);
+    } else {
+        const uint8_t* ip = src + bitmap;
+
+        if (device->Lengths[queue] != length) return -1;
+        memcpy(dst, last, length);
+
+        if (flags & VUSB_COMPLETE_DELTA) {
+            if (srcLength < bitmap) return -1;
+            for (uint32_t i = 0; i < length; i++) {
+                if (src[i / 8] & (1 << (i % 8))) {
+                    if (ip >= src + srcLength) return -1;
+                    dst[i] ^= *ip++;
+                }
+            }
+        }
+    }
+
+    /* Only a report rebuilt in full replaces the last one */
+    memcpy(last, dst, length);
+    device->Lengths[queue] = (uint8_t)length;
+    return 0;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* VUSB_REPORT_H */
@@ -0,0 +1,432 @@
+/**
+ * Virtual USB Shared Memory Transport
+ *
+ * Carries the same VUSB_* byte stream as a TCP connection between a client
+ * and a server on one machine, without going through the loopback stack.
+ * A named section holds one ring per direction, each with one producer and
+ * one consumer, so data moves with plain copies. A side that finds its ring
+ * empty (or full) spins briefly, then sleeps on a named event; the other
+ * side only sets the event when the sleeper says it is waiting, so a busy
+ * stream makes no system calls. One client at a time attaches to a server's
+ * section, and either side notices the other closing or exiting.
+ */
+
+#ifndef VUSB_SHM_H
+#define VUSB_SHM_H
+
+#include <winsock2.h>
+#include <windows.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define VUSB_SHM_MAGIC          0x4D485356  /* "VSHM" */
+#define VUSB_SHM_RING_SIZE      (4 * 1024 * 1024)   /* Power of two */
+#define VUSB_SHM_NAME_MAX       64
+#define VUSB_SHM_SPIN           4000        /* Polls before a side sleeps */
+
+/* Rings, by direction */
+#define VUSB_SHM_TO_SERVER      0
+#define VUSB_SHM_TO_CLIENT      1
+
+/* Section states */
+#define VUSB_SHM_FREE           0           /* Waiting for a client */
+#define VUSB_SHM_ATTACHED       1
+#define VUSB_SHM_CLOSED         2           /* One side has gone */
+
+/* One direction; positions count every byte ever written or read */
+typedef struct _VUSB_SHM_RING {
+    volatile LONG64 Head;                   /* Written by the producer */
+    volatile LONG   ConsumerWaiting;        /* Consumer sleeps on the data event */
+    uint8_t         Pad0[52];
+    volatile LONG64 Tail;                   /* Written by the consumer */
+    volatile LONG   ProducerWaiting;        /* Producer sleeps on the space event */
+    uint8_t         Pad1[52];
+    uint8_t         Data[VUSB_SHM_RING_SIZE];
+} VUSB_SHM_RING;
+
+/* Layout of the shared section */
+typedef struct _VUSB_SHM_REGION {
+    uint32_t        Magic;
+    uint32_t        RingSize;
+    volatile LONG   State;                  /* VUSB_SHM_FREE, _ATTACHED, _CLOSED */
+    DWORD           ServerProcessId;
+    DWORD           ClientProcessId;
+    uint8_t         Pad[44];
+    VUSB_SHM_RING   Rings[2];
+} VUSB_SHM_REGION, *PVUSB_SHM_REGION;
+
+/* One side's view of the section */
+typedef struct _VUSB_SHM_CHANNEL {
+    char            Name[VUSB_SHM_NAME_MAX];
+    HANDLE          Mapping;
+    PVUSB_SHM_REGION Region;
+    VUSB_SHM_RING*  Tx;
+    VUSB_SHM_RING*  Rx;
+    HANDLE          TxData;                 /* Set for the peer's receive */
+    HANDLE          TxSpace;                /* Waited on while Tx is full */
+    HANDLE          RxData;                 /* Waited on while Rx is empty */
+    HANDLE          RxSpace;                /* Set for the peer's send */
+    HANDLE          Attach;                 /* Set by a client attaching */
+    HANDLE          Peer;                   /* Peer process, signalled when it exits */
+    CRITICAL_SECTION SendLock;              /* Senders on several threads share Tx */
+} VUSB_SHM_CHANNEL, *PVUSB_SHM_CHANNEL;
+
+/* Named event of a section; the server creates them, the client opens them */
+static inline HANDLE VusbShmEvent(const char* name, const char* suffix, BOOL create)
+{
+    char fullName[VUSB_SHM_NAME_MAX + 32];
+
+    snprintf(fullName, sizeof(fullName), "Local\\vusb-%s%s", name, suffix);
+    if (create) {
+        return CreateEventA(NULL, FALSE, FALSE, fullName);
+    }
+    return OpenEventA(EVENT_MODIFY_STATE | SYNCHRONIZE, FALSE, fullName);
+}
+
+/* Pick this side's rings and get their events */
+static inline int VusbShmOpenEvents(PVUSB_SHM_CHANNEL ch, BOOL server)
+{
+    int tx = server ? VUSB_SHM_TO_CLIENT : VUSB_SHM_TO_SERVER;
+    int rx = server ? VUSB_SHM_TO_SERVER : VUSB_SHM_TO_CLIENT;
+    char suffix[16];
+
+    ch->Tx = &ch->Region->Rings[tx];
+    ch->Rx = &ch->Region->Rings[rx];
+
+    snprintf(suffix, sizeof(suffix), "-%d-data", tx);
+    ch->TxData = VusbShmEvent(ch->Name, suffix, server);
+    snprintf(suffix, sizeof(suffix), "-%d-space", tx);
+    ch->TxSpace = VusbShmEvent(ch->Name, suffix, server);
+    snprintf(suffix, sizeof(suffix), "-%d-data", rx);
+    ch->RxData = VusbShmEvent(ch->Name, suffix, server);
+    snprintf(suffix, sizeof(suffix), "-%d-space", rx);
+    ch->RxSpace = VusbShmEvent(ch->Name, suffix, server);
+    ch->Attach = VusbShmEvent(ch->Name, "-attach", server);
+
+    return (ch->TxData && ch->TxSpace && ch->RxData && ch->RxSpace && ch->Attach) ? 0 : -1;
+}
+
+/**
+ * VusbShmClose - Release a channel's mapping and handles
+ */
+static inline void VusbShmClose(PVUSB_SHM_CHANNEL ch)
+{
+    HANDLE* handles[] = { &ch->TxData, &ch->TxSpace, &ch->RxData, &ch->RxSpace,
+                          &ch->Attach, &ch->Peer, &ch->Mapping };
+
+    if (ch->Region) {
+        UnmapViewOfFile(ch->Region);
+        ch->Region = NULL;
+    }
+    for (int i = 0; i < (int)(sizeof(handles) / sizeof(handles[0])); i++) {
+        if (*handles[i]) {
+            CloseHandle(*handles[i]);
+            *handles[i] = NULL;
+        }
+    }
+    DeleteCriticalSection(&ch->SendLock);
+}
+
+/* Map a section created here or by the server */
+static inline int VusbShmMap(PVUSB_SHM_CHANNEL ch, const char* name, BOOL create)
+{
+    char fullName[VUSB_SHM_NAME_MAX + 16];
+
+    memset(ch, 0, sizeof(VUSB_SHM_CHANNEL));
+    strncpy(ch->Name, name, VUSB_SHM_NAME_MAX - 1);
+    InitializeCriticalSection(&ch->SendLock);
+
+    snprintf(fullName, sizeof(fullName), "Local\\vusb-%s", ch->Name);
+    if (create) {
+        ch->Mapping = CreateFileMappingA(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE,
+                                         0, sizeof(VUSB_SHM_REGION), fullName);
+        if (ch->Mapping && GetLastError() == ERROR_ALREADY_EXISTS) {
+            fprintf(stderr, "Shared memory %s is in use by another server\n", ch->Name);
+            VusbShmClose(ch);
+            return -1;
+        }
+    } else {
+        ch->Mapping = OpenFileMappingA(FILE_MAP_ALL_ACCESS, FALSE, fullName);
+    }
+    if (!ch->Mapping) {
+        VusbShmClose(ch);
+        return -1;
+    }
+
+    ch->Region = (PVUSB_SHM_REGION)MapViewOfFile(ch->Mapping, FILE_MAP_ALL_ACCESS,
+                                                 0, 0, sizeof(VUSB_SHM_REGION));
+    if (!ch->Region) {
+        VusbShmClose(ch);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * VusbShmCreate - Create a server's section for local clients to attach to
+ */
+static inline int VusbShmCreate(PVUSB_SHM_CHANNEL ch, const char* name)
+{
+    if (VusbShmMap(ch, name, TRUE) != 0) {
+        return -1;
+    }
+
+    ch->Region->RingSize = VUSB_SHM_RING_SIZE;
+    ch->Region->ServerProcessId = GetCurrentProcessId();
+    ch->Region->State = VUSB_SHM_FREE;
+    MemoryBarrier();
+    ch->Region->Magic = VUSB_SHM_MAGIC;
+
+    if (VusbShmOpenEvents(ch, TRUE) != 0) {
+        VusbShmClose(ch);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * VusbShmAccept - Wait for a client to attach
+ * @return: 0 when one has, 1 on timeout, -1 on failure
+ */
+static inline int VusbShmAccept(PVUSB_SHM_CHANNEL ch, DWORD timeoutMs)
+{
+    DWORD result = WaitForSingleObject(ch->Attach, timeoutMs);
+
+    if (result == WAIT_TIMEOUT) {
+        return 1;
+    }
+    if (result != WAIT_OBJECT_0 || ch->Region->State != VUSB_SHM_ATTACHED) {
+        return -1;
+    }
+
+    ch->Peer = OpenProcess(SYNCHRONIZE, FALSE, ch->Region->ClientProcessId);
+    return 0;
+}
+
+/**
+ * VusbShmConnect - Attach to a server's section
+ */
+static inline int VusbShmConnect(PVUSB_SHM_CHANNEL ch, const char* name)
+{
+    if (VusbShmMap(ch, name, FALSE) != 0) {
+        fprintf(stderr, "No server on shared memory %s\n", name);
+        return -1;
+    }
+
+    if (ch->Region->Magic != VUSB_SHM_MAGIC || ch->Region->RingSize != VUSB_SHM_RING_SIZE ||
+        VusbShmOpenEvents(ch, FALSE) != 0) {
+        fprintf(stderr, "Shared memory %s does not match this client\n", name);
+        VusbShmClose(ch);
+        return -1;
+    }
+
+    if (InterlockedCompareExchange(&ch->Region->State, VUSB_SHM_ATTACHED,
+                                   VUSB_SHM_FREE) != VUSB_SHM_FREE) {
+        fprintf(stderr, "Shared memory %s already has a client\n", name);
+        VusbShmClose(ch);
+        return -1;
+    }
+
+    ch->Region->ClientProcessId = GetCurrentProcessId();
+    ch->Peer = OpenProcess(SYNCHRONIZE, FALSE, ch->Region->ServerProcessId);
+    SetEvent(ch->Attach);
+    return 0;
+}
+
+/**
+ * VusbShmShutdown - Close the stream in both directions
+ *
+ * Wakes every side blocked on the channel, in this process or the peer's.
+ * What was already sent can still be received.
+ */
+static inline void VusbShmShutdown(PVUSB_SHM_CHANNEL ch)
+{
+    InterlockedExchange(&ch->Region->State, VUSB_SHM_CLOSED);
+    SetEvent(ch->TxData);
+    SetEvent(ch->TxSpace);
+    SetEvent(ch->RxData);
+    SetEvent(ch->RxSpace);
+}
+
+/**
+ * VusbShmReset - Empty the server's section for the next client
+ */
+static inline void VusbShmReset(PVUSB_SHM_CHANNEL ch)
+{
+    HANDLE events[] = { ch->TxData, ch->TxSpace, ch->RxData, ch->RxSpace, ch->Attach };
+
+    if (ch->Peer) {
+        CloseHandle(ch->Peer);
+        ch->Peer = NULL;
+    }
+    for (int i = 0; i < 2; i++) {
+        VUSB_SHM_RING* ring = &ch->Region->Rings[i];
+        ring->Head = 0;
+        ring->Tail = 0;
+        ring->ConsumerWaiting = 0;
+        ring->ProducerWaiting = 0;
+    }
+    for (int i = 0; i < (int)(sizeof(events) / sizeof(events[0])); i++) {
+        ResetEvent(events[i]);
+    }
+    ch->Region->ClientProcessId = 0;
+    InterlockedExchange(&ch->Region->State, VUSB_SHM_FREE);
+}
+
+/* Publish a ring position, waking the other side if it sleeps for it */
+static inline void VusbShmPublish(volatile LONG64* position, LONG64 value,
+                                  volatile LONG* waiting, HANDLE event)
+{
+    InterlockedExchange64(position, value);
+    if (*waiting) {
+        SetEvent(event);
+    }
+}
+
+/**
+ * VusbShmAwait - Wait for the other side to move a ring position
+ * @return: TRUE once it has moved, FALSE if the channel closed first
+ */
+static inline BOOL VusbShmAwait(PVUSB_SHM_CHANNEL ch, volatile LONG64* position, LONG64 seen,
+                                volatile LONG* waiting, HANDLE event)
+{
+    HANDLE handles[2] = { event, ch->Peer };
+
+    for (int i = 0; i < VUSB_SHM_SPIN; i++) {
+        if (*position != seen) return TRUE;
+        YieldProcessor();
+    }
+
+    /* Say so before the last look, so a move after it sets the event */
+    InterlockedExchange(waiting, 1);
+    while (*position == seen && ch->Region->State != VUSB_SHM_CLOSED) {
+        if (WaitForMultipleObjects(ch->Peer ? 2 : 1, handles, FALSE, INFINITE) != WAIT_OBJECT_0) {
+            /* The peer process exited */
+            InterlockedExchange(&ch->Region->State, VUSB_SHM_CLOSED);
+        }
+    }
+    InterlockedExchange(waiting, 0);
+
+    return *position != seen;
+}
+
+/**
+ * VusbShmSend - Send a message gathered from several buffers
+ * @return: 0 once all of it is in the ring, -1 if the channel closed
+ *
+ * The message is published in one piece unless it outgrows the ring.
+ */
+static inline int VusbShmSend(PVUSB_SHM_CHANNEL ch, const WSABUF* buffers, DWORD count)
+{
+    VUSB_SHM_RING* ring = ch->Tx;
+    LONG64 head;
+    int result = 0;
+
+    EnterCriticalSection(&ch->SendLock);
+    head = ring->Head;
+
+    for (DWORD i = 0; i < count && result == 0; i++) {
+        const uint8_t* data = (const uint8_t*)buffers[i].buf;
+        uint32_t left = buffers[i].len;
+
+        while (left > 0) {
+            LONG64 tail = ring->Tail;
+            uint32_t space = VUSB_SHM_RING_SIZE - (uint32_t)(head - tail);
+            uint32_t offset = (uint32_t)(head & (VUSB_SHM_RING_SIZE - 1));
+            uint32_t chunk, first;
+
+            if (ch->Region->State == VUSB_SHM_CLOSED) {
+                result = -1;
+                break;
+            }
+
+            if (space == 0) {
+                /* Let the consumer have what is written so far, then wait */
+                VusbShmPublish(&ring->Head, head, &ring->ConsumerWaiting, ch->TxData);
+                if (!VusbShmAwait(ch, &ring->Tail, tail, &ring->ProducerWaiting, ch->TxSpace)) {
+                    result = -1;
+                    break;
+                }
+                continue;
+            }
+            MemoryBarrier();
+
+            chunk = left < space ? left : space;
+            first = VUSB_SHM_RING_SIZE - offset;
+            if (first > chunk) {
+                first = chunk;
+            }
+            memcpy(ring->Data + offset, data, first);
+            memcpy(ring->Data, data + first, chunk - first);
+
+            head += chunk;
+            data += chunk;
+            left -= chunk;
+        }
+    }
+
+    if (result == 0) {
+        VusbShmPublish(&ring->Head, head, &ring->ConsumerWaiting, ch->TxData);
+    }
+    LeaveCriticalSection(&ch->SendLock);
+    return result;
+}
+
+/**
+ * VusbShmRecv - Receive from the channel, like recv()
+ * @waitAll: Wait for all of length, as with MSG_WAITALL
+ * @return: Bytes received; fewer than asked only once the channel is
+ *          closed and drained, 0 if nothing was left
+ */
+static inline int VusbShmRecv(PVUSB_SHM_CHANNEL ch, void* buffer, uint32_t length, BOOL waitAll)
+{
+    VUSB_SHM_RING* ring = ch->Rx;
+    uint8_t* out = (uint8_t*)buffer;
+    LONG64 tail = ring->Tail;
+    uint32_t received = 0;
+
+    while (received < length) {
+        uint32_t available = (uint32_t)(ring->Head - tail);
+        uint32_t offset = (uint32_t)(tail & (VUSB_SHM_RING_SIZE - 1));
+        uint32_t chunk, first;
+
+        if (available == 0) {
+            if (received > 0 && !waitAll) {
+                break;
+            }
+            if (!VusbShmAwait(ch, &ring->Head, tail, &ring->ConsumerWaiting, ch->RxData)) {
+                break;
+            }
+            continue;
+        }
+        MemoryBarrier();
+
+        chunk = length - received;
+        if (chunk > available) {
+            chunk = available;
+        }
+        first = VUSB_SHM_RING_SIZE - offset;
+        if (first > chunk) {
+            first = chunk;
+        }
+        memcpy(out + received, ring->Data + offset, first);
+        memcpy(out + received + first, ring->Data, chunk - first);
+
+        tail += chunk;
+        received += chunk;
+        VusbShmPublish(&ring->Tail, tail, &ring->ProducerWaiting, ch->RxSpace);
+    }
+
+    return (int)received;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* VUSB_SHM_H */
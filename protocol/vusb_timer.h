@@ -0,0 +1,175 @@
+/**
+ * Virtual USB Timer Wheel
+ *
+ * Hierarchical timing wheel for URB timeouts, shared by the user-mode
+ * components. Timers are intrusive and are armed and cancelled in O(1).
+ * Advancing the wheel costs O(1) per elapsed tick plus the expired timers;
+ * timers further out than the inner wheel wait in the outer wheel and move
+ * inward once per inner revolution. The wheel does no locking of its own.
+ */
+
+#ifndef VUSB_TIMER_H
+#define VUSB_TIMER_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define VUSB_TIMER_TICK_MS      10
+#define VUSB_TIMER_INNER_BITS   8
+#define VUSB_TIMER_OUTER_BITS   6
+#define VUSB_TIMER_INNER_SLOTS  (1 << VUSB_TIMER_INNER_BITS)    /* 2.56 s of ticks */
+#define VUSB_TIMER_OUTER_SLOTS  (1 << VUSB_TIMER_OUTER_BITS)    /* 163 s of ticks */
+
+/* Timer, embedded in the object it times; zeroed means not armed */
+typedef struct _VUSB_TIMER {
+    struct _VUSB_TIMER* Next;
+    struct _VUSB_TIMER* Prev;
+    uint64_t            Expires;            /* Tick */
+} VUSB_TIMER, *PVUSB_TIMER;
+
+typedef struct _VUSB_TIMER_WHEEL {
+    uint64_t            Now;                /* Current tick */
+    uint32_t            Count;              /* Armed timers */
+    VUSB_TIMER          Inner[VUSB_TIMER_INNER_SLOTS];  /* List heads */
+    VUSB_TIMER          Outer[VUSB_TIMER_OUTER_SLOTS];
+} VUSB_TIMER_WHEEL, *PVUSB_TIMER_WHEEL;
+
+/**
+ * VusbTimerWheelInit - Start an empty wheel at the given time
+ * @nowMs: Current time in milliseconds
+ */
+static inline void VusbTimerWheelInit(PVUSB_TIMER_WHEEL wheel, uint64_t nowMs)
+{
+    wheel->Now = nowMs / VUSB_TIMER_TICK_MS;
+    wheel->Count = 0;
+
+    for (int i = 0; i < VUSB_TIMER_INNER_SLOTS; i++) {
+        wheel->Inner[i].Next = wheel->Inner[i].Prev = &wheel->Inner[i];
+    }
+    for (int i = 0; i < VUSB_TIMER_OUTER_SLOTS; i++) {
+        wheel->Outer[i].Next = wheel->Outer[i].Prev = &wheel->Outer[i];
+    }
+}
+
+/* Link a timer into the slot for its expiry tick */
+static inline void VusbTimerPlace(PVUSB_TIMER_WHEEL wheel, PVUSB_TIMER timer)
+{
+    uint64_t delta = timer->Expires - wheel->Now;
+    PVUSB_TIMER head;
+
+    if (timer->Expires <= wheel->Now) {
+        /* Already due, fires on the next tick */
+        head = &wheel->Inner[(wheel->Now + 1) & (VUSB_TIMER_INNER_SLOTS - 1)];
+    } else if (delta < VUSB_TIMER_INNER_SLOTS) {
+        head = &wheel->Inner[timer->Expires & (VUSB_TIMER_INNER_SLOTS - 1)];
+    } else {
+        uint64_t revolution = timer->Expires >> VUSB_TIMER_INNER_BITS;
+        uint64_t last = (wheel->Now >> VUSB_TIMER_INNER_BITS) + VUSB_TIMER_OUTER_SLOTS - 1;
+
+        /* Beyond the outer wheel: park in its last slot and re-place later */
+        if (revolution > last) {
+            revolution = last;
+        }
+        head = &wheel->Outer[revolution & (VUSB_TIMER_OUTER_SLOTS - 1)];
+    }
+
+    timer->Prev = head->Prev;
+    timer->Next = head;
+    head->Prev->Next = timer;
+    head->Prev = timer;
+}
+
+/**
+ * VusbTimerArm - Arm a timer to fire timeoutMs after nowMs
+ *
+ * Taking the current time keeps the timeout exact even when the wheel has
+ * not been advanced for a while.
+ */
+static inline void VusbTimerArm(PVUSB_TIMER_WHEEL wheel, PVUSB_TIMER timer,
+                                uint64_t nowMs, uint32_t timeoutMs)
+{
+    timer->Expires = (nowMs + timeoutMs + VUSB_TIMER_TICK_MS - 1) / VUSB_TIMER_TICK_MS;
+    VusbTimerPlace(wheel, timer);
+    wheel->Count++;
+}
+
+/**
+ * VusbTimerCancel - Disarm a timer; harmless if it is not armed
+ */
+static inline void VusbTimerCancel(PVUSB_TIMER_WHEEL wheel, PVUSB_TIMER timer)
+{
+    if (!timer->Next) return;
+
+    timer->Prev->Next = timer->Next;
+    timer->Next->Prev = timer->Prev;
+    timer->Next = timer->Prev = NULL;
+    wheel->Count--;
+}
+
+/**
+ * VusbTimerAdvance - Move the wheel to the given time
+ * @nowMs: Current time in milliseconds
+ * @return: Expired timers chained through Next, or NULL. They are disarmed
+ *          and may be re-armed or freed by the caller.
+ */
+static inline PVUSB_TIMER VusbTimerAdvance(PVUSB_TIMER_WHEEL wheel, uint64_t nowMs)
+{
+    uint64_t target = nowMs / VUSB_TIMER_TICK_MS;
+    PVUSB_TIMER expired = NULL;
+
+    /* Nothing armed: skip the idle ticks */
+    if (wheel->Count == 0) {
+        if (target > wheel->Now) {
+            wheel->Now = target;
+        }
+        return NULL;
+    }
+
+    while (wheel->Now < target) {
+        PVUSB_TIMER head;
+
+        wheel->Now++;
+
+        /* Start of an inner revolution: spread its outer slot over the inner wheel */
+        if ((wheel->Now & (VUSB_TIMER_INNER_SLOTS - 1)) == 0) {
+            head = &wheel->Outer[(wheel->Now >> VUSB_TIMER_INNER_BITS) &
+                                 (VUSB_TIMER_OUTER_SLOTS - 1)];
+            while (head->Next != head) {
+                PVUSB_TIMER timer = head->Next;
+
+                head->Next = timer->Next;
+                timer->Next->Prev = head;
+                VusbTimerPlace(wheel, timer);
+            }
+        }
+
+        head = &wheel->Inner[wheel->Now & (VUSB_TIMER_INNER_SLOTS - 1)];
+        while (head->Next != head) {
+            PVUSB_TIMER timer = head->Next;
+
+            head->Next = timer->Next;
+            timer->Next->Prev = head;
+
+            timer->Prev = NULL;
+            timer->Next = expired;
+            expired = timer;
+            wheel->Count--;
+        }
+
+        if (wheel->Count == 0) {
+            wheel->Now = target;
+        }
+    }
+
+    return expired;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* VUSB_TIMER_H */
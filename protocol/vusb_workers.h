@@ -0,0 +1,162 @@
+/**
+ * Virtual USB Worker Pool
+ *
+ * Threads that run work the network threads should not wait for, such as
+ * completing URBs to the driver. Work is posted with a key, normally a
+ * device ID, and a key always goes to the same worker: one device's work
+ * runs in the order it was posted and stays on one core, while different
+ * devices run side by side. Each worker has its own completion queue
+ * (vusb_mpsc.h), so posting never takes a lock.
+ */
+
+#ifndef VUSB_WORKERS_H
+#define VUSB_WORKERS_H
+
+#include <windows.h>
+#include <string.h>
+#include "vusb_mpsc.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define VUSB_WORKERS_MAX        MAXIMUM_WAIT_OBJECTS    /* Stopped with one wait */
+
+/* Runs one posted node on a worker thread; the routine owns it from then */
+typedef void (*VUSB_WORK_ROUTINE)(void* context, PVUSB_MPSC_NODE node);
+
+struct _VUSB_WORKER_POOL;
+
+typedef struct _VUSB_WORKER {
+    VUSB_MPSC_QUEUE     Queue;
+    HANDLE              Event;          /* Set when Queue stops being empty */
+    HANDLE              Thread;
+    struct _VUSB_WORKER_POOL* Pool;
+} VUSB_WORKER;
+
+/* Zeroed means no workers */
+typedef struct _VUSB_WORKER_POOL {
+    VUSB_WORKER         Workers[VUSB_WORKERS_MAX];
+    int                 Count;
+    VUSB_WORK_ROUTINE   Routine;
+    void*               Context;
+    volatile BOOL       Stopping;
+} VUSB_WORKER_POOL, *PVUSB_WORKER_POOL;
+
+/* Runs one worker's queue until the pool stops */
+static DWORD WINAPI VusbWorkerThread(LPVOID param)
+{
+    VUSB_WORKER* worker = (VUSB_WORKER*)param;
+    PVUSB_WORKER_POOL pool = worker->Pool;
+
+    for (;;) {
+        BOOL stopping;
+        PVUSB_MPSC_NODE node;
+
+        WaitForSingleObject(worker->Event, INFINITE);
+
+        /* Read before draining: whatever was posted before the stop is run */
+        stopping = pool->Stopping;
+        node = VusbMpscTake(&worker->Queue);
+        while (node) {
+            PVUSB_MPSC_NODE next = node->Next;
+
+            pool->Routine(pool->Context, node);
+            node = next;
+        }
+
+        if (stopping) {
+            break;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * VusbWorkersStop - Run what is still queued, then end the workers
+ *
+ * Nothing may be posted once this is called.
+ */
+static inline void VusbWorkersStop(PVUSB_WORKER_POOL pool)
+{
+    HANDLE threads[VUSB_WORKERS_MAX];
+    int count = 0;
+
+    pool->Stopping = TRUE;
+    for (int i = 0; i < pool->Count; i++) {
+        if (pool->Workers[i].Thread) {
+            threads[count++] = pool->Workers[i].Thread;
+            SetEvent(pool->Workers[i].Event);
+        }
+    }
+
+    if (count > 0) {
+        WaitForMultipleObjects(count, threads, TRUE, INFINITE);
+    }
+
+    for (int i = 0; i < pool->Count; i++) {
+        if (pool->Workers[i].Thread) {
+            CloseHandle(pool->Workers[i].Thread);
+        }
+        if (pool->Workers[i].Event) {
+            CloseHandle(pool->Workers[i].Event);
+        }
+    }
+    memset(pool, 0, sizeof(VUSB_WORKER_POOL));
+}
+
+/**
+ * VusbWorkersStart - Start workers that hand posted nodes to a routine
+ * @count: Number of workers, at most VUSB_WORKERS_MAX
+ * @return: 0 on success, -1 if the workers could not be started
+ */
+static inline int VusbWorkersStart(PVUSB_WORKER_POOL pool, int count,
+                                   VUSB_WORK_ROUTINE routine, void* context)
+{
+    memset(pool, 0, sizeof(VUSB_WORKER_POOL));
+    if (count <= 0) {
+        return 0;
+    }
+    if (count > VUSB_WORKERS_MAX) {
+        count = VUSB_WORKERS_MAX;
+    }
+
+    pool->Routine = routine;
+    pool->Context = context;
+
+    for (int i = 0; i < count; i++) {
+        VUSB_WORKER* worker = &pool->Workers[i];
+
+        pool->Count = i + 1;
+        worker->Pool = pool;
+        worker->Event = CreateEvent(NULL, FALSE, FALSE, NULL);
+        if (worker->Event) {
+            worker->Thread = CreateThread(NULL, 0, VusbWorkerThread, worker, 0, NULL);
+        }
+        if (!worker->Thread) {
+            VusbWorkersStop(pool);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * VusbWorkersPost - Queue a node on the worker for a key; any thread
+ */
+static inline void VusbWorkersPost(PVUSB_WORKER_POOL pool, ULONG key, PVUSB_MPSC_NODE node)
+{
+    VUSB_WORKER* worker = &pool->Workers[key % (ULONG)pool->Count];
+
+    if (VusbMpscPush(&worker->Queue, node)) {
+        SetEvent(worker->Event);
+    }
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* VUSB_WORKERS_H */
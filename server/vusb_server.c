@@ -8,25 +8,42 @@
 #include <winsock2.h>
 #include <ws2tcpip.h>
 #include <windows.h>
+#include <bcrypt.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "vusb_server.h"
+#include "vusb_server_urb.h"
 #include "../protocol/vusb_protocol.h"
 #include "../protocol/vusb_ioctl.h"
 
 #pragma comment(lib, "ws2_32.lib")
+#pragma comment(lib, "bcrypt.lib")
 
 /* Global server context */
 static VUSB_SERVER_CONTEXT g_ServerContext = {0};
 
+static DWORD WINAPI VusbShmThread(LPVOID param);
+static void VusbServerCompleteToDriver(void* context, PVUSB_MPSC_NODE node);
+
+/* URB completion on its way to the driver; the IOCTL input is Completion
+ * and the data after it */
+typedef struct _VUSB_COMPLETION_WORK {
+    VUSB_MPSC_NODE      Link;
+    BOOL                Compressed;         /* Data still LZ4 compressed */
+    ULONG               DataLength;         /* Bytes after Completion */
+    VUSB_URB_COMPLETION Completion;
+} VUSB_COMPLETION_WORK, *PVUSB_COMPLETION_WORK;
+
+#ifndef VUSB_SERVER_NO_MAIN
 /**
  * main - Server entry point
  */
 int main(int argc, char* argv[])
 {
     VUSB_SERVER_CONFIG config = {0};
+    SYSTEM_INFO systemInfo;
     int result;
 
     printf("Virtual USB Server v1.0\n");
@@ -35,25 +52,89 @@ int main(int argc, char* argv[])
     /* Parse command line arguments */
     config.Port = VUSB_DEFAULT_PORT;
     config.MaxClients = VUSB_SERVER_MAX_CLIENTS;
+    config.ResumeGraceMs = VUSB_SERVER_RESUME_GRACE_MS;
+    config.UrbCredits = VUSB_SERVER_URB_CREDITS;
+    config.ByteCredits = VUSB_SERVER_BYTE_CREDITS;
+    config.CoalesceBytes = VUSB_COALESCE_BYTES;
+    config.CoalesceUs = VUSB_COALESCE_DELAY_US;
+    config.Compression = TRUE;
+
+    GetSystemInfo(&systemInfo);
+    config.Workers = (int)systemInfo.dwNumberOfProcessors;
 
     for (int i = 1; i < argc; i++) {
         if (strcmp(argv[i], "--port") == 0 && i + 1 < argc) {
             config.Port = (USHORT)atoi(argv[++i]);
         } else if (strcmp(argv[i], "--max-clients") == 0 && i + 1 < argc) {
             config.MaxClients = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--io-engine") == 0 && i + 1 < argc) {
+            const char* engine = argv[++i];
+            if (strcmp(engine, "batched") == 0) {
+                config.IoEngine = VUSB_SERVER_IO_BATCHED;
+            } else if (strcmp(engine, "blocking") == 0) {
+                config.IoEngine = VUSB_SERVER_IO_BLOCKING;
+            } else {
+                fprintf(stderr, "Unknown I/O engine: %s\n", engine);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--bundle-dir") == 0 && i + 1 < argc) {
+            strncpy(config.BundleDirectory, argv[++i], MAX_PATH - 1);
+        } else if (strcmp(argv[i], "--resume-grace") == 0 && i + 1 < argc) {
+            config.ResumeGraceMs = (ULONG)atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--credits") == 0 && i + 1 < argc) {
+            config.UrbCredits = (ULONG)atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--credit-bytes") == 0 && i + 1 < argc) {
+            config.ByteCredits = (ULONG)atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--coalesce-bytes") == 0 && i + 1 < argc) {
+            config.CoalesceBytes = (ULONG)atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--coalesce-us") == 0 && i + 1 < argc) {
+            config.CoalesceUs = (ULONG)atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--no-compress") == 0) {
+            config.Compression = FALSE;
+        } else if (strcmp(argv[i], "--shm") == 0 && i + 1 < argc) {
+            strncpy(config.ShmName, argv[++i], VUSB_SHM_NAME_MAX - 1);
+        } else if (strcmp(argv[i], "--workers") == 0 && i + 1 < argc) {
+            config.Workers = atoi(argv[++i]);
         } else if (strcmp(argv[i], "--help") == 0 || strcmp(argv[i], "-h") == 0) {
             printf("Usage: vusb_server [options]\n");
             printf("Options:\n");
             printf("  --port <port>         Listen port (default: %d)\n", VUSB_DEFAULT_PORT);
             printf("  --max-clients <num>   Maximum clients (default: %d)\n", VUSB_SERVER_MAX_CLIENTS);
+            printf("  --io-engine <name>    Receive path: blocking, batched (default: blocking)\n");
+            printf("  --bundle-dir <dir>    Keep attach descriptor bundles in <dir>\n");
+            printf("  --resume-grace <ms>   Keep a dropped session's devices (default: %d, 0 = off)\n",
+                   VUSB_SERVER_RESUME_GRACE_MS);
+            printf("  --credits <num>       URBs a client has in flight (default: %d, 0 = no limit)\n",
+                   VUSB_SERVER_URB_CREDITS);
+            printf("  --credit-bytes <num>  Transfer bytes a client has in flight (default: %d)\n",
+                   VUSB_SERVER_BYTE_CREDITS);
+            printf("  --coalesce-bytes <n>  Bulk SUBMIT bytes held for one send (default: %d, 0 = off)\n",
+                   VUSB_COALESCE_BYTES);
+            printf("  --coalesce-us <us>    Longest a bulk SUBMIT is held (default: %d)\n",
+                   VUSB_COALESCE_DELAY_US);
+            printf("  --no-compress         Never compress bulk payloads\n");
+            printf("  --shm <name>          Also take a local client through shared memory <name>\n");
+            printf("  --workers <num>       URB completion threads (default: one per CPU, 0 = none)\n");
             printf("  --help, -h            Show this help\n");
             return 0;
         }
     }
 
+    if (config.Workers > VUSB_WORKERS_MAX) {
+        config.Workers = VUSB_WORKERS_MAX;
+    }
+
     printf("Configuration:\n");
     printf("  Port: %d\n", config.Port);
-    printf("  Max clients: %d\n\n", config.MaxClients);
+    printf("  Max clients: %d\n", config.MaxClients);
+    printf("  I/O engine: %s\n",
+           config.IoEngine == VUSB_SERVER_IO_BATCHED ? "batched" : "blocking");
+    printf("  Resume grace: %u ms\n", config.ResumeGraceMs);
+    printf("  Credits: %u URBs, %u bytes\n", config.UrbCredits, config.ByteCredits);
+    printf("  Coalescing: %u bytes, %u us\n", config.CoalesceBytes, config.CoalesceUs);
+    printf("  Compression: %s\n", config.Compression ? "on" : "off");
+    printf("  Shared memory: %s\n", config.ShmName[0] ? config.ShmName : "off");
+    printf("  Completion workers: %d\n\n", config.Workers);
 
     /* Initialize server */
     result = VusbServerInit(&g_ServerContext, &config);
@@ -77,6 +158,7 @@ int main(int argc, char* argv[])
 
     return result;
 }
+#endif /* VUSB_SERVER_NO_MAIN */
 
 /**
  * VusbServerInit - Initialize server
@@ -101,6 +183,9 @@ int VusbServerInit(PVUSB_SERVER_CONTEXT ctx, PVUSB_SERVER_CONFIG config)
     /* Initialize critical section */
     InitializeCriticalSection(&ctx->ClientLock);
 
+    VusbBufferPoolInit(&ctx->BufferPool);
+    VusbBundleStoreInit(&ctx->Bundles, config->BundleDirectory);
+
     /* Allocate client array */
     ctx->Clients = (PVUSB_CLIENT_CONNECTION*)calloc(
         config->MaxClients, sizeof(PVUSB_CLIENT_CONNECTION));
@@ -108,6 +193,13 @@ int VusbServerInit(PVUSB_SERVER_CONTEXT ctx, PVUSB_SERVER_CONFIG config)
         return -1;
     }
 
+    /* URB completions are posted to these by device */
+    if (VusbWorkersStart(&ctx->Workers, config->Workers,
+                         VusbServerCompleteToDriver, ctx) != 0) {
+        fprintf(stderr, "Failed to start completion workers\n");
+        return -1;
+    }
+
     printf("Server initialized.\n");
     return 0;
 }
@@ -193,6 +285,36 @@ int VusbServerRun(PVUSB_SERVER_CONTEXT ctx)
     ctx->ListenSocket = listenSocket;
     ctx->Running = TRUE;
 
+    /* URBs the driver queues are sent to their clients by the forwarder */
+    if (ctx->DriverHandle != INVALID_HANDLE_VALUE) {
+        PSERVER_URB_CONTEXT forwarder = (PSERVER_URB_CONTEXT)malloc(sizeof(SERVER_URB_CONTEXT));
+
+        if (!forwarder || ServerUrbInit(forwarder, ctx, ctx->DriverHandle) != 0) {
+            fprintf(stderr, "Failed to initialize URB forwarder\n");
+            free(forwarder);
+            ctx->Running = FALSE;
+            return -1;
+        }
+        if (ServerUrbStart(forwarder) != 0) {
+            fprintf(stderr, "Failed to start URB forwarder\n");
+            ServerUrbStop(forwarder);
+            free(forwarder);
+            ctx->Running = FALSE;
+            return -1;
+        }
+        ctx->UrbForwarder = forwarder;
+    }
+
+    /* A local client may attach through shared memory instead */
+    if (ctx->Config.ShmName[0]) {
+        if (VusbShmCreate(&ctx->Shm, ctx->Config.ShmName) == 0) {
+            ctx->ShmThread = CreateThread(NULL, 0, VusbShmThread, ctx, 0, NULL);
+            printf("Local clients can attach through shared memory %s\n", ctx->Config.ShmName);
+        } else {
+            fprintf(stderr, "Failed to create shared memory %s\n", ctx->Config.ShmName);
+        }
+    }
+
     printf("\nServer listening on port %d...\n", ctx->Config.Port);
     printf("Press Ctrl+C to stop.\n\n");
 
@@ -210,6 +332,10 @@ int VusbServerRun(PVUSB_SERVER_CONTEXT ctx)
             continue;
         }
 
+        /* Small messages go out at once; the URB forwarder does its own batching */
+        optval = 1;
+        setsockopt(clientSocket, IPPROTO_TCP, TCP_NODELAY, (char*)&optval, sizeof(optval));
+
         char clientIP[INET_ADDRSTRLEN];
         inet_ntop(AF_INET, &clientAddr.sin_addr, clientIP, sizeof(clientIP));
         printf("New connection from %s:%d\n", clientIP, ntohs(clientAddr.sin_port));
@@ -251,8 +377,15 @@ PVUSB_CLIENT_CONNECTION VusbServerAcceptClient(
                 client->ServerContext = ctx;
                 client->SessionId = ++ctx->NextSessionId;
                 client->Connected = TRUE;
-                memcpy(&client->Address, addr, sizeof(*addr));
-                inet_ntop(AF_INET, &addr->sin_addr, client->AddressString, sizeof(client->AddressString));
+                client->ResumedEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+                InitializeCriticalSection(&client->SendLock);
+                VusbCoalesceInit(&client->Coalesce, ctx->Config.CoalesceBytes,
+                                 ctx->Config.CoalesceUs);
+                if (addr) {
+                    memcpy(&client->Address, addr, sizeof(*addr));
+                    inet_ntop(AF_INET, &addr->sin_addr, client->AddressString,
+                              sizeof(client->AddressString));
+                }
 
                 ctx->Clients[i] = client;
                 ctx->ClientCount++;
@@ -265,12 +398,108 @@ PVUSB_CLIENT_CONNECTION VusbServerAcceptClient(
 
     if (!client) {
         fprintf(stderr, "Server full, rejecting connection\n");
-        closesocket(socket);
+        if (socket != INVALID_SOCKET) {
+            closesocket(socket);
+        }
     }
 
     return client;
 }
 
+/**
+ * VusbShmThread - Serve local clients attaching through shared memory
+ *
+ * One client at a time, handled on this thread; the section is emptied
+ * for the next one once it leaves.
+ */
+static DWORD WINAPI VusbShmThread(LPVOID param)
+{
+    PVUSB_SERVER_CONTEXT ctx = (PVUSB_SERVER_CONTEXT)param;
+
+    while (ctx->Running) {
+        PVUSB_CLIENT_CONNECTION client;
+
+        if (VusbShmAccept(&ctx->Shm, 500) != 0) {
+            continue;
+        }
+
+        printf("New connection through shared memory %s\n", ctx->Config.ShmName);
+
+        client = VusbServerAcceptClient(ctx, INVALID_SOCKET, NULL);
+        if (client) {
+            client->Shm = &ctx->Shm;
+            strcpy(client->AddressString, "local");
+            VusbClientThread(client);
+        }
+
+        /* Whatever the client still sends is refused from here on */
+        VusbShmShutdown(&ctx->Shm);
+        if (ctx->Running) {
+            VusbShmReset(&ctx->Shm);
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * VusbServerPrintCoalesce - Report the batching the forwarder achieved for a client
+ */
+static void VusbServerPrintCoalesce(PVUSB_CLIENT_CONNECTION client)
+{
+    PVUSB_COALESCE c = &client->Coalesce;
+
+    if (c->Frames == 0) {
+        return;
+    }
+
+    printf("  Sent %llu messages in %llu sends (%.1f per send, %llu bytes)\n",
+           c->Messages, c->Frames, (double)c->Messages / c->Frames, c->Bytes);
+    printf("  Batches sent: %llu full, %llu timed out, %llu at idle\n",
+           c->Flushes[VUSB_FLUSH_BYTES], c->Flushes[VUSB_FLUSH_DELAY], c->Flushes[VUSB_FLUSH_IDLE]);
+}
+
+/**
+ * VusbServerParkClient - Keep a dropped client's devices for a resume
+ *
+ * Runs on the client's own thread. The devices stay plugged in, and URBs
+ * for them are held by the forwarder, until a SESSION_RESUME on a new
+ * connection takes them over or the grace period ends.
+ */
+static void VusbServerParkClient(PVUSB_SERVER_CONTEXT ctx, PVUSB_CLIENT_CONNECTION client)
+{
+    BOOL hasDevices = FALSE;
+
+    for (int i = 0; i < VUSB_MAX_DEVICES; i++) {
+        if (client->Devices[i].Active) {
+            hasDevices = TRUE;
+            break;
+        }
+    }
+
+    if (!hasDevices || client->Leaving || !ctx->Running || !client->ResumedEvent ||
+        !(client->Capabilities & VUSB_CAP_SESSION_RESUME)) {
+        return;
+    }
+
+    EnterCriticalSection(&ctx->ClientLock);
+    client->Parked = TRUE;
+    if (client->Socket != INVALID_SOCKET) {
+        closesocket(client->Socket);
+        client->Socket = INVALID_SOCKET;
+    }
+    LeaveCriticalSection(&ctx->ClientLock);
+
+    printf("Client %s dropped, keeping session %u for %u ms\n",
+           client->AddressString, client->SessionId, ctx->Config.ResumeGraceMs);
+
+    WaitForSingleObject(client->ResumedEvent, ctx->Config.ResumeGraceMs);
+
+    EnterCriticalSection(&ctx->ClientLock);
+    client->Parked = FALSE;
+    LeaveCriticalSection(&ctx->ClientLock);
+}
+
 /**
  * VusbServerDisconnectClient - Disconnect and cleanup a client
  */
@@ -278,6 +507,8 @@ void VusbServerDisconnectClient(PVUSB_SERVER_CONTEXT ctx, PVUSB_CLIENT_CONNECTIO
 {
     if (!client) return;
 
+    VusbServerParkClient(ctx, client);
+
     EnterCriticalSection(&ctx->ClientLock);
 
     /* Remove from client array */
@@ -291,25 +522,262 @@ void VusbServerDisconnectClient(PVUSB_SERVER_CONTEXT ctx, PVUSB_CLIENT_CONNECTIO
 
     LeaveCriticalSection(&ctx->ClientLock);
 
+    /* A forwarder send still blocked on the connection fails now */
+    if (client->Socket != INVALID_SOCKET) {
+        closesocket(client->Socket);
+        client->Socket = INVALID_SOCKET;
+    }
+    if (client->Shm) {
+        VusbShmShutdown(client->Shm);
+    }
+
     /* Unplug all devices owned by this client */
     for (int i = 0; i < VUSB_MAX_DEVICES; i++) {
         if (client->Devices[i].Active) {
+            /* URBs held while parked now have no one to go to */
+            if (ctx->UrbForwarder) {
+                ServerUrbPrepareReplay(ctx->UrbForwarder, client->Devices[i].DeviceId);
+            }
             VusbServerUnplugDevice(ctx, client->Devices[i].DeviceId);
         }
     }
-
-    /* Close socket */
-    if (client->Socket != INVALID_SOCKET) {
-        closesocket(client->Socket);
-        client->Socket = INVALID_SOCKET;
+    if (ctx->UrbForwarder) {
+        ServerUrbForgetClient(ctx->UrbForwarder, client);
+        ServerUrbStartReplay(ctx->UrbForwarder);
     }
 
     printf("Client %s disconnected (session %u)\n", 
            client->AddressString, client->SessionId);
+    VusbServerPrintCoalesce(client);
 
+    if (client->ResumedEvent) {
+        CloseHandle(client->ResumedEvent);
+    }
+    DeleteCriticalSection(&client->SendLock);
+    free(client->Reassembly.Buffer);
     free(client);
 }
 
+/**
+ * VusbServerSend - Send a message to a client over its transport
+ * @return: 0 if all of it was sent, -1 otherwise
+ */
+int VusbServerSend(PVUSB_CLIENT_CONNECTION client, const void* data, ULONG length)
+{
+    WSABUF buffer;
+
+    buffer.buf = (char*)data;
+    buffer.len = length;
+    return VusbServerSendVectored(client, &buffer, 1);
+}
+
+/**
+ * VusbServerSendVectored - Send one message gathered from several buffers
+ *
+ * Buffers are advanced in place when the socket takes a partial write;
+ * the send lock keeps another thread's message from landing in between.
+ * A local client's shared memory takes the message whole.
+ * @return: 0 if all of it was sent, -1 otherwise
+ */
+int VusbServerSendVectored(PVUSB_CLIENT_CONNECTION client, WSABUF* buffers, DWORD count)
+{
+    DWORD sent;
+    int result = 0;
+
+    if (client->Shm) {
+        return VusbShmSend(client->Shm, buffers, count);
+    }
+
+    EnterCriticalSection(&client->SendLock);
+    while (count > 0) {
+        if (WSASend(client->Socket, buffers, count, &sent, 0, NULL, NULL) == SOCKET_ERROR) {
+            result = -1;
+            break;
+        }
+
+        while (count > 0 && sent >= buffers->len) {
+            sent -= buffers->len;
+            buffers++;
+            count--;
+        }
+        if (count > 0) {
+            buffers->buf += sent;
+            buffers->len -= sent;
+        }
+    }
+    LeaveCriticalSection(&client->SendLock);
+
+    return result;
+}
+
+/**
+ * VusbServerRecv - Receive from a client over its transport, like recv()
+ */
+static int VusbServerRecv(PVUSB_CLIENT_CONNECTION client, void* buffer, int length, int flags)
+{
+    if (client->Shm) {
+        return VusbShmRecv(client->Shm, buffer, (uint32_t)length, (flags & MSG_WAITALL) != 0);
+    }
+    return recv(client->Socket, (char*)buffer, length, flags);
+}
+
+/**
+ * VusbStartReassembly - Allocate the buffer for a segmented message
+ */
+static int VusbStartReassembly(PVUSB_REASSEMBLY reassembly, ULONG totalLength)
+{
+    reassembly->Buffer = (PUCHAR)malloc(totalLength);
+    if (!reassembly->Buffer) {
+        return -1;
+    }
+    reassembly->TotalLength = totalLength;
+    reassembly->Received = 0;
+    return 0;
+}
+
+/**
+ * VusbFinishReassembly - Dispatch a segmented message once all of it arrived
+ */
+static void VusbFinishReassembly(PVUSB_SERVER_CONTEXT ctx, PVUSB_CLIENT_CONNECTION client)
+{
+    PVUSB_REASSEMBLY reassembly = &client->Reassembly;
+    PVUSB_HEADER message;
+
+    if (reassembly->Received < reassembly->TotalLength) {
+        return;
+    }
+
+    message = VusbReassembledMessage(reassembly);
+    if (message) {
+        VusbServerProcessMessage(ctx, client, message, (PUCHAR)(message + 1), message->Length);
+    } else {
+        fprintf(stderr, "Malformed segmented message from %s\n", client->AddressString);
+    }
+
+    free(reassembly->Buffer);
+    memset(reassembly, 0, sizeof(VUSB_REASSEMBLY));
+}
+
+/**
+ * VusbReceiveFragment - Receive a fragment straight into the reassembly buffer
+ *
+ * Used by the blocking receive loop once the fragment's header has been
+ * read, so large transfers never pass through the fixed receive buffer.
+ */
+static int VusbReceiveFragment(
+    PVUSB_SERVER_CONTEXT ctx,
+    PVUSB_CLIENT_CONNECTION client,
+    PVUSB_HEADER header)
+{
+    PVUSB_REASSEMBLY reassembly = &client->Reassembly;
+    VUSB_URB_FRAGMENT fragment;
+    int dataLength;
+    int result;
+
+    if (header->Length < VUSB_FRAGMENT_FIELDS_SIZE) {
+        return -1;
+    }
+
+    fragment.Header = *header;
+    result = VusbServerRecv(client, &fragment.TotalLength, VUSB_FRAGMENT_FIELDS_SIZE, MSG_WAITALL);
+    ctx->RecvCalls++;
+    if (result != VUSB_FRAGMENT_FIELDS_SIZE) {
+        return -1;
+    }
+
+    dataLength = VusbFragmentCheck(reassembly, &fragment);
+    if (dataLength < 0) {
+        fprintf(stderr, "Out-of-order fragment from %s\n", client->AddressString);
+        return -1;
+    }
+
+    if (header->Command == VUSB_CMD_URB_FRAGMENT &&
+        VusbStartReassembly(reassembly, fragment.TotalLength) != 0) {
+        return -1;
+    }
+
+    if (dataLength > 0) {
+        result = VusbServerRecv(client, reassembly->Buffer + fragment.Offset,
+                                dataLength, MSG_WAITALL);
+        ctx->RecvCalls++;
+        if (result != dataLength) {
+            return -1;
+        }
+        reassembly->Received += (ULONG)dataLength;
+    }
+
+    VusbFinishReassembly(ctx, client);
+    return 0;
+}
+
+/**
+ * VusbReceiveBatched - Receive loop reading as much as the socket holds
+ *
+ * One recv() usually returns several queued messages; they are
+ * dispatched in place and only a trailing partial message is kept.
+ */
+static void VusbReceiveBatched(
+    PVUSB_SERVER_CONTEXT ctx,
+    PVUSB_CLIENT_CONNECTION client,
+    PUCHAR buffer)
+{
+    ULONG length = 0;
+
+    while (client->Connected && ctx->Running) {
+        ULONG offset = 0;
+        int result;
+
+        result = VusbServerRecv(client, buffer + length,
+                                (int)(VUSB_MAX_PACKET_SIZE - length), 0);
+        ctx->RecvCalls++;
+        if (result <= 0) {
+            if (result == 0) {
+                printf("Client %s closed connection\n", client->AddressString);
+            } else {
+                fprintf(stderr, "recv() failed: %d\n", WSAGetLastError());
+            }
+            return;
+        }
+        length += (ULONG)result;
+
+        while (length - offset >= sizeof(VUSB_HEADER)) {
+            PVUSB_HEADER header = (PVUSB_HEADER)(buffer + offset);
+            ULONG frameLength;
+
+            if (!VusbValidateHeader(header)) {
+                fprintf(stderr, "Invalid protocol header from %s\n", client->AddressString);
+                return;
+            }
+
+            if (header->Length > VUSB_MAX_PACKET_SIZE - sizeof(VUSB_HEADER)) {
+                fprintf(stderr, "Payload too large: %u\n", header->Length);
+                return;
+            }
+
+            frameLength = sizeof(VUSB_HEADER) + header->Length;
+            if (length - offset < frameLength) {
+                break;
+            }
+
+            ctx->MessagesReceived++;
+            VusbServerProcessMessage(ctx, client, header, (PUCHAR)(header + 1), header->Length);
+            offset += frameLength;
+
+            if (!client->Connected) {
+                return;
+            }
+        }
+
+        /* Keep the partial message at the start of the buffer */
+        if (offset > 0) {
+            length -= offset;
+            if (length > 0) {
+                memmove(buffer, buffer + offset, length);
+            }
+        }
+    }
+}
+
 /**
  * VusbClientThread - Client handler thread
  */
@@ -329,10 +797,16 @@ DWORD WINAPI VusbClientThread(LPVOID param)
         goto cleanup;
     }
 
+    if (ctx->Config.IoEngine == VUSB_SERVER_IO_BATCHED) {
+        VusbReceiveBatched(ctx, client, buffer);
+        goto cleanup;
+    }
+
     /* Main receive loop */
     while (client->Connected && ctx->Running) {
         /* Receive header */
-        result = recv(client->Socket, (char*)&header, sizeof(header), MSG_WAITALL);
+        result = VusbServerRecv(client, &header, sizeof(header), MSG_WAITALL);
+        ctx->RecvCalls++;
         if (result != sizeof(header)) {
             if (result == 0) {
                 printf("Client %s closed connection\n", client->AddressString);
@@ -348,6 +822,16 @@ DWORD WINAPI VusbClientThread(LPVOID param)
             break;
         }
 
+        /* Fragments bypass the receive buffer */
+        if (header.Command == VUSB_CMD_URB_FRAGMENT ||
+            header.Command == VUSB_CMD_URB_CONTINUE) {
+            ctx->MessagesReceived++;
+            if (VusbReceiveFragment(ctx, client, &header) != 0) {
+                break;
+            }
+            continue;
+        }
+
         /* Receive payload if present */
         if (header.Length > 0) {
             if (header.Length > VUSB_MAX_PACKET_SIZE - sizeof(header)) {
@@ -355,7 +839,8 @@ DWORD WINAPI VusbClientThread(LPVOID param)
                 break;
             }
 
-            result = recv(client->Socket, (char*)buffer, header.Length, MSG_WAITALL);
+            result = VusbServerRecv(client, buffer, header.Length, MSG_WAITALL);
+            ctx->RecvCalls++;
             if (result != (int)header.Length) {
                 fprintf(stderr, "Failed to receive payload\n");
                 break;
@@ -363,6 +848,7 @@ DWORD WINAPI VusbClientThread(LPVOID param)
         }
 
         /* Process message */
+        ctx->MessagesReceived++;
         VusbServerProcessMessage(ctx, client, &header, buffer, header.Length);
     }
 
@@ -393,9 +879,14 @@ void VusbServerProcessMessage(
         break;
 
     case VUSB_CMD_DISCONNECT:
+        client->Leaving = TRUE;
         client->Connected = FALSE;
         break;
 
+    case VUSB_CMD_SESSION_RESUME:
+        VusbServerHandleSessionResume(ctx, client, header, payload, payloadLength);
+        break;
+
     case VUSB_CMD_PING:
         VusbServerSendPong(client, header->Sequence);
         break;
@@ -404,14 +895,31 @@ void VusbServerProcessMessage(
         VusbServerHandleDeviceAttach(ctx, client, header, payload, payloadLength);
         break;
 
+    case VUSB_CMD_DEVICE_ATTACH_HASH:
+        VusbServerHandleDeviceAttachHash(ctx, client, header, payload, payloadLength);
+        break;
+
     case VUSB_CMD_DEVICE_DETACH:
         VusbServerHandleDeviceDetach(ctx, client, header, payload, payloadLength);
         break;
 
+    case VUSB_CMD_DEVICE_RESET:
+        VusbServerHandleDeviceReset(ctx, client, header, payload, payloadLength);
+        break;
+
     case VUSB_CMD_URB_COMPLETE:
         VusbServerHandleUrbComplete(ctx, client, header, payload, payloadLength);
         break;
 
+    case VUSB_CMD_URB_COMPLETE_BATCH:
+        VusbServerHandleUrbCompleteBatch(ctx, client, header, payload, payloadLength);
+        break;
+
+    case VUSB_CMD_URB_FRAGMENT:
+    case VUSB_CMD_URB_CONTINUE:
+        VusbServerHandleFragment(ctx, client, header, payload, payloadLength);
+        break;
+
     case VUSB_CMD_DEVICE_LIST:
         VusbServerHandleDeviceList(ctx, client, header);
         break;
@@ -424,6 +932,14 @@ void VusbServerProcessMessage(
     }
 }
 
+/* Smaller of two credit windows, where 0 means no limit */
+static ULONG VusbServerCreditWindow(ULONG client, ULONG server)
+{
+    if (client == 0) return server;
+    if (server == 0) return client;
+    return client < server ? client : server;
+}
+
 /**
  * VusbServerHandleConnect - Handle client connect request
  */
@@ -435,54 +951,85 @@ void VusbServerHandleConnect(
     ULONG payloadLength)
 {
     VUSB_CONNECT_RESPONSE response;
-
-    UNREFERENCED_PARAMETER(ctx);
-    UNREFERENCED_PARAMETER(payload);
-    UNREFERENCED_PARAMETER(payloadLength);
+    VUSB_CONNECT_REQUEST request;
+    ULONG offered = VUSB_SERVER_CAPABILITIES;
 
     printf("Client %s connecting...\n", client->AddressString);
 
+    if (!ctx->Config.Compression) {
+        offered &= ~VUSB_CAP_COMPRESSION;
+    }
+
+    /* A local client does not lose its connection the way a remote one can */
+    if (client->Shm) {
+        offered &= ~VUSB_CAP_SESSION_RESUME;
+    }
+
+    /* Keep the features both sides support */
+    if (payloadLength >= VUSB_CONNECT_BASE_SIZE) {
+        /* The payload starts after the header; older clients stop before the credits */
+        if (payloadLength > sizeof(VUSB_CONNECT_REQUEST) - sizeof(VUSB_HEADER)) {
+            payloadLength = sizeof(VUSB_CONNECT_REQUEST) - sizeof(VUSB_HEADER);
+        }
+        memset(&request, 0, sizeof(request));
+        memcpy((PUCHAR)&request + sizeof(VUSB_HEADER), payload, payloadLength);
+        client->Capabilities = request.Capabilities & offered;
+        if (payloadLength < sizeof(VUSB_CONNECT_REQUEST) - sizeof(VUSB_HEADER)) {
+            client->Capabilities &= ~VUSB_CAP_CREDITS;
+        }
+
+        if (client->Capabilities & VUSB_CAP_CREDITS) {
+            client->UrbCredits = VusbServerCreditWindow(request.UrbCredits, ctx->Config.UrbCredits);
+            client->ByteCredits = VusbServerCreditWindow(request.ByteCredits,
+                                                         ctx->Config.ByteCredits);
+            client->EndpointCredits = VusbServerCreditWindow(request.EndpointCredits,
+                                                             VUSB_SERVER_ENDPOINT_CREDITS);
+        }
+    }
+
     /* Build response */
+    memset(&response, 0, sizeof(response));
     VusbInitHeader(&response.Header, VUSB_CMD_CONNECT, 
                    sizeof(response) - sizeof(VUSB_HEADER), header->Sequence);
     response.Status = VUSB_STATUS_SUCCESS;
     response.ServerVersion = 0x00010000;
-    response.Capabilities = 0;
+    response.Capabilities = offered;
     response.SessionId = client->SessionId;
+    response.UrbCredits = client->UrbCredits;
+    response.ByteCredits = client->ByteCredits;
+    response.EndpointCredits = client->EndpointCredits;
+
+    /* The token proves a later SESSION_RESUME comes from this client */
+    if ((client->Capabilities & VUSB_CAP_SESSION_RESUME) && ctx->Config.ResumeGraceMs > 0 &&
+        BCRYPT_SUCCESS(BCryptGenRandom(NULL, client->ResumeToken, VUSB_RESUME_TOKEN_SIZE,
+                                       BCRYPT_USE_SYSTEM_PREFERRED_RNG))) {
+        memcpy(response.ResumeToken, client->ResumeToken, VUSB_RESUME_TOKEN_SIZE);
+        response.ResumeGraceMs = ctx->Config.ResumeGraceMs;
+    } else {
+        client->Capabilities &= ~VUSB_CAP_SESSION_RESUME;
+    }
 
     /* Send response */
-    send(client->Socket, (char*)&response, sizeof(response), 0);
+    VusbServerSend(client, &response, sizeof(response));
 
     printf("Client %s connected (session %u)\n", client->AddressString, client->SessionId);
 }
 
 /**
- * VusbServerHandleDeviceAttach - Handle device attach request
+ * VusbServerAttach - Plug in a device and answer the client's attach
  */
-void VusbServerHandleDeviceAttach(
+static void VusbServerAttach(
     PVUSB_SERVER_CONTEXT ctx,
     PVUSB_CLIENT_CONNECTION client,
     PVUSB_HEADER header,
-    PUCHAR payload,
-    ULONG payloadLength)
+    VUSB_DEVICE_INFO* deviceInfo,
+    PUCHAR descriptors,
+    ULONG descriptorLength)
 {
     VUSB_DEVICE_ATTACH_RESPONSE response;
-    VUSB_DEVICE_INFO* deviceInfo;
-    ULONG descriptorLength;
-    PUCHAR descriptors;
     ULONG deviceId = 0;
     int result;
 
-    if (payloadLength < sizeof(VUSB_DEVICE_INFO) + sizeof(ULONG)) {
-        VusbServerSendError(client, header->Sequence, VUSB_STATUS_INVALID_PARAM,
-                           "Invalid attach request");
-        return;
-    }
-
-    deviceInfo = (VUSB_DEVICE_INFO*)payload;
-    descriptorLength = *(ULONG*)(payload + sizeof(VUSB_DEVICE_INFO));
-    descriptors = payload + sizeof(VUSB_DEVICE_INFO) + sizeof(ULONG);
-
     printf("Device attach: VID=%04X PID=%04X (%s - %s)\n",
            deviceInfo->VendorId, deviceInfo->ProductId,
            deviceInfo->Manufacturer, deviceInfo->Product);
@@ -508,7 +1055,164 @@ void VusbServerHandleDeviceAttach(
     response.Status = (result == 0) ? VUSB_STATUS_SUCCESS : VUSB_STATUS_ERROR;
     response.DeviceId = deviceId;
 
-    send(client->Socket, (char*)&response, sizeof(response), 0);
+    VusbServerSend(client, &response, sizeof(response));
+}
+
+/**
+ * VusbServerHandleDeviceAttach - Handle device attach request
+ */
+void VusbServerHandleDeviceAttach(
+    PVUSB_SERVER_CONTEXT ctx,
+    PVUSB_CLIENT_CONNECTION client,
+    PVUSB_HEADER header,
+    PUCHAR payload,
+    ULONG payloadLength)
+{
+    VUSB_DEVICE_INFO* deviceInfo;
+    ULONG descriptorLength;
+    PUCHAR descriptors;
+
+    if (payloadLength < sizeof(VUSB_DEVICE_INFO) + sizeof(ULONG)) {
+        VusbServerSendError(client, header->Sequence, VUSB_STATUS_INVALID_PARAM,
+                           "Invalid attach request");
+        return;
+    }
+
+    deviceInfo = (VUSB_DEVICE_INFO*)payload;
+    descriptorLength = *(ULONG*)(payload + sizeof(VUSB_DEVICE_INFO));
+    descriptors = payload + sizeof(VUSB_DEVICE_INFO) + sizeof(ULONG);
+
+    if (descriptorLength > payloadLength - sizeof(VUSB_DEVICE_INFO) - sizeof(ULONG)) {
+        VusbServerSendError(client, header->Sequence, VUSB_STATUS_INVALID_PARAM,
+                           "Invalid attach request");
+        return;
+    }
+
+    /* Next time this client can name the blob by its hash */
+    VusbBundleAdd(&ctx->Bundles, descriptors, descriptorLength);
+
+    VusbServerAttach(ctx, client, header, deviceInfo, descriptors, descriptorLength);
+}
+
+/**
+ * VusbServerHandleDeviceAttachHash - Handle an attach naming a descriptor bundle
+ *
+ * Unknown bundles are answered with VUSB_STATUS_BUNDLE_UNKNOWN, and the
+ * client follows up with a full attach.
+ */
+void VusbServerHandleDeviceAttachHash(
+    PVUSB_SERVER_CONTEXT ctx,
+    PVUSB_CLIENT_CONNECTION client,
+    PVUSB_HEADER header,
+    PUCHAR payload,
+    ULONG payloadLength)
+{
+    VUSB_DEVICE_ATTACH_HASH_REQUEST request;
+    VUSB_DEVICE_ATTACH_RESPONSE response;
+    PVUSB_BUNDLE bundle;
+
+    if (payloadLength < sizeof(request) - sizeof(VUSB_HEADER)) {
+        VusbServerSendError(client, header->Sequence, VUSB_STATUS_INVALID_PARAM,
+                           "Invalid attach request");
+        return;
+    }
+    memcpy((PUCHAR)&request + sizeof(VUSB_HEADER), payload, sizeof(request) - sizeof(VUSB_HEADER));
+
+    bundle = VusbBundleFind(&ctx->Bundles, request.DescriptorHash, request.DescriptorLength);
+    if (!bundle) {
+        VusbInitHeader(&response.Header, VUSB_CMD_DEVICE_ATTACH,
+                       sizeof(response) - sizeof(VUSB_HEADER), header->Sequence);
+        response.Status = VUSB_STATUS_BUNDLE_UNKNOWN;
+        response.DeviceId = 0;
+        VusbServerSend(client, &response, sizeof(response));
+        return;
+    }
+
+    VusbServerAttach(ctx, client, header, &request.DeviceInfo, bundle->Data, bundle->Length);
+}
+
+/**
+ * VusbServerHandleSessionResume - Move a parked session's devices to this connection
+ *
+ * URBs the old connection had not completed are re-sent by the forwarder
+ * once the response is out.
+ */
+void VusbServerHandleSessionResume(
+    PVUSB_SERVER_CONTEXT ctx,
+    PVUSB_CLIENT_CONNECTION client,
+    PVUSB_HEADER header,
+    PUCHAR payload,
+    ULONG payloadLength)
+{
+    VUSB_SESSION_RESUME_REQUEST request;
+    VUSB_SESSION_RESUME_RESPONSE response;
+    PVUSB_CLIENT_CONNECTION parked = NULL;
+    ULONG deviceCount = 0;
+    ULONG urbCount = 0;
+
+    if (payloadLength < sizeof(request) - sizeof(VUSB_HEADER)) {
+        VusbServerSendError(client, header->Sequence, VUSB_STATUS_INVALID_PARAM,
+                           "Invalid resume request");
+        return;
+    }
+    memcpy((PUCHAR)&request + sizeof(VUSB_HEADER), payload, sizeof(request) - sizeof(VUSB_HEADER));
+
+    EnterCriticalSection(&ctx->ClientLock);
+
+    for (int i = 0; i < ctx->Config.MaxClients; i++) {
+        PVUSB_CLIENT_CONNECTION other = ctx->Clients[i];
+        if (other && other != client && other->Parked &&
+            other->SessionId == request.SessionId &&
+            memcmp(other->ResumeToken, request.ResumeToken, VUSB_RESUME_TOKEN_SIZE) == 0) {
+            parked = other;
+            break;
+        }
+    }
+
+    if (parked) {
+        for (int i = 0; i < VUSB_MAX_DEVICES; i++) {
+            if (!parked->Devices[i].Active) {
+                continue;
+            }
+
+            for (int j = 0; j < VUSB_MAX_DEVICES; j++) {
+                if (!client->Devices[j].Active) {
+                    /* Hold new URBs until the in-flight ones are re-sent */
+                    if (ctx->UrbForwarder) {
+                        urbCount += ServerUrbPrepareReplay(ctx->UrbForwarder,
+                                                           parked->Devices[i].DeviceId);
+                    }
+                    client->Devices[j] = parked->Devices[i];
+                    parked->Devices[i].Active = FALSE;
+                    deviceCount++;
+                    break;
+                }
+            }
+        }
+
+        /* The parked thread unplugs whatever did not fit */
+        parked->Parked = FALSE;
+        SetEvent(parked->ResumedEvent);
+    }
+
+    LeaveCriticalSection(&ctx->ClientLock);
+
+    VusbInitHeader(&response.Header, VUSB_CMD_SESSION_RESUME,
+                   sizeof(response) - sizeof(VUSB_HEADER), header->Sequence);
+    response.Status = parked ? VUSB_STATUS_SUCCESS : VUSB_STATUS_SESSION_EXPIRED;
+    response.SessionId = request.SessionId;
+    response.DeviceCount = deviceCount;
+    response.UrbsReplayed = urbCount;
+
+    VusbServerSend(client, &response, sizeof(response));
+
+    if (parked) {
+        printf("Client %s resumed session %u: %u devices, %u URBs to replay\n",
+               client->AddressString, request.SessionId, deviceCount, urbCount);
+        if (ctx->UrbForwarder) {
+            ServerUrbStartReplay(ctx->UrbForwarder);
+        }
+    }
 }
 
 /**
@@ -534,8 +1238,6 @@ void VusbServerHandleDeviceDetach(
 
     printf("Device detach: ID=%u\n", deviceId);
 
-    VusbServerUnplugDevice(ctx, deviceId);
-
     /* Remove from client tracking */
     for (int i = 0; i < VUSB_MAX_DEVICES; i++) {
         if (client->Devices[i].Active && client->Devices[i].DeviceId == deviceId) {
@@ -544,9 +1246,58 @@ void VusbServerHandleDeviceDetach(
         }
     }
 
+    /* With no client left for it, the forwarder fails the device's URBs
+     * and gives their credit back */
+    if (ctx->UrbForwarder) {
+        ServerUrbPrepareReplay(ctx->UrbForwarder, deviceId);
+        ServerUrbStartReplay(ctx->UrbForwarder);
+    }
+
+    VusbServerUnplugDevice(ctx, deviceId);
+
     /* Send acknowledgment */
     VusbInitHeader(&response, VUSB_CMD_DEVICE_DETACH, 0, header->Sequence);
-    send(client->Socket, (char*)&response, sizeof(response), 0);
+    VusbServerSend(client, &response, sizeof(response));
+}
+
+/**
+ * VusbServerHandleDeviceReset - Handle a client's device having been reset
+ */
+void VusbServerHandleDeviceReset(
+    PVUSB_SERVER_CONTEXT ctx,
+    PVUSB_CLIENT_CONNECTION client,
+    PVUSB_HEADER header,
+    PUCHAR payload,
+    ULONG payloadLength)
+{
+    VUSB_HEADER response;
+    ULONG deviceId;
+    BOOL owned = FALSE;
+
+    if (payloadLength < sizeof(ULONG)) {
+        VusbServerSendError(client, header->Sequence, VUSB_STATUS_INVALID_PARAM,
+                           "Invalid reset request");
+        return;
+    }
+
+    deviceId = *(ULONG*)payload;
+
+    for (int i = 0; i < VUSB_MAX_DEVICES; i++) {
+        if (client->Devices[i].Active && client->Devices[i].DeviceId == deviceId) {
+            owned = TRUE;
+            break;
+        }
+    }
+
+    /* Only the client that attached a device can reset it */
+    if (owned) {
+        printf("Device reset: ID=%u\n", deviceId);
+        VusbServerResetDevice(ctx, deviceId);
+    }
+
+    /* Send acknowledgment */
+    VusbInitHeader(&response, VUSB_CMD_DEVICE_RESET, 0, header->Sequence);
+    VusbServerSend(client, &response, sizeof(response));
 }
 
 /**
@@ -559,44 +1310,216 @@ void VusbServerHandleUrbComplete(
     PUCHAR payload,
     ULONG payloadLength)
 {
-    VUSB_URB_COMPLETE* urbComplete;
-    VUSB_URB_COMPLETION completion;
-    DWORD bytesReturned;
-
-    UNREFERENCED_PARAMETER(client);
+    VUSB_URB_COMPLETE urbComplete;
+    PVUSB_COMPLETION_WORK work;
+    UCHAR report[VUSB_REPORT_MAX];
+    PUCHAR data;
+    ULONG dataLength;
+    ULONG copyLength;
+    BOOL compressed;
 
     if (payloadLength < sizeof(VUSB_URB_COMPLETE) - sizeof(VUSB_HEADER)) {
         return;
     }
 
-    urbComplete = (VUSB_URB_COMPLETE*)payload;
+    /* The payload starts after the header */
+    memcpy((PUCHAR)&urbComplete + sizeof(VUSB_HEADER), payload,
+           sizeof(VUSB_URB_COMPLETE) - sizeof(VUSB_HEADER));
+    data = payload + sizeof(VUSB_URB_COMPLETE) - sizeof(VUSB_HEADER);
+    dataLength = payloadLength - (sizeof(VUSB_URB_COMPLETE) - sizeof(VUSB_HEADER));
 
-    /* Forward to driver */
-    if (ctx->DriverHandle != INVALID_HANDLE_VALUE) {
-        completion.DeviceId = urbComplete->DeviceId;
-        completion.UrbId = urbComplete->UrbId;
-        completion.SequenceNumber = header->Sequence;
-        completion.Status = urbComplete->Status;
-        completion.ActualLength = urbComplete->ActualLength;
-
-        /* Build IOCTL input with data */
-        size_t inputSize = sizeof(completion) + urbComplete->ActualLength;
-        PUCHAR inputBuffer = (PUCHAR)malloc(inputSize);
-        if (inputBuffer) {
-            memcpy(inputBuffer, &completion, sizeof(completion));
-            if (urbComplete->ActualLength > 0) {
-                memcpy(inputBuffer + sizeof(completion), 
-                       (PUCHAR)(urbComplete + 1), urbComplete->ActualLength);
-            }
+    /* Flags reuse what were the high bytes of ErrorCount; only those for
+     * features the client negotiated mean anything */
+    if (!(client->Capabilities & VUSB_CAP_COMPRESSION)) {
+        urbComplete.Flags &= ~VUSB_COMPLETE_COMPRESSED;
+    }
+    if (!(client->Capabilities & VUSB_CAP_REPORT_DELTA)) {
+        urbComplete.Flags &= ~VUSB_COMPLETE_REPORTS;
+    }
+
+    /* Interrupt reports sent as changes are rebuilt from the last ones */
+    if (urbComplete.Flags & VUSB_COMPLETE_REPORTS) {
+        if (VusbReportDecode(&client->Reports, urbComplete.DeviceId, urbComplete.EndpointAddress,
+                             urbComplete.Flags, data, dataLength, report,
+                             urbComplete.ActualLength) != 0) {
+            fprintf(stderr, "Bad interrupt report for URB %u from %s\n",
+                    urbComplete.UrbId, client->AddressString);
+            urbComplete.Status = VUSB_STATUS_ERROR;
+            urbComplete.ActualLength = 0;
+        }
+        data = report;
+        dataLength = urbComplete.ActualLength;
+    }
+
+    /* Compressed data expands to ActualLength, which must stay a sane allocation */
+    if ((urbComplete.Flags & VUSB_COMPLETE_COMPRESSED) &&
+        urbComplete.ActualLength > VUSB_MAX_SEGMENTED_SIZE) {
+        fprintf(stderr, "Oversized compressed URB %u from %s\n",
+                urbComplete.UrbId, client->AddressString);
+        urbComplete.Flags &= ~VUSB_COMPLETE_COMPRESSED;
+        urbComplete.Status = VUSB_STATUS_ERROR;
+        urbComplete.ActualLength = 0;
+    }
+
+    if (!(urbComplete.Flags & VUSB_COMPLETE_COMPRESSED) && urbComplete.ActualLength > dataLength) {
+        urbComplete.ActualLength = dataLength;
+    }
+
+    if (ctx->DriverHandle == INVALID_HANDLE_VALUE) {
+        return;
+    }
+
+    /* Compressed data is copied as it is and expanded by whoever completes it */
+    compressed = (urbComplete.Flags & VUSB_COMPLETE_COMPRESSED) != 0;
+    copyLength = compressed ? dataLength : urbComplete.ActualLength;
+
+    work = (PVUSB_COMPLETION_WORK)VusbBufferAlloc(&ctx->BufferPool,
+                                                  sizeof(VUSB_COMPLETION_WORK) + copyLength);
+    if (!work) {
+        return;
+    }
+
+    work->Compressed = compressed;
+    work->DataLength = copyLength;
+    work->Completion.DeviceId = urbComplete.DeviceId;
+    work->Completion.UrbId = urbComplete.UrbId;
+    work->Completion.SequenceNumber = header->Sequence;
+    work->Completion.Status = urbComplete.Status;
+    work->Completion.ActualLength = urbComplete.ActualLength;
+    if (copyLength > 0) {
+        memcpy(&work->Completion + 1, data, copyLength);
+    }
 
-            DeviceIoControl(ctx->DriverHandle, IOCTL_VUSB_COMPLETE_URB,
-                           inputBuffer, (DWORD)inputSize, NULL, 0, &bytesReturned, NULL);
+    /* One device's completions go to one worker, in the order received */
+    if (ctx->Workers.Count > 0) {
+        VusbWorkersPost(&ctx->Workers, urbComplete.DeviceId, &work->Link);
+    } else {
+        VusbServerCompleteToDriver(ctx, &work->Link);
+    }
+}
+
+/**
+ * VusbServerCompleteToDriver - Complete a received URB to the driver
+ *
+ * Runs on a completion worker, or on the receive thread without any.
+ */
+static void VusbServerCompleteToDriver(void* context, PVUSB_MPSC_NODE node)
+{
+    PVUSB_SERVER_CONTEXT ctx = (PVUSB_SERVER_CONTEXT)context;
+    PVUSB_COMPLETION_WORK work = CONTAINING_RECORD(node, VUSB_COMPLETION_WORK, Link);
+    PUCHAR input = (PUCHAR)&work->Completion;
+    PUCHAR expanded = NULL;
+    size_t inputSize = sizeof(VUSB_URB_COMPLETION) + work->Completion.ActualLength;
+    DWORD bytesReturned;
+    BOOL pending = TRUE;
+
+    if (work->Compressed) {
+        /* Expanded straight into an IOCTL input of its own */
+        expanded = (PUCHAR)VusbBufferAlloc(&ctx->BufferPool, inputSize);
+        if (expanded &&
+            VusbLz4Decompress((PUCHAR)(&work->Completion + 1), work->DataLength,
+                              expanded + sizeof(VUSB_URB_COMPLETION),
+                              work->Completion.ActualLength) == 0) {
+            memcpy(expanded, &work->Completion, sizeof(VUSB_URB_COMPLETION));
+            input = expanded;
+        } else {
+            fprintf(stderr, "Bad compressed completion for URB %u of device %u\n",
+                    work->Completion.UrbId, work->Completion.DeviceId);
+            work->Completion.Status = VUSB_STATUS_ERROR;
+            work->Completion.ActualLength = 0;
+            inputSize = sizeof(VUSB_URB_COMPLETION);
+        }
+    }
+
+    /* Returns the URB's credit; one the forwarder timed out is done already */
+    if (ctx->UrbForwarder) {
+        pending = ServerUrbComplete(ctx->UrbForwarder, work->Completion.DeviceId,
+                                    work->Completion.UrbId, work->Completion.Status,
+                                    work->Completion.ActualLength,
+                                    input + sizeof(VUSB_URB_COMPLETION)) == 0;
+    }
+
+    if (pending) {
+        DeviceIoControl(ctx->DriverHandle, IOCTL_VUSB_COMPLETE_URB,
+                       input, (DWORD)inputSize, NULL, 0, &bytesReturned, NULL);
+    }
+
+    if (expanded) {
+        VusbBufferFree(&ctx->BufferPool, expanded);
+    }
+    VusbBufferFree(&ctx->BufferPool, work);
+}
+
+/**
+ * VusbServerHandleUrbCompleteBatch - Handle several URB completions from client
+ */
+void VusbServerHandleUrbCompleteBatch(
+    PVUSB_SERVER_CONTEXT ctx,
+    PVUSB_CLIENT_CONNECTION client,
+    PVUSB_HEADER header,
+    PUCHAR payload,
+    ULONG payloadLength)
+{
+    PVUSB_HEADER entry;
+    uint32_t offset = 0;
+
+    UNREFERENCED_PARAMETER(header);
+
+    if (payloadLength < sizeof(uint32_t)) {
+        return;
+    }
 
-            free(inputBuffer);
+    /* Entries are complete URB_COMPLETE messages; handle each as if sent alone */
+    while ((entry = VusbBatchNext(payload + sizeof(uint32_t),
+                                  payloadLength - sizeof(uint32_t), &offset)) != NULL) {
+        if (entry->Command == VUSB_CMD_URB_COMPLETE) {
+            VusbServerHandleUrbComplete(ctx, client, entry, (PUCHAR)(entry + 1), entry->Length);
         }
     }
 }
 
+/**
+ * VusbServerHandleFragment - Collect a fragment received into the frame buffer
+ */
+void VusbServerHandleFragment(
+    PVUSB_SERVER_CONTEXT ctx,
+    PVUSB_CLIENT_CONNECTION client,
+    PVUSB_HEADER header,
+    PUCHAR payload,
+    ULONG payloadLength)
+{
+    PVUSB_REASSEMBLY reassembly = &client->Reassembly;
+    VUSB_URB_FRAGMENT fragment;
+    int dataLength;
+
+    if (payloadLength < VUSB_FRAGMENT_FIELDS_SIZE) {
+        return;
+    }
+
+    fragment.Header = *header;
+    memcpy(&fragment.TotalLength, payload, VUSB_FRAGMENT_FIELDS_SIZE);
+
+    dataLength = VusbFragmentCheck(reassembly, &fragment);
+    if (dataLength < 0) {
+        /* Drop the partial message */
+        fprintf(stderr, "Out-of-order fragment from %s\n", client->AddressString);
+        free(reassembly->Buffer);
+        memset(reassembly, 0, sizeof(VUSB_REASSEMBLY));
+        return;
+    }
+
+    if (header->Command == VUSB_CMD_URB_FRAGMENT &&
+        VusbStartReassembly(reassembly, fragment.TotalLength) != 0) {
+        return;
+    }
+
+    memcpy(reassembly->Buffer + fragment.Offset,
+           payload + VUSB_FRAGMENT_FIELDS_SIZE, dataLength);
+    reassembly->Received += (ULONG)dataLength;
+
+    VusbFinishReassembly(ctx, client);
+}
+
 /**
  * VusbServerHandleDeviceList - Handle device list request
  */
@@ -608,6 +1531,7 @@ void VusbServerHandleDeviceList(
     VUSB_DEVICE_LIST deviceList;
     DWORD bytesReturned;
     VUSB_DEVICE_LIST_RESPONSE response;
+    WSABUF buffers[1 + VUSB_MAX_DEVICES];
     size_t responseSize;
 
     memset(&deviceList, 0, sizeof(deviceList));
@@ -630,6 +1554,10 @@ void VusbServerHandleDeviceList(
         }
     }
 
+    if (deviceList.DeviceCount > VUSB_MAX_DEVICES) {
+        deviceList.DeviceCount = VUSB_MAX_DEVICES;
+    }
+
     /* Build response */
     responseSize = sizeof(VUSB_HEADER) + sizeof(UINT32) * 2 + 
                    deviceList.DeviceCount * sizeof(VUSB_DEVICE_INFO);
@@ -639,14 +1567,14 @@ void VusbServerHandleDeviceList(
     response.Status = VUSB_STATUS_SUCCESS;
     response.DeviceCount = deviceList.DeviceCount;
 
-    /* Send header and count */
-    send(client->Socket, (char*)&response, sizeof(response), 0);
-
-    /* Send device info for each device */
+    /* Header and count, then each device's info, as one message */
+    buffers[0].buf = (char*)&response;
+    buffers[0].len = sizeof(response);
     for (ULONG i = 0; i < deviceList.DeviceCount; i++) {
-        send(client->Socket, (char*)&deviceList.Devices[i].DeviceInfo, 
-             sizeof(VUSB_DEVICE_INFO), 0);
+        buffers[1 + i].buf = (char*)&deviceList.Devices[i].DeviceInfo;
+        buffers[1 + i].len = sizeof(VUSB_DEVICE_INFO);
     }
+    VusbServerSendVectored(client, buffers, 1 + deviceList.DeviceCount);
 }
 
 /**
@@ -705,6 +1633,12 @@ int VusbServerPluginDevice(
 
     if (result && response.Status == VUSB_STATUS_SUCCESS) {
         *deviceId = response.DeviceId;
+
+        /* Enumeration is answered from the attach descriptors */
+        if (ctx->UrbForwarder) {
+            ServerUrbSeedDevice(ctx->UrbForwarder, response.DeviceId, descriptors,
+                                descriptorLength);
+        }
         return 0;
     }
 
@@ -732,6 +1666,11 @@ int VusbServerUnplugDevice(PVUSB_SERVER_CONTEXT ctx, ULONG deviceId)
         return -1;
     }
 
+    /* The driver may hand the ID to another device */
+    if (ctx->UrbForwarder) {
+        ServerUrbForgetDevice(ctx->UrbForwarder, deviceId);
+    }
+
     request.DeviceId = deviceId;
 
     DeviceIoControl(ctx->DriverHandle, IOCTL_VUSB_UNPLUG_DEVICE,
@@ -740,6 +1679,35 @@ int VusbServerUnplugDevice(PVUSB_SERVER_CONTEXT ctx, ULONG deviceId)
     return 0;
 }
 
+/**
+ * VusbServerResetDevice - Return a device to its default state via driver IOCTL
+ *
+ * Status and configuration answers cached before the reset no longer hold.
+ */
+int VusbServerResetDevice(PVUSB_SERVER_CONTEXT ctx, ULONG deviceId)
+{
+    VUSB_UNPLUG_REQUEST request;
+    DWORD bytesReturned;
+
+    if (ctx->UrbForwarder) {
+        ServerUrbResetDevice(ctx->UrbForwarder, deviceId);
+    }
+
+    if (ctx->DriverHandle == INVALID_HANDLE_VALUE) {
+        printf("[SIM] Reset device ID %u\n", deviceId);
+        return 0;
+    }
+
+    request.DeviceId = deviceId;
+
+    if (!DeviceIoControl(ctx->DriverHandle, IOCTL_VUSB_RESET_DEVICE,
+                         &request, sizeof(request), NULL, 0, &bytesReturned, NULL)) {
+        return -1;
+    }
+
+    return 0;
+}
+
 /**
  * VusbServerSendPong - Send pong response
  */
@@ -747,7 +1715,7 @@ void VusbServerSendPong(PVUSB_CLIENT_CONNECTION client, ULONG sequence)
 {
     VUSB_HEADER response;
     VusbInitHeader(&response, VUSB_CMD_PONG, 0, sequence);
-    send(client->Socket, (char*)&response, sizeof(response), 0);
+    VusbServerSend(client, &response, sizeof(response));
 }
 
 /**
@@ -764,7 +1732,7 @@ void VusbServerSendError(PVUSB_CLIENT_CONNECTION client, ULONG sequence,
     response.OriginalSequence = sequence;
     strncpy_s(response.ErrorMessage, sizeof(response.ErrorMessage), message, _TRUNCATE);
 
-    send(client->Socket, (char*)&response, sizeof(response), 0);
+    VusbServerSend(client, &response, sizeof(response));
 }
 
 /**
@@ -786,13 +1754,38 @@ void VusbServerCleanup(PVUSB_SERVER_CONTEXT ctx)
         if (ctx->Clients[i]) {
             ctx->Clients[i]->Connected = FALSE;
             closesocket(ctx->Clients[i]->Socket);
+            if (ctx->Clients[i]->Parked) {
+                SetEvent(ctx->Clients[i]->ResumedEvent);
+            }
         }
     }
     LeaveCriticalSection(&ctx->ClientLock);
 
+    /* Wakes the shared memory client's thread */
+    if (ctx->ShmThread) {
+        VusbShmShutdown(&ctx->Shm);
+    }
+
     /* Wait for client threads to finish */
     Sleep(1000);
 
+    if (ctx->ShmThread) {
+        WaitForSingleObject(ctx->ShmThread, 2000);
+        CloseHandle(ctx->ShmThread);
+        ctx->ShmThread = NULL;
+        VusbShmClose(&ctx->Shm);
+    }
+
+    /* Completions already received still reach the driver */
+    VusbWorkersStop(&ctx->Workers);
+
+    /* Workers retire completions through the forwarder, so it goes last */
+    if (ctx->UrbForwarder) {
+        ServerUrbStop(ctx->UrbForwarder);
+        free(ctx->UrbForwarder);
+        ctx->UrbForwarder = NULL;
+    }
+
     /* Close driver handle */
     if (ctx->DriverHandle != INVALID_HANDLE_VALUE) {
         CloseHandle(ctx->DriverHandle);
@@ -809,5 +1802,16 @@ void VusbServerCleanup(PVUSB_SERVER_CONTEXT ctx)
 
     WSACleanup();
 
+    printf("Received %llu messages with %llu recv() calls\n",
+           ctx->MessagesReceived, ctx->RecvCalls);
+    printf("Buffer pool made %u heap allocations\n",
+           VusbBufferPoolHeapAllocs(&ctx->BufferPool));
+
+    VusbBufferPoolDestroy(&ctx->BufferPool);
+
+    printf("Descriptor bundles: %u known, %u attaches by hash, %u sent in full\n",
+           ctx->Bundles.Count, ctx->Bundles.Hits, ctx->Bundles.Misses);
+    VusbBundleStoreDestroy(&ctx->Bundles);
+
     printf("Server cleanup complete.\n");
 }
@@ -10,17 +10,54 @@
 #include <windows.h>
 #include "../protocol/vusb_protocol.h"
 #include "../protocol/vusb_ioctl.h"
+#include "../protocol/vusb_pool.h"
+#include "../protocol/vusb_bundle.h"
+#include "../protocol/vusb_coalesce.h"
+#include "../protocol/vusb_report.h"
+#include "../protocol/vusb_shm.h"
+#include "../protocol/vusb_workers.h"
 
 #define VUSB_SERVER_MAX_CLIENTS 32
 
+/* How long a dropped session keeps its devices, by default */
+#define VUSB_SERVER_RESUME_GRACE_MS 5000
+
+/* Most a client is sent before completing anything, by default */
+#define VUSB_SERVER_URB_CREDITS     128
+#define VUSB_SERVER_BYTE_CREDITS    (8 * 1024 * 1024)
+#define VUSB_SERVER_ENDPOINT_CREDITS 16
+
+/* Protocol features this server offers to clients */
+#define VUSB_SERVER_CAPABILITIES    (VUSB_CAP_URB_BATCH | VUSB_CAP_SEGMENTED | \
+                                     VUSB_CAP_DESC_BUNDLE | VUSB_CAP_SESSION_RESUME | \
+                                     VUSB_CAP_CREDITS | VUSB_CAP_COMPRESSION | \
+                                     VUSB_CAP_REPORT_DELTA)
+
 /* Forward declarations */
 typedef struct _VUSB_SERVER_CONTEXT VUSB_SERVER_CONTEXT, *PVUSB_SERVER_CONTEXT;
 typedef struct _VUSB_CLIENT_CONNECTION VUSB_CLIENT_CONNECTION, *PVUSB_CLIENT_CONNECTION;
+struct _SERVER_URB_CONTEXT;
+
+/* Client receive path */
+typedef enum _VUSB_SERVER_IO_ENGINE {
+    VUSB_SERVER_IO_BLOCKING = 0,    /* Header and payload read separately */
+    VUSB_SERVER_IO_BATCHED,         /* One read drains every queued message */
+} VUSB_SERVER_IO_ENGINE;
 
 /* Server configuration */
 typedef struct _VUSB_SERVER_CONFIG {
     USHORT  Port;
     int     MaxClients;
+    VUSB_SERVER_IO_ENGINE IoEngine;
+    char    BundleDirectory[MAX_PATH];  /* Descriptor bundles on disk, empty = memory only */
+    ULONG   ResumeGraceMs;              /* Dropped sessions kept this long, 0 = never */
+    ULONG   UrbCredits;                 /* Flow control windows offered, 0 = no limit */
+    ULONG   ByteCredits;
+    ULONG   CoalesceBytes;              /* Bulk SUBMITs held for one send, 0 = off */
+    ULONG   CoalesceUs;
+    BOOL    Compression;                /* Offer compressed bulk payloads */
+    char    ShmName[VUSB_SHM_NAME_MAX]; /* Shared memory for a local client, empty = off */
+    int     Workers;                    /* URB completion workers, 0 = on the receive thread */
 } VUSB_SERVER_CONFIG, *PVUSB_SERVER_CONFIG;
 
 /* Device tracking for a client */
@@ -33,13 +70,29 @@ typedef struct _VUSB_CLIENT_DEVICE {
 /* Client connection */
 typedef struct _VUSB_CLIENT_CONNECTION {
     SOCKET                  Socket;
+    PVUSB_SHM_CHANNEL       Shm;            /* Local client's transport instead, or NULL */
+    CRITICAL_SECTION        SendLock;       /* One message at a time: the client thread
+                                             * and the forwarder both send */
     HANDLE                  Thread;
     PVUSB_SERVER_CONTEXT    ServerContext;
     ULONG                   SessionId;
     BOOL                    Connected;
+    ULONG                   Capabilities;   /* Negotiated VUSB_CAP_* flags */
+    UCHAR                   ResumeToken[VUSB_RESUME_TOKEN_SIZE];
+    BOOL                    Parked;         /* Connection lost, devices kept for a resume */
+    BOOL                    Leaving;        /* Client said DISCONNECT, nothing to keep */
+    HANDLE                  ResumedEvent;   /* Set when a resume takes the devices */
+    ULONG                   UrbCredits;     /* Negotiated windows, 0 = no limit */
+    ULONG                   ByteCredits;
+    ULONG                   EndpointCredits;
+    ULONG                   UrbsInFlight;   /* Charged against them, under the */
+    ULONG                   BytesInFlight;  /* forwarder's PendingLock */
+    VUSB_COALESCE           Coalesce;       /* Forwarder thread sends to it */
+    VUSB_REPORT_TABLE       Reports;        /* Receive thread rebuilds reports with it */
     struct sockaddr_in      Address;
     char                    AddressString[INET_ADDRSTRLEN];
     VUSB_CLIENT_DEVICE      Devices[VUSB_MAX_DEVICES];
+    VUSB_REASSEMBLY         Reassembly;     /* Segmented message being received */
 } VUSB_CLIENT_CONNECTION, *PVUSB_CLIENT_CONNECTION;
 
 /* Simulated device entry (when driver not available) */
@@ -56,6 +109,10 @@ typedef struct _VUSB_SERVER_CONTEXT {
     SOCKET                  ListenSocket;
     HANDLE                  DriverHandle;
     
+    /* Shared memory a local client attaches to, served by its own thread */
+    VUSB_SHM_CHANNEL        Shm;
+    HANDLE                  ShmThread;
+    
     /* Client management */
     CRITICAL_SECTION        ClientLock;
     int                     ClientCount;
@@ -65,6 +122,22 @@ typedef struct _VUSB_SERVER_CONTEXT {
     /* Simulation mode device tracking */
     ULONG                   NextSimDeviceId;
     VUSB_SIM_DEVICE         SimDevices[VUSB_MAX_DEVICES];
+    
+    /* Message and IOCTL buffers, shared by client and forwarder threads */
+    VUSB_BUFFER_POOL        BufferPool;
+    
+    /* Descriptor blobs seen in attach requests, by hash */
+    VUSB_BUNDLE_STORE       Bundles;
+    
+    /* Complete URBs to the driver, by device, off the receive threads */
+    VUSB_WORKER_POOL        Workers;
+    
+    /* URB forwarder, if one runs; replays URBs to resumed sessions */
+    struct _SERVER_URB_CONTEXT* UrbForwarder;
+    
+    /* Receive path statistics */
+    ULONGLONG               MessagesReceived;
+    ULONGLONG               RecvCalls;
 } VUSB_SERVER_CONTEXT, *PVUSB_SERVER_CONTEXT;
 
 /* Server functions */
@@ -80,6 +153,8 @@ PVUSB_CLIENT_CONNECTION VusbServerAcceptClient(
     struct sockaddr_in* addr);
 void VusbServerDisconnectClient(PVUSB_SERVER_CONTEXT ctx, PVUSB_CLIENT_CONNECTION client);
 DWORD WINAPI VusbClientThread(LPVOID param);
+int VusbServerSend(PVUSB_CLIENT_CONNECTION client, const void* data, ULONG length);
+int VusbServerSendVectored(PVUSB_CLIENT_CONNECTION client, WSABUF* buffers, DWORD count);
 
 /* Message processing */
 void VusbServerProcessMessage(
@@ -104,6 +179,20 @@ void VusbServerHandleDeviceAttach(
     PUCHAR payload,
     ULONG payloadLength);
 
+void VusbServerHandleDeviceAttachHash(
+    PVUSB_SERVER_CONTEXT ctx,
+    PVUSB_CLIENT_CONNECTION client,
+    PVUSB_HEADER header,
+    PUCHAR payload,
+    ULONG payloadLength);
+
+void VusbServerHandleSessionResume(
+    PVUSB_SERVER_CONTEXT ctx,
+    PVUSB_CLIENT_CONNECTION client,
+    PVUSB_HEADER header,
+    PUCHAR payload,
+    ULONG payloadLength);
+
 void VusbServerHandleDeviceDetach(
     PVUSB_SERVER_CONTEXT ctx,
     PVUSB_CLIENT_CONNECTION client,
@@ -111,6 +200,13 @@ void VusbServerHandleDeviceDetach(
     PUCHAR payload,
     ULONG payloadLength);
 
+void VusbServerHandleDeviceReset(
+    PVUSB_SERVER_CONTEXT ctx,
+    PVUSB_CLIENT_CONNECTION client,
+    PVUSB_HEADER header,
+    PUCHAR payload,
+    ULONG payloadLength);
+
 void VusbServerHandleUrbComplete(
     PVUSB_SERVER_CONTEXT ctx,
     PVUSB_CLIENT_CONNECTION client,
@@ -118,6 +214,20 @@ void VusbServerHandleUrbComplete(
     PUCHAR payload,
     ULONG payloadLength);
 
+void VusbServerHandleUrbCompleteBatch(
+    PVUSB_SERVER_CONTEXT ctx,
+    PVUSB_CLIENT_CONNECTION client,
+    PVUSB_HEADER header,
+    PUCHAR payload,
+    ULONG payloadLength);
+
+void VusbServerHandleFragment(
+    PVUSB_SERVER_CONTEXT ctx,
+    PVUSB_CLIENT_CONNECTION client,
+    PVUSB_HEADER header,
+    PUCHAR payload,
+    ULONG payloadLength);
+
 void VusbServerHandleDeviceList(
     PVUSB_SERVER_CONTEXT ctx,
     PVUSB_CLIENT_CONNECTION client,
@@ -132,6 +242,7 @@ int VusbServerPluginDevice(
     PULONG deviceId);
 
 int VusbServerUnplugDevice(PVUSB_SERVER_CONTEXT ctx, ULONG deviceId);
+int VusbServerResetDevice(PVUSB_SERVER_CONTEXT ctx, ULONG deviceId);
 
 /* Utility */
 void VusbServerSendPong(PVUSB_CLIENT_CONNECTION client, ULONG sequence);
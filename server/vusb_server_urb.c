@@ -15,8 +15,53 @@
 
 /* Forward declarations */
 static DWORD WINAPI UrbForwarderThread(LPVOID param);
-static PSERVER_PENDING_URB AllocPendingUrb(void);
-static void FreePendingUrb(PSERVER_PENDING_URB urb);
+static PSERVER_PENDING_URB AllocPendingUrb(PSERVER_URB_CONTEXT ctx);
+static void FreePendingUrb(PSERVER_URB_CONTEXT ctx, PSERVER_PENDING_URB urb);
+static PSERVER_URB_DEVICE GetUrbDevice(PSERVER_URB_CONTEXT ctx, uint32_t deviceId, BOOL create);
+static PSERVER_PENDING_URB TakePendingUrb(PSERVER_URB_CONTEXT ctx, uint32_t deviceId,
+                                          uint32_t urbId);
+static void ReleasePendingUrb(PSERVER_URB_CONTEXT ctx, PSERVER_URB_DEVICE device,
+                              PSERVER_PENDING_URB urb);
+static BOOL HasCredit(struct _VUSB_CLIENT_CONNECTION* client, PSERVER_ENDPOINT_QUEUE queue,
+                      PSERVER_PENDING_URB urb);
+static void ChargeCredit(struct _VUSB_CLIENT_CONNECTION* client, PSERVER_PENDING_URB urb);
+static void ReturnCredit(PSERVER_PENDING_URB urb);
+static void DispatchWaiting(PSERVER_URB_CONTEXT ctx);
+static void ReleaseDeparting(PSERVER_URB_CONTEXT ctx);
+static void ReplayUrbs(PSERVER_URB_CONTEXT ctx);
+static void ReturnRequests(PSERVER_URB_CONTEXT ctx, struct _VUSB_CLIENT_CONNECTION* client,
+                           uint32_t deviceId, PVUSB_PENDING_URB* requests, uint32_t count);
+static void ExpireUrbs(PSERVER_URB_CONTEXT ctx);
+static void SendCancel(PSERVER_URB_CONTEXT ctx, PSERVER_PENDING_URB urb);
+static void CompleteToDriver(PSERVER_URB_CONTEXT ctx, uint32_t deviceId, uint32_t urbId,
+                             uint32_t sequence, uint32_t status);
+static int SendSubmit(PSERVER_URB_CONTEXT ctx, struct _VUSB_CLIENT_CONNECTION* client,
+                      PVUSB_PENDING_URB pendingUrb, size_t sendSize, uint8_t flags);
+static PSERVER_URB_BATCH GetBatch(PSERVER_URB_CONTEXT ctx,
+                                  struct _VUSB_CLIENT_CONNECTION* client, uint32_t size);
+static int SendBatch(PSERVER_URB_BATCH batch, VUSB_FLUSH_REASON reason);
+static void FlushBatches(PSERVER_URB_CONTEXT ctx, BOOL drained);
+static DWORD BatchWaitMs(PSERVER_URB_CONTEXT ctx);
+static int SendSegmented(PVUSB_CLIENT_CONNECTION client, const void* head, uint32_t headLength,
+                         const uint8_t* data, uint32_t dataLength, uint32_t sequence);
+static void FailUrb(PSERVER_URB_CONTEXT ctx, PVUSB_PENDING_URB pendingUrb, uint32_t status);
+static BOOL GrowForwarderBuffer(uint8_t** buffer, DWORD* bufferSize);
+static PSERVER_CONTROL_CACHE GetControlCache(PSERVER_URB_CONTEXT ctx, uint32_t deviceId,
+                                             BOOL create);
+static BOOL AnswerFromCache(PSERVER_URB_CONTEXT ctx, PVUSB_PENDING_URB pendingUrb);
+static void TrackControlRequest(PSERVER_URB_CONTEXT ctx, PSERVER_PENDING_URB tracking);
+static void LearnResponse(PSERVER_URB_CONTEXT ctx, PSERVER_PENDING_URB urb,
+                          uint32_t actualLength, const uint8_t* data);
+static void CacheStore(PSERVER_URB_CONTEXT ctx, PSERVER_CONTROL_CACHE cache,
+                       const VUSB_SETUP_PACKET* setup, const uint8_t* data,
+                       uint32_t length, BOOL complete, BOOL seeded);
+static void CacheDrop(PSERVER_URB_CONTEXT ctx, PSERVER_CONTROL_CACHE cache, uint32_t what);
+
+/* What a cache invalidation drops */
+#define CACHE_DROP_STATE    0x1     /* GET_STATUS and GET_CONFIGURATION answers */
+#define CACHE_DROP_LEARNED  0x2     /* Descriptors learned from completions */
+#define CACHE_DROP_SEEDED   0x4     /* Descriptors from the attach request */
+#define CACHE_DROP_ALL      0x7
 
 /**
  * ServerUrbInit - Initialize URB forwarder
@@ -32,6 +77,21 @@ int ServerUrbInit(PSERVER_URB_CONTEXT ctx, PVUSB_SERVER_CONTEXT serverCtx,
     ctx->Running = FALSE;
     
     InitializeCriticalSection(&ctx->PendingLock);
+    VusbPoolInit(&ctx->PendingPool, sizeof(SERVER_PENDING_URB), SERVER_URB_POOL_SLAB);
+    VusbTimerWheelInit(&ctx->Timers, GetTickCount64());
+    
+    InitializeCriticalSection(&ctx->DepartLock);
+    
+    ctx->DispatchEvent = CreateEvent(NULL, FALSE, FALSE, NULL);
+    ctx->DepartedEvent = CreateEvent(NULL, FALSE, FALSE, NULL);
+    if (!ctx->DispatchEvent || !ctx->DepartedEvent) {
+        if (ctx->DispatchEvent) CloseHandle(ctx->DispatchEvent);
+        if (ctx->DepartedEvent) CloseHandle(ctx->DepartedEvent);
+        VusbPoolDestroy(&ctx->PendingPool);
+        DeleteCriticalSection(&ctx->DepartLock);
+        DeleteCriticalSection(&ctx->PendingLock);
+        return -1;
+    }
     
     return 0;
 }
@@ -75,18 +135,59 @@ void ServerUrbStop(PSERVER_URB_CONTEXT ctx)
         ctx->ForwarderThread = NULL;
     }
     
+    for (int i = 0; i < SERVER_URB_MAX_BATCHES; i++) {
+        free(ctx->Batches[i].Buffer);
+        ctx->Batches[i].Buffer = NULL;
+    }
+    
     /* Free pending URBs */
     EnterCriticalSection(&ctx->PendingLock);
-    while (ctx->PendingList) {
-        PSERVER_PENDING_URB next = ctx->PendingList->Next;
-        FreePendingUrb(ctx->PendingList);
-        ctx->PendingList = next;
+    for (int i = 0; i < SERVER_URB_MAX_DEVICES; i++) {
+        for (int j = 0; j < VUSB_ENDPOINT_QUEUES; j++) {
+            PSERVER_ENDPOINT_QUEUE queue = &ctx->Devices[i].Endpoints[j];
+            
+            while (queue->Head) {
+                PSERVER_PENDING_URB next = queue->Head->Next;
+                FreePendingUrb(ctx, queue->Head);
+                queue->Head = next;
+            }
+            while (queue->WaitHead) {
+                PSERVER_PENDING_URB next = queue->WaitHead->Next;
+                FreePendingUrb(ctx, queue->WaitHead);
+                queue->WaitHead = next;
+            }
+        }
+    }
+    memset(ctx->Devices, 0, sizeof(ctx->Devices));
+    ctx->PendingCount = 0;
+    ctx->WaitingCount = 0;
+    
+    for (int i = 0; i < SERVER_URB_MAX_DEVICES; i++) {
+        CacheDrop(ctx, &ctx->Caches[i], CACHE_DROP_ALL);
+        ctx->Caches[i].DeviceId = 0;
     }
     LeaveCriticalSection(&ctx->PendingLock);
     
     DeleteCriticalSection(&ctx->PendingLock);
+    DeleteCriticalSection(&ctx->DepartLock);
+    
+    if (ctx->DispatchEvent) {
+        CloseHandle(ctx->DispatchEvent);
+        ctx->DispatchEvent = NULL;
+    }
+    if (ctx->DepartedEvent) {
+        CloseHandle(ctx->DepartedEvent);
+        ctx->DepartedEvent = NULL;
+    }
     
-    printf("[URB Forwarder] Stopped\n");
+    printf("[URB Forwarder] Stopped, %ld tracking slab allocations, %llu cached control responses\n",
+           ctx->PendingPool.SlabAllocs, ctx->CacheHits);
+    if (ctx->Compression.Tried > 0) {
+        printf("[URB Forwarder] Compressed %llu of %llu bulk OUT payloads, %llu bytes to %llu\n",
+               ctx->Compression.Kept, ctx->Compression.Tried,
+               ctx->Compression.RawBytes, ctx->Compression.PackedBytes);
+    }
+    VusbPoolDestroy(&ctx->PendingPool);
 }
 
 /**
@@ -96,38 +197,88 @@ static DWORD WINAPI UrbForwarderThread(LPVOID param)
 {
     PSERVER_URB_CONTEXT ctx = (PSERVER_URB_CONTEXT)param;
     uint8_t* buffer;
+    DWORD bufferSize = VUSB_MAX_PACKET_SIZE;
     DWORD bytesReturned;
     OVERLAPPED overlapped = {0};
+    HANDLE events[2];
     
     printf("[URB Forwarder] Thread started\n");
     
-    buffer = (uint8_t*)malloc(VUSB_MAX_PACKET_SIZE);
+    buffer = (uint8_t*)malloc(bufferSize);
     if (!buffer) {
         return 1;
     }
     
     overlapped.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+    events[0] = overlapped.hEvent;
+    events[1] = ctx->DispatchEvent;
     
     while (ctx->Running) {
+        /* Client pointers from the last pass are no longer in use */
+        ReleaseDeparting(ctx);
+        
+        /* Send batches held past their time budget while URBs keep coming */
+        FlushBatches(ctx, FALSE);
+        
+        /* Re-send what resumed sessions lost, ahead of anything newer */
+        if (InterlockedExchange(&ctx->ReplayPending, 0)) {
+            ReplayUrbs(ctx);
+        }
+        
+        /* Release held-back URBs that completions or resumes made room for */
+        if (InterlockedExchange(&ctx->DispatchPending, 0)) {
+            DispatchWaiting(ctx);
+        }
+        ExpireUrbs(ctx);
+        
         /* Request pending URB from driver */
         BOOL result = DeviceIoControl(
             ctx->DriverHandle,
             IOCTL_VUSB_GET_PENDING_URB,
             NULL, 0,
-            buffer, VUSB_MAX_PACKET_SIZE,
+            buffer, bufferSize,
             &bytesReturned,
             &overlapped
         );
         
         if (!result) {
             DWORD error = GetLastError();
+            if (error == ERROR_INSUFFICIENT_BUFFER &&
+                GrowForwarderBuffer(&buffer, &bufferSize)) {
+                continue;
+            }
             if (error == ERROR_IO_PENDING) {
-                /* Wait for URB with timeout */
-                DWORD waitResult = WaitForSingleObject(overlapped.hEvent, 100);
+                /* Driver queue drained - push out batches not worth holding */
+                FlushBatches(ctx, TRUE);
+                
+                /* Wait for URB with timeout, sending held-back URBs and batches meanwhile */
+                DWORD waitResult;
+                for (;;) {
+                    DWORD waitMs = BatchWaitMs(ctx);
+                    
+                    waitResult = WaitForMultipleObjects(2, events, FALSE, waitMs < 100 ? waitMs : 100);
+                    if (waitResult == WAIT_OBJECT_0 + 1) {
+                        ReleaseDeparting(ctx);
+                        if (InterlockedExchange(&ctx->ReplayPending, 0)) {
+                            ReplayUrbs(ctx);
+                        }
+                        InterlockedExchange(&ctx->DispatchPending, 0);
+                        DispatchWaiting(ctx);
+                        FlushBatches(ctx, TRUE);
+                    } else if (waitResult == WAIT_TIMEOUT && waitMs < 100) {
+                        /* A held batch ran out of time */
+                        FlushBatches(ctx, FALSE);
+                    } else {
+                        break;
+                    }
+                }
                 
                 if (waitResult == WAIT_OBJECT_0) {
                     if (!GetOverlappedResult(ctx->DriverHandle, &overlapped, 
                                              &bytesReturned, FALSE)) {
+                        if (GetLastError() == ERROR_INSUFFICIENT_BUFFER) {
+                            GrowForwarderBuffer(&buffer, &bufferSize);
+                        }
                         ResetEvent(overlapped.hEvent);
                         continue;
                     }
@@ -139,6 +290,7 @@ static DWORD WINAPI UrbForwarderThread(LPVOID param)
                 }
             } else {
                 /* Error */
+                ServerUrbFlush(ctx);
                 Sleep(100);
                 continue;
             }
@@ -152,6 +304,7 @@ static DWORD WINAPI UrbForwarderThread(LPVOID param)
         }
     }
     
+    ReleaseDeparting(ctx);
     CloseHandle(overlapped.hEvent);
     free(buffer);
     
@@ -161,15 +314,23 @@ static DWORD WINAPI UrbForwarderThread(LPVOID param)
 
 /**
  * ServerUrbForward - Forward URB to appropriate client
+ *
+ * URBs are queued per device endpoint, and sent while the client has
+ * credit for them (see HasCredit); the rest are held back until
+ * completions return credit. Bulk endpoints keep at most
+ * SERVER_URB_BULK_DEPTH URBs at the client, so a busy bulk endpoint cannot
+ * fill the connection ahead of other endpoints. Every endpoint holds its
+ * URBs back while the client is parked awaiting a resume, and until URBs
+ * sent before the resume have been replayed.
  */
 int ServerUrbForward(PSERVER_URB_CONTEXT ctx, PVUSB_PENDING_URB pendingUrb)
 {
-    PVUSB_SERVER_CONTEXT serverCtx = ctx->ServerContext;
     PVUSB_CLIENT_CONNECTION client;
-    uint8_t* sendBuffer;
+    PSERVER_PENDING_URB tracking;
+    PSERVER_URB_DEVICE device;
+    PSERVER_ENDPOINT_QUEUE queue;
     size_t sendSize;
-    VUSB_URB_SUBMIT* submit;
-    int result;
+    BOOL hold;
     
     printf("[URB Forward] URB %u for device %u, EP=0x%02X, Type=%d, Len=%u\n",
            pendingUrb->UrbId, pendingUrb->DeviceId, pendingUrb->EndpointAddress,
@@ -180,17 +341,7 @@ int ServerUrbForward(PSERVER_URB_CONTEXT ctx, PVUSB_PENDING_URB pendingUrb)
     if (!client) {
         printf("[URB Forward] No client for device %u\n", pendingUrb->DeviceId);
         
-        /* Complete URB with error */
-        VUSB_URB_COMPLETION completion = {0};
-        completion.DeviceId = pendingUrb->DeviceId;
-        completion.UrbId = pendingUrb->UrbId;
-        completion.SequenceNumber = pendingUrb->SequenceNumber;
-        completion.Status = VUSB_STATUS_NO_DEVICE;
-        completion.ActualLength = 0;
-        
-        DWORD bytesReturned;
-        DeviceIoControl(ctx->DriverHandle, IOCTL_VUSB_COMPLETE_URB,
-                       &completion, sizeof(completion), NULL, 0, &bytesReturned, NULL);
+        FailUrb(ctx, pendingUrb, VUSB_STATUS_NO_DEVICE);
         return -1;
     }
     
@@ -200,10 +351,157 @@ int ServerUrbForward(PSERVER_URB_CONTEXT ctx, PVUSB_PENDING_URB pendingUrb)
         sendSize += pendingUrb->TransferBufferLength;
     }
     
-    sendBuffer = (uint8_t*)malloc(sendSize);
-    if (!sendBuffer) return -1;
+    /* Anything over one frame needs a client that reassembles segments */
+    if (sendSize > VUSB_MAX_PACKET_SIZE && !(client->Capabilities & VUSB_CAP_SEGMENTED)) {
+        printf("[URB Forward] URB %u too large for client %s\n",
+               pendingUrb->UrbId, client->AddressString);
+        FailUrb(ctx, pendingUrb, VUSB_STATUS_NOT_SUPPORTED);
+        return -1;
+    }
+    
+    /* Deterministic control requests are answered without a round trip */
+    if (pendingUrb->TransferType == VUSB_TRANSFER_CONTROL && AnswerFromCache(ctx, pendingUrb)) {
+        return 0;
+    }
+    
+    /* Track pending URB */
+    tracking = AllocPendingUrb(ctx);
+    if (!tracking) {
+        FailUrb(ctx, pendingUrb, VUSB_STATUS_NO_MEMORY);
+        return -1;
+    }
+    tracking->UrbId = pendingUrb->UrbId;
+    tracking->DeviceId = pendingUrb->DeviceId;
+    tracking->Length = pendingUrb->TransferBufferLength;
+    tracking->EndpointAddress = pendingUrb->EndpointAddress;
+    tracking->TransferType = pendingUrb->TransferType;
+    tracking->Timeout = pendingUrb->Timeout;
+    memcpy(&tracking->SetupPacket, &pendingUrb->SetupPacket, sizeof(VUSB_SETUP_PACKET));
+    QueryPerformanceCounter(&tracking->SubmitTime);
+    
+    EnterCriticalSection(&ctx->PendingLock);
+    
+    device = GetUrbDevice(ctx, pendingUrb->DeviceId, TRUE);
+    if (!device) {
+        LeaveCriticalSection(&ctx->PendingLock);
+        FreePendingUrb(ctx, tracking);
+        FailUrb(ctx, pendingUrb, VUSB_STATUS_NO_MEMORY);
+        return -1;
+    }
+    
+    if (pendingUrb->TransferType == VUSB_TRANSFER_CONTROL) {
+        TrackControlRequest(ctx, tracking);
+    }
+    queue = &device->Endpoints[VUSB_ENDPOINT_QUEUE(pendingUrb->EndpointAddress)];
+    
+    /* Once an endpoint holds URBs back, later ones queue behind them */
+    hold = client->Parked || device->Replay || queue->WaitHead ||
+           !HasCredit(client, queue, tracking);
+    
+    /* The driver buffer is reused for the next URB; keep a copy to send it
+     * later, or to send it again if a resumable client's connection drops */
+    if (hold || (client->Capabilities & VUSB_CAP_SESSION_RESUME)) {
+        size_t requestSize = sizeof(VUSB_PENDING_URB) + (sendSize - sizeof(VUSB_URB_SUBMIT));
+        
+        tracking->Request = (PVUSB_PENDING_URB)VusbBufferAlloc(
+            &ctx->ServerContext->BufferPool, requestSize);
+        if (tracking->Request) {
+            memcpy(tracking->Request, pendingUrb, requestSize);
+        } else if (hold) {
+            if (device->PendingCount == 0) {
+                device->DeviceId = 0;
+            }
+            LeaveCriticalSection(&ctx->PendingLock);
+            FreePendingUrb(ctx, tracking);
+            FailUrb(ctx, pendingUrb, VUSB_STATUS_NO_MEMORY);
+            return -1;
+        }
+    }
+    
+    if (hold) {
+        tracking->Waiting = TRUE;
+        if (queue->WaitTail) {
+            queue->WaitTail->Next = tracking;
+        } else {
+            queue->WaitHead = tracking;
+        }
+        queue->WaitTail = tracking;
+        device->WaitingCount++;
+        ctx->WaitingCount++;
+    } else {
+        if (queue->Tail) {
+            queue->Tail->Next = tracking;
+        } else {
+            queue->Head = tracking;
+        }
+        queue->Tail = tracking;
+        queue->Sent++;
+        ChargeCredit(client, tracking);
+    }
+    device->PendingCount++;
+    ctx->PendingCount++;
+    
+    /* Held-back URBs count their timeout from the driver's submission too */
+    if (tracking->Timeout > 0) {
+        VusbTimerArm(&ctx->Timers, &tracking->Timer, GetTickCount64(), tracking->Timeout);
+    }
+    
+    LeaveCriticalSection(&ctx->PendingLock);
+    
+    if (hold) {
+        return 0;
+    }
+    
+    return SendSubmit(ctx, client, pendingUrb, sendSize, 0);
+}
+
+/**
+ * SendSubmit - Send a SUBMIT_URB for a driver request
+ * @sendSize: Message size including OUT data
+ * @flags: VUSB_SUBMIT_* flags
+ *
+ * Control, interrupt and isochronous submits are sent at once, ahead of
+ * bulk submits still collecting in the client's batch. Bulk OUT data is
+ * sent compressed to clients that take it, when it compresses well.
+ */
+static int SendSubmit(PSERVER_URB_CONTEXT ctx, PVUSB_CLIENT_CONNECTION client,
+                      PVUSB_PENDING_URB pendingUrb, size_t sendSize, uint8_t flags)
+{
+    PSERVER_URB_BATCH batch = NULL;
+    VUSB_URB_SUBMIT header;
+    VUSB_URB_SUBMIT* submit;
+    VUSB_FLUSH_REASON reason;
+    WSABUF buffers[2];
+    uint8_t* outData = (uint8_t*)(pendingUrb + 1);
+    uint32_t outLength = (uint32_t)(sendSize - sizeof(VUSB_URB_SUBMIT));
+    uint8_t* packed = NULL;
+    int result = 0;
+    
+    if ((client->Capabilities & VUSB_CAP_COMPRESSION) && outLength >= VUSB_COMPRESS_MIN_LENGTH) {
+        packed = (uint8_t*)VusbBufferAlloc(&ctx->ServerContext->BufferPool, outLength);
+        if (packed) {
+            uint32_t packedLength = VusbCompressPayload(&ctx->Compression, pendingUrb->DeviceId,
+                                                        pendingUrb->EndpointAddress,
+                                                        pendingUrb->TransferType,
+                                                        outData, outLength, packed);
+            if (packedLength > 0) {
+                outData = packed;
+                outLength = packedLength;
+                sendSize = sizeof(VUSB_URB_SUBMIT) + packedLength;
+                flags |= VUSB_SUBMIT_COMPRESSED;
+            }
+        }
+    }
+    
+    /* Batch-capable clients get bulk submits appended to their open batch */
+    if (pendingUrb->TransferType == VUSB_TRANSFER_BULK &&
+        (client->Capabilities & VUSB_CAP_URB_BATCH) &&
+        sendSize <= VUSB_MAX_PACKET_SIZE - sizeof(VUSB_URB_BATCH)) {
+        batch = GetBatch(ctx, client, (uint32_t)sendSize);
+    }
     
-    submit = (VUSB_URB_SUBMIT*)sendBuffer;
+    /* Unbatched submits are gathered from the header and the OUT data */
+    submit = batch ? (VUSB_URB_SUBMIT*)(batch->Buffer + batch->Length) : &header;
     VusbInitHeader(&submit->Header, VUSB_CMD_SUBMIT_URB, 
                    (uint32_t)(sendSize - sizeof(VUSB_HEADER)), pendingUrb->SequenceNumber);
     submit->DeviceId = pendingUrb->DeviceId;
@@ -211,104 +509,184 @@ int ServerUrbForward(PSERVER_URB_CONTEXT ctx, PVUSB_PENDING_URB pendingUrb)
     submit->EndpointAddress = pendingUrb->EndpointAddress;
     submit->TransferType = pendingUrb->TransferType;
     submit->Direction = pendingUrb->Direction;
-    submit->Reserved = 0;
+    submit->Flags = flags;
     submit->TransferFlags = pendingUrb->TransferFlags;
     submit->TransferBufferLength = pendingUrb->TransferBufferLength;
     submit->Interval = pendingUrb->Interval;
     memcpy(&submit->SetupPacket, &pendingUrb->SetupPacket, sizeof(VUSB_SETUP_PACKET));
     
-    /* Copy OUT data if present */
-    if (pendingUrb->Direction == VUSB_DIR_OUT && pendingUrb->TransferBufferLength > 0) {
-        memcpy(sendBuffer + sizeof(VUSB_URB_SUBMIT), 
-               (uint8_t*)(pendingUrb + 1), pendingUrb->TransferBufferLength);
+    if (batch) {
+        /* Copy OUT data into the batch */
+        if (outLength > 0) {
+            memcpy(submit + 1, outData, outLength);
+        }
+        
+        batch->Length += (uint32_t)sendSize;
+        batch->Count++;
+        
+        /*
+         * Sparse bulk traffic is left for the forwarder to send once the
+         * driver queue drains; only a spent budget sends the batch here.
+         */
+        if (VusbCoalesceAdd(&client->Coalesce, pendingUrb->TransferType, (uint32_t)sendSize,
+                            &reason) && reason != VUSB_FLUSH_SPARSE) {
+            result = SendBatch(batch, reason);
+        } else if (batch->Count == VUSB_URB_BATCH_MAX_ENTRIES) {
+            result = SendBatch(batch, VUSB_FLUSH_BYTES);
+        }
+    } else {
+        VusbCoalesceSentAlone(&client->Coalesce, (uint32_t)sendSize);
+        
+        if (sendSize > VUSB_MAX_PACKET_SIZE) {
+            result = SendSegmented(client, submit, sizeof(VUSB_URB_SUBMIT),
+                                   outData, outLength, pendingUrb->SequenceNumber);
+        } else {
+            /* Send to client */
+            buffers[0].buf = (char*)submit;
+            buffers[0].len = sizeof(VUSB_URB_SUBMIT);
+            buffers[1].buf = (char*)outData;
+            buffers[1].len = outLength;
+            
+            result = VusbServerSendVectored(client, buffers, buffers[1].len ? 2 : 1);
+        }
     }
     
-    /* Track pending URB */
-    PSERVER_PENDING_URB tracking = AllocPendingUrb();
-    if (tracking) {
-        tracking->UrbId = pendingUrb->UrbId;
-        tracking->DeviceId = pendingUrb->DeviceId;
-        tracking->Client = client;
-        QueryPerformanceCounter(&tracking->SubmitTime);
-        
-        EnterCriticalSection(&ctx->PendingLock);
-        tracking->Next = ctx->PendingList;
-        ctx->PendingList = tracking;
-        ctx->PendingCount++;
-        LeaveCriticalSection(&ctx->PendingLock);
+    if (packed) {
+        VusbBufferFree(&ctx->ServerContext->BufferPool, packed);
+    }
+    return result;
+}
+
+/**
+ * ServerUrbComplete - Retire a URB the client completed
+ *
+ * Gives the URB's credit back and learns a cacheable response; the caller
+ * completes it to the driver. Safe on any thread.
+ * @return: 0 if the URB was pending, -1 if it already timed out or was
+ *          never forwarded, so the driver must not see it again
+ */
+int ServerUrbComplete(PSERVER_URB_CONTEXT ctx, uint32_t deviceId, uint32_t urbId,
+                      uint32_t status, uint32_t actualLength, uint8_t* data)
+{
+    PSERVER_PENDING_URB curr;
+    
+    curr = TakePendingUrb(ctx, deviceId, urbId);
+    if (!curr) {
+        printf("[URB Complete] URB %u not found in pending queues\n", urbId);
+        return -1;
     }
     
-    /* Send to client */
-    result = send(client->Socket, (char*)sendBuffer, (int)sendSize, 0);
-    free(sendBuffer);
+    printf("[URB Complete] URB %u, status=%u, length=%u\n", urbId, status, actualLength);
+    
+    if (curr->Cacheable && status == VUSB_STATUS_SUCCESS) {
+        LearnResponse(ctx, curr, actualLength, data);
+    }
     
-    return (result == (int)sendSize) ? 0 : -1;
+    FreePendingUrb(ctx, curr);
+    return 0;
 }
 
 /**
- * ServerUrbComplete - Handle URB completion from client
+ * ServerUrbSeedDevice - Seed a device's control-response cache
+ * @descriptors: Descriptor blob from the attach request
+ *
+ * Device, configuration, string, qualifier and BOS descriptors become
+ * GET_DESCRIPTOR answers, so enumeration needs no round trips for them.
  */
-int ServerUrbComplete(PSERVER_URB_CONTEXT ctx, uint32_t urbId, uint32_t status,
-                      uint32_t actualLength, uint8_t* data)
+void ServerUrbSeedDevice(PSERVER_URB_CONTEXT ctx, uint32_t deviceId,
+                         const uint8_t* descriptors, uint32_t length)
 {
-    PSERVER_PENDING_URB prev = NULL;
-    PSERVER_PENDING_URB curr;
-    DWORD bytesReturned;
+    PSERVER_CONTROL_CACHE cache;
+    uint16_t typeCount[256] = {0};
+    uint16_t langId = 0;
+    uint32_t offset;
+    
+    if (!ctx || !descriptors) return;
     
-    /* Find and remove from pending list */
     EnterCriticalSection(&ctx->PendingLock);
     
-    curr = ctx->PendingList;
-    while (curr) {
-        if (curr->UrbId == urbId) {
-            if (prev) {
-                prev->Next = curr->Next;
-            } else {
-                ctx->PendingList = curr->Next;
+    cache = GetControlCache(ctx, deviceId, TRUE);
+    if (!cache) {
+        LeaveCriticalSection(&ctx->PendingLock);
+        return;
+    }
+    
+    /* String 0 lists the languages; other strings are in the first one */
+    for (offset = 0; offset + 2 <= length; offset += descriptors[offset]) {
+        if (descriptors[offset] < 2 || offset + descriptors[offset] > length) break;
+        if (descriptors[offset + 1] == 0x03 && descriptors[offset] >= 4) {
+            langId = (uint16_t)(descriptors[offset + 2] | (descriptors[offset + 3] << 8));
+            break;
+        }
+    }
+    
+    for (offset = 0; offset + 2 <= length; ) {
+        VUSB_SETUP_PACKET setup = {0};
+        uint8_t len = descriptors[offset];
+        uint8_t type = descriptors[offset + 1];
+        uint32_t total = len;
+        
+        if (len < 2 || offset + len > length) break;
+        
+        /* Configuration, other-speed and BOS descriptors carry their children */
+        if ((type == 0x02 || type == 0x07 || type == 0x0F) && len >= 4) {
+            total = descriptors[offset + 2] | (descriptors[offset + 3] << 8);
+            if (total < len || offset + total > length) {
+                total = length - offset;
+            }
+        }
+        
+        switch (type) {
+        case 0x01: case 0x02: case 0x03: case 0x06: case 0x07: case 0x0F:
+            setup.bmRequestType = 0x80;
+            setup.bRequest = 0x06;
+            setup.wValue = (uint16_t)((type << 8) | (typeCount[type] & 0xFF));
+            setup.wIndex = (type == 0x03 && typeCount[type] > 0) ? langId : 0;
+            if (typeCount[type] <= 0xFF && total <= 0xFFFF) {
+                CacheStore(ctx, cache, &setup, &descriptors[offset], total, TRUE, TRUE);
             }
-            ctx->PendingCount--;
             break;
         }
-        prev = curr;
-        curr = curr->Next;
+        typeCount[type]++;
+        offset += len;
     }
     
     LeaveCriticalSection(&ctx->PendingLock);
+}
+
+/**
+ * ServerUrbResetDevice - Forget what a device answered since attach
+ */
+void ServerUrbResetDevice(PSERVER_URB_CONTEXT ctx, uint32_t deviceId)
+{
+    PSERVER_CONTROL_CACHE cache;
     
-    if (!curr) {
-        printf("[URB Complete] URB %u not found in pending list\n", urbId);
-        return -1;
+    if (!ctx) return;
+    
+    EnterCriticalSection(&ctx->PendingLock);
+    cache = GetControlCache(ctx, deviceId, FALSE);
+    if (cache) {
+        CacheDrop(ctx, cache, CACHE_DROP_STATE | CACHE_DROP_LEARNED);
     }
+    LeaveCriticalSection(&ctx->PendingLock);
+}
+
+/**
+ * ServerUrbForgetDevice - Release a detached device's cached responses
+ */
+void ServerUrbForgetDevice(PSERVER_URB_CONTEXT ctx, uint32_t deviceId)
+{
+    PSERVER_CONTROL_CACHE cache;
     
-    printf("[URB Complete] URB %u, status=%u, length=%u\n", urbId, status, actualLength);
+    if (!ctx) return;
     
-    /* Send completion to driver */
-    if (ctx->DriverHandle != INVALID_HANDLE_VALUE) {
-        size_t completionSize = sizeof(VUSB_URB_COMPLETION) + actualLength;
-        uint8_t* completionBuffer = (uint8_t*)malloc(completionSize);
-        
-        if (completionBuffer) {
-            PVUSB_URB_COMPLETION completion = (PVUSB_URB_COMPLETION)completionBuffer;
-            completion->DeviceId = curr->DeviceId;
-            completion->UrbId = urbId;
-            completion->SequenceNumber = 0;
-            completion->Status = status;
-            completion->ActualLength = actualLength;
-            
-            if (data && actualLength > 0) {
-                memcpy(completionBuffer + sizeof(VUSB_URB_COMPLETION), data, actualLength);
-            }
-            
-            DeviceIoControl(ctx->DriverHandle, IOCTL_VUSB_COMPLETE_URB,
-                           completionBuffer, (DWORD)completionSize, 
-                           NULL, 0, &bytesReturned, NULL);
-            
-            free(completionBuffer);
-        }
+    EnterCriticalSection(&ctx->PendingLock);
+    cache = GetControlCache(ctx, deviceId, FALSE);
+    if (cache) {
+        CacheDrop(ctx, cache, CACHE_DROP_ALL);
+        cache->DeviceId = 0;
     }
-    
-    FreePendingUrb(curr);
-    return 0;
+    LeaveCriticalSection(&ctx->PendingLock);
 }
 
 /**
@@ -323,7 +701,7 @@ PVUSB_CLIENT_CONNECTION ServerUrbFindClientForDevice(PSERVER_URB_CONTEXT ctx,
     
     for (int i = 0; i < serverCtx->Config.MaxClients; i++) {
         PVUSB_CLIENT_CONNECTION client = serverCtx->Clients[i];
-        if (client && client->Connected) {
+        if (client && (client->Connected || client->Parked)) {
             for (int j = 0; j < VUSB_MAX_DEVICES; j++) {
                 if (client->Devices[j].Active && client->Devices[j].DeviceId == deviceId) {
                     LeaveCriticalSection(&serverCtx->ClientLock);
@@ -337,13 +715,1143 @@ PVUSB_CLIENT_CONNECTION ServerUrbFindClientForDevice(PSERVER_URB_CONTEXT ctx,
     return NULL;
 }
 
-/* Helper functions */
-static PSERVER_PENDING_URB AllocPendingUrb(void)
+/**
+ * ServerUrbPrepareReplay - Hold a device's URBs for replay after a resume
+ *
+ * Called before the device moves to its new connection; URBs forwarded
+ * from then on wait until ServerUrbStartReplay has re-sent the old ones.
+ * @return: Number of sent URBs that will be replayed
+ */
+uint32_t ServerUrbPrepareReplay(PSERVER_URB_CONTEXT ctx, uint32_t deviceId)
+{
+    PSERVER_URB_DEVICE device;
+    uint32_t count = 0;
+    
+    if (!ctx) return 0;
+    
+    EnterCriticalSection(&ctx->PendingLock);
+    
+    device = GetUrbDevice(ctx, deviceId, FALSE);
+    if (device) {
+        device->Replay = TRUE;
+        for (int i = 0; i < VUSB_ENDPOINT_QUEUES; i++) {
+            for (PSERVER_PENDING_URB urb = device->Endpoints[i].Head; urb; urb = urb->Next) {
+                /* Charged to the new client when replayed */
+                ReturnCredit(urb);
+                if (urb->Request) {
+                    count++;
+                }
+            }
+        }
+    }
+    
+    LeaveCriticalSection(&ctx->PendingLock);
+    return count;
+}
+
+/**
+ * ServerUrbStartReplay - Have the forwarder replay the prepared devices
+ */
+void ServerUrbStartReplay(PSERVER_URB_CONTEXT ctx)
+{
+    if (!ctx || !ctx->DispatchEvent) return;
+    
+    InterlockedExchange(&ctx->ReplayPending, 1);
+    InterlockedExchange(&ctx->DispatchPending, 1);
+    SetEvent(ctx->DispatchEvent);
+}
+
+/**
+ * ServerUrbForgetClient - Stop charging a departing client for its sent URBs
+ *
+ * Called before the connection is freed, once it is out of the server's
+ * client list. The URBs stay pending until they complete, time out or are
+ * failed along with their device. The forwarder looks clients up anew on
+ * every pass, so once it has started another pass it holds no pointer to
+ * this one; that is waited for here, and its open batch is dropped.
+ */
+void ServerUrbForgetClient(PSERVER_URB_CONTEXT ctx, PVUSB_CLIENT_CONNECTION client)
+{
+    if (!ctx || !client) return;
+    
+    EnterCriticalSection(&ctx->PendingLock);
+    
+    for (int i = 0; i < SERVER_URB_MAX_DEVICES; i++) {
+        PSERVER_URB_DEVICE device = &ctx->Devices[i];
+        
+        if (device->DeviceId == 0) {
+            continue;
+        }
+        for (int j = 0; j < VUSB_ENDPOINT_QUEUES; j++) {
+            for (PSERVER_PENDING_URB urb = device->Endpoints[j].Head; urb; urb = urb->Next) {
+                if (urb->Client == client) {
+                    ReturnCredit(urb);
+                }
+            }
+        }
+    }
+    
+    LeaveCriticalSection(&ctx->PendingLock);
+    
+    if (!ctx->ForwarderThread) {
+        return;
+    }
+    
+    EnterCriticalSection(&ctx->DepartLock);
+    ctx->Departing = client;
+    SetEvent(ctx->DispatchEvent);
+    while (ctx->Departing == client && ctx->Running) {
+        WaitForSingleObject(ctx->DepartedEvent, 100);
+    }
+    ctx->Departing = NULL;
+    LeaveCriticalSection(&ctx->DepartLock);
+}
+
+/**
+ * ReleaseDeparting - Let go of a client waiting in ServerUrbForgetClient
+ *
+ * Runs on the forwarder thread between passes. The client's unsent batch
+ * is dropped; its URBs are replayed or failed with their devices.
+ */
+static void ReleaseDeparting(PSERVER_URB_CONTEXT ctx)
+{
+    PVUSB_CLIENT_CONNECTION client = ctx->Departing;
+    
+    if (!client) {
+        return;
+    }
+    
+    for (int i = 0; i < SERVER_URB_MAX_BATCHES; i++) {
+        if (ctx->Batches[i].Client == client) {
+            ctx->Batches[i].Client = NULL;
+            ctx->Batches[i].Length = 0;
+            ctx->Batches[i].Count = 0;
+        }
+    }
+    
+    ctx->Departing = NULL;
+    SetEvent(ctx->DepartedEvent);
+}
+
+/**
+ * ServerUrbFlush - Send every submit batch assembled so far
+ */
+void ServerUrbFlush(PSERVER_URB_CONTEXT ctx)
+{
+    for (int i = 0; i < SERVER_URB_MAX_BATCHES; i++) {
+        if (ctx->Batches[i].Client) {
+            SendBatch(&ctx->Batches[i], VUSB_FLUSH_IDLE);
+        }
+    }
+}
+
+/**
+ * TakePendingUrb - Remove a URB sent to the client from its endpoint queue
+ * @return: Tracking entry, or NULL if the URB is not pending
+ */
+static PSERVER_PENDING_URB TakePendingUrb(PSERVER_URB_CONTEXT ctx, uint32_t deviceId,
+                                          uint32_t urbId)
+{
+    PSERVER_URB_DEVICE device;
+    PSERVER_PENDING_URB curr = NULL;
+    
+    EnterCriticalSection(&ctx->PendingLock);
+    
+    device = GetUrbDevice(ctx, deviceId, FALSE);
+    if (!device) {
+        LeaveCriticalSection(&ctx->PendingLock);
+        return NULL;
+    }
+    
+    /* Endpoints complete in order, so the URB is normally a queue head */
+    for (int i = 0; i < VUSB_ENDPOINT_QUEUES && !curr; i++) {
+        if (device->Endpoints[i].Head && device->Endpoints[i].Head->UrbId == urbId) {
+            curr = device->Endpoints[i].Head;
+        }
+    }
+    
+    for (int i = 0; i < VUSB_ENDPOINT_QUEUES && !curr; i++) {
+        for (curr = device->Endpoints[i].Head; curr; curr = curr->Next) {
+            if (curr->UrbId == urbId) {
+                break;
+            }
+        }
+    }
+    
+    if (curr) {
+        ReleasePendingUrb(ctx, device, curr);
+    }
+    
+    LeaveCriticalSection(&ctx->PendingLock);
+    return curr;
+}
+
+/* Remove a URB from a singly linked queue */
+static BOOL QueueRemove(PSERVER_PENDING_URB* head, PSERVER_PENDING_URB* tail,
+                        PSERVER_PENDING_URB urb)
 {
-    return (PSERVER_PENDING_URB)calloc(1, sizeof(SERVER_PENDING_URB));
+    PSERVER_PENDING_URB prev = NULL;
+    
+    for (PSERVER_PENDING_URB curr = *head; curr; prev = curr, curr = curr->Next) {
+        if (curr == urb) {
+            if (prev) {
+                prev->Next = curr->Next;
+            } else {
+                *head = curr->Next;
+            }
+            if (*tail == curr) {
+                *tail = prev;
+            }
+            curr->Next = NULL;
+            return TRUE;
+        }
+    }
+    
+    return FALSE;
 }
 
-static void FreePendingUrb(PSERVER_PENDING_URB urb)
+/**
+ * ReleasePendingUrb - Unlink a URB from its endpoint and stop its timer
+ * (PendingLock held)
+ */
+static void ReleasePendingUrb(PSERVER_URB_CONTEXT ctx, PSERVER_URB_DEVICE device,
+                              PSERVER_PENDING_URB urb)
 {
-    if (urb) free(urb);
+    PSERVER_ENDPOINT_QUEUE queue = &device->Endpoints[VUSB_ENDPOINT_QUEUE(urb->EndpointAddress)];
+    
+    if (QueueRemove(&queue->Head, &queue->Tail, urb)) {
+        queue->Sent--;
+        ReturnCredit(urb);
+        
+        /* Let the forwarder send what the returned credit makes room for */
+        if (ctx->WaitingCount > 0) {
+            InterlockedExchange(&ctx->DispatchPending, 1);
+            SetEvent(ctx->DispatchEvent);
+        }
+    } else if (QueueRemove(&queue->WaitHead, &queue->WaitTail, urb)) {
+        device->WaitingCount--;
+        ctx->WaitingCount--;
+    }
+    
+    VusbTimerCancel(&ctx->Timers, &urb->Timer);
+    
+    ctx->PendingCount--;
+    if (--device->PendingCount == 0) {
+        device->DeviceId = 0;
+    }
+}
+
+/* ============ Flow Control ============ */
+
+/**
+ * HasCredit - Whether a client's windows let one more URB of an endpoint go out
+ * (PendingLock held)
+ *
+ * The windows are negotiated at connect; a client without VUSB_CAP_CREDITS
+ * only has the bulk depth limit. Bulk endpoints also leave part of the URB
+ * window to control and interrupt endpoints. A URB larger than the byte
+ * window goes out on its own once nothing else is in flight.
+ */
+static BOOL HasCredit(PVUSB_CLIENT_CONNECTION client, PSERVER_ENDPOINT_QUEUE queue,
+                      PSERVER_PENDING_URB urb)
+{
+    uint32_t depth = client->EndpointCredits;
+    uint32_t urbs = client->UrbCredits;
+    
+    if (urb->TransferType == VUSB_TRANSFER_BULK) {
+        if (depth == 0 || depth > SERVER_URB_BULK_DEPTH) {
+            depth = SERVER_URB_BULK_DEPTH;
+        }
+        urbs = SERVER_URB_BULK_SHARE(urbs);
+    }
+    
+    if (depth > 0 && queue->Sent >= depth) {
+        return FALSE;
+    }
+    if (urbs > 0 && client->UrbsInFlight >= urbs) {
+        return FALSE;
+    }
+    if (client->ByteCredits > 0 && client->UrbsInFlight > 0 &&
+        client->BytesInFlight + urb->Length > client->ByteCredits) {
+        return FALSE;
+    }
+    return TRUE;
+}
+
+/* Charge a URB being sent against its client's windows (PendingLock held) */
+static void ChargeCredit(PVUSB_CLIENT_CONNECTION client, PSERVER_PENDING_URB urb)
+{
+    urb->Client = client;
+    client->UrbsInFlight++;
+    client->BytesInFlight += urb->Length;
+}
+
+/* Give a URB's credit back to the client it was charged to (PendingLock held) */
+static void ReturnCredit(PSERVER_PENDING_URB urb)
+{
+    if (urb->Client) {
+        urb->Client->UrbsInFlight--;
+        urb->Client->BytesInFlight -= urb->Length;
+        urb->Client = NULL;
+    }
+}
+
+/**
+ * ExpireUrbs - Time out URBs whose completion did not arrive in time
+ *
+ * Runs on the forwarder thread. Each expired URB completes to the driver
+ * with VUSB_STATUS_TIMEOUT, and the client is told to cancel it if it was
+ * sent; a completion arriving later is ignored.
+ */
+static void ExpireUrbs(PSERVER_URB_CONTEXT ctx)
+{
+    PSERVER_PENDING_URB expired = NULL;
+    PVUSB_TIMER timer;
+    uint64_t now = GetTickCount64();
+    
+    /* Nothing new to do within the same tick */
+    if (now / VUSB_TIMER_TICK_MS <= ctx->Timers.Now) {
+        return;
+    }
+    
+    EnterCriticalSection(&ctx->PendingLock);
+    
+    timer = VusbTimerAdvance(&ctx->Timers, now);
+    while (timer) {
+        PSERVER_PENDING_URB urb = CONTAINING_RECORD(timer, SERVER_PENDING_URB, Timer);
+        PSERVER_URB_DEVICE device = GetUrbDevice(ctx, urb->DeviceId, FALSE);
+        
+        timer = timer->Next;
+        urb->Timer.Next = NULL;
+        
+        if (device) {
+            ReleasePendingUrb(ctx, device, urb);
+        }
+        urb->Next = expired;
+        expired = urb;
+    }
+    
+    LeaveCriticalSection(&ctx->PendingLock);
+    
+    while (expired) {
+        PSERVER_PENDING_URB urb = expired;
+        expired = urb->Next;
+        
+        printf("[URB Forwarder] URB %u on device %u timed out after %u ms\n",
+               urb->UrbId, urb->DeviceId, urb->Timeout);
+        
+        CompleteToDriver(ctx, urb->DeviceId, urb->UrbId, 0, VUSB_STATUS_TIMEOUT);
+        
+        /* A held-back URB never reached the client */
+        if (!urb->Waiting) {
+            SendCancel(ctx, urb);
+        }
+        
+        FreePendingUrb(ctx, urb);
+    }
+}
+
+/**
+ * SendCancel - Ask the client to abandon a URB
+ */
+static void SendCancel(PSERVER_URB_CONTEXT ctx, PSERVER_PENDING_URB urb)
+{
+    PVUSB_CLIENT_CONNECTION client;
+    VUSB_URB_CANCEL cancel;
+    WSABUF buffer;
+    
+    client = ServerUrbFindClientForDevice(ctx, urb->DeviceId);
+    if (!client || client->Parked) {
+        return;
+    }
+    
+    VusbInitHeader(&cancel.Header, VUSB_CMD_CANCEL_URB,
+                   sizeof(VUSB_URB_CANCEL) - sizeof(VUSB_HEADER), 0);
+    cancel.DeviceId = urb->DeviceId;
+    cancel.UrbId = urb->UrbId;
+    
+    buffer.buf = (char*)&cancel;
+    buffer.len = sizeof(cancel);
+    VusbServerSendVectored(client, &buffer, 1);
+    VusbCoalesceSentAlone(&client->Coalesce, sizeof(cancel));
+}
+
+/**
+ * DispatchWaiting - Send held-back URBs their clients have credit for
+ *
+ * Runs on the forwarder thread. Endpoints take turns, one URB each per
+ * pass, so a deep queue on one endpoint does not delay the others. The
+ * first device served moves on every call, so when a client's credit runs
+ * short the same device is not always the one left waiting.
+ */
+static void DispatchWaiting(PSERVER_URB_CONTEXT ctx)
+{
+    PVUSB_PENDING_URB ready[VUSB_ENDPOINT_QUEUES];
+    uint32_t start = ctx->DispatchStart;
+    BOOL progress = TRUE;
+    
+    ctx->DispatchStart = (start + 1) % SERVER_URB_MAX_DEVICES;
+    
+    while (progress && ctx->WaitingCount > 0) {
+        progress = FALSE;
+        
+        for (int n = 0; n < SERVER_URB_MAX_DEVICES; n++) {
+            PSERVER_URB_DEVICE device = &ctx->Devices[(start + n) % SERVER_URB_MAX_DEVICES];
+            PVUSB_CLIENT_CONNECTION client;
+            uint32_t deviceId;
+            uint32_t count = 0;
+            
+            EnterCriticalSection(&ctx->PendingLock);
+            
+            deviceId = device->DeviceId;
+            if (deviceId == 0 || device->WaitingCount == 0 || device->Replay) {
+                LeaveCriticalSection(&ctx->PendingLock);
+                continue;
+            }
+            
+            LeaveCriticalSection(&ctx->PendingLock);
+            
+            /* A parked client's URBs wait for its resume */
+            client = ServerUrbFindClientForDevice(ctx, deviceId);
+            if (client && client->Parked) {
+                continue;
+            }
+            
+            EnterCriticalSection(&ctx->PendingLock);
+            
+            if (device->DeviceId != deviceId) {
+                LeaveCriticalSection(&ctx->PendingLock);
+                continue;
+            }
+            
+            for (int j = 0; j < VUSB_ENDPOINT_QUEUES; j++) {
+                PSERVER_ENDPOINT_QUEUE queue = &device->Endpoints[j];
+                PSERVER_PENDING_URB urb = queue->WaitHead;
+                
+                if (!urb || (client && !HasCredit(client, queue, urb))) {
+                    continue;
+                }
+                
+                queue->WaitHead = urb->Next;
+                if (!queue->WaitHead) {
+                    queue->WaitTail = NULL;
+                }
+                urb->Next = NULL;
+                urb->Waiting = FALSE;
+                
+                if (queue->Tail) {
+                    queue->Tail->Next = urb;
+                } else {
+                    queue->Head = urb;
+                }
+                queue->Tail = urb;
+                queue->Sent++;
+                if (client) {
+                    ChargeCredit(client, urb);
+                }
+                device->WaitingCount--;
+                ctx->WaitingCount--;
+                
+                /* Once sent, the URB can be completed and freed at any
+                 * time, so the copy is borrowed while it is sent */
+                ready[count++] = urb->Request;
+                if (client) {
+                    urb->Request = NULL;
+                }
+            }
+            
+            LeaveCriticalSection(&ctx->PendingLock);
+            
+            if (count == 0) {
+                continue;
+            }
+            progress = TRUE;
+            
+            for (uint32_t j = 0; j < count; j++) {
+                PVUSB_PENDING_URB request = ready[j];
+                size_t sendSize = sizeof(VUSB_URB_SUBMIT);
+                
+                if (request->Direction == VUSB_DIR_OUT) {
+                    sendSize += request->TransferBufferLength;
+                }
+                
+                if (client) {
+                    SendSubmit(ctx, client, request, sendSize, 0);
+                    
+                    /* The request is only needed until it has been sent,
+                     * unless a resume may have to send it again */
+                    if (!(client->Capabilities & VUSB_CAP_SESSION_RESUME)) {
+                        VusbBufferFree(&ctx->ServerContext->BufferPool, request);
+                    }
+                } else {
+                    PSERVER_PENDING_URB urb = TakePendingUrb(ctx, deviceId, request->UrbId);
+                    
+                    FailUrb(ctx, request, VUSB_STATUS_NO_DEVICE);
+                    if (urb) {
+                        FreePendingUrb(ctx, urb);
+                    }
+                }
+            }
+            
+            if (client && (client->Capabilities & VUSB_CAP_SESSION_RESUME)) {
+                ReturnRequests(ctx, client, deviceId, ready, count);
+            }
+        }
+    }
+}
+
+/**
+ * ReplayUrbs - Re-send the sent URBs of devices prepared for replay
+ *
+ * Runs on the forwarder thread, before held-back URBs are dispatched, so
+ * replayed submits reach the client ahead of anything newer. They carry
+ * VUSB_SUBMIT_REPLAYED; the client answers ones it already completed from
+ * its record of recent completions. A device whose client is gone has
+ * all its URBs failed instead.
+ */
+static void ReplayUrbs(PSERVER_URB_CONTEXT ctx)
+{
+    for (int i = 0; i < SERVER_URB_MAX_DEVICES; i++) {
+        PSERVER_URB_DEVICE device = &ctx->Devices[i];
+        PVUSB_CLIENT_CONNECTION client;
+        PVUSB_PENDING_URB* requests = NULL;
+        PSERVER_PENDING_URB failed = NULL;
+        uint32_t deviceId;
+        uint32_t count = 0;
+        
+        EnterCriticalSection(&ctx->PendingLock);
+        deviceId = device->Replay ? device->DeviceId : 0;
+        device->Replay = FALSE;
+        LeaveCriticalSection(&ctx->PendingLock);
+        
+        if (deviceId == 0) {
+            continue;
+        }
+        
+        client = ServerUrbFindClientForDevice(ctx, deviceId);
+        
+        EnterCriticalSection(&ctx->PendingLock);
+        
+        if (device->DeviceId != deviceId) {
+            LeaveCriticalSection(&ctx->PendingLock);
+            continue;
+        }
+        
+        if (client) {
+            /* Borrow the copies; URBs still pending get them back */
+            requests = (PVUSB_PENDING_URB*)malloc(device->PendingCount * sizeof(PVUSB_PENDING_URB));
+            for (int j = 0; requests && j < VUSB_ENDPOINT_QUEUES; j++) {
+                for (PSERVER_PENDING_URB urb = device->Endpoints[j].Head; urb; urb = urb->Next) {
+                    if (urb->Request) {
+                        requests[count++] = urb->Request;
+                        urb->Request = NULL;
+                    }
+                }
+            }
+        } else {
+            for (int j = 0; j < VUSB_ENDPOINT_QUEUES; j++) {
+                PSERVER_ENDPOINT_QUEUE queue = &device->Endpoints[j];
+                
+                while (queue->Head || queue->WaitHead) {
+                    PSERVER_PENDING_URB urb = queue->Head ? queue->Head : queue->WaitHead;
+                    
+                    ReleasePendingUrb(ctx, device, urb);
+                    urb->Next = failed;
+                    failed = urb;
+                }
+            }
+        }
+        
+        LeaveCriticalSection(&ctx->PendingLock);
+        
+        while (failed) {
+            PSERVER_PENDING_URB urb = failed;
+            failed = urb->Next;
+            
+            CompleteToDriver(ctx, urb->DeviceId, urb->UrbId, 0, VUSB_STATUS_NO_DEVICE);
+            FreePendingUrb(ctx, urb);
+        }
+        
+        if (!requests) {
+            continue;
+        }
+        
+        for (uint32_t j = 0; j < count; j++) {
+            size_t sendSize = sizeof(VUSB_URB_SUBMIT);
+            
+            if (requests[j]->Direction == VUSB_DIR_OUT) {
+                sendSize += requests[j]->TransferBufferLength;
+            }
+            SendSubmit(ctx, client, requests[j], sendSize, VUSB_SUBMIT_REPLAYED);
+        }
+        
+        printf("[URB Forwarder] Replayed %u URBs for device %u\n", count, deviceId);
+        
+        ReturnRequests(ctx, client, deviceId, requests, count);
+        free(requests);
+    }
+}
+
+/**
+ * ReturnRequests - Give borrowed request copies back to their URBs
+ *
+ * The forwarder borrows a URB's copy under PendingLock before sending it,
+ * since once on the wire the URB can be completed and freed at any time.
+ * URBs still pending get their copy back; for ones completed meanwhile the
+ * copy goes back to the pool.
+ */
+static void ReturnRequests(PSERVER_URB_CONTEXT ctx, PVUSB_CLIENT_CONNECTION client,
+                           uint32_t deviceId, PVUSB_PENDING_URB* requests, uint32_t count)
+{
+    PSERVER_URB_DEVICE owner;
+    
+    EnterCriticalSection(&ctx->PendingLock);
+    
+    owner = GetUrbDevice(ctx, deviceId, FALSE);
+    for (uint32_t j = 0; j < count; j++) {
+        PSERVER_PENDING_URB urb = NULL;
+        
+        for (int k = 0; owner && k < VUSB_ENDPOINT_QUEUES && !urb; k++) {
+            for (urb = owner->Endpoints[k].Head; urb; urb = urb->Next) {
+                if (urb->UrbId == requests[j]->UrbId && !urb->Request) {
+                    break;
+                }
+            }
+        }
+        
+        if (urb) {
+            urb->Request = requests[j];
+            if (!urb->Client) {
+                ChargeCredit(client, urb);
+            }
+        } else {
+            VusbBufferFree(&ctx->ServerContext->BufferPool, requests[j]);
+        }
+    }
+    
+    LeaveCriticalSection(&ctx->PendingLock);
+}
+
+/**
+ * GetBatch - Find or open the batch for a client with room for size bytes
+ */
+static PSERVER_URB_BATCH GetBatch(PSERVER_URB_CONTEXT ctx,
+                                  PVUSB_CLIENT_CONNECTION client, uint32_t size)
+{
+    PSERVER_URB_BATCH batch = NULL;
+    
+    for (int i = 0; i < SERVER_URB_MAX_BATCHES; i++) {
+        if (ctx->Batches[i].Client == client) {
+            batch = &ctx->Batches[i];
+            if (batch->Length + size > VUSB_MAX_PACKET_SIZE) {
+                SendBatch(batch, VUSB_FLUSH_BYTES);
+            }
+            break;
+        }
+    }
+    
+    if (!batch) {
+        for (int i = 0; i < SERVER_URB_MAX_BATCHES && !batch; i++) {
+            if (!ctx->Batches[i].Client) {
+                batch = &ctx->Batches[i];
+            }
+        }
+        if (!batch) {
+            ServerUrbFlush(ctx);
+            batch = &ctx->Batches[0];
+        }
+    }
+    
+    if (!batch->Buffer) {
+        batch->Buffer = (uint8_t*)malloc(VUSB_MAX_PACKET_SIZE);
+        if (!batch->Buffer) return NULL;
+    }
+    
+    if (!batch->Client) {
+        batch->Client = client;
+        batch->Length = sizeof(VUSB_URB_BATCH);
+        batch->Count = 0;
+    }
+    
+    return batch;
+}
+
+/**
+ * FlushBatches - Send the batches that should not be held any longer
+ * @drained: Driver queue is empty, so batches of clients whose bulk
+ *           traffic is sparse go out too
+ */
+static void FlushBatches(PSERVER_URB_CONTEXT ctx, BOOL drained)
+{
+    for (int i = 0; i < SERVER_URB_MAX_BATCHES; i++) {
+        PSERVER_URB_BATCH batch = &ctx->Batches[i];
+        
+        if (!batch->Client) {
+            continue;
+        }
+        if (VusbCoalesceDue(&batch->Client->Coalesce)) {
+            SendBatch(batch, VUSB_FLUSH_DELAY);
+        } else if (drained && !batch->Client->Coalesce.Holding) {
+            SendBatch(batch, VUSB_FLUSH_IDLE);
+        }
+    }
+}
+
+/**
+ * BatchWaitMs - How long the forwarder may wait before a held batch is due
+ * @return: INFINITE if no batch is held
+ */
+static DWORD BatchWaitMs(PSERVER_URB_CONTEXT ctx)
+{
+    DWORD waitMs = INFINITE;
+    
+    for (int i = 0; i < SERVER_URB_MAX_BATCHES; i++) {
+        if (ctx->Batches[i].Client) {
+            DWORD batchMs = VusbCoalesceWaitMs(&ctx->Batches[i].Client->Coalesce);
+            if (batchMs < waitMs) {
+                waitMs = batchMs;
+            }
+        }
+    }
+    return waitMs;
+}
+
+/**
+ * SendBatch - Send a batch as one frame and reset it
+ * @reason: Why it is sent, counted for the client
+ */
+static int SendBatch(PSERVER_URB_BATCH batch, VUSB_FLUSH_REASON reason)
+{
+    PVUSB_URB_BATCH frame = (PVUSB_URB_BATCH)batch->Buffer;
+    uint8_t* data = batch->Buffer;
+    uint32_t length = batch->Length;
+    WSABUF buffer;
+    int result;
+    
+    if (batch->Count == 1) {
+        /* A lone submit goes out as a plain SUBMIT_URB */
+        data += sizeof(VUSB_URB_BATCH);
+        length -= sizeof(VUSB_URB_BATCH);
+    } else {
+        VusbInitHeader(&frame->Header, VUSB_CMD_SUBMIT_URB_BATCH,
+                       length - sizeof(VUSB_HEADER), 0);
+        frame->Count = batch->Count;
+    }
+    
+    buffer.buf = (char*)data;
+    buffer.len = length;
+    result = VusbServerSendVectored(batch->Client, &buffer, 1);
+    VusbCoalesceSent(&batch->Client->Coalesce, reason);
+    
+    batch->Client = NULL;
+    batch->Length = 0;
+    batch->Count = 0;
+    
+    return result;
+}
+
+/**
+ * SendSegmented - Send a message larger than one frame as URB_FRAGMENT
+ * followed by URB_CONTINUE pieces
+ * @head: Message header structure
+ * @data: Transfer data following it
+ */
+static int SendSegmented(PVUSB_CLIENT_CONNECTION client, const void* head, uint32_t headLength,
+                         const uint8_t* data, uint32_t dataLength, uint32_t sequence)
+{
+    uint32_t totalLength = headLength + dataLength;
+    uint32_t offset = 0;
+    
+    while (offset < totalLength) {
+        VUSB_URB_FRAGMENT fragment;
+        WSABUF buffers[3];
+        DWORD count = 1;
+        uint32_t end;
+        
+        end = offset + (uint32_t)VUSB_FRAGMENT_DATA_MAX;
+        if (end > totalLength) {
+            end = totalLength;
+        }
+        
+        VusbInitHeader(&fragment.Header,
+                       offset == 0 ? VUSB_CMD_URB_FRAGMENT : VUSB_CMD_URB_CONTINUE,
+                       (uint32_t)VUSB_FRAGMENT_FIELDS_SIZE + (end - offset), sequence);
+        fragment.TotalLength = totalLength;
+        fragment.Offset = offset;
+        
+        buffers[0].buf = (char*)&fragment;
+        buffers[0].len = sizeof(fragment);
+        
+        /* The piece may span the end of the header structure */
+        if (offset < headLength) {
+            buffers[count].buf = (char*)head + offset;
+            buffers[count].len = (end < headLength ? end : headLength) - offset;
+            count++;
+        }
+        if (end > headLength) {
+            uint32_t start = offset > headLength ? offset - headLength : 0;
+            buffers[count].buf = (char*)data + start;
+            buffers[count].len = end - headLength - start;
+            count++;
+        }
+        
+        if (VusbServerSendVectored(client, buffers, count) != 0) {
+            return -1;
+        }
+        offset = end;
+    }
+    
+    return 0;
+}
+
+/**
+ * GrowForwarderBuffer - Make room for an OUT transfer larger than one frame
+ *
+ * The driver requeues a URB that does not fit, so the next request gets it.
+ */
+static BOOL GrowForwarderBuffer(uint8_t** buffer, DWORD* bufferSize)
+{
+    DWORD largest = sizeof(VUSB_PENDING_URB) + VUSB_MAX_SEGMENTED_SIZE;
+    uint8_t* larger;
+    
+    if (*bufferSize >= largest) {
+        return FALSE;
+    }
+    
+    larger = (uint8_t*)malloc(largest);
+    if (!larger) {
+        return FALSE;
+    }
+    
+    free(*buffer);
+    *buffer = larger;
+    *bufferSize = largest;
+    return TRUE;
+}
+
+/**
+ * FailUrb - Complete a URB back to the driver without forwarding it
+ */
+static void FailUrb(PSERVER_URB_CONTEXT ctx, PVUSB_PENDING_URB pendingUrb, uint32_t status)
+{
+    CompleteToDriver(ctx, pendingUrb->DeviceId, pendingUrb->UrbId,
+                     pendingUrb->SequenceNumber, status);
+}
+
+/**
+ * CompleteToDriver - Complete a URB to the driver with a status and no data
+ */
+static void CompleteToDriver(PSERVER_URB_CONTEXT ctx, uint32_t deviceId, uint32_t urbId,
+                             uint32_t sequence, uint32_t status)
+{
+    VUSB_URB_COMPLETION completion = {0};
+    DWORD bytesReturned;
+    
+    completion.DeviceId = deviceId;
+    completion.UrbId = urbId;
+    completion.SequenceNumber = sequence;
+    completion.Status = status;
+    completion.ActualLength = 0;
+    
+    DeviceIoControl(ctx->DriverHandle, IOCTL_VUSB_COMPLETE_URB,
+                   &completion, sizeof(completion), NULL, 0, &bytesReturned, NULL);
+}
+
+/* ============================================================
+ * Control Response Cache
+ * ============================================================ */
+
+/* Device-recipient GET_STATUS, GET_CONFIGURATION and standard descriptors */
+static BOOL IsCacheableRequest(const VUSB_SETUP_PACKET* setup)
+{
+    if (setup->bmRequestType != 0x80) {
+        return FALSE;
+    }
+    
+    switch (setup->bRequest) {
+    case 0x00: /* GET_STATUS */
+    case 0x08: /* GET_CONFIGURATION */
+        return TRUE;
+        
+    case 0x06: /* GET_DESCRIPTOR */
+        switch (setup->wValue >> 8) {
+        case 0x01: case 0x02: case 0x03: case 0x06: case 0x07: case 0x0F:
+            return TRUE;
+        }
+        return FALSE;
+        
+    default:
+        return FALSE;
+    }
+}
+
+static PSERVER_CACHED_RESPONSE CacheFind(PSERVER_CONTROL_CACHE cache,
+                                         const VUSB_SETUP_PACKET* setup)
+{
+    for (uint32_t i = 0; i < cache->Count; i++) {
+        PSERVER_CACHED_RESPONSE entry = &cache->Entries[i];
+        
+        if (entry->bRequest == setup->bRequest && entry->wValue == setup->wValue &&
+            entry->wIndex == setup->wIndex) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * AnswerFromCache - Complete a control IN request from the device's cache
+ * @return: TRUE if the URB was completed to the driver
+ */
+static BOOL AnswerFromCache(PSERVER_URB_CONTEXT ctx, PVUSB_PENDING_URB pendingUrb)
+{
+    const VUSB_SETUP_PACKET* setup = &pendingUrb->SetupPacket;
+    PSERVER_CONTROL_CACHE cache;
+    PSERVER_CACHED_RESPONSE entry;
+    PVUSB_URB_COMPLETION completion = NULL;
+    uint32_t length = 0;
+    DWORD bytesReturned;
+    
+    if (!IsCacheableRequest(setup)) {
+        return FALSE;
+    }
+    
+    EnterCriticalSection(&ctx->PendingLock);
+    
+    cache = GetControlCache(ctx, pendingUrb->DeviceId, FALSE);
+    entry = cache ? CacheFind(cache, setup) : NULL;
+    
+    /* A truncated answer only serves requests no longer than it */
+    if (entry && (entry->Complete || setup->wLength <= entry->Length)) {
+        length = entry->Length < setup->wLength ? entry->Length : setup->wLength;
+        completion = (PVUSB_URB_COMPLETION)VusbBufferAlloc(
+            &ctx->ServerContext->BufferPool, sizeof(VUSB_URB_COMPLETION) + length);
+        if (completion) {
+            memcpy(completion + 1, entry->Data, length);
+            ctx->CacheHits++;
+        }
+    }
+    
+    LeaveCriticalSection(&ctx->PendingLock);
+    
+    if (!completion) {
+        return FALSE;
+    }
+    
+    completion->DeviceId = pendingUrb->DeviceId;
+    completion->UrbId = pendingUrb->UrbId;
+    completion->SequenceNumber = pendingUrb->SequenceNumber;
+    completion->Status = VUSB_STATUS_SUCCESS;
+    completion->ActualLength = length;
+    
+    DeviceIoControl(ctx->DriverHandle, IOCTL_VUSB_COMPLETE_URB,
+                   completion, (DWORD)(sizeof(VUSB_URB_COMPLETION) + length),
+                   NULL, 0, &bytesReturned, NULL);
+    
+    VusbBufferFree(&ctx->ServerContext->BufferPool, completion);
+    return TRUE;
+}
+
+/**
+ * TrackControlRequest - Apply a forwarded control request to the cache
+ * (PendingLock held)
+ *
+ * Requests that change device state invalidate the answers they affect;
+ * cacheable requests are marked so their response can be learned.
+ */
+static void TrackControlRequest(PSERVER_URB_CONTEXT ctx, PSERVER_PENDING_URB tracking)
+{
+    const VUSB_SETUP_PACKET* setup = &tracking->SetupPacket;
+    PSERVER_CONTROL_CACHE cache;
+    
+    if (IsCacheableRequest(setup)) {
+        cache = GetControlCache(ctx, tracking->DeviceId, TRUE);
+        if (cache) {
+            tracking->Cacheable = TRUE;
+            tracking->CacheGeneration = cache->Generation;
+        }
+        return;
+    }
+    
+    /* Standard requests to the device, host to device */
+    if (setup->bmRequestType != 0x00) {
+        return;
+    }
+    
+    cache = GetControlCache(ctx, tracking->DeviceId, FALSE);
+    if (!cache) {
+        return;
+    }
+    
+    switch (setup->bRequest) {
+    case 0x01: /* CLEAR_FEATURE */
+    case 0x03: /* SET_FEATURE */
+    case 0x09: /* SET_CONFIGURATION */
+        CacheDrop(ctx, cache, CACHE_DROP_STATE);
+        break;
+        
+    case 0x07: /* SET_DESCRIPTOR */
+        CacheDrop(ctx, cache, CACHE_DROP_ALL);
+        break;
+    }
+}
+
+/**
+ * LearnResponse - Remember the answer to a cacheable control request
+ *
+ * Answers are dropped if the cache was invalidated while the request was
+ * outstanding, so a stale response never outlives the change.
+ */
+static void LearnResponse(PSERVER_URB_CONTEXT ctx, PSERVER_PENDING_URB urb,
+                          uint32_t actualLength, const uint8_t* data)
+{
+    const VUSB_SETUP_PACKET* setup = &urb->SetupPacket;
+    PSERVER_CONTROL_CACHE cache;
+    BOOL complete;
+    
+    if (!data || actualLength == 0 || actualLength > setup->wLength) {
+        return;
+    }
+    
+    /* A short answer is the whole answer */
+    complete = actualLength < setup->wLength;
+    
+    if (setup->bRequest != 0x06) {
+        complete = TRUE;
+    } else if (actualLength >= 2) {
+        uint8_t type = (uint8_t)(setup->wValue >> 8);
+        uint32_t declared = data[0];
+        
+        if ((type == 0x02 || type == 0x07 || type == 0x0F) && actualLength >= 4) {
+            declared = data[2] | (data[3] << 8);
+        }
+        if (declared <= actualLength) {
+            complete = TRUE;
+        }
+    }
+    
+    EnterCriticalSection(&ctx->PendingLock);
+    cache = GetControlCache(ctx, urb->DeviceId, FALSE);
+    if (cache && cache->Generation == urb->CacheGeneration) {
+        CacheStore(ctx, cache, setup, data, actualLength, complete, FALSE);
+    }
+    LeaveCriticalSection(&ctx->PendingLock);
+}
+
+/* Add or improve a cached answer (PendingLock held) */
+static void CacheStore(PSERVER_URB_CONTEXT ctx, PSERVER_CONTROL_CACHE cache,
+                       const VUSB_SETUP_PACKET* setup, const uint8_t* data,
+                       uint32_t length, BOOL complete, BOOL seeded)
+{
+    PSERVER_CACHED_RESPONSE entry = CacheFind(cache, setup);
+    uint8_t* copy;
+    
+    if (entry) {
+        /* Keep what we have unless the new answer is longer or whole */
+        if (entry->Complete || (!complete && length <= entry->Length)) {
+            return;
+        }
+    } else if (cache->Count < SERVER_URB_CACHE_ENTRIES) {
+        entry = &cache->Entries[cache->Count++];
+        memset(entry, 0, sizeof(SERVER_CACHED_RESPONSE));
+        entry->bRequest = setup->bRequest;
+        entry->wValue = setup->wValue;
+        entry->wIndex = setup->wIndex;
+    } else {
+        return;
+    }
+    
+    copy = (uint8_t*)VusbBufferAlloc(&ctx->ServerContext->BufferPool, length);
+    if (!copy) {
+        return;
+    }
+    memcpy(copy, data, length);
+    
+    VusbBufferFree(&ctx->ServerContext->BufferPool, entry->Data);
+    entry->Data = copy;
+    entry->Length = (uint16_t)length;
+    entry->Complete = complete;
+    entry->Seeded = seeded;
+}
+
+/* Drop cached answers of the given kinds (PendingLock held) */
+static void CacheDrop(PSERVER_URB_CONTEXT ctx, PSERVER_CONTROL_CACHE cache, uint32_t what)
+{
+    uint32_t kept = 0;
+    
+    for (uint32_t i = 0; i < cache->Count; i++) {
+        PSERVER_CACHED_RESPONSE entry = &cache->Entries[i];
+        uint32_t kind = entry->bRequest != 0x06 ? CACHE_DROP_STATE :
+                        entry->Seeded ? CACHE_DROP_SEEDED : CACHE_DROP_LEARNED;
+        
+        if (kind & what) {
+            VusbBufferFree(&ctx->ServerContext->BufferPool, entry->Data);
+        } else {
+            cache->Entries[kept++] = *entry;
+        }
+    }
+    
+    cache->Count = kept;
+    cache->Generation++;
+}
+
+/* Find a device's control cache (PendingLock held) */
+static PSERVER_CONTROL_CACHE GetControlCache(PSERVER_URB_CONTEXT ctx, uint32_t deviceId,
+                                             BOOL create)
+{
+    PSERVER_CONTROL_CACHE unused = NULL;
+    
+    for (int i = 0; i < SERVER_URB_MAX_DEVICES; i++) {
+        if (ctx->Caches[i].DeviceId == deviceId) {
+            return &ctx->Caches[i];
+        }
+        if (!unused && ctx->Caches[i].DeviceId == 0) {
+            unused = &ctx->Caches[i];
+        }
+    }
+    
+    if (!create || !unused) {
+        return NULL;
+    }
+    
+    memset(unused, 0, sizeof(SERVER_CONTROL_CACHE));
+    unused->DeviceId = deviceId;
+    return unused;
+}
+
+/* Helper functions */
+static PSERVER_PENDING_URB AllocPendingUrb(PSERVER_URB_CONTEXT ctx)
+{
+    PSERVER_PENDING_URB urb = (PSERVER_PENDING_URB)VusbPoolAlloc(&ctx->PendingPool);
+    if (urb) memset(urb, 0, sizeof(SERVER_PENDING_URB));
+    return urb;
+}
+
+static void FreePendingUrb(PSERVER_URB_CONTEXT ctx, PSERVER_PENDING_URB urb)
+{
+    VusbBufferFree(&ctx->ServerContext->BufferPool, urb->Request);
+    VusbPoolFree(&ctx->PendingPool, urb);
+}
+
+/* Find a device's endpoint queues (PendingLock held) */
+static PSERVER_URB_DEVICE GetUrbDevice(PSERVER_URB_CONTEXT ctx, uint32_t deviceId, BOOL create)
+{
+    PSERVER_URB_DEVICE unused = NULL;
+    
+    for (int i = 0; i < SERVER_URB_MAX_DEVICES; i++) {
+        if (ctx->Devices[i].DeviceId == deviceId) {
+            return &ctx->Devices[i];
+        }
+        if (!unused && ctx->Devices[i].DeviceId == 0) {
+            unused = &ctx->Devices[i];
+        }
+    }
+    
+    if (!create || !unused) {
+        return NULL;
+    }
+    
+    memset(unused, 0, sizeof(SERVER_URB_DEVICE));
+    unused->DeviceId = deviceId;
+    return unused;
 }
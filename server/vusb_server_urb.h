@@ -11,6 +11,9 @@
 #include <windows.h>
 #include "../protocol/vusb_protocol.h"
 #include "../protocol/vusb_ioctl.h"
+#include "../protocol/vusb_pool.h"
+#include "../protocol/vusb_timer.h"
+#include "../protocol/vusb_compress.h"
 
 /* Forward declarations */
 struct _VUSB_SERVER_CONTEXT;
@@ -18,15 +21,88 @@ struct _VUSB_CLIENT_CONNECTION;
 
 /* Pending URB tracking on server side */
 typedef struct _SERVER_PENDING_URB {
-    struct _SERVER_PENDING_URB* Next;
+    struct _SERVER_PENDING_URB* Next;   /* Endpoint queue link */
     uint32_t    UrbId;
     uint32_t    DeviceId;
     uint32_t    ClientDeviceId;     /* Client's device ID */
-    struct _VUSB_CLIENT_CONNECTION* Client;
+    struct _VUSB_CLIENT_CONNECTION* Client;     /* Charged for the URB while it is sent */
+    uint32_t    Length;             /* Transfer bytes it is charged */
     LARGE_INTEGER SubmitTime;
-    uint32_t    Timeout;
+    uint32_t    Timeout;            /* Milliseconds, 0 = none */
+    VUSB_TIMER  Timer;              /* Armed while Timeout runs */
+    uint8_t     EndpointAddress;
+    uint8_t     TransferType;
+    PVUSB_PENDING_URB Request;      /* Copy of the request if it may be sent again */
+    BOOL        Waiting;            /* Held back, not yet sent to the client */
+    BOOL        Cacheable;          /* Response may be learned by the control cache */
+    uint32_t    CacheGeneration;    /* Device cache generation when forwarded */
+    VUSB_SETUP_PACKET SetupPacket;
 } SERVER_PENDING_URB, *PSERVER_PENDING_URB;
 
+/* Tracking entries obtained per pool slab */
+#define SERVER_URB_POOL_SLAB    256
+
+/* Devices that can have URBs pending at once */
+#define SERVER_URB_MAX_DEVICES  64
+
+/* Bulk URBs an endpoint keeps at the client; later ones wait on the server */
+#define SERVER_URB_BULK_DEPTH   4
+
+/* Share of a client's URB credits bulk endpoints may use; the rest is kept
+ * for control and interrupt endpoints */
+#define SERVER_URB_BULK_SHARE(credits)  ((credits) - (credits) / 4)
+
+/* URBs of one endpoint, in submission order */
+typedef struct _SERVER_ENDPOINT_QUEUE {
+    PSERVER_PENDING_URB Head;       /* Sent to the client, oldest first */
+    PSERVER_PENDING_URB Tail;
+    uint32_t    Sent;
+    PSERVER_PENDING_URB WaitHead;   /* Held back until the client has credit */
+    PSERVER_PENDING_URB WaitTail;
+} SERVER_ENDPOINT_QUEUE, *PSERVER_ENDPOINT_QUEUE;
+
+/* Endpoint queues of a device with URBs pending */
+typedef struct _SERVER_URB_DEVICE {
+    uint32_t    DeviceId;           /* 0 = entry unused */
+    uint32_t    PendingCount;       /* Sent and held back, all endpoints */
+    uint32_t    WaitingCount;
+    BOOL        Replay;             /* Sent URBs to re-send after a session resume */
+    SERVER_ENDPOINT_QUEUE Endpoints[VUSB_ENDPOINT_QUEUES];
+} SERVER_URB_DEVICE, *PSERVER_URB_DEVICE;
+
+/* Control responses cached per device */
+#define SERVER_URB_CACHE_ENTRIES 32
+
+/* Response to an idempotent control request, keyed by its setup packet */
+typedef struct _SERVER_CACHED_RESPONSE {
+    uint8_t     bRequest;
+    uint16_t    wValue;
+    uint16_t    wIndex;
+    BOOL        Complete;           /* Whole response known, serves any wLength */
+    BOOL        Seeded;             /* From the attach descriptors, kept on reset */
+    uint16_t    Length;
+    uint8_t*    Data;               /* From the server buffer pool */
+} SERVER_CACHED_RESPONSE, *PSERVER_CACHED_RESPONSE;
+
+/* Control-response cache of one device */
+typedef struct _SERVER_CONTROL_CACHE {
+    uint32_t    DeviceId;           /* 0 = entry unused */
+    uint32_t    Generation;         /* Bumped on invalidation */
+    uint32_t    Count;
+    SERVER_CACHED_RESPONSE Entries[SERVER_URB_CACHE_ENTRIES];
+} SERVER_CONTROL_CACHE, *PSERVER_CONTROL_CACHE;
+
+/* Clients that can have a submit batch open at once */
+#define SERVER_URB_MAX_BATCHES  8
+
+/* Submit batch being assembled for one client */
+typedef struct _SERVER_URB_BATCH {
+    struct _VUSB_CLIENT_CONNECTION* Client;
+    uint8_t*    Buffer;             /* VUSB_MAX_PACKET_SIZE bytes */
+    uint32_t    Length;             /* Including the VUSB_URB_BATCH header */
+    uint32_t    Count;
+} SERVER_URB_BATCH, *PSERVER_URB_BATCH;
+
 /* URB forwarder context */
 typedef struct _SERVER_URB_CONTEXT {
     struct _VUSB_SERVER_CONTEXT* ServerContext;
@@ -34,10 +110,34 @@ typedef struct _SERVER_URB_CONTEXT {
     HANDLE      ForwarderThread;
     volatile BOOL Running;
     
-    /* Pending URB list */
+    /* Pending URBs, queued per device endpoint */
     CRITICAL_SECTION PendingLock;
-    PSERVER_PENDING_URB PendingList;
+    SERVER_URB_DEVICE Devices[SERVER_URB_MAX_DEVICES];
     uint32_t    PendingCount;
+    uint32_t    WaitingCount;       /* Held-back URBs, all devices */
+    VUSB_POOL   PendingPool;        /* SERVER_PENDING_URB entries */
+    VUSB_TIMER_WHEEL Timers;        /* URB timeouts, advanced by the forwarder */
+    
+    /* Control responses answered without the client (PendingLock) */
+    SERVER_CONTROL_CACHE Caches[SERVER_URB_MAX_DEVICES];
+    uint64_t    CacheHits;
+    
+    /* Raised when a completion makes room for a held-back URB */
+    HANDLE      DispatchEvent;
+    volatile LONG DispatchPending;
+    volatile LONG ReplayPending;    /* Some device has Replay set */
+    uint32_t    DispatchStart;      /* Device served first by the next dispatch */
+    
+    /* A client being freed waits until the forwarder holds no pointer to it */
+    CRITICAL_SECTION DepartLock;
+    struct _VUSB_CLIENT_CONNECTION* volatile Departing;
+    HANDLE      DepartedEvent;
+    
+    /* Submit batches, touched by the forwarder thread only */
+    SERVER_URB_BATCH Batches[SERVER_URB_MAX_BATCHES];
+    
+    /* Bulk OUT compression results, touched by the forwarder thread only */
+    VUSB_COMPRESS_TABLE Compression;
 } SERVER_URB_CONTEXT, *PSERVER_URB_CONTEXT;
 
 /* Initialize URB forwarder */
@@ -53,9 +153,31 @@ void ServerUrbStop(PSERVER_URB_CONTEXT ctx);
 /* Forward a URB to the appropriate client */
 int ServerUrbForward(PSERVER_URB_CONTEXT ctx, PVUSB_PENDING_URB pendingUrb);
 
-/* Handle URB completion from client */
-int ServerUrbComplete(PSERVER_URB_CONTEXT ctx, uint32_t urbId, uint32_t status,
-                      uint32_t actualLength, uint8_t* data);
+/* Send every submit batch assembled so far */
+void ServerUrbFlush(PSERVER_URB_CONTEXT ctx);
+
+/* Retire a URB the client completed; 0 if the driver is still owed its completion */
+int ServerUrbComplete(PSERVER_URB_CONTEXT ctx, uint32_t deviceId, uint32_t urbId,
+                      uint32_t status, uint32_t actualLength, uint8_t* data);
+
+/* Seed a device's control-response cache from its attach descriptors */
+void ServerUrbSeedDevice(PSERVER_URB_CONTEXT ctx, uint32_t deviceId,
+                         const uint8_t* descriptors, uint32_t length);
+
+/* Drop learned control responses after a device reset */
+void ServerUrbResetDevice(PSERVER_URB_CONTEXT ctx, uint32_t deviceId);
+
+/* Drop all control responses of a detached device */
+void ServerUrbForgetDevice(PSERVER_URB_CONTEXT ctx, uint32_t deviceId);
+
+/* Hold a device's new URBs until its sent ones are replayed; returns their count */
+uint32_t ServerUrbPrepareReplay(PSERVER_URB_CONTEXT ctx, uint32_t deviceId);
+
+/* Replay every prepared device to its new client, or fail its URBs if it has none */
+void ServerUrbStartReplay(PSERVER_URB_CONTEXT ctx);
+
+/* Stop charging a departing client and wait until the forwarder has let go of it */
+void ServerUrbForgetClient(PSERVER_URB_CONTEXT ctx, struct _VUSB_CLIENT_CONNECTION* client);
 
 /* Find client for a device */
 struct _VUSB_CLIENT_CONNECTION* ServerUrbFindClientForDevice(
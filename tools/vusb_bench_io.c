@@ -0,0 +1,269 @@
+/**
+ * Server I/O engine benchmark
+ *
+ * Runs each receive path of both servers in this process and streams URB
+ * completions at it from a client on loopback TCP:
+ *
+ * - vusb_userspace with thread-per-client (--io-engine threads) and with
+ *   Registered I/O (--io-engine rio)
+ * - vusb_server with one blocking recv() pair per message (--io-engine
+ *   blocking) and with batched receives (--io-engine batched)
+ *
+ * The client writes its completions in bursts, as a busy client's
+ * coalescing does, then waits for the answer to a PING sent after them.
+ * The completions name no pending URB, so what is timed is the receive
+ * path rather than URB handling. Socket calls come from the servers' own
+ * counters (IoSyscalls, RecvCalls).
+ */
+
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <windows.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../server/vusb_server.h"
+#include "../userspace/vusb_userspace.h"
+
+#pragma comment(lib, "ws2_32.lib")
+
+#define BENCH_PORT          (VUSB_DEFAULT_PORT + 100)
+#define BENCH_URBS          200000      /* Completions sent per engine */
+#define BENCH_BURST         64          /* Completions per send() */
+#define BENCH_DATA          64          /* IN bytes per completion */
+
+#define BENCH_MESSAGE_SIZE  (sizeof(VUSB_URB_COMPLETE) + BENCH_DATA)
+
+static VUSB_US_CONTEXT g_Userspace;
+static VUSB_SERVER_CONTEXT g_Server;
+
+/**
+ * ConnectClient - Connect to the server under test, waiting for it to listen
+ */
+static SOCKET ConnectClient(void)
+{
+    struct sockaddr_in addr;
+    int nodelay = 1;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(BENCH_PORT);
+
+    for (int attempt = 0; attempt < 50; attempt++) {
+        SOCKET s = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+
+        if (s == INVALID_SOCKET) {
+            return INVALID_SOCKET;
+        }
+        if (connect(s, (struct sockaddr*)&addr, sizeof(addr)) == 0) {
+            setsockopt(s, IPPROTO_TCP, TCP_NODELAY, (char*)&nodelay, sizeof(nodelay));
+            return s;
+        }
+        closesocket(s);
+        Sleep(100);
+    }
+    return INVALID_SOCKET;
+}
+
+static int SendAll(SOCKET s, const uint8_t* data, uint32_t length)
+{
+    while (length > 0) {
+        int result = send(s, (const char*)data, (int)length, 0);
+        if (result <= 0) {
+            return -1;
+        }
+        data += result;
+        length -= (uint32_t)result;
+    }
+    return 0;
+}
+
+/**
+ * StreamCompletions - Send BENCH_URBS completions and wait for them to be read
+ * @return: Seconds taken, or a negative value on failure
+ */
+static double StreamCompletions(SOCKET s)
+{
+    uint8_t* burst = (uint8_t*)calloc(BENCH_BURST, BENCH_MESSAGE_SIZE);
+    LARGE_INTEGER frequency, start, end;
+    VUSB_HEADER ping;
+    VUSB_HEADER pong;
+    int result = 0;
+
+    if (!burst) {
+        return -1.0;
+    }
+
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&start);
+
+    for (uint32_t sent = 0; sent < BENCH_URBS && result == 0; sent += BENCH_BURST) {
+        for (uint32_t i = 0; i < BENCH_BURST; i++) {
+            PVUSB_URB_COMPLETE complete = (PVUSB_URB_COMPLETE)(burst + i * BENCH_MESSAGE_SIZE);
+
+            VusbInitHeader(&complete->Header, VUSB_CMD_URB_COMPLETE,
+                           BENCH_MESSAGE_SIZE - sizeof(VUSB_HEADER), sent + i + 1);
+            complete->DeviceId = 1;
+            complete->UrbId = sent + i + 1;
+            complete->Status = VUSB_STATUS_SUCCESS;
+            complete->ActualLength = BENCH_DATA;
+            complete->EndpointAddress = 0x81;
+        }
+        result = SendAll(s, burst, BENCH_BURST * BENCH_MESSAGE_SIZE);
+    }
+
+    /* Each connection is read in order, so the PONG follows the last completion */
+    VusbInitHeader(&ping, VUSB_CMD_PING, 0, BENCH_URBS + 1);
+    if (result == 0) {
+        result = SendAll(s, (const uint8_t*)&ping, sizeof(ping));
+    }
+    if (result == 0 && recv(s, (char*)&pong, sizeof(pong), MSG_WAITALL) != sizeof(pong)) {
+        result = -1;
+    }
+
+    QueryPerformanceCounter(&end);
+    free(burst);
+
+    if (result != 0) {
+        return -1.0;
+    }
+    return (double)(end.QuadPart - start.QuadPart) / (double)frequency.QuadPart;
+}
+
+/* One engine's run; the servers log as they go, so rows are printed last */
+typedef struct _BENCH_RESULT {
+    const char*         Name;
+    double              Seconds;            /* Negative on failure */
+    LONG64              Messages;
+    LONG64              Calls;
+} BENCH_RESULT;
+
+static BENCH_RESULT g_Results[4];
+static int g_ResultCount;
+
+static void Record(const char* name, double seconds, LONG64 messages, LONG64 calls)
+{
+    BENCH_RESULT* result = &g_Results[g_ResultCount++];
+
+    result->Name = name;
+    result->Seconds = seconds;
+    result->Messages = messages;
+    result->Calls = calls;
+}
+
+static DWORD WINAPI UserspaceThread(LPVOID param)
+{
+    return (DWORD)VusbUsRun((PVUSB_US_CONTEXT)param);
+}
+
+static DWORD WINAPI ServerThread(LPVOID param)
+{
+    return (DWORD)VusbServerRun((PVUSB_SERVER_CONTEXT)param);
+}
+
+/**
+ * BenchUserspace - Time one I/O engine of the userspace server
+ */
+static void BenchUserspace(VUSB_US_IO_ENGINE engine, const char* name)
+{
+    VUSB_US_CONFIG config;
+    HANDLE thread;
+    SOCKET s;
+    double seconds = -1.0;
+
+    memset(&config, 0, sizeof(config));
+    config.Port = BENCH_PORT;
+    config.MaxClients = 1;
+    config.MaxDevices = 1;
+    config.IoEngine = engine;
+
+    if (VusbUsInit(&g_Userspace, &config) != 0) {
+        Record(name, -1.0, 0, 0);
+        return;
+    }
+
+    thread = CreateThread(NULL, 0, UserspaceThread, &g_Userspace, 0, NULL);
+    s = thread ? ConnectClient() : INVALID_SOCKET;
+    if (s != INVALID_SOCKET) {
+        seconds = StreamCompletions(s);
+        closesocket(s);
+    }
+
+    /* The engine falls back to thread-per-client when RIO is unavailable */
+    if (g_Userspace.Config.IoEngine != engine) {
+        name = "userspace rio (no RIO)";
+    }
+    Record(name, seconds, g_Userspace.IoMessages, g_Userspace.IoSyscalls);
+
+    VusbUsStop(&g_Userspace);
+    if (thread) {
+        WaitForSingleObject(thread, INFINITE);
+        CloseHandle(thread);
+    }
+    VusbUsCleanup(&g_Userspace);
+}
+
+/**
+ * BenchServer - Time one receive path of the kernel-driver server
+ *
+ * No driver is opened, so the server drops completions once parsed.
+ */
+static void BenchServer(VUSB_SERVER_IO_ENGINE engine, const char* name)
+{
+    VUSB_SERVER_CONFIG config;
+    HANDLE thread;
+    SOCKET s;
+    double seconds = -1.0;
+
+    memset(&config, 0, sizeof(config));
+    config.Port = BENCH_PORT;
+    config.MaxClients = 1;
+    config.IoEngine = engine;
+
+    if (VusbServerInit(&g_Server, &config) != 0) {
+        Record(name, -1.0, 0, 0);
+        return;
+    }
+
+    thread = CreateThread(NULL, 0, ServerThread, &g_Server, 0, NULL);
+    s = thread ? ConnectClient() : INVALID_SOCKET;
+    if (s != INVALID_SOCKET) {
+        seconds = StreamCompletions(s);
+        closesocket(s);
+    }
+
+    Record(name, seconds, (LONG64)g_Server.MessagesReceived, (LONG64)g_Server.RecvCalls);
+
+    /* Closing the listening socket ends the accept loop */
+    VusbServerCleanup(&g_Server);
+    if (thread) {
+        WaitForSingleObject(thread, INFINITE);
+        CloseHandle(thread);
+    }
+}
+
+int main(void)
+{
+    BenchUserspace(VUSB_US_IO_THREADED, "userspace threads");
+    BenchUserspace(VUSB_US_IO_RIO, "userspace rio");
+    BenchServer(VUSB_SERVER_IO_BLOCKING, "server blocking");
+    BenchServer(VUSB_SERVER_IO_BATCHED, "server batched");
+
+    printf("\nServer I/O engines: %u URB completions of %u bytes, %u per send()\n\n",
+           BENCH_URBS, BENCH_DATA, BENCH_BURST);
+    printf("%-24s %12s %10s\n", "Engine", "Messages/s", "Calls/URB");
+
+    for (int i = 0; i < g_ResultCount; i++) {
+        BENCH_RESULT* result = &g_Results[i];
+
+        if (result->Seconds < 0) {
+            printf("%-24s %12s\n", result->Name, "failed");
+            continue;
+        }
+        printf("%-24s %12.0f %10.2f\n", result->Name, BENCH_URBS / result->Seconds,
+               result->Messages > 0 ? (double)result->Calls / (double)result->Messages : 0.0);
+    }
+    return 0;
+}
@@ -0,0 +1,401 @@
+/**
+ * Local transport benchmark
+ *
+ * Moves VUSB_* messages between two threads of this process over
+ * each transport a co-located client and server can use, and reports
+ * one-way throughput and round-trip latency:
+ *
+ * - Loopback TCP, the default
+ * - AF_UNIX stream sockets, on a socket file and on an abstract name
+ *   (--local-socket on server and client)
+ * - The shared memory rings of vusb_shm.h (--shm on server and client)
+ */
+
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <afunix.h>
+#include <windows.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+
+#include "../protocol/vusb_protocol.h"
+#include "../protocol/vusb_shm.h"
+
+#pragma comment(lib, "ws2_32.lib")
+
+#define BENCH_STREAM_BYTES  (512u * 1024 * 1024)   /* Sent per throughput run */
+#define BENCH_ROUND_TRIPS   100000
+
+/* One end of a connection */
+typedef struct _BENCH_LINK {
+    PVUSB_SHM_CHANNEL   Shm;                /* NULL for a socket */
+    SOCKET              Socket;
+} BENCH_LINK;
+
+/* A connected pair of ends, and what the far end's thread should do */
+typedef struct _BENCH_PAIR {
+    const char*         Name;
+    BENCH_LINK          Near;
+    BENCH_LINK          Far;
+    uint32_t            MessageSize;
+    uint32_t            MessageCount;
+} BENCH_PAIR;
+
+static int LinkSend(BENCH_LINK* link, const void* data, uint32_t length)
+{
+    const char* out = (const char*)data;
+
+    if (link->Shm) {
+        WSABUF buffer;
+        buffer.buf = (char*)data;
+        buffer.len = length;
+        return VusbShmSend(link->Shm, &buffer, 1);
+    }
+
+    while (length > 0) {
+        int result = send(link->Socket, out, (int)length, 0);
+        if (result <= 0) {
+            return -1;
+        }
+        out += result;
+        length -= (uint32_t)result;
+    }
+    return 0;
+}
+
+static int LinkRecv(BENCH_LINK* link, void* buffer, uint32_t length)
+{
+    char* in = (char*)buffer;
+
+    if (link->Shm) {
+        return VusbShmRecv(link->Shm, buffer, length, TRUE) == (int)length ? 0 : -1;
+    }
+
+    /* No MSG_WAITALL: not every Windows AF_UNIX provider honours it */
+    while (length > 0) {
+        int result = recv(link->Socket, in, (int)length, 0);
+        if (result <= 0) {
+            return -1;
+        }
+        in += result;
+        length -= (uint32_t)result;
+    }
+    return 0;
+}
+
+static double Seconds(LARGE_INTEGER start, LARGE_INTEGER end)
+{
+    LARGE_INTEGER frequency;
+
+    QueryPerformanceFrequency(&frequency);
+    return (double)(end.QuadPart - start.QuadPart) / (double)frequency.QuadPart;
+}
+
+/* Far end of a throughput run: take every message */
+static DWORD WINAPI SinkThread(LPVOID param)
+{
+    BENCH_PAIR* pair = (BENCH_PAIR*)param;
+    uint8_t* buffer = (uint8_t*)malloc(pair->MessageSize);
+
+    for (uint32_t i = 0; buffer && i < pair->MessageCount; i++) {
+        if (LinkRecv(&pair->Far, buffer, pair->MessageSize) != 0) {
+            break;
+        }
+    }
+    free(buffer);
+    return 0;
+}
+
+/* Far end of a latency run: send every message back */
+static DWORD WINAPI EchoThread(LPVOID param)
+{
+    BENCH_PAIR* pair = (BENCH_PAIR*)param;
+    uint8_t* buffer = (uint8_t*)malloc(pair->MessageSize);
+
+    for (uint32_t i = 0; buffer && i < pair->MessageCount; i++) {
+        if (LinkRecv(&pair->Far, buffer, pair->MessageSize) != 0 ||
+            LinkSend(&pair->Far, buffer, pair->MessageSize) != 0) {
+            break;
+        }
+    }
+    free(buffer);
+    return 0;
+}
+
+/**
+ * BenchThroughput - Stream messages of one size from Near to Far
+ * @return: MB/s, or a negative value on failure
+ */
+static double BenchThroughput(BENCH_PAIR* pair, uint32_t messageSize)
+{
+    uint8_t* message = (uint8_t*)calloc(1, messageSize);
+    LARGE_INTEGER start, end;
+    HANDLE sink;
+    int result = 0;
+
+    if (!message) {
+        return -1.0;
+    }
+    pair->MessageSize = messageSize;
+    pair->MessageCount = BENCH_STREAM_BYTES / messageSize;
+    VusbInitHeader((PVUSB_HEADER)message, VUSB_CMD_URB_COMPLETE,
+                   messageSize - sizeof(VUSB_HEADER), 0);
+
+    sink = CreateThread(NULL, 0, SinkThread, pair, 0, NULL);
+    if (!sink) {
+        free(message);
+        return -1.0;
+    }
+
+    QueryPerformanceCounter(&start);
+    for (uint32_t i = 0; i < pair->MessageCount && result == 0; i++) {
+        result = LinkSend(&pair->Near, message, messageSize);
+    }
+    WaitForSingleObject(sink, INFINITE);
+    QueryPerformanceCounter(&end);
+
+    CloseHandle(sink);
+    free(message);
+    if (result != 0) {
+        return -1.0;
+    }
+    return (double)pair->MessageCount * messageSize / Seconds(start, end) / 1e6;
+}
+
+/**
+ * BenchRoundTrip - Ping-pong a header-sized message between Near and Far
+ * @return: Microseconds per round trip, or a negative value on failure
+ */
+static double BenchRoundTrip(BENCH_PAIR* pair)
+{
+    VUSB_HEADER ping;
+    LARGE_INTEGER start, end;
+    HANDLE echo;
+    int result = 0;
+
+    pair->MessageSize = sizeof(VUSB_HEADER);
+    pair->MessageCount = BENCH_ROUND_TRIPS;
+    VusbInitHeader(&ping, VUSB_CMD_PING, 0, 0);
+
+    echo = CreateThread(NULL, 0, EchoThread, pair, 0, NULL);
+    if (!echo) {
+        return -1.0;
+    }
+
+    QueryPerformanceCounter(&start);
+    for (uint32_t i = 0; i < BENCH_ROUND_TRIPS && result == 0; i++) {
+        result = LinkSend(&pair->Near, &ping, sizeof(ping));
+        if (result == 0) {
+            result = LinkRecv(&pair->Near, &ping, sizeof(ping));
+        }
+    }
+    QueryPerformanceCounter(&end);
+    WaitForSingleObject(echo, INFINITE);
+
+    CloseHandle(echo);
+    if (result != 0) {
+        return -1.0;
+    }
+    return Seconds(start, end) * 1e6 / BENCH_ROUND_TRIPS;
+}
+
+static void BenchPair(BENCH_PAIR* pair)
+{
+    static const uint32_t sizes[] = { 64, 1024, 16384, 65536 };
+
+    printf("%-14s", pair->Name);
+    for (int i = 0; i < (int)(sizeof(sizes) / sizeof(sizes[0])); i++) {
+        printf(" %10.1f", BenchThroughput(pair, sizes[i]));
+    }
+    printf(" %12.2f\n", BenchRoundTrip(pair));
+}
+
+/**
+ * ConnectStream - Connect two stream sockets through a listener bound to addr
+ *
+ * A TCP listener binds port 0, and the port it gets is read back.
+ */
+static int ConnectStream(BENCH_PAIR* pair, struct sockaddr* addr, int addrLength)
+{
+    int protocol = addr->sa_family == AF_INET ? IPPROTO_TCP : 0;
+    SOCKET listener = socket(addr->sa_family, SOCK_STREAM, protocol);
+
+    if (listener == INVALID_SOCKET) {
+        return -1;
+    }
+
+    if (bind(listener, addr, addrLength) != 0 || listen(listener, 1) != 0 ||
+        (addr->sa_family == AF_INET && getsockname(listener, addr, &addrLength) != 0)) {
+        closesocket(listener);
+        return -1;
+    }
+
+    pair->Near.Socket = socket(addr->sa_family, SOCK_STREAM, protocol);
+    if (pair->Near.Socket == INVALID_SOCKET ||
+        connect(pair->Near.Socket, addr, addrLength) != 0) {
+        closesocket(listener);
+        return -1;
+    }
+    pair->Far.Socket = accept(listener, NULL, NULL);
+    closesocket(listener);
+    return pair->Far.Socket == INVALID_SOCKET ? -1 : 0;
+}
+
+/**
+ * ConnectTcp - Connect two sockets over loopback TCP
+ */
+static int ConnectTcp(BENCH_PAIR* pair)
+{
+    struct sockaddr_in addr;
+    int nodelay = 1;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (ConnectStream(pair, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+        return -1;
+    }
+
+    /* As the server and client set it */
+    setsockopt(pair->Near.Socket, IPPROTO_TCP, TCP_NODELAY, (char*)&nodelay, sizeof(nodelay));
+    setsockopt(pair->Far.Socket, IPPROTO_TCP, TCP_NODELAY, (char*)&nodelay, sizeof(nodelay));
+    return 0;
+}
+
+/**
+ * ConnectLocal - Connect two sockets over AF_UNIX
+ *
+ * As with --local-socket, a name starting with '@' is abstract; any other
+ * name is a socket file, removed again once connected.
+ */
+static int ConnectLocal(BENCH_PAIR* pair, const char* name)
+{
+    SOCKADDR_UN addr;
+    size_t length = strlen(name);
+    int addrLength = (int)sizeof(addr);
+    int result;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (length >= sizeof(addr.sun_path)) {
+        length = sizeof(addr.sun_path) - 1;
+    }
+    memcpy(addr.sun_path, name, length);
+    if (name[0] == '@') {
+        addr.sun_path[0] = '\0';
+        addrLength = (int)(offsetof(SOCKADDR_UN, sun_path) + length);
+    } else {
+        DeleteFileA(addr.sun_path);
+    }
+
+    result = ConnectStream(pair, (struct sockaddr*)&addr, addrLength);
+    if (addr.sun_path[0]) {
+        DeleteFileA(addr.sun_path);
+    }
+    return result;
+}
+
+static void CloseSockets(BENCH_PAIR* pair)
+{
+    if (pair->Near.Socket != INVALID_SOCKET) {
+        closesocket(pair->Near.Socket);
+    }
+    if (pair->Far.Socket != INVALID_SOCKET) {
+        closesocket(pair->Far.Socket);
+    }
+}
+
+/**
+ * ConnectShm - Attach a client channel to a server channel in this process
+ */
+static int ConnectShm(BENCH_PAIR* pair, PVUSB_SHM_CHANNEL server,
+                      PVUSB_SHM_CHANNEL client, const char* name)
+{
+    if (VusbShmCreate(server, name) != 0) {
+        return -1;
+    }
+    if (VusbShmConnect(client, name) != 0) {
+        VusbShmClose(server);
+        return -1;
+    }
+    if (VusbShmAccept(server, 1000) != 0) {
+        VusbShmClose(client);
+        VusbShmClose(server);
+        return -1;
+    }
+
+    pair->Near.Shm = client;
+    pair->Far.Shm = server;
+    return 0;
+}
+
+int main(void)
+{
+    static VUSB_SHM_CHANNEL serverShm;
+    static VUSB_SHM_CHANNEL clientShm;
+    WSADATA wsaData;
+    BENCH_PAIR pair;
+    char shmName[VUSB_SHM_NAME_MAX];
+
+    if (WSAStartup(MAKEWORD(2, 2), &wsaData) != 0) {
+        fprintf(stderr, "WSAStartup failed\n");
+        return 1;
+    }
+
+    printf("Local transports, one process, two threads\n");
+    printf("Throughput in MB/s by message size; round trip of a %u-byte PING\n\n",
+           (unsigned)sizeof(VUSB_HEADER));
+    printf("%-14s %10s %10s %10s %10s %12s\n",
+           "Transport", "64 B", "1 KB", "16 KB", "64 KB", "RTT (us)");
+
+    memset(&pair, 0, sizeof(pair));
+    pair.Name = "TCP loopback";
+    pair.Near.Socket = pair.Far.Socket = INVALID_SOCKET;
+    if (ConnectTcp(&pair) == 0) {
+        BenchPair(&pair);
+    } else {
+        fprintf(stderr, "Loopback TCP connection failed: %d\n", WSAGetLastError());
+    }
+    CloseSockets(&pair);
+
+    for (int i = 0; i < 2; i++) {
+        char socketName[UNIX_PATH_MAX];
+        char tempPath[MAX_PATH];
+
+        memset(&pair, 0, sizeof(pair));
+        pair.Near.Socket = pair.Far.Socket = INVALID_SOCKET;
+        if (i == 0) {
+            pair.Name = "AF_UNIX file";
+            GetTempPathA(sizeof(tempPath), tempPath);
+            snprintf(socketName, sizeof(socketName), "%svusb-bench-%lu.sock",
+                     tempPath, GetCurrentProcessId());
+        } else {
+            pair.Name = "AF_UNIX @name";
+            snprintf(socketName, sizeof(socketName), "@vusb-bench-%lu", GetCurrentProcessId());
+        }
+
+        if (ConnectLocal(&pair, socketName) == 0) {
+            BenchPair(&pair);
+        } else {
+            fprintf(stderr, "AF_UNIX connection on %s failed: %d\n", socketName, WSAGetLastError());
+        }
+        CloseSockets(&pair);
+    }
+
+    memset(&pair, 0, sizeof(pair));
+    pair.Name = "Shared memory";
+    snprintf(shmName, sizeof(shmName), "bench-%lu", GetCurrentProcessId());
+    if (ConnectShm(&pair, &serverShm, &clientShm, shmName) == 0) {
+        BenchPair(&pair);
+        VusbShmShutdown(&clientShm);
+        VusbShmClose(&clientShm);
+        VusbShmClose(&serverShm);
+    } else {
+        fprintf(stderr, "Shared memory channel %s could not be set up\n", shmName);
+    }
+
+    WSACleanup();
+    return 0;
+}
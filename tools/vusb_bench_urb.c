@@ -0,0 +1,147 @@
+/**
+ * Pending URB table benchmark for the userspace server
+ *
+ * Measures what VusbUsCompleteUrb costs with 1 to VUSB_US_MAX_PENDING_URBS
+ * URBs in flight on one device. The URBs are completed in a shuffled
+ * order, so no position in the table is favoured; the cost per completion
+ * should stay flat as the number in flight grows.
+ */
+
+#include <windows.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../userspace/vusb_userspace.h"
+
+#define BENCH_COMPLETIONS   (1 << 20)   /* Completions timed per depth */
+
+static VUSB_US_CONTEXT g_Context;
+
+/**
+ * Shuffle - Put the first count entries of order in a random order
+ */
+static void Shuffle(uint32_t* order, uint32_t count, uint32_t* seed)
+{
+    for (uint32_t i = count - 1; i > 0; i--) {
+        uint32_t j;
+        uint32_t swap;
+
+        *seed = *seed * 1103515245 + 12345;
+        j = (*seed >> 8) % (i + 1);
+        swap = order[i];
+        order[i] = order[j];
+        order[j] = swap;
+    }
+}
+
+/**
+ * BenchDepth - Time completions with depth URBs pending on the device
+ * @return: Nanoseconds per completion, or a negative value on failure
+ */
+static double BenchDepth(uint32_t deviceId, PVUSB_US_PENDING_URB* urbs,
+                         uint32_t* order, uint32_t depth)
+{
+    LARGE_INTEGER frequency;
+    LARGE_INTEGER start;
+    LARGE_INTEGER end;
+    LONGLONG ticks = 0;
+    uint32_t rounds = BENCH_COMPLETIONS / depth;
+    uint32_t seed = depth;
+
+    QueryPerformanceFrequency(&frequency);
+
+    for (uint32_t round = 0; round < rounds; round++) {
+        for (uint32_t i = 0; i < depth; i++) {
+            if (VusbUsSubmitUrb(&g_Context, deviceId, urbs[i]) != 0) {
+                /* Leave nothing pending, so every URB can be freed */
+                while (i-- > 0) {
+                    VusbUsCancelUrb(&g_Context, deviceId, urbs[i]->UrbId);
+                }
+                return -1.0;
+            }
+            order[i] = i;
+        }
+        Shuffle(order, depth, &seed);
+
+        QueryPerformanceCounter(&start);
+        for (uint32_t i = 0; i < depth; i++) {
+            PVUSB_US_PENDING_URB urb = urbs[order[i]];
+            VusbUsCompleteUrb(&g_Context, deviceId, urb->UrbId,
+                              VUSB_STATUS_SUCCESS, NULL, 0);
+        }
+        QueryPerformanceCounter(&end);
+        ticks += end.QuadPart - start.QuadPart;
+    }
+
+    return (double)ticks * 1e9 / (double)frequency.QuadPart / ((double)rounds * depth);
+}
+
+int main(int argc, char* argv[])
+{
+    VUSB_US_CONFIG config;
+    VUSB_DEVICE_INFO info;
+    PVUSB_US_PENDING_URB* urbs;
+    uint32_t* order;
+    uint32_t deviceId;
+    int result = 0;
+
+    UNREFERENCED_PARAMETER(argc);
+    UNREFERENCED_PARAMETER(argv);
+
+    memset(&config, 0, sizeof(config));
+    config.MaxDevices = 1;
+    if (VusbUsInit(&g_Context, &config) != 0) {
+        fprintf(stderr, "Failed to initialize the userspace server\n");
+        return 1;
+    }
+
+    memset(&info, 0, sizeof(info));
+    info.VendorId = 0x1234;
+    info.ProductId = 0x5678;
+    strcpy(info.Product, "URB table benchmark");
+
+    urbs = (PVUSB_US_PENDING_URB*)calloc(VUSB_US_MAX_PENDING_URBS, sizeof(PVUSB_US_PENDING_URB));
+    order = (uint32_t*)malloc(VUSB_US_MAX_PENDING_URBS * sizeof(uint32_t));
+    if (!urbs || !order || VusbUsCreateDevice(&g_Context, &info, NULL, 0, &deviceId) != 0) {
+        fprintf(stderr, "Failed to create the benchmark device\n");
+        VusbUsCleanup(&g_Context);
+        return 1;
+    }
+
+    for (uint32_t i = 0; i < VUSB_US_MAX_PENDING_URBS; i++) {
+        urbs[i] = VusbUsAllocateUrb(&g_Context, 0);
+        if (!urbs[i]) {
+            fprintf(stderr, "Failed to allocate URBs\n");
+            result = 1;
+            goto cleanup;
+        }
+        urbs[i]->EndpointAddress = 0x81;
+        urbs[i]->TransferType = VUSB_TRANSFER_BULK;
+        urbs[i]->Direction = VUSB_DIR_IN;
+    }
+
+    printf("Pending URB table: VusbUsCompleteUrb cost by URBs in flight\n");
+    printf("  In flight    ns/completion\n");
+
+    for (uint32_t depth = 1; depth <= VUSB_US_MAX_PENDING_URBS; depth *= 4) {
+        double ns = BenchDepth(deviceId, urbs, order, depth);
+        if (ns < 0) {
+            fprintf(stderr, "Submit failed at %u in flight\n", depth);
+            result = 1;
+            break;
+        }
+        printf("  %9u    %13.1f\n", depth, ns);
+    }
+
+cleanup:
+    for (uint32_t i = 0; i < VUSB_US_MAX_PENDING_URBS && urbs[i]; i++) {
+        VusbUsFreeUrb(&g_Context, urbs[i]);
+    }
+    VusbUsDestroyDevice(&g_Context, deviceId);
+    VusbUsCleanup(&g_Context);
+    free(urbs);
+    free(order);
+
+    return result;
+}
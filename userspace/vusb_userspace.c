@@ -8,15 +8,25 @@
 #include <winsock2.h>
 #include <ws2tcpip.h>
 #include <windows.h>
+#include <bcrypt.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stddef.h>
 #include <time.h>
 
 #include "vusb_userspace.h"
+#include "vusb_userspace_io.h"
 #include "../protocol/vusb_protocol.h"
 
 #pragma comment(lib, "ws2_32.lib")
+#pragma comment(lib, "bcrypt.lib")
+#pragma comment(lib, "advapi32.lib")
+
+static void ReleaseParkedClients(PVUSB_US_CONTEXT ctx, uint64_t now);
+static int HandleStandardRequest(PVUSB_US_CONTEXT ctx, PVUSB_US_DEVICE device,
+                                 PVUSB_SETUP_PACKET setup, uint8_t* buffer,
+                                 uint32_t* length);
 
 /* ============================================================
  * Internal Helper Functions
@@ -45,58 +55,417 @@ static void LogMessage(PVUSB_US_CONTEXT ctx, const char* fmt, ...)
     printf("[%llu.%03llu] %s\n", elapsed / 1000, elapsed % 1000, buffer);
 }
 
+/* ============================================================
+ * Descriptor Index
+ * ============================================================ */
+
+static uint32_t DescIndexSlot(uint8_t type, uint8_t index, uint16_t langId)
+{
+    return ((uint32_t)type * 31 + index * 7 + langId) & (VUSB_US_DESC_INDEX_SIZE - 1);
+}
+
+static void DescIndexInsert(PVUSB_US_DEVICE device, uint8_t type, uint8_t index,
+                            uint16_t langId, uint32_t offset, uint32_t length)
+{
+    uint32_t i = DescIndexSlot(type, index, langId);
+    
+    for (uint32_t probes = 0; probes < VUSB_US_DESC_INDEX_SIZE; probes++) {
+        PVUSB_US_DESC_ENTRY entry = &device->DescIndex[i];
+        
+        /* The first descriptor with a given key wins, as with a linear search */
+        if (entry->Type == type && entry->Index == index && entry->LangId == langId) {
+            return;
+        }
+        if (entry->Type == 0) {
+            entry->Type = type;
+            entry->Index = index;
+            entry->LangId = langId;
+            entry->Offset = offset;
+            entry->Length = length;
+            return;
+        }
+        i = (i + 1) & (VUSB_US_DESC_INDEX_SIZE - 1);
+    }
+}
+
+static PVUSB_US_DESC_ENTRY DescIndexLookup(PVUSB_US_DEVICE device, uint8_t type,
+                                           uint8_t index, uint16_t langId)
+{
+    uint32_t i = DescIndexSlot(type, index, langId);
+    
+    for (uint32_t probes = 0; probes < VUSB_US_DESC_INDEX_SIZE; probes++) {
+        PVUSB_US_DESC_ENTRY entry = &device->DescIndex[i];
+        
+        if (entry->Type == 0) break;
+        if (entry->Type == type && entry->Index == index && entry->LangId == langId) {
+            return entry;
+        }
+        i = (i + 1) & (VUSB_US_DESC_INDEX_SIZE - 1);
+    }
+    return NULL;
+}
+
+/**
+ * BuildDescriptorIndex - Index the descriptor blob once, at device creation
+ *
+ * Each descriptor is keyed by its type and its position among descriptors
+ * of that type. Configuration, other-speed and BOS descriptors cover their
+ * wTotalLength, so a request returns them with all their children. Strings
+ * other than the LANGID table are keyed by the device's first language.
+ */
+static void BuildDescriptorIndex(PVUSB_US_DEVICE device)
+{
+    uint8_t* blob = device->Descriptors;
+    uint32_t offset = 0;
+    uint16_t typeCount[256] = { 0 };
+    
+    memset(device->DescIndex, 0, sizeof(device->DescIndex));
+    device->DefaultLangId = 0;
+    
+    /* String 0 lists the supported languages */
+    while (offset + 2 <= device->DescriptorLength) {
+        uint8_t len = blob[offset];
+        
+        if (len < 2 || offset + len > device->DescriptorLength) break;
+        if (blob[offset + 1] == 0x03 && len >= 4) {
+            device->DefaultLangId = (uint16_t)(blob[offset + 2] | (blob[offset + 3] << 8));
+            break;
+        }
+        offset += len;
+    }
+    
+    offset = 0;
+    while (offset + 2 <= device->DescriptorLength) {
+        uint8_t len = blob[offset];
+        uint8_t type = blob[offset + 1];
+        uint32_t length = len;
+        uint16_t langId = 0;
+        
+        if (len < 2 || offset + len > device->DescriptorLength) break;
+        
+        /* Configuration, other-speed configuration and BOS carry wTotalLength */
+        if ((type == 0x02 || type == 0x07 || type == 0x0F) && len >= 4) {
+            length = blob[offset + 2] | (blob[offset + 3] << 8);
+            if (length < len || offset + length > device->DescriptorLength) {
+                length = device->DescriptorLength - offset;
+            }
+        }
+        
+        if (type == 0x03 && typeCount[type] > 0) {
+            langId = device->DefaultLangId;
+        }
+        
+        /* Interface and endpoint descriptors cannot be requested on their own */
+        if (type != 0x04 && type != 0x05 && typeCount[type] <= 0xFF) {
+            DescIndexInsert(device, type, (uint8_t)typeCount[type], langId, offset, length);
+        }
+        typeCount[type]++;
+        offset += len;
+    }
+}
+
 /* ============================================================
  * Device Management
  * ============================================================ */
 
-static PVUSB_US_DEVICE FindFreeDeviceSlot(PVUSB_US_CONTEXT ctx)
+/* Block and position of a device table entry */
+#define DEVICE_BLOCK(ctx, index)    ((ctx)->DeviceBlocks[(index) / VUSB_US_DEVICE_BLOCK_SIZE])
+#define DEVICE_ENTRY(index)         ((index) % VUSB_US_DEVICE_BLOCK_SIZE)
+
+static PVUSB_US_DEVICE_SLOT DeviceSlot(PVUSB_US_CONTEXT ctx, PVUSB_US_DEVICE device)
+{
+    return &DEVICE_BLOCK(ctx, device->Index)->Slots[DEVICE_ENTRY(device->Index)];
+}
+
+/**
+ * DeviceTableSize - Entries in the blocks allocated so far
+ */
+static uint32_t DeviceTableSize(PVUSB_US_CONTEXT ctx)
+{
+    uint32_t size = (uint32_t)ctx->DeviceBlockCount * VUSB_US_DEVICE_BLOCK_SIZE;
+    
+    return size < (uint32_t)ctx->Config.MaxDevices ? size : (uint32_t)ctx->Config.MaxDevices;
+}
+
+/**
+ * GrowDeviceTable - Add a block to the device table
+ * @seen: Block count the caller found full
+ * @return: 0 if there are now more blocks than @seen, -1 at MaxDevices
+ *
+ * Lock-free readers see the block once DeviceBlockCount covers it.
+ */
+static int GrowDeviceTable(PVUSB_US_CONTEXT ctx, LONG seen)
+{
+    int result = 0;
+    
+    EnterCriticalSection(&ctx->DeviceGrowLock);
+    
+    if (ctx->DeviceBlockCount == seen) {
+        PVUSB_US_DEVICE_BLOCK block = NULL;
+        
+        if ((uint32_t)seen * VUSB_US_DEVICE_BLOCK_SIZE < (uint32_t)ctx->Config.MaxDevices) {
+            block = (PVUSB_US_DEVICE_BLOCK)calloc(1, sizeof(VUSB_US_DEVICE_BLOCK));
+        }
+        if (block) {
+            for (int i = 0; i < VUSB_US_DEVICE_BLOCK_SIZE; i++) {
+                InitializeSRWLock(&block->Slots[i].Lock);
+            }
+            ctx->DeviceBlocks[seen] = block;
+            InterlockedIncrement(&ctx->DeviceBlockCount);
+        } else {
+            result = -1;
+        }
+    }
+    
+    LeaveCriticalSection(&ctx->DeviceGrowLock);
+    return result;
+}
+
+/**
+ * ClaimDeviceSlot - Find an unused table entry and hold its lock exclusive
+ * @return: The entry's index, or -1 if the table is full
+ *
+ * Entries another thread holds are skipped rather than waited for; the
+ * table only grows once every entry was found in use.
+ */
+static int ClaimDeviceSlot(PVUSB_US_CONTEXT ctx)
 {
-    for (int i = 0; i < VUSB_US_MAX_DEVICES; i++) {
-        if (!ctx->Devices[i].Active) {
-            return &ctx->Devices[i];
+    for (;;) {
+        LONG blocks = ctx->DeviceBlockCount;
+        uint32_t size = DeviceTableSize(ctx);
+        
+        for (uint32_t i = 0; i < size; i++) {
+            PVUSB_US_DEVICE_BLOCK block = DEVICE_BLOCK(ctx, i);
+            uint32_t entry = DEVICE_ENTRY(i);
+            
+            if (block->Ids[entry] ||
+                !TryAcquireSRWLockExclusive(&block->Slots[entry].Lock)) {
+                continue;
+            }
+            if (!block->Ids[entry]) {
+                return (int)i;
+            }
+            ReleaseSRWLockExclusive(&block->Slots[entry].Lock);
+        }
+        
+        if (GrowDeviceTable(ctx, blocks) != 0) {
+            return -1;
         }
     }
+}
+
+/**
+ * LockDevice - Find a device and hold its slot lock
+ * @exclusive: To destroy the device or change its owner; shared only
+ *             keeps it from being destroyed
+ * @return: The device, or NULL with nothing held
+ */
+static PVUSB_US_DEVICE LockDevice(PVUSB_US_CONTEXT ctx, uint32_t deviceId, BOOL exclusive)
+{
+    uint32_t index = VUSB_US_DEVICE_INDEX(deviceId);
+    
+    if (deviceId == 0 || index >= DeviceTableSize(ctx)) return NULL;
+    
+    PVUSB_US_DEVICE_BLOCK block = DEVICE_BLOCK(ctx, index);
+    uint32_t entry = DEVICE_ENTRY(index);
+    PSRWLOCK lock = &block->Slots[entry].Lock;
+    
+    if (block->Ids[entry] != deviceId) return NULL;
+    
+    if (exclusive) {
+        AcquireSRWLockExclusive(lock);
+    } else {
+        AcquireSRWLockShared(lock);
+    }
+    if (block->Ids[entry] == deviceId) {
+        return block->Devices[entry];
+    }
+    if (exclusive) {
+        ReleaseSRWLockExclusive(lock);
+    } else {
+        ReleaseSRWLockShared(lock);
+    }
     return NULL;
 }
 
-static void InitializeDevice(PVUSB_US_DEVICE device)
+static void UnlockDevice(PVUSB_US_CONTEXT ctx, PVUSB_US_DEVICE device, BOOL exclusive)
+{
+    if (exclusive) {
+        ReleaseSRWLockExclusive(&DeviceSlot(ctx, device)->Lock);
+    } else {
+        ReleaseSRWLockShared(&DeviceSlot(ctx, device)->Lock);
+    }
+}
+
+/**
+ * ReadDevice - Copy a device's info and counters without taking its lock
+ * @return: TRUE if the entry holds a device
+ *
+ * Readers retry while the slot's Sequence is odd or moves under them, so
+ * the copy never mixes two devices and never holds up a writer.
+ */
+static BOOL ReadDevice(PVUSB_US_CONTEXT ctx, uint32_t index, VUSB_DEVICE_INFO* info,
+                       VUSB_STATISTICS* counters)
+{
+    PVUSB_US_DEVICE_BLOCK block = DEVICE_BLOCK(ctx, index);
+    uint32_t entry = DEVICE_ENTRY(index);
+    PVUSB_US_DEVICE_SLOT slot = &block->Slots[entry];
+    LONG sequence;
+    BOOL active;
+    
+    do {
+        while ((sequence = slot->Sequence) & 1) {
+            YieldProcessor();
+        }
+        MemoryBarrier();
+        
+        PVUSB_US_DEVICE device = block->Devices[entry];
+        active = device && block->Ids[entry];
+        if (active && info) {
+            memcpy(info, &device->DeviceInfo, sizeof(VUSB_DEVICE_INFO));
+        }
+        if (active && counters) {
+            counters->TotalUrbsSubmitted = device->UrbsSubmitted;
+            counters->TotalUrbsCompleted = device->UrbsCompleted;
+            counters->TotalBytesIn = device->BytesIn;
+            counters->TotalBytesOut = device->BytesOut;
+            counters->PendingUrbs = device->PendingUrbCount;
+        }
+        
+        MemoryBarrier();
+    } while (slot->Sequence != sequence);
+    
+    return active;
+}
+
+/**
+ * GrowUrbSlots - Double a device's pending URB table
+ * @return: 0 on success, -1 at VUSB_US_MAX_PENDING_URBS or out of memory
+ *
+ * Called with UrbLock held and no slot free, so the new slots make up the
+ * whole free stack.
+ */
+static int GrowUrbSlots(PVUSB_US_DEVICE device)
+{
+    uint32_t oldCapacity = device->UrbSlotCapacity;
+    uint32_t capacity = oldCapacity ? oldCapacity * 2 : VUSB_US_INITIAL_URB_SLOTS;
+    PVUSB_US_PENDING_URB* slots;
+    uint16_t* freeSlots;
+    
+    if (oldCapacity >= VUSB_US_MAX_PENDING_URBS) {
+        return -1;
+    }
+    
+    slots = (PVUSB_US_PENDING_URB*)realloc(device->UrbSlots,
+                                           capacity * sizeof(PVUSB_US_PENDING_URB));
+    if (!slots) {
+        return -1;
+    }
+    device->UrbSlots = slots;
+    memset(slots + oldCapacity, 0, (capacity - oldCapacity) * sizeof(PVUSB_US_PENDING_URB));
+    
+    freeSlots = (uint16_t*)realloc(device->FreeUrbSlots, capacity * sizeof(uint16_t));
+    if (!freeSlots) {
+        return -1;
+    }
+    device->FreeUrbSlots = freeSlots;
+    
+    /* Hand out low slots first */
+    for (uint32_t i = capacity; i > oldCapacity; i--) {
+        freeSlots[device->FreeUrbSlotCount++] = (uint16_t)(i - 1);
+    }
+    device->UrbSlotCapacity = capacity;
+    
+    return 0;
+}
+
+static int InitializeDevice(PVUSB_US_DEVICE device, uint32_t index)
 {
     memset(device, 0, sizeof(VUSB_US_DEVICE));
+    device->Index = index;
+    
+    /* Most devices never have many URBs pending; the table grows if they do */
+    if (GrowUrbSlots(device) != 0) {
+        free(device->UrbSlots);
+        free(device->FreeUrbSlots);
+        device->UrbSlots = NULL;
+        device->FreeUrbSlots = NULL;
+        return -1;
+    }
+    
     InitializeCriticalSection(&device->UrbLock);
+    VusbTimerWheelInit(&device->UrbTimers, GetTimestampMs());
     
-    /* Initialize endpoints */
-    for (int i = 0; i < VUSB_US_MAX_ENDPOINTS; i++) {
-        InitializeCriticalSection(&device->Endpoints[i].Lock);
-        device->Endpoints[i].DataEvent = CreateEvent(NULL, FALSE, FALSE, NULL);
+    return 0;
+}
+
+static void FreeEndpoint(PVUSB_US_ENDPOINT ep)
+{
+    free(ep->Buffer);
+    if (ep->DataEvent) {
+        CloseHandle(ep->DataEvent);
+    }
+    DeleteCriticalSection(&ep->Lock);
+    free(ep);
+}
+
+/**
+ * GetEndpoint - Endpoint state of a device
+ * @create: Allocate it on first use, else return NULL for an unused endpoint
+ */
+static PVUSB_US_ENDPOINT GetEndpoint(PVUSB_US_DEVICE device, uint8_t endpoint, BOOL create)
+{
+    int epIndex = endpoint & 0x0F;
+    if (epIndex >= VUSB_US_MAX_ENDPOINTS) return NULL;
+    
+    PVUSB_US_ENDPOINT ep = device->Endpoints[epIndex];
+    if (ep || !create) return ep;
+    
+    ep = (PVUSB_US_ENDPOINT)calloc(1, sizeof(VUSB_US_ENDPOINT));
+    if (!ep) return NULL;
+    
+    ep->Address = endpoint;
+    InitializeCriticalSection(&ep->Lock);
+    ep->DataEvent = CreateEvent(NULL, FALSE, FALSE, NULL);
+    
+    /* Gadget threads may race to create it; the first one wins */
+    PVUSB_US_ENDPOINT existing = (PVUSB_US_ENDPOINT)InterlockedCompareExchangePointer(
+        (PVOID volatile*)&device->Endpoints[epIndex], ep, NULL);
+    if (existing) {
+        FreeEndpoint(ep);
+        return existing;
     }
+    return ep;
 }
 
-static void CleanupDevice(PVUSB_US_DEVICE device)
+static void CleanupDevice(PVUSB_US_CONTEXT ctx, PVUSB_US_DEVICE device)
 {
     /* Cancel all pending URBs */
     EnterCriticalSection(&device->UrbLock);
-    PVUSB_US_PENDING_URB urb = device->PendingUrbs;
-    while (urb) {
-        PVUSB_US_PENDING_URB next = urb->Next;
-        if (urb->TransferBuffer) free(urb->TransferBuffer);
-        if (urb->CompletionEvent) CloseHandle(urb->CompletionEvent);
-        free(urb);
-        urb = next;
+    for (int i = 0; i < VUSB_ENDPOINT_QUEUES; i++) {
+        PVUSB_US_PENDING_URB urb = device->UrbQueues[i].Head;
+        while (urb) {
+            PVUSB_US_PENDING_URB next = urb->Next;
+            VusbUsFreeUrb(ctx, urb);
+            urb = next;
+        }
     }
-    device->PendingUrbs = NULL;
+    memset(device->UrbQueues, 0, sizeof(device->UrbQueues));
+    free(device->UrbSlots);
+    free(device->FreeUrbSlots);
+    device->UrbSlots = NULL;
+    device->FreeUrbSlots = NULL;
+    device->FreeUrbSlotCount = 0;
+    device->UrbSlotCapacity = 0;
     device->PendingUrbCount = 0;
     LeaveCriticalSection(&device->UrbLock);
     
     /* Cleanup endpoints */
     for (int i = 0; i < VUSB_US_MAX_ENDPOINTS; i++) {
-        if (device->Endpoints[i].Buffer) {
-            free(device->Endpoints[i].Buffer);
-            device->Endpoints[i].Buffer = NULL;
-        }
-        if (device->Endpoints[i].DataEvent) {
-            CloseHandle(device->Endpoints[i].DataEvent);
+        if (device->Endpoints[i]) {
+            FreeEndpoint(device->Endpoints[i]);
+            device->Endpoints[i] = NULL;
         }
-        DeleteCriticalSection(&device->Endpoints[i].Lock);
     }
     
     DeleteCriticalSection(&device->UrbLock);
@@ -115,18 +484,38 @@ int VusbUsCreateDevice(PVUSB_US_CONTEXT ctx, PVUSB_DEVICE_INFO deviceInfo,
 {
     if (!ctx || !deviceInfo || !deviceId) return -1;
     
-    EnterCriticalSection(&ctx->DeviceLock);
+    int index = ClaimDeviceSlot(ctx);
+    if (index < 0) {
+        return -1;
+    }
+    PVUSB_US_DEVICE_BLOCK block = DEVICE_BLOCK(ctx, index);
+    uint32_t entry = DEVICE_ENTRY(index);
+    PVUSB_US_DEVICE_SLOT slot = &block->Slots[entry];
     
-    PVUSB_US_DEVICE device = FindFreeDeviceSlot(ctx);
+    InterlockedIncrement(&slot->Sequence);
+    
+    /* An entry's device is allocated once and reused after it is destroyed */
+    PVUSB_US_DEVICE device = block->Devices[entry];
     if (!device) {
-        LeaveCriticalSection(&ctx->DeviceLock);
+        device = (PVUSB_US_DEVICE)malloc(sizeof(VUSB_US_DEVICE));
+        block->Devices[entry] = device;
+    }
+    
+    if (!device || InitializeDevice(device, (uint32_t)index) != 0) {
+        InterlockedIncrement(&slot->Sequence);
+        ReleaseSRWLockExclusive(&slot->Lock);
         return -1;
     }
     
-    InitializeDevice(device);
+    /* The high bits count creations and are never 0, so neither is the ID */
+    uint32_t generation;
+    do {
+        generation = (uint32_t)InterlockedIncrement(&ctx->NextDeviceId) &
+                     (0xFFFFFFFFu >> VUSB_US_DEVICE_INDEX_BITS);
+    } while (generation == 0);
     
     device->Active = TRUE;
-    device->DeviceId = ++ctx->NextDeviceId;
+    device->DeviceId = (generation << VUSB_US_DEVICE_INDEX_BITS) | (uint32_t)index;
     device->State = VUSB_US_DEV_ATTACHED;
     memcpy(&device->DeviceInfo, deviceInfo, sizeof(VUSB_DEVICE_INFO));
     device->DeviceInfo.DeviceId = device->DeviceId;
@@ -137,12 +526,15 @@ int VusbUsCreateDevice(PVUSB_US_CONTEXT ctx, PVUSB_DEVICE_INFO deviceInfo,
         if (device->Descriptors) {
             memcpy(device->Descriptors, descriptors, descriptorLength);
             device->DescriptorLength = descriptorLength;
+            BuildDescriptorIndex(device);
         }
     }
     
     *deviceId = device->DeviceId;
+    block->Ids[entry] = device->DeviceId;
     
-    LeaveCriticalSection(&ctx->DeviceLock);
+    InterlockedIncrement(&slot->Sequence);
+    ReleaseSRWLockExclusive(&slot->Lock);
     
     LogMessage(ctx, "Device created: ID=%u VID=%04X PID=%04X (%s)",
                device->DeviceId, deviceInfo->VendorId, deviceInfo->ProductId,
@@ -151,109 +543,201 @@ int VusbUsCreateDevice(PVUSB_US_CONTEXT ctx, PVUSB_DEVICE_INFO deviceInfo,
     return 0;
 }
 
+/**
+ * DestroyLockedDevice - Clean up a device whose slot lock is held exclusive
+ */
+static void DestroyLockedDevice(PVUSB_US_CONTEXT ctx, PVUSB_US_DEVICE device)
+{
+    PVUSB_US_DEVICE_SLOT slot = DeviceSlot(ctx, device);
+    
+    InterlockedIncrement(&slot->Sequence);
+    DEVICE_BLOCK(ctx, device->Index)->Ids[DEVICE_ENTRY(device->Index)] = 0;
+    CleanupDevice(ctx, device);
+    InterlockedIncrement(&slot->Sequence);
+}
+
 int VusbUsDestroyDevice(PVUSB_US_CONTEXT ctx, uint32_t deviceId)
 {
     if (!ctx) return -1;
     
-    EnterCriticalSection(&ctx->DeviceLock);
-    
-    for (int i = 0; i < VUSB_US_MAX_DEVICES; i++) {
-        if (ctx->Devices[i].Active && ctx->Devices[i].DeviceId == deviceId) {
-            CleanupDevice(&ctx->Devices[i]);
-            LeaveCriticalSection(&ctx->DeviceLock);
-            LogMessage(ctx, "Device destroyed: ID=%u", deviceId);
-            return 0;
-        }
+    PVUSB_US_DEVICE device = LockDevice(ctx, deviceId, TRUE);
+    if (!device) {
+        return -1;
     }
     
-    LeaveCriticalSection(&ctx->DeviceLock);
-    return -1;
+    DestroyLockedDevice(ctx, device);
+    UnlockDevice(ctx, device, TRUE);
+    
+    LogMessage(ctx, "Device destroyed: ID=%u", deviceId);
+    return 0;
 }
 
 PVUSB_US_DEVICE VusbUsGetDevice(PVUSB_US_CONTEXT ctx, uint32_t deviceId)
 {
-    if (!ctx) return NULL;
+    if (!ctx || deviceId == 0) return NULL;
     
-    for (int i = 0; i < VUSB_US_MAX_DEVICES; i++) {
-        if (ctx->Devices[i].Active && ctx->Devices[i].DeviceId == deviceId) {
-            return &ctx->Devices[i];
-        }
-    }
-    return NULL;
+    uint32_t index = VUSB_US_DEVICE_INDEX(deviceId);
+    if (index >= DeviceTableSize(ctx)) return NULL;
+    
+    PVUSB_US_DEVICE_BLOCK block = DEVICE_BLOCK(ctx, index);
+    if (block->Ids[DEVICE_ENTRY(index)] != deviceId) return NULL;
+    
+    return block->Devices[DEVICE_ENTRY(index)];
 }
 
 /* ============================================================
  * URB Processing
  * ============================================================ */
 
-static PVUSB_US_PENDING_URB AllocateUrb(void)
+PVUSB_US_PENDING_URB VusbUsAllocateUrb(PVUSB_US_CONTEXT ctx, uint32_t bufferLength)
 {
-    PVUSB_US_PENDING_URB urb = (PVUSB_US_PENDING_URB)calloc(1, sizeof(VUSB_US_PENDING_URB));
-    if (urb) {
-        urb->CompletionEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+    PVUSB_US_PENDING_URB urb;
+    HANDLE event;
+    
+    if (!ctx) return NULL;
+    
+    urb = (PVUSB_US_PENDING_URB)VusbPoolAlloc(&ctx->UrbPool);
+    if (!urb) return NULL;
+    
+    /* Pooled URBs keep their event; everything else starts from zero */
+    event = urb->CompletionEvent;
+    memset(urb, 0, sizeof(VUSB_US_PENDING_URB));
+    
+    if (event) {
+        ResetEvent(event);
+    } else {
+        event = CreateEvent(NULL, TRUE, FALSE, NULL);
+    }
+    urb->CompletionEvent = event;
+    
+    if (bufferLength > 0) {
+        urb->TransferBuffer = (uint8_t*)VusbBufferAlloc(&ctx->BufferPool, bufferLength);
+        if (!urb->TransferBuffer) {
+            VusbPoolFree(&ctx->UrbPool, urb);
+            return NULL;
+        }
+        urb->TransferBufferLength = bufferLength;
     }
+    
     return urb;
 }
 
-static void FreeUrb(PVUSB_US_PENDING_URB urb)
+void VusbUsFreeUrb(PVUSB_US_CONTEXT ctx, PVUSB_US_PENDING_URB urb)
+{
+    if (!ctx || !urb) return;
+    
+    VusbBufferFree(&ctx->BufferPool, urb->TransferBuffer);
+    urb->TransferBuffer = NULL;
+    VusbPoolFree(&ctx->UrbPool, urb);
+}
+
+/**
+ * IsLocalStandardRequest - Whether the server answers a URB instead of the device
+ *
+ * Descriptors come from the device's index and the bus address is the
+ * virtual bus's own, so those two are always answered here. Other
+ * standard requests are answered here only when simulating.
+ */
+static BOOL IsLocalStandardRequest(PVUSB_US_CONTEXT ctx, PVUSB_US_PENDING_URB urb)
 {
-    if (!urb) return;
-    if (urb->TransferBuffer) free(urb->TransferBuffer);
-    if (urb->CompletionEvent) CloseHandle(urb->CompletionEvent);
-    free(urb);
+    if (urb->TransferType != VUSB_TRANSFER_CONTROL || (urb->EndpointAddress & 0x0F) != 0) {
+        return FALSE;
+    }
+    if (ctx->Config.EnableSimulation) {
+        return TRUE;
+    }
+    return urb->SetupPacket.bRequest == 0x05 || urb->SetupPacket.bRequest == 0x06;
 }
 
+static int CompleteDeviceUrb(PVUSB_US_CONTEXT ctx, PVUSB_US_DEVICE device,
+                             uint32_t urbId, uint32_t status,
+                             uint8_t* data, uint32_t length);
+
 int VusbUsSubmitUrb(PVUSB_US_CONTEXT ctx, uint32_t deviceId, 
                     PVUSB_US_PENDING_URB urb)
 {
     if (!ctx || !urb) return -1;
     
-    PVUSB_US_DEVICE device = VusbUsGetDevice(ctx, deviceId);
+    /* Shared keeps the device from being destroyed under us */
+    PVUSB_US_DEVICE device = LockDevice(ctx, deviceId, FALSE);
     if (!device) return -1;
     
+    /* Standard requests the server answers itself are completed once queued;
+     * until then the URB is still the submitter's alone */
+    uint32_t answerLength = urb->TransferBufferLength;
+    BOOL answered = IsLocalStandardRequest(ctx, urb) &&
+                    HandleStandardRequest(ctx, device, &urb->SetupPacket,
+                                          urb->TransferBuffer, &answerLength) == 0;
+    
     EnterCriticalSection(&device->UrbLock);
     
-    urb->UrbId = ++device->NextUrbId;
+    if (device->FreeUrbSlotCount == 0 && GrowUrbSlots(device) != 0) {
+        LeaveCriticalSection(&device->UrbLock);
+        UnlockDevice(ctx, device, FALSE);
+        return -1;
+    }
+    
+    uint32_t slot = device->FreeUrbSlots[--device->FreeUrbSlotCount];
+    
+    urb->UrbId = (++device->NextUrbId * VUSB_US_MAX_PENDING_URBS) | slot;
     urb->SubmitTime = GetTimestampMs();
     urb->Completed = FALSE;
     
-    /* Add to pending list */
-    urb->Next = device->PendingUrbs;
-    device->PendingUrbs = urb;
+    /* Control transfers never wait forever; others only if asked to */
+    if (urb->Timeout == 0 && urb->TransferType == VUSB_TRANSFER_CONTROL) {
+        urb->Timeout = VUSB_US_CONTROL_TIMEOUT_MS;
+    }
+    if (urb->Timeout > 0) {
+        VusbTimerArm(&device->UrbTimers, &urb->Timer, urb->SubmitTime, urb->Timeout);
+    }
+    
+    /* Add to pending table */
+    device->UrbSlots[slot] = urb;
     device->PendingUrbCount++;
     device->UrbsSubmitted++;
     
+    /* and to the back of its endpoint's queue */
+    PVUSB_US_URB_QUEUE queue = &device->UrbQueues[VUSB_ENDPOINT_QUEUE(urb->EndpointAddress)];
+    urb->Next = NULL;
+    urb->Prev = queue->Tail;
+    if (queue->Tail) {
+        queue->Tail->Next = urb;
+    } else {
+        queue->Head = urb;
+    }
+    queue->Tail = urb;
+    queue->Count++;
+    
+    uint32_t urbId = urb->UrbId;
+    
     LeaveCriticalSection(&device->UrbLock);
     
+    if (answered) {
+        CompleteDeviceUrb(ctx, device, urbId, VUSB_STATUS_SUCCESS, NULL, answerLength);
+    }
+    
+    UnlockDevice(ctx, device, FALSE);
+    
     ctx->TotalUrbsProcessed++;
     
     return 0;
 }
 
-int VusbUsCompleteUrb(PVUSB_US_CONTEXT ctx, uint32_t deviceId, 
-                      uint32_t urbId, uint32_t status,
-                      uint8_t* data, uint32_t length)
+static int CompleteDeviceUrb(PVUSB_US_CONTEXT ctx, PVUSB_US_DEVICE device,
+                             uint32_t urbId, uint32_t status,
+                             uint8_t* data, uint32_t length)
 {
-    if (!ctx) return -1;
-    
-    PVUSB_US_DEVICE device = VusbUsGetDevice(ctx, deviceId);
-    if (!device) return -1;
-    
     EnterCriticalSection(&device->UrbLock);
     
-    /* Find URB */
-    PVUSB_US_PENDING_URB* pUrb = &device->PendingUrbs;
-    while (*pUrb && (*pUrb)->UrbId != urbId) {
-        pUrb = &(*pUrb)->Next;
-    }
+    /* Find URB; the slot must still hold this exact ID */
+    uint32_t slot = VUSB_US_URB_SLOT(urbId);
+    PVUSB_US_PENDING_URB urb = slot < device->UrbSlotCapacity ? device->UrbSlots[slot] : NULL;
     
-    if (!*pUrb) {
+    if (!urb || urb->UrbId != urbId) {
         LeaveCriticalSection(&device->UrbLock);
         return -1;
     }
     
-    PVUSB_US_PENDING_URB urb = *pUrb;
-    
     /* Complete the URB */
     urb->Status = status;
     urb->ActualLength = length;
@@ -274,49 +758,219 @@ int VusbUsCompleteUrb(PVUSB_US_CONTEXT ctx, uint32_t deviceId,
     }
     device->UrbsCompleted++;
     
-    /* Signal completion */
-    if (urb->CompletionEvent) {
-        SetEvent(urb->CompletionEvent);
-    }
-    
-    /* Call completion callback */
-    if (urb->CompletionCallback) {
-        urb->CompletionCallback(urb, urb->CallbackContext);
-    }
+    VusbTimerCancel(&device->UrbTimers, &urb->Timer);
     
-    /* Remove from pending list */
-    *pUrb = urb->Next;
+    /* Remove from pending table and endpoint queue */
+    device->UrbSlots[slot] = NULL;
+    device->FreeUrbSlots[device->FreeUrbSlotCount++] = (uint16_t)slot;
     device->PendingUrbCount--;
     
+    PVUSB_US_URB_QUEUE queue = &device->UrbQueues[VUSB_ENDPOINT_QUEUE(urb->EndpointAddress)];
+    if (urb->Prev) {
+        urb->Prev->Next = urb->Next;
+    } else {
+        queue->Head = urb->Next;
+    }
+    if (urb->Next) {
+        urb->Next->Prev = urb->Prev;
+    } else {
+        queue->Tail = urb->Prev;
+    }
+    urb->Next = urb->Prev = NULL;
+    queue->Count--;
+    
     LeaveCriticalSection(&device->UrbLock);
     
     ctx->TotalBytesTransferred += length;
     
+    /* Tell the submitter outside UrbLock; callbacks go to the completion thread */
+    if (urb->CompletionCallback) {
+        PVUSB_US_COMPLETIONS completions =
+            &DEVICE_BLOCK(ctx, device->Index)->Completions[DEVICE_ENTRY(device->Index)];
+        
+        /* The push that fills an empty queue puts the device on the ready list */
+        if (VusbMpscPush(&completions->Queue, &urb->CompletionLink) &&
+            VusbMpscPush(&ctx->ReadyDevices, &completions->Ready)) {
+            SetEvent(ctx->CompletionEvent);
+        }
+    } else if (urb->CompletionEvent) {
+        SetEvent(urb->CompletionEvent);
+    }
+    
     return 0;
 }
 
+int VusbUsCompleteUrb(PVUSB_US_CONTEXT ctx, uint32_t deviceId, 
+                      uint32_t urbId, uint32_t status,
+                      uint8_t* data, uint32_t length)
+{
+    if (!ctx) return -1;
+    
+    PVUSB_US_DEVICE device = LockDevice(ctx, deviceId, FALSE);
+    if (!device) return -1;
+    
+    int result = CompleteDeviceUrb(ctx, device, urbId, status, data, length);
+    UnlockDevice(ctx, device, FALSE);
+    
+    return result;
+}
+
 int VusbUsCancelUrb(PVUSB_US_CONTEXT ctx, uint32_t deviceId, uint32_t urbId)
 {
     return VusbUsCompleteUrb(ctx, deviceId, urbId, VUSB_STATUS_CANCELED, NULL, 0);
 }
 
 /* ============================================================
- * Standard USB Request Handling
+ * URB Timeouts
  * ============================================================ */
 
-static int HandleStandardRequest(PVUSB_US_CONTEXT ctx, PVUSB_US_DEVICE device,
-                                 PVUSB_SETUP_PACKET setup, uint8_t* buffer,
-                                 uint32_t* length)
+/**
+ * ExpireDeviceUrbs - Time out the URBs whose timers have run out
+ * @expired: Scratch space for VUSB_US_MAX_PENDING_URBS IDs
+ *
+ * Only the timers due since the last pass are touched, never the whole
+ * pending table. Caller holds the device's slot lock shared, which keeps
+ * the device and its owner alive.
+ * The URBs are completed after UrbLock is dropped; one the client
+ * completes in the meantime is not timed out.
+ */
+static void ExpireDeviceUrbs(PVUSB_US_CONTEXT ctx, PVUSB_US_DEVICE device,
+                             uint32_t* expired)
 {
-    uint8_t requestType = setup->bmRequestType & 0x60; /* Request type bits */
-    
-    if (requestType != 0) {
-        /* Not a standard request, let gadget handler deal with it */
-        return -1;
-    }
+    uint32_t count = 0;
+    
+    EnterCriticalSection(&device->UrbLock);
+    PVUSB_TIMER timer = VusbTimerAdvance(&device->UrbTimers, GetTimestampMs());
+    while (timer) {
+        PVUSB_US_PENDING_URB urb = CONTAINING_RECORD(timer, VUSB_US_PENDING_URB, Timer);
+        
+        timer = timer->Next;
+        urb->Timer.Next = NULL;
+        
+        expired[count++] = urb->UrbId;
+    }
+    LeaveCriticalSection(&device->UrbLock);
+    
+    /* Tell the client to stop working on them */
+    for (uint32_t i = 0; i < count; i++) {
+        VUSB_URB_CANCEL cancel;
+        
+        if (CompleteDeviceUrb(ctx, device, expired[i], VUSB_STATUS_TIMEOUT, NULL, 0) != 0) {
+            continue;
+        }
+        
+        LogMessage(ctx, "URB %u on device %u timed out", expired[i], device->DeviceId);
+        
+        if (!device->OwnerClient) continue;
+        
+        VusbInitHeader(&cancel.Header, VUSB_CMD_CANCEL_URB,
+                       sizeof(VUSB_URB_CANCEL) - sizeof(VUSB_HEADER), 0);
+        cancel.DeviceId = device->RemoteDeviceId;
+        cancel.UrbId = expired[i];
+        VusbUsSendToClient((PVUSB_US_CLIENT)device->OwnerClient, &cancel, sizeof(cancel));
+    }
+}
+
+/**
+ * ExpiryThread - Advance every device's timer wheel until shutdown
+ */
+static DWORD WINAPI ExpiryThread(LPVOID param)
+{
+    PVUSB_US_CONTEXT ctx = (PVUSB_US_CONTEXT)param;
+    uint32_t* expired = (uint32_t*)malloc(VUSB_US_MAX_PENDING_URBS * sizeof(uint32_t));
+    
+    if (!expired) return 1;
+    
+    while (WaitForSingleObject(ctx->ShutdownEvent, VUSB_US_EXPIRY_INTERVAL_MS) == WAIT_TIMEOUT) {
+        /* One device at a time; the others can be created and destroyed meanwhile */
+        uint32_t size = DeviceTableSize(ctx);
+        
+        for (uint32_t i = 0; i < size; i++) {
+            PVUSB_US_DEVICE_BLOCK block = DEVICE_BLOCK(ctx, i);
+            uint32_t entry = DEVICE_ENTRY(i);
+            
+            if (!block->Ids[entry]) continue;
+            
+            AcquireSRWLockShared(&block->Slots[entry].Lock);
+            if (block->Ids[entry]) {
+                ExpireDeviceUrbs(ctx, block->Devices[entry], expired);
+            }
+            ReleaseSRWLockShared(&block->Slots[entry].Lock);
+        }
+        
+        ReleaseParkedClients(ctx, GetTimestampMs());
+    }
+    
+    free(expired);
+    return 0;
+}
+
+/**
+ * CompletionThread - Run URB completion callbacks
+ *
+ * Network threads only queue completed URBs; this thread takes each ready
+ * device's queue whole and runs the callbacks, holding no lock.
+ */
+static DWORD WINAPI CompletionThread(LPVOID param)
+{
+    PVUSB_US_CONTEXT ctx = (PVUSB_US_CONTEXT)param;
+    
+    while (WaitForSingleObject(ctx->CompletionEvent, INFINITE) == WAIT_OBJECT_0) {
+        PVUSB_MPSC_NODE ready = VusbMpscTake(&ctx->ReadyDevices);
+        
+        while (ready) {
+            PVUSB_US_COMPLETIONS completions = CONTAINING_RECORD(ready, VUSB_US_COMPLETIONS, Ready);
+            
+            /* Once the queue is taken the next completion requeues the device */
+            ready = ready->Next;
+            
+            PVUSB_MPSC_NODE node = VusbMpscTake(&completions->Queue);
+            while (node) {
+                PVUSB_US_PENDING_URB urb =
+                    CONTAINING_RECORD(node, VUSB_US_PENDING_URB, CompletionLink);
+                
+                /* The callback may free the URB */
+                node = node->Next;
+                
+                if (urb->CompletionEvent) {
+                    SetEvent(urb->CompletionEvent);
+                }
+                urb->CompletionCallback(urb, urb->CallbackContext);
+            }
+        }
+        
+        if (ctx->StopCompletions) {
+            break;
+        }
+    }
+    
+    return 0;
+}
+
+/* ============================================================
+ * Standard USB Request Handling
+ * ============================================================ */
+
+/**
+ * HandleStandardRequest - Answer a standard request from the device's state
+ * @length: In, the size of buffer; out, the bytes returned in it
+ * @return: 0 if answered, -1 to leave the request to the device
+ */
+static int HandleStandardRequest(PVUSB_US_CONTEXT ctx, PVUSB_US_DEVICE device,
+                                 PVUSB_SETUP_PACKET setup, uint8_t* buffer,
+                                 uint32_t* length)
+{
+    uint8_t requestType = setup->bmRequestType & 0x60; /* Request type bits */
+    uint32_t capacity = buffer ? *length : 0;
+    
+    if (requestType != 0) {
+        /* Not a standard request, let gadget handler deal with it */
+        return -1;
+    }
     
     switch (setup->bRequest) {
     case 0x00: /* GET_STATUS */
+        if (capacity < 2) return -1;
         buffer[0] = 0;
         buffer[1] = 0;
         *length = 2;
@@ -341,28 +995,30 @@ static int HandleStandardRequest(PVUSB_US_CONTEXT ctx, PVUSB_US_DEVICE device,
         {
             uint8_t descType = (setup->wValue >> 8) & 0xFF;
             uint8_t descIndex = setup->wValue & 0xFF;
+            uint16_t langId = 0;
+            PVUSB_US_DESC_ENTRY entry;
+            
+            /* wIndex is the language for strings, the interface otherwise */
+            if (descType == 0x03 && descIndex != 0) {
+                langId = setup->wIndex;
+            }
             
-            /* Search descriptors */
-            if (device->Descriptors && device->DescriptorLength > 0) {
-                uint32_t offset = 0;
-                while (offset < device->DescriptorLength) {
-                    uint8_t len = device->Descriptors[offset];
-                    uint8_t type = device->Descriptors[offset + 1];
-                    
-                    if (len == 0) break;
-                    
-                    if (type == descType) {
-                        if (descIndex == 0) {
-                            uint32_t copyLen = len;
-                            if (copyLen > setup->wLength) copyLen = setup->wLength;
-                            memcpy(buffer, &device->Descriptors[offset], copyLen);
-                            *length = copyLen;
-                            return 0;
-                        }
-                        descIndex--;
-                    }
-                    offset += len;
+            entry = DescIndexLookup(device, descType, descIndex, langId);
+            
+            /* Hosts ask for languages we do not have; answer in ours */
+            if (!entry && descType == 0x03 && descIndex != 0) {
+                entry = DescIndexLookup(device, descType, descIndex, device->DefaultLangId);
+            }
+            
+            if (entry) {
+                uint32_t copyLen = entry->Length;
+                if (copyLen > setup->wLength) copyLen = setup->wLength;
+                if (copyLen > capacity) copyLen = capacity;
+                if (copyLen > 0) {
+                    memcpy(buffer, &device->Descriptors[entry->Offset], copyLen);
                 }
+                *length = copyLen;
+                return 0;
             }
             
             /* Descriptor not found */
@@ -370,6 +1026,7 @@ static int HandleStandardRequest(PVUSB_US_CONTEXT ctx, PVUSB_US_DEVICE device,
         }
         
     case 0x08: /* GET_CONFIGURATION */
+        if (capacity < 1) return -1;
         buffer[0] = device->Configuration;
         *length = 1;
         return 0;
@@ -390,6 +1047,7 @@ static int HandleStandardRequest(PVUSB_US_CONTEXT ctx, PVUSB_US_DEVICE device,
         return 0;
         
     case 0x0A: /* GET_INTERFACE */
+        if (capacity < 1) return -1;
         buffer[0] = 0;
         *length = 1;
         return 0;
@@ -412,9 +1070,58 @@ static int HandleStandardRequest(PVUSB_US_CONTEXT ctx, PVUSB_US_DEVICE device,
  * Client Message Processing
  * ============================================================ */
 
+/**
+ * SendAll - Write a whole buffer, waiting for room on non-blocking sockets
+ */
+static int SendAll(PVUSB_US_CLIENT client, const uint8_t* data, uint32_t length)
+{
+    SOCKET socket = client->Socket;
+    
+    while (length > 0) {
+        int result = send(socket, (const char*)data, (int)length, 0);
+        InterlockedIncrement64(&client->Context->IoSyscalls);
+        if (result == SOCKET_ERROR) {
+            if (WSAGetLastError() != WSAEWOULDBLOCK) {
+                return -1;
+            }
+            
+            fd_set writefds;
+            struct timeval tv;
+            FD_ZERO(&writefds);
+            FD_SET(socket, &writefds);
+            tv.tv_sec = 5;
+            tv.tv_usec = 0;
+            if (select(0, NULL, &writefds, NULL, &tv) <= 0) {
+                return -1;
+            }
+            continue;
+        }
+        data += result;
+        length -= (uint32_t)result;
+    }
+    return 0;
+}
+
+int VusbUsSendToClient(PVUSB_US_CLIENT client, const void* data, uint32_t length)
+{
+    int result;
+    
+    EnterCriticalSection(&client->SendLock);
+    if (client->Parked) {
+        result = -1;
+    } else if (client->Context->Config.IoEngine == VUSB_US_IO_RIO && !client->Local) {
+        result = VusbUsIoSend(client, (const uint8_t*)data, length);
+    } else {
+        result = SendAll(client, (const uint8_t*)data, length);
+    }
+    LeaveCriticalSection(&client->SendLock);
+    
+    return result;
+}
+
 static void SendResponse(PVUSB_US_CLIENT client, void* data, uint32_t length)
 {
-    send(client->Socket, (char*)data, length, 0);
+    VusbUsSendToClient(client, data, length);
 }
 
 static void HandleClientConnect(PVUSB_US_CONTEXT ctx, PVUSB_US_CLIENT client,
@@ -425,46 +1132,144 @@ static void HandleClientConnect(PVUSB_US_CONTEXT ctx, PVUSB_US_CLIENT client,
     LogMessage(ctx, "Client %s connecting...", client->AddressString);
     
     /* Parse connect request */
-    if (header->Length >= sizeof(VUSB_CONNECT_REQUEST) - sizeof(VUSB_HEADER)) {
+    if (header->Length >= VUSB_CONNECT_BASE_SIZE) {
         VUSB_CONNECT_REQUEST* req = (VUSB_CONNECT_REQUEST*)(payload - sizeof(VUSB_HEADER));
         client->ClientVersion = req->ClientVersion;
-        client->Capabilities = req->Capabilities;
+        client->Capabilities = req->Capabilities & VUSB_US_CAPABILITIES;
         strncpy(client->ClientName, req->ClientName, sizeof(client->ClientName) - 1);
     }
     
     client->Authenticated = TRUE;
     
     /* Build response */
+    memset(&response, 0, sizeof(response));
     VusbInitHeader(&response.Header, VUSB_CMD_CONNECT,
                    sizeof(response) - sizeof(VUSB_HEADER), header->Sequence);
     response.Status = VUSB_STATUS_SUCCESS;
     response.ServerVersion = 0x00010000;
-    response.Capabilities = 0;
+    response.Capabilities = VUSB_US_CAPABILITIES;
     response.SessionId = client->SessionId;
     
+    /* The token proves a later SESSION_RESUME comes from this client */
+    if ((client->Capabilities & VUSB_CAP_SESSION_RESUME) && ctx->Config.ResumeGraceMs > 0 &&
+        BCRYPT_SUCCESS(BCryptGenRandom(NULL, client->ResumeToken, VUSB_RESUME_TOKEN_SIZE,
+                                       BCRYPT_USE_SYSTEM_PREFERRED_RNG))) {
+        memcpy(response.ResumeToken, client->ResumeToken, VUSB_RESUME_TOKEN_SIZE);
+        response.ResumeGraceMs = ctx->Config.ResumeGraceMs;
+    } else {
+        client->Capabilities &= ~VUSB_CAP_SESSION_RESUME;
+    }
+    
     SendResponse(client, &response, sizeof(response));
     
     LogMessage(ctx, "Client %s connected (session %u, name: %s)",
                client->AddressString, client->SessionId, client->ClientName);
 }
 
-static void HandleDeviceAttach(PVUSB_US_CONTEXT ctx, PVUSB_US_CLIENT client,
-                               PVUSB_HEADER header, uint8_t* payload, uint32_t payloadLen)
+/* ============================================================
+ * Client Device Index
+ * ============================================================ */
+
+static void RemoteIndexInsert(PVUSB_US_CLIENT client, uint32_t remoteId,
+                              PVUSB_US_DEVICE device)
 {
-    VUSB_DEVICE_ATTACH_RESPONSE response;
+    uint32_t mask = client->RemoteIndexSize - 1;
+    uint32_t i = remoteId & mask;
     
-    if (payloadLen < sizeof(VUSB_DEVICE_INFO) + sizeof(uint32_t)) {
-        VusbInitHeader(&response.Header, VUSB_CMD_DEVICE_ATTACH,
-                       sizeof(response) - sizeof(VUSB_HEADER), header->Sequence);
-        response.Status = VUSB_STATUS_INVALID_PARAM;
-        response.DeviceId = 0;
-        SendResponse(client, &response, sizeof(response));
-        return;
+    while (client->RemoteIndex[i].Device && client->RemoteIndex[i].RemoteId != remoteId) {
+        i = (i + 1) & mask;
     }
     
-    VUSB_DEVICE_INFO* deviceInfo = (VUSB_DEVICE_INFO*)payload;
-    uint32_t descLen = *(uint32_t*)(payload + sizeof(VUSB_DEVICE_INFO));
-    uint8_t* descriptors = payload + sizeof(VUSB_DEVICE_INFO) + sizeof(uint32_t);
+    client->RemoteIndex[i].RemoteId = remoteId;
+    client->RemoteIndex[i].Device = device;
+}
+
+static PVUSB_US_DEVICE RemoteIndexLookup(PVUSB_US_CLIENT client, uint32_t remoteId)
+{
+    uint32_t mask = client->RemoteIndexSize - 1;
+    uint32_t i = remoteId & mask;
+    
+    if (!client->RemoteIndex) return NULL;
+    
+    while (client->RemoteIndex[i].Device) {
+        if (client->RemoteIndex[i].RemoteId == remoteId) {
+            return client->RemoteIndex[i].Device;
+        }
+        i = (i + 1) & mask;
+    }
+    return NULL;
+}
+
+/**
+ * RemoteIndexRebuild - Recreate the index from the client's device list
+ *
+ * Only needed on detach, which keeps lookups free of tombstones.
+ */
+static void RemoteIndexRebuild(PVUSB_US_CONTEXT ctx, PVUSB_US_CLIENT client)
+{
+    if (!client->RemoteIndex) return;
+    
+    memset(client->RemoteIndex, 0, client->RemoteIndexSize * sizeof(VUSB_US_REMOTE_ENTRY));
+    
+    for (int i = 0; i < client->DeviceCount; i++) {
+        PVUSB_US_DEVICE device = VusbUsGetDevice(ctx, client->DeviceIds[i]);
+        if (device) {
+            RemoteIndexInsert(client, device->RemoteDeviceId, device);
+        }
+    }
+}
+
+/**
+ * AddClientDevice - Record a device as the client's and index it
+ * @return: 0 on success, -1 if the client's tables could not grow
+ *
+ * The device list doubles when full and the index doubles before it is
+ * half full, so lookups stay short however many devices a client brings.
+ */
+static int AddClientDevice(PVUSB_US_CLIENT client, PVUSB_US_DEVICE device)
+{
+    if (client->DeviceCount == client->DeviceCapacity) {
+        int capacity = client->DeviceCapacity ? client->DeviceCapacity * 2 : 8;
+        uint32_t* ids = (uint32_t*)realloc(client->DeviceIds, capacity * sizeof(uint32_t));
+        if (!ids) return -1;
+        
+        client->DeviceIds = ids;
+        client->DeviceCapacity = capacity;
+    }
+    
+    if ((uint32_t)(client->DeviceCount + 1) * 2 > client->RemoteIndexSize) {
+        uint32_t size = client->RemoteIndexSize ? client->RemoteIndexSize * 2 :
+                        VUSB_US_REMOTE_INDEX_SIZE;
+        VUSB_US_REMOTE_ENTRY* old = client->RemoteIndex;
+        uint32_t oldSize = client->RemoteIndexSize;
+        
+        client->RemoteIndex = (VUSB_US_REMOTE_ENTRY*)calloc(size, sizeof(VUSB_US_REMOTE_ENTRY));
+        if (!client->RemoteIndex) {
+            client->RemoteIndex = old;
+            return -1;
+        }
+        client->RemoteIndexSize = size;
+        
+        for (uint32_t i = 0; i < oldSize; i++) {
+            if (old[i].Device) {
+                RemoteIndexInsert(client, old[i].RemoteId, old[i].Device);
+            }
+        }
+        free(old);
+    }
+    
+    client->DeviceIds[client->DeviceCount++] = device->DeviceId;
+    RemoteIndexInsert(client, device->RemoteDeviceId, device);
+    return 0;
+}
+
+/**
+ * AttachDevice - Create a device for the client and answer its attach
+ */
+static void AttachDevice(PVUSB_US_CONTEXT ctx, PVUSB_US_CLIENT client, PVUSB_HEADER header,
+                         VUSB_DEVICE_INFO* deviceInfo, uint8_t* descriptors, uint32_t descLen)
+{
+    VUSB_DEVICE_ATTACH_RESPONSE response;
     
     LogMessage(ctx, "Device attach: VID=%04X PID=%04X (%s - %s)",
                deviceInfo->VendorId, deviceInfo->ProductId,
@@ -481,9 +1286,11 @@ static void HandleDeviceAttach(PVUSB_US_CONTEXT ctx, PVUSB_US_CLIENT client,
             device->RemoteDeviceId = deviceInfo->DeviceId;
         }
         
-        /* Track in client */
-        if (client->DeviceCount < VUSB_US_MAX_DEVICES) {
-            client->DeviceIds[client->DeviceCount++] = deviceId;
+        /* Track in client; a device the client cannot track is not kept */
+        if (!device || AddClientDevice(client, device) != 0) {
+            VusbUsDestroyDevice(ctx, deviceId);
+            deviceId = 0;
+            result = -1;
         }
     }
     
@@ -495,6 +1302,316 @@ static void HandleDeviceAttach(PVUSB_US_CONTEXT ctx, PVUSB_US_CLIENT client,
     SendResponse(client, &response, sizeof(response));
 }
 
+static void HandleDeviceAttach(PVUSB_US_CONTEXT ctx, PVUSB_US_CLIENT client,
+                               PVUSB_HEADER header, uint8_t* payload, uint32_t payloadLen)
+{
+    VUSB_DEVICE_ATTACH_RESPONSE response;
+    uint32_t descLen = 0;
+    
+    if (payloadLen >= sizeof(VUSB_DEVICE_INFO) + sizeof(uint32_t)) {
+        descLen = *(uint32_t*)(payload + sizeof(VUSB_DEVICE_INFO));
+    }
+    
+    if (payloadLen < sizeof(VUSB_DEVICE_INFO) + sizeof(uint32_t) ||
+        descLen > payloadLen - sizeof(VUSB_DEVICE_INFO) - sizeof(uint32_t)) {
+        VusbInitHeader(&response.Header, VUSB_CMD_DEVICE_ATTACH,
+                       sizeof(response) - sizeof(VUSB_HEADER), header->Sequence);
+        response.Status = VUSB_STATUS_INVALID_PARAM;
+        response.DeviceId = 0;
+        SendResponse(client, &response, sizeof(response));
+        return;
+    }
+    
+    VUSB_DEVICE_INFO* deviceInfo = (VUSB_DEVICE_INFO*)payload;
+    uint8_t* descriptors = payload + sizeof(VUSB_DEVICE_INFO) + sizeof(uint32_t);
+    
+    /* Next time this client can name the blob by its hash */
+    VusbBundleAdd(&ctx->Bundles, descriptors, descLen);
+    
+    AttachDevice(ctx, client, header, deviceInfo, descriptors, descLen);
+}
+
+/**
+ * HandleDeviceAttachHash - Attach with descriptors the server may already hold
+ *
+ * Unknown bundles are answered with VUSB_STATUS_BUNDLE_UNKNOWN, and the
+ * client follows up with a full attach.
+ */
+static void HandleDeviceAttachHash(PVUSB_US_CONTEXT ctx, PVUSB_US_CLIENT client,
+                                   PVUSB_HEADER header, uint8_t* payload, uint32_t payloadLen)
+{
+    VUSB_DEVICE_ATTACH_HASH_REQUEST request;
+    VUSB_DEVICE_ATTACH_RESPONSE response;
+    PVUSB_BUNDLE bundle = NULL;
+    
+    if (payloadLen >= sizeof(request) - sizeof(VUSB_HEADER)) {
+        memcpy((uint8_t*)&request + sizeof(VUSB_HEADER), payload,
+               sizeof(request) - sizeof(VUSB_HEADER));
+        bundle = VusbBundleFind(&ctx->Bundles, request.DescriptorHash, request.DescriptorLength);
+    }
+    
+    if (!bundle) {
+        VusbInitHeader(&response.Header, VUSB_CMD_DEVICE_ATTACH,
+                       sizeof(response) - sizeof(VUSB_HEADER), header->Sequence);
+        response.Status = payloadLen >= sizeof(request) - sizeof(VUSB_HEADER) ?
+                          VUSB_STATUS_BUNDLE_UNKNOWN : VUSB_STATUS_INVALID_PARAM;
+        response.DeviceId = 0;
+        SendResponse(client, &response, sizeof(response));
+        return;
+    }
+    
+    LogMessage(ctx, "Descriptor bundle known (%u bytes), attaching without it", bundle->Length);
+    
+    AttachDevice(ctx, client, header, &request.DeviceInfo, bundle->Data, bundle->Length);
+}
+
+/**
+ * PutSegmented - Write a message as URB_FRAGMENT and URB_CONTINUE pieces
+ * @head: Fixed part of the message
+ * @data: Bytes following it, or NULL for zeros
+ * @return: Bytes written to out
+ */
+static uint32_t PutSegmented(uint8_t* out, const void* head, uint32_t headLength,
+                             const uint8_t* data, uint32_t dataLength, uint32_t sequence)
+{
+    uint32_t totalLength = headLength + dataLength;
+    uint32_t offset = 0;
+    uint32_t written = 0;
+    
+    while (offset < totalLength) {
+        VUSB_URB_FRAGMENT* fragment = (VUSB_URB_FRAGMENT*)(out + written);
+        uint32_t end = offset + (uint32_t)VUSB_FRAGMENT_DATA_MAX;
+        
+        if (end > totalLength) {
+            end = totalLength;
+        }
+        
+        VusbInitHeader(&fragment->Header,
+                       offset == 0 ? VUSB_CMD_URB_FRAGMENT : VUSB_CMD_URB_CONTINUE,
+                       (uint32_t)VUSB_FRAGMENT_FIELDS_SIZE + (end - offset), sequence);
+        fragment->TotalLength = totalLength;
+        fragment->Offset = offset;
+        written += sizeof(VUSB_URB_FRAGMENT);
+        
+        /* The piece may span the end of the fixed part */
+        if (offset < headLength) {
+            uint32_t headEnd = end < headLength ? end : headLength;
+            memcpy(out + written, (const uint8_t*)head + offset, headEnd - offset);
+            written += headEnd - offset;
+        }
+        if (end > headLength) {
+            uint32_t start = offset > headLength ? offset - headLength : 0;
+            if (data) {
+                memcpy(out + written, data + start, end - headLength - start);
+            } else {
+                memset(out + written, 0, end - headLength - start);
+            }
+            written += end - headLength - start;
+        }
+        offset = end;
+    }
+    
+    return written;
+}
+
+/**
+ * ReplayDeviceUrbs - Send a resumed device's pending URBs to its new client
+ * @return: Number of URBs sent
+ *
+ * Each endpoint's URBs go out oldest first, flagged VUSB_SUBMIT_REPLAYED;
+ * the client answers ones it already completed from its record of recent
+ * completions. Submits larger than one frame go out segmented; a client
+ * that cannot take them gets none, and those URBs fail. The messages are
+ * built under UrbLock and sent after it.
+ */
+static uint32_t ReplayDeviceUrbs(PVUSB_US_CLIENT client, PVUSB_US_DEVICE device)
+{
+    PVUSB_US_CONTEXT ctx = client->Context;
+    BOOL segmented = (client->Capabilities & VUSB_CAP_SEGMENTED) != 0;
+    uint8_t* buffer;
+    uint32_t* failed;
+    uint32_t failedCount = 0;
+    uint32_t length = 0;
+    uint32_t size = 0;
+    uint32_t count = 0;
+    
+    EnterCriticalSection(&device->UrbLock);
+    
+    for (int i = 0; i < VUSB_ENDPOINT_QUEUES; i++) {
+        for (PVUSB_US_PENDING_URB urb = device->UrbQueues[i].Head; urb; urb = urb->Next) {
+            uint32_t messageLength = sizeof(VUSB_URB_SUBMIT);
+            if (urb->Direction == VUSB_DIR_OUT) {
+                messageLength += urb->TransferBufferLength;
+            }
+            if (messageLength > VUSB_MAX_PACKET_SIZE) {
+                messageLength += (uint32_t)sizeof(VUSB_URB_FRAGMENT) *
+                    ((messageLength + (uint32_t)VUSB_FRAGMENT_DATA_MAX - 1) /
+                     (uint32_t)VUSB_FRAGMENT_DATA_MAX);
+            }
+            size += messageLength;
+        }
+    }
+    
+    buffer = size > 0 ? (uint8_t*)malloc(size) : NULL;
+    failed = (uint32_t*)malloc((device->PendingUrbCount + 1) * sizeof(uint32_t));
+    
+    for (int i = 0; buffer && failed && i < VUSB_ENDPOINT_QUEUES; i++) {
+        for (PVUSB_US_PENDING_URB urb = device->UrbQueues[i].Head; urb; urb = urb->Next) {
+            VUSB_URB_SUBMIT submit;
+            uint32_t dataLength = urb->Direction == VUSB_DIR_OUT ? urb->TransferBufferLength : 0;
+            uint32_t messageLength = sizeof(VUSB_URB_SUBMIT) + dataLength;
+            
+            if (messageLength > VUSB_MAX_PACKET_SIZE &&
+                (!segmented || messageLength > VUSB_MAX_SEGMENTED_SIZE)) {
+                failed[failedCount++] = urb->UrbId;
+                continue;
+            }
+            
+            VusbInitHeader(&submit.Header, VUSB_CMD_SUBMIT_URB,
+                           sizeof(VUSB_URB_SUBMIT) - sizeof(VUSB_HEADER) + dataLength,
+                           urb->Sequence);
+            submit.DeviceId = device->RemoteDeviceId;
+            submit.UrbId = urb->UrbId;
+            submit.EndpointAddress = urb->EndpointAddress;
+            submit.TransferType = urb->TransferType;
+            submit.Direction = urb->Direction;
+            submit.Flags = VUSB_SUBMIT_REPLAYED;
+            submit.TransferFlags = urb->TransferFlags;
+            submit.TransferBufferLength = urb->TransferBufferLength;
+            submit.Interval = urb->Interval;
+            memcpy(&submit.SetupPacket, &urb->SetupPacket, sizeof(VUSB_SETUP_PACKET));
+            
+            if (messageLength > VUSB_MAX_PACKET_SIZE) {
+                length += PutSegmented(buffer + length, &submit, sizeof(VUSB_URB_SUBMIT),
+                                       urb->TransferBuffer, dataLength, urb->Sequence);
+            } else {
+                memcpy(buffer + length, &submit, sizeof(VUSB_URB_SUBMIT));
+                if (dataLength > 0 && urb->TransferBuffer) {
+                    memcpy(buffer + length + sizeof(VUSB_URB_SUBMIT), urb->TransferBuffer,
+                           dataLength);
+                } else if (dataLength > 0) {
+                    memset(buffer + length + sizeof(VUSB_URB_SUBMIT), 0, dataLength);
+                }
+                length += messageLength;
+            }
+            count++;
+        }
+    }
+    
+    LeaveCriticalSection(&device->UrbLock);
+    
+    if (buffer) {
+        if (length > 0) {
+            VusbUsSendToClient(client, buffer, length);
+        }
+        free(buffer);
+    }
+    
+    /* The new client never sees these, so they would only time out */
+    for (uint32_t i = 0; i < failedCount; i++) {
+        LogMessage(ctx, "URB %u on device %u too large to replay", failed[i], device->DeviceId);
+        CompleteDeviceUrb(ctx, device, failed[i], VUSB_STATUS_ERROR, NULL, 0);
+    }
+    free(failed);
+    
+    return count;
+}
+
+/**
+ * HandleSessionResume - Take over the devices of a parked session
+ *
+ * The parked client is unlinked under ClientLock, so the expiry thread
+ * cannot release it meanwhile; each device moves over under its slot lock,
+ * which also covers the expiry thread's use of OwnerClient.
+ */
+static void HandleSessionResume(PVUSB_US_CONTEXT ctx, PVUSB_US_CLIENT client,
+                                PVUSB_HEADER header, uint8_t* payload, uint32_t payloadLen)
+{
+    VUSB_SESSION_RESUME_REQUEST request;
+    VUSB_SESSION_RESUME_RESPONSE response;
+    PVUSB_US_CLIENT parked = NULL;
+    int firstMoved = client->DeviceCount;   /* Moved devices are appended */
+    int movedCount = 0;
+    uint32_t urbCount = 0;
+    
+    if (payloadLen >= sizeof(request) - sizeof(VUSB_HEADER)) {
+        memcpy((uint8_t*)&request + sizeof(VUSB_HEADER), payload,
+               sizeof(request) - sizeof(VUSB_HEADER));
+        
+        EnterCriticalSection(&ctx->ClientLock);
+        for (int i = 0; i < ctx->Config.MaxClients; i++) {
+            PVUSB_US_CLIENT other = ctx->Clients[i];
+            if (other && other != client && other->Parked &&
+                other->SessionId == request.SessionId &&
+                memcmp(other->ResumeToken, request.ResumeToken, VUSB_RESUME_TOKEN_SIZE) == 0) {
+                parked = other;
+                ctx->Clients[i] = NULL;
+                ctx->ClientCount--;
+                break;
+            }
+        }
+        LeaveCriticalSection(&ctx->ClientLock);
+    }
+    
+    if (parked) {
+        for (int i = 0; i < parked->DeviceCount; i++) {
+            PVUSB_US_DEVICE device = LockDevice(ctx, parked->DeviceIds[i], TRUE);
+            if (!device) {
+                continue;
+            }
+            
+            if (AddClientDevice(client, device) != 0) {
+                UnlockDevice(ctx, device, TRUE);
+                break;
+            }
+            device->OwnerClient = client;
+            UnlockDevice(ctx, device, TRUE);
+            movedCount++;
+            
+            /* Moved devices are no longer the parked client's to destroy */
+            parked->DeviceIds[i--] = parked->DeviceIds[--parked->DeviceCount];
+        }
+    }
+    
+    VusbInitHeader(&response.Header, VUSB_CMD_SESSION_RESUME,
+                   sizeof(response) - sizeof(VUSB_HEADER), header->Sequence);
+    response.Status = parked ? VUSB_STATUS_SUCCESS :
+                      payloadLen >= sizeof(request) - sizeof(VUSB_HEADER) ?
+                      VUSB_STATUS_SESSION_EXPIRED : VUSB_STATUS_INVALID_PARAM;
+    response.SessionId = parked ? parked->SessionId : 0;
+    response.DeviceCount = (uint32_t)movedCount;
+    response.UrbsReplayed = 0;
+    
+    if (!parked) {
+        SendResponse(client, &response, sizeof(response));
+        return;
+    }
+    
+    /* Devices that did not fit go with the parked client */
+    VusbUsReleaseClient(ctx, parked);
+    
+    /* Count what will be replayed; the submits follow the response */
+    for (int i = 0; i < movedCount; i++) {
+        PVUSB_US_DEVICE device = VusbUsGetDevice(ctx, client->DeviceIds[firstMoved + i]);
+        if (device) {
+            EnterCriticalSection(&device->UrbLock);
+            response.UrbsReplayed += device->PendingUrbCount;
+            LeaveCriticalSection(&device->UrbLock);
+        }
+    }
+    SendResponse(client, &response, sizeof(response));
+    
+    for (int i = 0; i < movedCount; i++) {
+        PVUSB_US_DEVICE device = VusbUsGetDevice(ctx, client->DeviceIds[firstMoved + i]);
+        if (device) {
+            urbCount += ReplayDeviceUrbs(client, device);
+        }
+    }
+    
+    LogMessage(ctx, "Client %s resumed session %u: %d devices, %u URBs replayed",
+               client->AddressString, request.SessionId, movedCount, urbCount);
+}
+
 static void HandleDeviceDetach(PVUSB_US_CONTEXT ctx, PVUSB_US_CLIENT client,
                                PVUSB_HEADER header, uint8_t* payload)
 {
@@ -503,75 +1620,309 @@ static void HandleDeviceDetach(PVUSB_US_CONTEXT ctx, PVUSB_US_CLIENT client,
     
     LogMessage(ctx, "Device detach: ID=%u", deviceId);
     
-    /* Verify ownership */
-    PVUSB_US_DEVICE device = VusbUsGetDevice(ctx, deviceId);
-    if (device && device->OwnerClient == client) {
-        VusbUsDestroyDevice(ctx, deviceId);
-        
-        /* Remove from client tracking */
-        for (int i = 0; i < client->DeviceCount; i++) {
-            if (client->DeviceIds[i] == deviceId) {
-                client->DeviceIds[i] = client->DeviceIds[--client->DeviceCount];
-                break;
-            }
-        }
+    /* Verify ownership */
+    PVUSB_US_DEVICE device = VusbUsGetDevice(ctx, deviceId);
+    if (device && device->OwnerClient == client) {
+        VusbUsDestroyDevice(ctx, deviceId);
+        
+        /* Remove from client tracking */
+        for (int i = 0; i < client->DeviceCount; i++) {
+            if (client->DeviceIds[i] == deviceId) {
+                client->DeviceIds[i] = client->DeviceIds[--client->DeviceCount];
+                break;
+            }
+        }
+        RemoteIndexRebuild(ctx, client);
+    }
+    
+    /* Send status response */
+    VUSB_HEADER resp;
+    VusbInitHeader(&resp, VUSB_CMD_STATUS, 0, header->Sequence);
+    SendResponse(client, &resp, sizeof(resp));
+}
+
+/**
+ * HandleDeviceReset - A client's device was reset: back to the default state
+ */
+static void HandleDeviceReset(PVUSB_US_CONTEXT ctx, PVUSB_US_CLIENT client,
+                              PVUSB_HEADER header, uint8_t* payload)
+{
+    VUSB_DEVICE_RESET_REQUEST* req = (VUSB_DEVICE_RESET_REQUEST*)(payload - sizeof(VUSB_HEADER));
+    uint32_t deviceId = req->DeviceId;
+    
+    LogMessage(ctx, "Device reset: ID=%u", deviceId);
+    
+    /* Verify ownership */
+    PVUSB_US_DEVICE device = LockDevice(ctx, deviceId, FALSE);
+    if (device) {
+        if (device->OwnerClient == client) {
+            device->Address = 0;
+            device->Configuration = 0;
+            device->State = VUSB_US_DEV_DEFAULT;
+            
+            /* Notify gadget */
+            if (ctx->GadgetOps && ctx->GadgetOps->HandleSetConfiguration) {
+                ctx->GadgetOps->HandleSetConfiguration(device, 0);
+            }
+        }
+        UnlockDevice(ctx, device, FALSE);
+    }
+    
+    /* Send status response */
+    VUSB_HEADER resp;
+    VusbInitHeader(&resp, VUSB_CMD_STATUS, 0, header->Sequence);
+    SendResponse(client, &resp, sizeof(resp));
+}
+
+/* A client's URB_COMPLETE on its way to a completion worker; data follows */
+typedef struct _VUSB_US_COMPLETION_WORK {
+    VUSB_MPSC_NODE      Link;
+    uint32_t            DeviceId;           /* Local ID; the device is looked up again */
+    uint32_t            UrbId;
+    uint32_t            Status;
+    uint32_t            ActualLength;
+} VUSB_US_COMPLETION_WORK, *PVUSB_US_COMPLETION_WORK;
+
+/**
+ * CompleteQueuedUrb - Complete a URB a receive thread posted to a worker
+ *
+ * The device may have been detached since; VusbUsCompleteUrb then finds
+ * nothing to complete.
+ */
+static void CompleteQueuedUrb(void* context, PVUSB_MPSC_NODE node)
+{
+    PVUSB_US_CONTEXT ctx = (PVUSB_US_CONTEXT)context;
+    PVUSB_US_COMPLETION_WORK work = CONTAINING_RECORD(node, VUSB_US_COMPLETION_WORK, Link);
+    
+    VusbUsCompleteUrb(ctx, work->DeviceId, work->UrbId, work->Status,
+                      work->ActualLength > 0 ? (uint8_t*)(work + 1) : NULL,
+                      work->ActualLength);
+    VusbBufferFree(&ctx->BufferPool, work);
+}
+
+static void HandleUrbComplete(PVUSB_US_CONTEXT ctx, PVUSB_US_CLIENT client,
+                              PVUSB_HEADER header, uint8_t* payload, uint32_t payloadLen)
+{
+    if (payloadLen < sizeof(VUSB_URB_COMPLETE) - sizeof(VUSB_HEADER)) {
+        return;
+    }
+    
+    VUSB_URB_COMPLETE* complete = (VUSB_URB_COMPLETE*)(payload - sizeof(VUSB_HEADER));
+    uint32_t dataLength = payloadLen - (sizeof(VUSB_URB_COMPLETE) - sizeof(VUSB_HEADER));
+    uint32_t actualLength = complete->ActualLength;
+    
+    /* Never report more than the message carried */
+    if (actualLength > dataLength) {
+        actualLength = dataLength;
+    }
+    
+    uint8_t* data = NULL;
+    if (actualLength > 0) {
+        data = payload + sizeof(VUSB_URB_COMPLETE) - sizeof(VUSB_HEADER);
+    }
+    
+    /*
+     * Resolve the device through the client's own index. Only this client
+     * can create or destroy its devices, and it does so on this thread, so
+     * no device slot lock is needed here.
+     */
+    PVUSB_US_DEVICE device = RemoteIndexLookup(client, complete->DeviceId);
+    if (!device || !device->Active) {
+        return;
+    }
+    
+    /* One device's completions go to one worker, in the order received */
+    if (ctx->Workers.Count > 0) {
+        PVUSB_US_COMPLETION_WORK work = (PVUSB_US_COMPLETION_WORK)VusbBufferAlloc(
+            &ctx->BufferPool, sizeof(VUSB_US_COMPLETION_WORK) + actualLength);
+        if (!work) {
+            return;
+        }
+        
+        work->DeviceId = device->DeviceId;
+        work->UrbId = complete->UrbId;
+        work->Status = complete->Status;
+        work->ActualLength = actualLength;
+        if (actualLength > 0) {
+            memcpy(work + 1, data, actualLength);
+        }
+        VusbWorkersPost(&ctx->Workers, device->DeviceId, &work->Link);
+    } else {
+        CompleteDeviceUrb(ctx, device, complete->UrbId,
+                          complete->Status, data, actualLength);
+    }
+    
+    UNREFERENCED_PARAMETER(header);
+}
+
+static void HandleUrbCompleteBatch(PVUSB_US_CONTEXT ctx, PVUSB_US_CLIENT client,
+                                   uint8_t* payload, uint32_t payloadLen)
+{
+    PVUSB_HEADER entry;
+    uint32_t offset = 0;
+    
+    if (payloadLen < sizeof(uint32_t)) {
+        return;
+    }
+    
+    /* Entries are complete URB_COMPLETE messages; handle each as if sent alone */
+    while ((entry = VusbBatchNext(payload + sizeof(uint32_t),
+                                  payloadLen - sizeof(uint32_t), &offset)) != NULL) {
+        if (entry->Command == VUSB_CMD_URB_COMPLETE) {
+            HandleUrbComplete(ctx, client, entry, (uint8_t*)(entry + 1), entry->Length);
+        }
+    }
+}
+
+/* ============================================================
+ * Segmented Messages
+ * ============================================================ */
+
+static int StartReassembly(PVUSB_REASSEMBLY reassembly, uint32_t totalLength)
+{
+    reassembly->Buffer = (uint8_t*)malloc(totalLength);
+    if (!reassembly->Buffer) {
+        return -1;
+    }
+    reassembly->TotalLength = totalLength;
+    reassembly->Received = 0;
+    return 0;
+}
+
+static void ResetReassembly(PVUSB_REASSEMBLY reassembly)
+{
+    free(reassembly->Buffer);
+    memset(reassembly, 0, sizeof(VUSB_REASSEMBLY));
+}
+
+/**
+ * FinishReassembly - Dispatch the segmented message once all of it arrived
+ */
+static void FinishReassembly(PVUSB_US_CONTEXT ctx, PVUSB_US_CLIENT client)
+{
+    PVUSB_REASSEMBLY reassembly = &client->Reassembly;
+    PVUSB_HEADER message;
+    
+    if (reassembly->Received < reassembly->TotalLength) {
+        return;
+    }
+    
+    message = VusbReassembledMessage(reassembly);
+    if (message) {
+        VusbUsProcessMessage(ctx, client, message, (uint8_t*)(message + 1), message->Length);
+    } else {
+        LogMessage(ctx, "Malformed segmented message from %s", client->AddressString);
+    }
+    
+    ResetReassembly(reassembly);
+}
+
+/**
+ * HandleFragment - Collect a fragment staged by the reactor or RIO engine
+ */
+static void HandleFragment(PVUSB_US_CONTEXT ctx, PVUSB_US_CLIENT client,
+                           PVUSB_HEADER header, uint8_t* payload, uint32_t payloadLen)
+{
+    PVUSB_REASSEMBLY reassembly = &client->Reassembly;
+    VUSB_URB_FRAGMENT fragment;
+    int dataLength;
+    
+    if (payloadLen < VUSB_FRAGMENT_FIELDS_SIZE) {
+        return;
+    }
+    
+    fragment.Header = *header;
+    memcpy(&fragment.TotalLength, payload, VUSB_FRAGMENT_FIELDS_SIZE);
+    
+    dataLength = VusbFragmentCheck(reassembly, &fragment);
+    if (dataLength < 0) {
+        LogMessage(ctx, "Out-of-order fragment from %s", client->AddressString);
+        ResetReassembly(reassembly);
+        return;
+    }
+    
+    if (header->Command == VUSB_CMD_URB_FRAGMENT &&
+        StartReassembly(reassembly, fragment.TotalLength) != 0) {
+        return;
     }
     
-    /* Send status response */
-    VUSB_HEADER resp;
-    VusbInitHeader(&resp, VUSB_CMD_STATUS, 0, header->Sequence);
-    SendResponse(client, &resp, sizeof(resp));
+    memcpy(reassembly->Buffer + fragment.Offset,
+           payload + VUSB_FRAGMENT_FIELDS_SIZE, dataLength);
+    reassembly->Received += (uint32_t)dataLength;
+    
+    FinishReassembly(ctx, client);
 }
 
-static void HandleUrbComplete(PVUSB_US_CONTEXT ctx, PVUSB_US_CLIENT client,
-                              PVUSB_HEADER header, uint8_t* payload, uint32_t payloadLen)
+/**
+ * ReceiveFragment - Receive a fragment straight into the reassembly buffer
+ *
+ * Used by the blocking client thread once the fragment's header is read.
+ */
+static int ReceiveFragment(PVUSB_US_CONTEXT ctx, PVUSB_US_CLIENT client,
+                           PVUSB_HEADER header)
 {
-    UNREFERENCED_PARAMETER(client);
+    PVUSB_REASSEMBLY reassembly = &client->Reassembly;
+    VUSB_URB_FRAGMENT fragment;
+    int dataLength;
+    int result;
     
-    if (payloadLen < sizeof(VUSB_URB_COMPLETE) - sizeof(VUSB_HEADER)) {
-        return;
+    if (header->Length < VUSB_FRAGMENT_FIELDS_SIZE) {
+        return -1;
     }
     
-    VUSB_URB_COMPLETE* complete = (VUSB_URB_COMPLETE*)(payload - sizeof(VUSB_HEADER));
+    fragment.Header = *header;
+    result = recv(client->Socket, (char*)&fragment.TotalLength,
+                  VUSB_FRAGMENT_FIELDS_SIZE, MSG_WAITALL);
+    InterlockedIncrement64(&ctx->IoSyscalls);
+    if (result != VUSB_FRAGMENT_FIELDS_SIZE) {
+        return -1;
+    }
     
-    uint8_t* data = NULL;
-    if (complete->ActualLength > 0) {
-        data = payload + sizeof(VUSB_URB_COMPLETE) - sizeof(VUSB_HEADER);
+    dataLength = VusbFragmentCheck(reassembly, &fragment);
+    if (dataLength < 0) {
+        LogMessage(ctx, "Out-of-order fragment from %s", client->AddressString);
+        return -1;
     }
     
-    /* Find device by remote ID and complete URB */
-    EnterCriticalSection(&ctx->DeviceLock);
-    for (int i = 0; i < VUSB_US_MAX_DEVICES; i++) {
-        PVUSB_US_DEVICE device = &ctx->Devices[i];
-        if (device->Active && device->RemoteDeviceId == complete->DeviceId) {
-            VusbUsCompleteUrb(ctx, device->DeviceId, complete->UrbId,
-                              complete->Status, data, complete->ActualLength);
-            break;
+    if (header->Command == VUSB_CMD_URB_FRAGMENT &&
+        StartReassembly(reassembly, fragment.TotalLength) != 0) {
+        return -1;
+    }
+    
+    if (dataLength > 0) {
+        result = recv(client->Socket, (char*)reassembly->Buffer + fragment.Offset,
+                      dataLength, MSG_WAITALL);
+        InterlockedIncrement64(&ctx->IoSyscalls);
+        if (result != dataLength) {
+            return -1;
         }
+        reassembly->Received += (uint32_t)dataLength;
     }
-    LeaveCriticalSection(&ctx->DeviceLock);
     
-    UNREFERENCED_PARAMETER(header);
+    InterlockedIncrement64(&ctx->IoMessages);
+    FinishReassembly(ctx, client);
+    return 0;
 }
 
 static void HandleDeviceList(PVUSB_US_CONTEXT ctx, PVUSB_US_CLIENT client,
                              PVUSB_HEADER header)
 {
-    uint8_t buffer[sizeof(VUSB_DEVICE_LIST_RESPONSE) + 
-                   VUSB_US_MAX_DEVICES * sizeof(VUSB_DEVICE_INFO)];
+    uint32_t size = DeviceTableSize(ctx);
+    uint8_t* buffer = (uint8_t*)malloc(sizeof(VUSB_DEVICE_LIST_RESPONSE) +
+                                       size * sizeof(VUSB_DEVICE_INFO));
+    if (!buffer) {
+        return;
+    }
     VUSB_DEVICE_LIST_RESPONSE* response = (VUSB_DEVICE_LIST_RESPONSE*)buffer;
     VUSB_DEVICE_INFO* devices = (VUSB_DEVICE_INFO*)(buffer + sizeof(VUSB_DEVICE_LIST_RESPONSE));
     
     int count = 0;
     
-    EnterCriticalSection(&ctx->DeviceLock);
-    for (int i = 0; i < VUSB_US_MAX_DEVICES && count < VUSB_US_MAX_DEVICES; i++) {
-        if (ctx->Devices[i].Active) {
-            memcpy(&devices[count], &ctx->Devices[i].DeviceInfo, sizeof(VUSB_DEVICE_INFO));
+    for (uint32_t i = 0; i < size; i++) {
+        if (ReadDevice(ctx, i, &devices[count], NULL)) {
             count++;
         }
     }
-    LeaveCriticalSection(&ctx->DeviceLock);
     
     uint32_t payloadLen = sizeof(uint32_t) * 2 + count * sizeof(VUSB_DEVICE_INFO);
     VusbInitHeader(&response->Header, VUSB_CMD_DEVICE_LIST, payloadLen, header->Sequence);
@@ -579,6 +1930,7 @@ static void HandleDeviceList(PVUSB_US_CONTEXT ctx, PVUSB_US_CLIENT client,
     response->DeviceCount = count;
     
     SendResponse(client, buffer, sizeof(VUSB_HEADER) + payloadLen);
+    free(buffer);
 }
 
 static void HandlePing(PVUSB_US_CLIENT client, PVUSB_HEADER header)
@@ -588,18 +1940,25 @@ static void HandlePing(PVUSB_US_CLIENT client, PVUSB_HEADER header)
     SendResponse(client, &response, sizeof(response));
 }
 
-static void ProcessClientMessage(PVUSB_US_CONTEXT ctx, PVUSB_US_CLIENT client,
-                                 PVUSB_HEADER header, uint8_t* payload, uint32_t payloadLen)
+void VusbUsProcessMessage(PVUSB_US_CONTEXT ctx, PVUSB_US_CLIENT client,
+                          PVUSB_HEADER header, uint8_t* payload, uint32_t payloadLen)
 {
+    InterlockedIncrement64(&ctx->IoMessages);
+    
     switch (header->Command) {
     case VUSB_CMD_CONNECT:
         HandleClientConnect(ctx, client, header, payload);
         break;
         
     case VUSB_CMD_DISCONNECT:
+        client->Leaving = TRUE;
         client->Connected = FALSE;
         break;
         
+    case VUSB_CMD_SESSION_RESUME:
+        HandleSessionResume(ctx, client, header, payload, payloadLen);
+        break;
+        
     case VUSB_CMD_PING:
         HandlePing(client, header);
         break;
@@ -608,14 +1967,31 @@ static void ProcessClientMessage(PVUSB_US_CONTEXT ctx, PVUSB_US_CLIENT client,
         HandleDeviceAttach(ctx, client, header, payload, payloadLen);
         break;
         
+    case VUSB_CMD_DEVICE_ATTACH_HASH:
+        HandleDeviceAttachHash(ctx, client, header, payload, payloadLen);
+        break;
+        
     case VUSB_CMD_DEVICE_DETACH:
         HandleDeviceDetach(ctx, client, header, payload);
         break;
         
+    case VUSB_CMD_DEVICE_RESET:
+        HandleDeviceReset(ctx, client, header, payload);
+        break;
+        
     case VUSB_CMD_URB_COMPLETE:
         HandleUrbComplete(ctx, client, header, payload, payloadLen);
         break;
         
+    case VUSB_CMD_URB_COMPLETE_BATCH:
+        HandleUrbCompleteBatch(ctx, client, payload, payloadLen);
+        break;
+        
+    case VUSB_CMD_URB_FRAGMENT:
+    case VUSB_CMD_URB_CONTINUE:
+        HandleFragment(ctx, client, header, payload, payloadLen);
+        break;
+        
     case VUSB_CMD_DEVICE_LIST:
         HandleDeviceList(ctx, client, header);
         break;
@@ -635,21 +2011,24 @@ static DWORD WINAPI ClientThread(LPVOID param)
 {
     PVUSB_US_CLIENT client = (PVUSB_US_CLIENT)param;
     PVUSB_US_CONTEXT ctx = client->Context;
-    VUSB_HEADER header;
+    PVUSB_HEADER header;
     uint8_t* buffer = NULL;
     int result;
     
     LogMessage(ctx, "Client thread started for session %u", client->SessionId);
     
+    /* Header and payload back to back: handlers read the payload as the whole message */
     buffer = (uint8_t*)malloc(VUSB_MAX_PACKET_SIZE);
     if (!buffer) {
         goto cleanup;
     }
+    header = (PVUSB_HEADER)buffer;
     
     while (client->Connected && ctx->Running) {
         /* Receive header */
-        result = recv(client->Socket, (char*)&header, sizeof(header), MSG_WAITALL);
-        if (result != sizeof(header)) {
+        result = recv(client->Socket, (char*)header, sizeof(VUSB_HEADER), MSG_WAITALL);
+        InterlockedIncrement64(&ctx->IoSyscalls);
+        if (result != sizeof(VUSB_HEADER)) {
             if (result == 0) {
                 LogMessage(ctx, "Client %s closed connection", client->AddressString);
             }
@@ -657,27 +2036,37 @@ static DWORD WINAPI ClientThread(LPVOID param)
         }
         
         /* Validate header */
-        if (!VusbValidateHeader(&header)) {
+        if (!VusbValidateHeader(header)) {
             LogMessage(ctx, "Invalid protocol header from %s", client->AddressString);
             break;
         }
         
+        /* Fragments bypass the receive buffer */
+        if (header->Command == VUSB_CMD_URB_FRAGMENT ||
+            header->Command == VUSB_CMD_URB_CONTINUE) {
+            if (ReceiveFragment(ctx, client, header) != 0) {
+                break;
+            }
+            continue;
+        }
+        
         /* Receive payload */
-        if (header.Length > 0) {
-            if (header.Length > VUSB_MAX_PACKET_SIZE - sizeof(header)) {
-                LogMessage(ctx, "Payload too large: %u", header.Length);
+        if (header->Length > 0) {
+            if (header->Length > VUSB_MAX_PACKET_SIZE - sizeof(VUSB_HEADER)) {
+                LogMessage(ctx, "Payload too large: %u", header->Length);
                 break;
             }
             
-            result = recv(client->Socket, (char*)buffer, header.Length, MSG_WAITALL);
-            if (result != (int)header.Length) {
+            result = recv(client->Socket, (char*)(header + 1), header->Length, MSG_WAITALL);
+            InterlockedIncrement64(&ctx->IoSyscalls);
+            if (result != (int)header->Length) {
                 LogMessage(ctx, "Failed to receive payload");
                 break;
             }
         }
         
         /* Process message */
-        ProcessClientMessage(ctx, client, &header, buffer, header.Length);
+        VusbUsProcessMessage(ctx, client, header, (uint8_t*)(header + 1), header->Length);
     }
     
 cleanup:
@@ -687,21 +2076,81 @@ cleanup:
         free(buffer);
     }
     
+    VusbUsReleaseClient(ctx, client);
+    
+    return 0;
+}
+
+/**
+ * ParkClient - Keep a dropped client's devices for a session resume
+ * @return: TRUE if the client was parked and must not be released yet
+ *
+ * Must not block: the reactor and RIO engines release clients on their
+ * I/O threads. The expiry thread releases the client once ParkedUntil
+ * passes.
+ */
+static BOOL ParkClient(PVUSB_US_CONTEXT ctx, PVUSB_US_CLIENT client)
+{
+    if (client->Parked || client->Leaving || !ctx->Running || client->DeviceCount == 0 ||
+        !(client->Capabilities & VUSB_CAP_SESSION_RESUME)) {
+        return FALSE;
+    }
+    
+    EnterCriticalSection(&client->SendLock);
+    client->Parked = TRUE;
+    client->ParkedUntil = GetTimestampMs() + ctx->Config.ResumeGraceMs;
+    closesocket(client->Socket);
+    client->Socket = INVALID_SOCKET;
+    LeaveCriticalSection(&client->SendLock);
+    
+    LogMessage(ctx, "Client %s dropped, keeping session %u for %u ms",
+               client->AddressString, client->SessionId, ctx->Config.ResumeGraceMs);
+    return TRUE;
+}
+
+/**
+ * ReleaseParkedClients - Release parked clients whose grace period is over
+ * @now: Current time, or UINT64_MAX to release every parked client
+ */
+static void ReleaseParkedClients(PVUSB_US_CONTEXT ctx, uint64_t now)
+{
+    /* One entry at a time, so accepts never wait behind a long table */
+    for (int i = 0; i < ctx->Config.MaxClients; i++) {
+        PVUSB_US_CLIENT expired = NULL;
+        
+        EnterCriticalSection(&ctx->ClientLock);
+        PVUSB_US_CLIENT client = ctx->Clients[i];
+        if (client && client->Parked && client->ParkedUntil <= now) {
+            expired = client;
+            ctx->Clients[i] = NULL;
+            ctx->ClientCount--;
+        }
+        LeaveCriticalSection(&ctx->ClientLock);
+        
+        if (expired) {
+            VusbUsReleaseClient(ctx, expired);
+        }
+    }
+}
+
+void VusbUsReleaseClient(PVUSB_US_CONTEXT ctx, PVUSB_US_CLIENT client)
+{
+    if (ParkClient(ctx, client)) {
+        return;
+    }
+    
     /* Cleanup client devices */
-    EnterCriticalSection(&ctx->DeviceLock);
     for (int i = 0; i < client->DeviceCount; i++) {
-        for (int j = 0; j < VUSB_US_MAX_DEVICES; j++) {
-            if (ctx->Devices[j].Active && 
-                ctx->Devices[j].DeviceId == client->DeviceIds[i]) {
-                CleanupDevice(&ctx->Devices[j]);
-            }
+        PVUSB_US_DEVICE device = LockDevice(ctx, client->DeviceIds[i], TRUE);
+        if (device) {
+            DestroyLockedDevice(ctx, device);
+            UnlockDevice(ctx, device, TRUE);
         }
     }
-    LeaveCriticalSection(&ctx->DeviceLock);
     
     /* Remove from client list */
     EnterCriticalSection(&ctx->ClientLock);
-    for (int i = 0; i < VUSB_US_MAX_CLIENTS; i++) {
+    for (int i = 0; i < ctx->Config.MaxClients; i++) {
         if (ctx->Clients[i] == client) {
             ctx->Clients[i] = NULL;
             ctx->ClientCount--;
@@ -713,10 +2162,14 @@ cleanup:
     LogMessage(ctx, "Client %s disconnected (session %u)", 
                client->AddressString, client->SessionId);
     
-    closesocket(client->Socket);
+    if (client->Socket != INVALID_SOCKET) {
+        closesocket(client->Socket);
+    }
+    DeleteCriticalSection(&client->SendLock);
+    free(client->Reassembly.Buffer);
+    free(client->DeviceIds);
+    free(client->RemoteIndex);
     free(client);
-    
-    return 0;
 }
 
 /* ============================================================
@@ -728,10 +2181,8 @@ int VusbUsEpWrite(PVUSB_US_DEVICE device, uint8_t endpoint,
 {
     if (!device || !data) return -1;
     
-    int epIndex = endpoint & 0x0F;
-    if (epIndex >= VUSB_US_MAX_ENDPOINTS) return -1;
-    
-    PVUSB_US_ENDPOINT ep = &device->Endpoints[epIndex];
+    PVUSB_US_ENDPOINT ep = GetEndpoint(device, endpoint, TRUE);
+    if (!ep) return -1;
     
     EnterCriticalSection(&ep->Lock);
     
@@ -762,10 +2213,8 @@ int VusbUsEpRead(PVUSB_US_DEVICE device, uint8_t endpoint,
 {
     if (!device || !buffer) return -1;
     
-    int epIndex = endpoint & 0x0F;
-    if (epIndex >= VUSB_US_MAX_ENDPOINTS) return -1;
-    
-    PVUSB_US_ENDPOINT ep = &device->Endpoints[epIndex];
+    PVUSB_US_ENDPOINT ep = GetEndpoint(device, endpoint, FALSE);
+    if (!ep) return 0;
     
     EnterCriticalSection(&ep->Lock);
     
@@ -794,9 +2243,9 @@ void VusbUsEpStall(PVUSB_US_DEVICE device, uint8_t endpoint)
 {
     if (!device) return;
     
-    int epIndex = endpoint & 0x0F;
-    if (epIndex < VUSB_US_MAX_ENDPOINTS) {
-        device->Endpoints[epIndex].State = VUSB_US_EP_STALLED;
+    PVUSB_US_ENDPOINT ep = GetEndpoint(device, endpoint, TRUE);
+    if (ep) {
+        ep->State = VUSB_US_EP_STALLED;
     }
 }
 
@@ -804,9 +2253,9 @@ void VusbUsEpUnstall(PVUSB_US_DEVICE device, uint8_t endpoint)
 {
     if (!device) return;
     
-    int epIndex = endpoint & 0x0F;
-    if (epIndex < VUSB_US_MAX_ENDPOINTS) {
-        device->Endpoints[epIndex].State = VUSB_US_EP_ENABLED;
+    PVUSB_US_ENDPOINT ep = GetEndpoint(device, endpoint, TRUE);
+    if (ep) {
+        ep->State = VUSB_US_EP_ENABLED;
     }
 }
 
@@ -880,20 +2329,20 @@ void VusbUsGetStats(PVUSB_US_CONTEXT ctx, VUSB_STATISTICS* stats)
     
     memset(stats, 0, sizeof(VUSB_STATISTICS));
     
-    EnterCriticalSection(&ctx->DeviceLock);
+    uint32_t size = DeviceTableSize(ctx);
     
-    for (int i = 0; i < VUSB_US_MAX_DEVICES; i++) {
-        if (ctx->Devices[i].Active) {
+    for (uint32_t i = 0; i < size; i++) {
+        VUSB_STATISTICS device;
+        
+        if (ReadDevice(ctx, i, NULL, &device)) {
             stats->ActiveDevices++;
-            stats->TotalUrbsSubmitted += ctx->Devices[i].UrbsSubmitted;
-            stats->TotalUrbsCompleted += ctx->Devices[i].UrbsCompleted;
-            stats->TotalBytesIn += ctx->Devices[i].BytesIn;
-            stats->TotalBytesOut += ctx->Devices[i].BytesOut;
-            stats->PendingUrbs += ctx->Devices[i].PendingUrbCount;
+            stats->TotalUrbsSubmitted += device.TotalUrbsSubmitted;
+            stats->TotalUrbsCompleted += device.TotalUrbsCompleted;
+            stats->TotalBytesIn += device.TotalBytesIn;
+            stats->TotalBytesOut += device.TotalBytesOut;
+            stats->PendingUrbs += device.PendingUrbs;
         }
     }
-    
-    LeaveCriticalSection(&ctx->DeviceLock);
 }
 
 int VusbUsListDevices(PVUSB_US_CONTEXT ctx, VUSB_DEVICE_INFO* list, int maxDevices)
@@ -901,18 +2350,14 @@ int VusbUsListDevices(PVUSB_US_CONTEXT ctx, VUSB_DEVICE_INFO* list, int maxDevic
     if (!ctx || !list) return 0;
     
     int count = 0;
+    uint32_t size = DeviceTableSize(ctx);
     
-    EnterCriticalSection(&ctx->DeviceLock);
-    
-    for (int i = 0; i < VUSB_US_MAX_DEVICES && count < maxDevices; i++) {
-        if (ctx->Devices[i].Active) {
-            memcpy(&list[count], &ctx->Devices[i].DeviceInfo, sizeof(VUSB_DEVICE_INFO));
+    for (uint32_t i = 0; i < size && count < maxDevices; i++) {
+        if (ReadDevice(ctx, i, &list[count], NULL)) {
             count++;
         }
     }
     
-    LeaveCriticalSection(&ctx->DeviceLock);
-    
     return count;
 }
 
@@ -924,7 +2369,7 @@ void VusbUsListClients(PVUSB_US_CONTEXT ctx,
     
     EnterCriticalSection(&ctx->ClientLock);
     
-    for (int i = 0; i < VUSB_US_MAX_CLIENTS; i++) {
+    for (int i = 0; i < ctx->Config.MaxClients; i++) {
         if (ctx->Clients[i]) {
             callback(ctx->Clients[i], userdata);
         }
@@ -948,9 +2393,32 @@ int VusbUsInit(PVUSB_US_CONTEXT ctx, PVUSB_US_CONFIG config)
     ctx->Config = *config;
     ctx->Running = FALSE;
     ctx->ListenSocket = INVALID_SOCKET;
+    ctx->LocalListenSocket = INVALID_SOCKET;
     ctx->CaptureFile = INVALID_HANDLE_VALUE;
     ctx->StartTime = GetTimestampMs();
     
+    /* Tables are sized from the configuration; devices beyond what the
+     * device ID can index are refused */
+    if (ctx->Config.MaxClients <= 0) {
+        ctx->Config.MaxClients = VUSB_US_DEFAULT_CLIENTS;
+    }
+    if (ctx->Config.MaxDevices <= 0) {
+        ctx->Config.MaxDevices = VUSB_US_DEFAULT_DEVICES;
+    }
+    if (ctx->Config.MaxDevices > VUSB_US_DEVICE_LIMIT) {
+        ctx->Config.MaxDevices = VUSB_US_DEVICE_LIMIT;
+    }
+    
+    ctx->Clients = (PVUSB_US_CLIENT*)calloc(ctx->Config.MaxClients, sizeof(PVUSB_US_CLIENT));
+    ctx->DeviceBlocks = (PVUSB_US_DEVICE_BLOCK*)calloc(
+        (ctx->Config.MaxDevices + VUSB_US_DEVICE_BLOCK_SIZE - 1) / VUSB_US_DEVICE_BLOCK_SIZE,
+        sizeof(PVUSB_US_DEVICE_BLOCK));
+    if (!ctx->Clients || !ctx->DeviceBlocks) {
+        free(ctx->Clients);
+        free(ctx->DeviceBlocks);
+        return -1;
+    }
+    
     /* Initialize Winsock */
     result = WSAStartup(MAKEWORD(2, 2), &wsaData);
     if (result != 0) {
@@ -960,11 +2428,25 @@ int VusbUsInit(PVUSB_US_CONTEXT ctx, PVUSB_US_CONFIG config)
     
     /* Initialize synchronization */
     InitializeCriticalSection(&ctx->ClientLock);
-    InitializeCriticalSection(&ctx->DeviceLock);
+    InitializeCriticalSection(&ctx->DeviceGrowLock);
     InitializeCriticalSection(&ctx->CaptureLock);
     
     ctx->ShutdownEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
     
+    /* CompletionEvent sits past the pool's free-list link, so it survives reuse */
+    VusbPoolInit(&ctx->UrbPool, sizeof(VUSB_US_PENDING_URB), VUSB_US_URB_POOL_SLAB);
+    VusbBufferPoolInit(&ctx->BufferPool);
+    VusbBundleStoreInit(&ctx->Bundles, config->BundleDirectory);
+    
+    ctx->ExpiryThread = CreateThread(NULL, 0, ExpiryThread, ctx, 0, NULL);
+    
+    ctx->CompletionEvent = CreateEvent(NULL, FALSE, FALSE, NULL);
+    ctx->CompletionThread = CreateThread(NULL, 0, CompletionThread, ctx, 0, NULL);
+    
+    if (VusbWorkersStart(&ctx->Workers, ctx->Config.Workers, CompleteQueuedUrb, ctx) != 0) {
+        fprintf(stderr, "Failed to start completion workers, completing on receive threads\n");
+    }
+    
     ctx->Initialized = TRUE;
     
     LogMessage(ctx, "Userspace server initialized");
@@ -977,26 +2459,68 @@ void VusbUsCleanup(PVUSB_US_CONTEXT ctx)
     
     VusbUsStop(ctx);
     
-    /* Cleanup devices */
-    EnterCriticalSection(&ctx->DeviceLock);
-    for (int i = 0; i < VUSB_US_MAX_DEVICES; i++) {
-        if (ctx->Devices[i].Active) {
-            CleanupDevice(&ctx->Devices[i]);
+    if (ctx->ExpiryThread) {
+        WaitForSingleObject(ctx->ExpiryThread, INFINITE);
+        CloseHandle(ctx->ExpiryThread);
+        ctx->ExpiryThread = NULL;
+    }
+    
+    /* Workers feed the completion thread, so they finish first */
+    VusbWorkersStop(&ctx->Workers);
+    
+    /* Deliver what is still queued, then stop */
+    if (ctx->CompletionThread) {
+        ctx->StopCompletions = TRUE;
+        SetEvent(ctx->CompletionEvent);
+        WaitForSingleObject(ctx->CompletionThread, INFINITE);
+        CloseHandle(ctx->CompletionThread);
+        ctx->CompletionThread = NULL;
+    }
+    
+    /* Cleanup devices, then the table itself */
+    for (LONG b = 0; b < ctx->DeviceBlockCount; b++) {
+        PVUSB_US_DEVICE_BLOCK block = ctx->DeviceBlocks[b];
+        
+        for (int i = 0; i < VUSB_US_DEVICE_BLOCK_SIZE; i++) {
+            AcquireSRWLockExclusive(&block->Slots[i].Lock);
+            if (block->Ids[i]) {
+                DestroyLockedDevice(ctx, block->Devices[i]);
+            }
+            ReleaseSRWLockExclusive(&block->Slots[i].Lock);
+            free(block->Devices[i]);
         }
+        free(block);
     }
-    LeaveCriticalSection(&ctx->DeviceLock);
+    free(ctx->DeviceBlocks);
+    ctx->DeviceBlocks = NULL;
+    ctx->DeviceBlockCount = 0;
     
     /* Stop capture */
     VusbUsStopCapture(ctx);
     
+    /* Close the events of recycled URBs, then release the pools */
+    PSLIST_ENTRY entry;
+    while ((entry = InterlockedPopEntrySList(&ctx->UrbPool.FreeList)) != NULL) {
+        PVUSB_US_PENDING_URB urb = (PVUSB_US_PENDING_URB)entry;
+        if (urb->CompletionEvent) CloseHandle(urb->CompletionEvent);
+    }
+    VusbPoolDestroy(&ctx->UrbPool);
+    VusbBufferPoolDestroy(&ctx->BufferPool);
+    VusbBundleStoreDestroy(&ctx->Bundles);
+    
     /* Cleanup synchronization */
     DeleteCriticalSection(&ctx->ClientLock);
-    DeleteCriticalSection(&ctx->DeviceLock);
+    DeleteCriticalSection(&ctx->DeviceGrowLock);
     DeleteCriticalSection(&ctx->CaptureLock);
+    free(ctx->Clients);
+    ctx->Clients = NULL;
     
     if (ctx->ShutdownEvent) {
         CloseHandle(ctx->ShutdownEvent);
     }
+    if (ctx->CompletionEvent) {
+        CloseHandle(ctx->CompletionEvent);
+    }
     
     WSACleanup();
     
@@ -1005,16 +2529,254 @@ void VusbUsCleanup(PVUSB_US_CONTEXT ctx)
     printf("Userspace server cleaned up\n");
 }
 
+/* TOKEN_USER with room for its SID */
+typedef union _US_TOKEN_USER {
+    TOKEN_USER  User;
+    BYTE        Buffer[sizeof(TOKEN_USER) + SECURITY_MAX_SID_SIZE];
+} US_TOKEN_USER;
+
+/**
+ * GetProcessUser - Look up the user a process runs as
+ */
+static int GetProcessUser(DWORD processId, US_TOKEN_USER* user)
+{
+    HANDLE process;
+    HANDLE token = NULL;
+    DWORD length;
+    BOOL found;
+    
+    process = OpenProcess(PROCESS_QUERY_LIMITED_INFORMATION, FALSE, processId);
+    if (!process) return -1;
+    
+    found = OpenProcessToken(process, TOKEN_QUERY, &token) &&
+            GetTokenInformation(token, TokenUser, user, sizeof(*user), &length);
+    
+    if (token) CloseHandle(token);
+    CloseHandle(process);
+    return found ? 0 : -1;
+}
+
+/**
+ * CheckLocalClient - Identify a client on the AF_UNIX socket and decide
+ * whether to let it in
+ * @processId: Receives the client's process ID
+ * @return: 0 if it may connect
+ *
+ * Windows passes no credentials over AF_UNIX, but tells the peer's process
+ * ID; unless LocalAnyUser is set, only processes running as the server's
+ * user are accepted.
+ */
+static int CheckLocalClient(PVUSB_US_CONTEXT ctx, SOCKET clientSocket, DWORD* processId)
+{
+    US_TOKEN_USER peerUser;
+    US_TOKEN_USER serverUser;
+    DWORD bytes = 0;
+    
+    *processId = 0;
+    if (WSAIoctl(clientSocket, SIO_AF_UNIX_GETPEERPID, NULL, 0, processId,
+                 sizeof(*processId), &bytes, NULL, NULL) == SOCKET_ERROR) {
+        LogMessage(ctx, "Cannot identify local client: %d", WSAGetLastError());
+        return -1;
+    }
+    
+    if (ctx->Config.LocalAnyUser) {
+        return 0;
+    }
+    
+    if (GetProcessUser(*processId, &peerUser) != 0 ||
+        GetProcessUser(GetCurrentProcessId(), &serverUser) != 0 ||
+        !EqualSid(peerUser.User.User.Sid, serverUser.User.User.Sid)) {
+        printf("Rejected local client pid %lu: runs as another user\n", (unsigned long)*processId);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * LocalAddress - Fill in an AF_UNIX address
+ * @return: Length of the address
+ *
+ * A name starting with '@' is abstract: it has no file and goes away with
+ * the listener.
+ */
+static int LocalAddress(const char* name, SOCKADDR_UN* addr)
+{
+    size_t length = strlen(name);
+    
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (length >= sizeof(addr->sun_path)) {
+        length = sizeof(addr->sun_path) - 1;
+    }
+    memcpy(addr->sun_path, name, length);
+    
+    if (name[0] == '@') {
+        addr->sun_path[0] = '\0';
+        return (int)(offsetof(SOCKADDR_UN, sun_path) + length);
+    }
+    return (int)sizeof(*addr);
+}
+
+/**
+ * OpenLocalListener - Listen on the AF_UNIX socket for clients on this host
+ *
+ * A socket file left behind by an earlier run is replaced.
+ */
+static SOCKET OpenLocalListener(PVUSB_US_CONTEXT ctx)
+{
+    SOCKADDR_UN addr;
+    int addrLength;
+    SOCKET listenSocket;
+    
+    addrLength = LocalAddress(ctx->Config.LocalSocket, &addr);
+    if (addr.sun_path[0]) {
+        DeleteFileA(addr.sun_path);
+    }
+    
+    listenSocket = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listenSocket == INVALID_SOCKET) {
+        fprintf(stderr, "AF_UNIX socket() failed: %d\n", WSAGetLastError());
+        return INVALID_SOCKET;
+    }
+    
+    if (bind(listenSocket, (struct sockaddr*)&addr, addrLength) == SOCKET_ERROR ||
+        listen(listenSocket, SOMAXCONN) == SOCKET_ERROR) {
+        fprintf(stderr, "Cannot listen on %s: %d\n", ctx->Config.LocalSocket, WSAGetLastError());
+        closesocket(listenSocket);
+        return INVALID_SOCKET;
+    }
+    
+    return listenSocket;
+}
+
+/**
+ * AcceptClient - Take a connection from a listening socket and start serving it
+ * @local: The AF_UNIX listener rather than TCP
+ */
+static void AcceptClient(PVUSB_US_CONTEXT ctx, SOCKET listenSocket, BOOL local)
+{
+    struct sockaddr_storage clientAddr;
+    int clientAddrLen = sizeof(clientAddr);
+    SOCKET clientSocket;
+    DWORD processId = 0;
+    int optval;
+    
+    clientSocket = accept(listenSocket, (struct sockaddr*)&clientAddr, &clientAddrLen);
+    if (clientSocket == INVALID_SOCKET) {
+        if (ctx->Running) {
+            fprintf(stderr, "accept() failed: %d\n", WSAGetLastError());
+        }
+        return;
+    }
+    
+    if (local) {
+        if (CheckLocalClient(ctx, clientSocket, &processId) != 0) {
+            closesocket(clientSocket);
+            return;
+        }
+    } else {
+        /* Replies are small and awaited by the client; send them at once */
+        optval = 1;
+        setsockopt(clientSocket, IPPROTO_TCP, TCP_NODELAY, (char*)&optval, sizeof(optval));
+    }
+    
+    /* Allocate client */
+    PVUSB_US_CLIENT client = (PVUSB_US_CLIENT)calloc(1, sizeof(VUSB_US_CLIENT));
+    if (!client) {
+        closesocket(clientSocket);
+        return;
+    }
+    
+    client->Socket = clientSocket;
+    client->Context = ctx;
+    InitializeCriticalSection(&client->SendLock);
+    client->SessionId = ++ctx->NextSessionId;
+    client->Connected = TRUE;
+    client->Local = local;
+    client->ProcessId = processId;
+    if (local) {
+        snprintf(client->AddressString, sizeof(client->AddressString), "pid %lu",
+                 (unsigned long)processId);
+    } else {
+        memcpy(&client->Address, &clientAddr, sizeof(client->Address));
+        inet_ntop(AF_INET, &client->Address.sin_addr, client->AddressString, 
+                  sizeof(client->AddressString));
+    }
+    
+    /* Add to client list */
+    EnterCriticalSection(&ctx->ClientLock);
+    BOOL added = FALSE;
+    for (int i = 0; i < ctx->Config.MaxClients; i++) {
+        if (!ctx->Clients[i]) {
+            ctx->Clients[i] = client;
+            ctx->ClientCount++;
+            added = TRUE;
+            break;
+        }
+    }
+    LeaveCriticalSection(&ctx->ClientLock);
+    
+    if (!added) {
+        LogMessage(ctx, "Server full, rejecting connection from %s", 
+                   client->AddressString);
+        closesocket(clientSocket);
+        DeleteCriticalSection(&client->SendLock);
+        free(client);
+        return;
+    }
+    
+    if (local) {
+        LogMessage(ctx, "New local connection from %s", client->AddressString);
+    } else {
+        LogMessage(ctx, "New connection from %s:%d", 
+                   client->AddressString, ntohs(client->Address.sin_port));
+    }
+    
+    /* Hand the socket to the reactor or RIO engine; RIO takes only TCP, so
+     * local clients always get a thread of their own */
+    if (ctx->Config.IoEngine != VUSB_US_IO_THREADED && !local) {
+        if (VusbUsIoAttach(ctx, client) != 0) {
+            LogMessage(ctx, "Failed to attach client to I/O engine");
+            VusbUsReleaseClient(ctx, client);
+        }
+        return;
+    }
+    
+    /* Start client thread */
+    client->Thread = CreateThread(NULL, 0, ClientThread, client, 0, NULL);
+    if (!client->Thread) {
+        LogMessage(ctx, "Failed to create client thread");
+        EnterCriticalSection(&ctx->ClientLock);
+        for (int i = 0; i < ctx->Config.MaxClients; i++) {
+            if (ctx->Clients[i] == client) {
+                ctx->Clients[i] = NULL;
+                ctx->ClientCount--;
+                break;
+            }
+        }
+        LeaveCriticalSection(&ctx->ClientLock);
+        closesocket(clientSocket);
+        DeleteCriticalSection(&client->SendLock);
+        free(client);
+    }
+}
+
 int VusbUsRun(PVUSB_US_CONTEXT ctx)
 {
     if (!ctx || !ctx->Initialized) return -1;
     
     SOCKET listenSocket = INVALID_SOCKET;
+    SOCKET localSocket = INVALID_SOCKET;
     struct sockaddr_in serverAddr;
     int result;
     
-    /* Create listening socket */
-    listenSocket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    /* Create listening socket; accepted sockets inherit its flags */
+    if (ctx->Config.IoEngine == VUSB_US_IO_RIO) {
+        listenSocket = WSASocket(AF_INET, SOCK_STREAM, IPPROTO_TCP, NULL, 0,
+                                 WSA_FLAG_OVERLAPPED | WSA_FLAG_REGISTERED_IO);
+    } else {
+        listenSocket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    }
     if (listenSocket == INVALID_SOCKET) {
         fprintf(stderr, "socket() failed: %d\n", WSAGetLastError());
         return -1;
@@ -1045,111 +2807,84 @@ int VusbUsRun(PVUSB_US_CONTEXT ctx)
         return -1;
     }
     
+    /* Clients on this host may skip TCP/IP */
+    if (ctx->Config.LocalSocket[0]) {
+        localSocket = OpenLocalListener(ctx);
+        if (localSocket == INVALID_SOCKET) {
+            closesocket(listenSocket);
+            return -1;
+        }
+    }
+    
     ctx->ListenSocket = listenSocket;
+    ctx->LocalListenSocket = localSocket;
     ctx->Running = TRUE;
     
+    if (ctx->Config.IoEngine != VUSB_US_IO_THREADED && VusbUsIoStart(ctx) != 0) {
+        fprintf(stderr, "Failed to start I/O engine, using thread-per-client\n");
+        ctx->Config.IoEngine = VUSB_US_IO_THREADED;
+    }
+    
     printf("\n");
     printf("=====================================\n");
     printf(" Virtual USB Userspace Server\n");
     printf("=====================================\n");
     printf(" Port: %d\n", ctx->Config.Port);
+    if (localSocket != INVALID_SOCKET) {
+        printf(" Local socket: %s (%s)\n", ctx->Config.LocalSocket,
+               ctx->Config.LocalAnyUser ? "any user" : "this user only");
+    }
     printf(" Max clients: %d\n", ctx->Config.MaxClients);
     printf(" Max devices: %d\n", ctx->Config.MaxDevices);
     printf(" Simulation: %s\n", ctx->Config.EnableSimulation ? "enabled" : "disabled");
     printf(" Logging: %s\n", ctx->Config.EnableLogging ? "enabled" : "disabled");
+    printf(" I/O engine: %s\n", 
+           ctx->Config.IoEngine == VUSB_US_IO_RIO ? "rio" :
+           ctx->Config.IoEngine == VUSB_US_IO_REACTOR ? "reactor" : "threads");
     printf("=====================================\n");
     printf("\nListening for connections...\n");
     printf("Press Ctrl+C to stop.\n\n");
     
     /* Accept loop */
     while (ctx->Running) {
-        struct sockaddr_in clientAddr;
-        int clientAddrLen = sizeof(clientAddr);
-        SOCKET clientSocket;
-        
         /* Use select with timeout for graceful shutdown */
         fd_set readfds;
         struct timeval tv;
         FD_ZERO(&readfds);
         FD_SET(listenSocket, &readfds);
+        if (localSocket != INVALID_SOCKET) {
+            FD_SET(localSocket, &readfds);
+        }
         tv.tv_sec = 1;
         tv.tv_usec = 0;
         
         result = select(0, &readfds, NULL, NULL, &tv);
         if (result <= 0) continue;
         
-        clientSocket = accept(listenSocket, (struct sockaddr*)&clientAddr, &clientAddrLen);
-        if (clientSocket == INVALID_SOCKET) {
-            if (ctx->Running) {
-                fprintf(stderr, "accept() failed: %d\n", WSAGetLastError());
-            }
-            continue;
-        }
-        
-        /* Allocate client */
-        PVUSB_US_CLIENT client = (PVUSB_US_CLIENT)calloc(1, sizeof(VUSB_US_CLIENT));
-        if (!client) {
-            closesocket(clientSocket);
-            continue;
-        }
-        
-        client->Socket = clientSocket;
-        client->Context = ctx;
-        client->SessionId = ++ctx->NextSessionId;
-        client->Connected = TRUE;
-        memcpy(&client->Address, &clientAddr, sizeof(clientAddr));
-        inet_ntop(AF_INET, &clientAddr.sin_addr, client->AddressString, 
-                  sizeof(client->AddressString));
-        
-        /* Add to client list */
-        EnterCriticalSection(&ctx->ClientLock);
-        BOOL added = FALSE;
-        for (int i = 0; i < VUSB_US_MAX_CLIENTS; i++) {
-            if (!ctx->Clients[i]) {
-                ctx->Clients[i] = client;
-                ctx->ClientCount++;
-                added = TRUE;
-                break;
-            }
-        }
-        LeaveCriticalSection(&ctx->ClientLock);
-        
-        if (!added) {
-            LogMessage(ctx, "Server full, rejecting connection from %s", 
-                       client->AddressString);
-            closesocket(clientSocket);
-            free(client);
-            continue;
+        if (FD_ISSET(listenSocket, &readfds)) {
+            AcceptClient(ctx, listenSocket, FALSE);
         }
-        
-        LogMessage(ctx, "New connection from %s:%d", 
-                   client->AddressString, ntohs(clientAddr.sin_port));
-        
-        /* Start client thread */
-        client->Thread = CreateThread(NULL, 0, ClientThread, client, 0, NULL);
-        if (!client->Thread) {
-            LogMessage(ctx, "Failed to create client thread");
-            EnterCriticalSection(&ctx->ClientLock);
-            for (int i = 0; i < VUSB_US_MAX_CLIENTS; i++) {
-                if (ctx->Clients[i] == client) {
-                    ctx->Clients[i] = NULL;
-                    ctx->ClientCount--;
-                    break;
-                }
-            }
-            LeaveCriticalSection(&ctx->ClientLock);
-            closesocket(clientSocket);
-            free(client);
+        if (localSocket != INVALID_SOCKET && FD_ISSET(localSocket, &readfds)) {
+            AcceptClient(ctx, localSocket, TRUE);
         }
     }
     
     /* Cleanup */
     closesocket(listenSocket);
     ctx->ListenSocket = INVALID_SOCKET;
+    if (localSocket != INVALID_SOCKET) {
+        closesocket(localSocket);
+        ctx->LocalListenSocket = INVALID_SOCKET;
+        if (ctx->Config.LocalSocket[0] != '@') {
+            DeleteFileA(ctx->Config.LocalSocket);
+        }
+    }
+    
+    VusbUsIoStop(ctx);
     
     /* Wait for client threads */
     EnterCriticalSection(&ctx->ClientLock);
-    for (int i = 0; i < VUSB_US_MAX_CLIENTS; i++) {
+    for (int i = 0; i < ctx->Config.MaxClients; i++) {
         if (ctx->Clients[i]) {
             ctx->Clients[i]->Connected = FALSE;
             if (ctx->Clients[i]->Thread) {
@@ -1161,6 +2896,9 @@ int VusbUsRun(PVUSB_US_CONTEXT ctx)
     }
     LeaveCriticalSection(&ctx->ClientLock);
     
+    /* Sessions still waiting for a resume will not get one */
+    ReleaseParkedClients(ctx, UINT64_MAX);
+    
     return 0;
 }
 
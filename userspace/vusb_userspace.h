@@ -18,21 +18,48 @@
 
 #include <winsock2.h>
 #include <ws2tcpip.h>
+#include <afunix.h>
 #include <windows.h>
 #include <stdint.h>
 #include "../protocol/vusb_protocol.h"
 #include "../protocol/vusb_ioctl.h"
+#include "../protocol/vusb_pool.h"
+#include "../protocol/vusb_timer.h"
+#include "../protocol/vusb_bundle.h"
+#include "../protocol/vusb_mpsc.h"
+#include "../protocol/vusb_workers.h"
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
 /* Configuration */
-#define VUSB_US_MAX_DEVICES         16
-#define VUSB_US_MAX_CLIENTS         32
+#define VUSB_US_DEFAULT_DEVICES     16      /* VUSB_US_CONFIG defaults */
+#define VUSB_US_DEFAULT_CLIENTS     32
+#define VUSB_US_DEVICE_BLOCK_SIZE   64      /* Devices added to the table at a time */
 #define VUSB_US_MAX_ENDPOINTS       32
-#define VUSB_US_MAX_PENDING_URBS    256
+#define VUSB_US_MAX_PENDING_URBS    4096    /* Per device, power of two */
+#define VUSB_US_INITIAL_URB_SLOTS   64      /* Pending URB slots a new device starts with */
 #define VUSB_US_URB_BUFFER_SIZE     65536
+#define VUSB_US_MAX_REACTOR_THREADS 16
+#define VUSB_US_RX_INITIAL_SIZE     4096
+#define VUSB_US_REMOTE_INDEX_SIZE   32      /* Initial size, power of two */
+#define VUSB_US_URB_POOL_SLAB       256     /* URB objects per pool slab */
+#define VUSB_US_CONTROL_TIMEOUT_MS  5000    /* Default for control transfers */
+#define VUSB_US_EXPIRY_INTERVAL_MS  100     /* How often the timer wheels advance */
+#define VUSB_US_DESC_INDEX_SIZE     128     /* Power of two, descriptors indexed per device */
+#define VUSB_US_RESUME_GRACE_MS     5000    /* Default for keeping a dropped session */
+
+/* Protocol features offered to clients */
+#define VUSB_US_CAPABILITIES        (VUSB_CAP_URB_BATCH | VUSB_CAP_SEGMENTED | \
+                                     VUSB_CAP_DESC_BUNDLE | VUSB_CAP_SESSION_RESUME)
+
+/* Network I/O engine */
+typedef enum _VUSB_US_IO_ENGINE {
+    VUSB_US_IO_THREADED = 0,        /* One blocking thread per client */
+    VUSB_US_IO_REACTOR,             /* Fixed reactor threads on a completion port */
+    VUSB_US_IO_RIO,                 /* Registered I/O with batched completions */
+} VUSB_US_IO_ENGINE;
 
 /* Endpoint state */
 typedef enum _VUSB_US_EP_STATE {
@@ -42,7 +69,7 @@ typedef enum _VUSB_US_EP_STATE {
     VUSB_US_EP_HALTED,
 } VUSB_US_EP_STATE;
 
-/* Userspace endpoint */
+/* Userspace endpoint, allocated the first time a gadget uses it */
 typedef struct _VUSB_US_ENDPOINT {
     uint8_t             Address;
     uint8_t             Attributes;         /* Transfer type + sync + usage */
@@ -72,9 +99,24 @@ typedef enum _VUSB_US_DEV_STATE {
     VUSB_US_DEV_SUSPENDED,
 } VUSB_US_DEV_STATE;
 
+/*
+ * URB IDs carry their pending-table slot in the low bits; the high bits
+ * come from a per-device counter so a stale ID never matches a reused slot.
+ */
+#define VUSB_US_URB_SLOT(urbId)     ((urbId) & (VUSB_US_MAX_PENDING_URBS - 1))
+
+/*
+ * Device IDs carry their device table index the same way; the high bits
+ * count creations. The index width also caps VUSB_US_CONFIG.MaxDevices.
+ */
+#define VUSB_US_DEVICE_INDEX_BITS   16
+#define VUSB_US_DEVICE_LIMIT        (1 << VUSB_US_DEVICE_INDEX_BITS)
+#define VUSB_US_DEVICE_INDEX(deviceId)  ((deviceId) & (VUSB_US_DEVICE_LIMIT - 1))
+
 /* Pending URB in userspace */
 typedef struct _VUSB_US_PENDING_URB {
-    struct _VUSB_US_PENDING_URB* Next;
+    struct _VUSB_US_PENDING_URB* Next;  /* Endpoint queue links */
+    struct _VUSB_US_PENDING_URB* Prev;
     uint32_t            UrbId;
     uint32_t            Sequence;
     uint8_t             EndpointAddress;
@@ -83,6 +125,7 @@ typedef struct _VUSB_US_PENDING_URB {
     uint32_t            TransferFlags;
     uint32_t            TransferBufferLength;
     uint32_t            Interval;
+    uint32_t            Timeout;            /* Milliseconds, 0 = none */
     VUSB_SETUP_PACKET   SetupPacket;
     uint8_t*            TransferBuffer;
     uint32_t            ActualLength;
@@ -90,16 +133,35 @@ typedef struct _VUSB_US_PENDING_URB {
     BOOL                Completed;
     HANDLE              CompletionEvent;
     uint64_t            SubmitTime;
+    VUSB_TIMER          Timer;              /* Armed while Timeout is running */
+    VUSB_MPSC_NODE      CompletionLink;     /* Waiting for the completion thread */
     
-    /* Callback for completion */
+    /* Callback for completion, run on the completion thread */
     void*               CallbackContext;
     void                (*CompletionCallback)(struct _VUSB_US_PENDING_URB*, void*);
 } VUSB_US_PENDING_URB, *PVUSB_US_PENDING_URB;
 
+/* Pending URBs of one endpoint, oldest first */
+typedef struct _VUSB_US_URB_QUEUE {
+    PVUSB_US_PENDING_URB Head;
+    PVUSB_US_PENDING_URB Tail;
+    uint32_t            Count;
+} VUSB_US_URB_QUEUE, *PVUSB_US_URB_QUEUE;
+
+/* (type, index, langid) -> slice of the descriptor blob */
+typedef struct _VUSB_US_DESC_ENTRY {
+    uint8_t             Type;               /* 0 if the entry is free */
+    uint8_t             Index;
+    uint16_t            LangId;             /* Strings other than index 0, else 0 */
+    uint32_t            Offset;
+    uint32_t            Length;             /* wTotalLength for configuration and BOS */
+} VUSB_US_DESC_ENTRY, *PVUSB_US_DESC_ENTRY;
+
 /* Userspace virtual device */
 typedef struct _VUSB_US_DEVICE {
     BOOL                Active;
     uint32_t            DeviceId;
+    uint32_t            Index;              /* Entry in the device table */
     uint32_t            RemoteDeviceId;     /* ID on the client side */
     VUSB_US_DEV_STATE   State;
     
@@ -109,21 +171,32 @@ typedef struct _VUSB_US_DEVICE {
     /* Full descriptors */
     uint8_t*            Descriptors;
     uint32_t            DescriptorLength;
+    VUSB_US_DESC_ENTRY  DescIndex[VUSB_US_DESC_INDEX_SIZE];
+    uint16_t            DefaultLangId;      /* First language in string 0 */
     
     /* Current configuration */
     uint8_t             Configuration;
     uint8_t             Address;
     
-    /* Endpoints */
-    VUSB_US_ENDPOINT    Endpoints[VUSB_US_MAX_ENDPOINTS];
+    /* Endpoints, NULL until used */
+    PVUSB_US_ENDPOINT volatile Endpoints[VUSB_US_MAX_ENDPOINTS];
     int                 NumEndpoints;
     
-    /* Pending URBs */
+    /* Pending URBs, indexed by VUSB_US_URB_SLOT(UrbId) */
     CRITICAL_SECTION    UrbLock;
-    PVUSB_US_PENDING_URB PendingUrbs;
+    PVUSB_US_PENDING_URB* UrbSlots;         /* UrbSlotCapacity entries */
+    uint16_t*           FreeUrbSlots;       /* Stack of unused slot indices */
+    uint32_t            FreeUrbSlotCount;
+    uint32_t            UrbSlotCapacity;    /* Doubled when full, up to VUSB_US_MAX_PENDING_URBS */
     uint32_t            PendingUrbCount;
     uint32_t            NextUrbId;
     
+    /* The same URBs per endpoint, indexed by VUSB_ENDPOINT_QUEUE(address) */
+    VUSB_US_URB_QUEUE   UrbQueues[VUSB_ENDPOINT_QUEUES];
+    
+    /* Timeouts of the same URBs, also guarded by UrbLock */
+    VUSB_TIMER_WHEEL    UrbTimers;
+    
     /* Client connection owning this device */
     void*               OwnerClient;
     
@@ -134,6 +207,38 @@ typedef struct _VUSB_US_DEVICE {
     uint64_t            UrbsCompleted;
 } VUSB_US_DEVICE, *PVUSB_US_DEVICE;
 
+/* Guards one entry of the device table; kept out of VUSB_US_DEVICE so
+ * creating a device never wipes it */
+typedef struct _VUSB_US_DEVICE_SLOT {
+    SRWLOCK             Lock;               /* Exclusive to create, destroy or re-own the device */
+    volatile LONG       Sequence;           /* Odd while Active or DeviceInfo change */
+} VUSB_US_DEVICE_SLOT, *PVUSB_US_DEVICE_SLOT;
+
+/* Completed URBs with a callback, for one device */
+typedef struct _VUSB_US_COMPLETIONS {
+    VUSB_MPSC_QUEUE     Queue;
+    VUSB_MPSC_NODE      Ready;              /* On the context's ReadyDevices while Queue is not empty */
+} VUSB_US_COMPLETIONS, *PVUSB_US_COMPLETIONS;
+
+/*
+ * VUSB_US_DEVICE_BLOCK_SIZE entries of the device table, one array per
+ * field so scans for a free entry or a live device read the IDs alone. Blocks are
+ * added as the table fills and live as long as the context, so device
+ * pointers stay valid without a lock.
+ */
+typedef struct _VUSB_US_DEVICE_BLOCK {
+    volatile uint32_t   Ids[VUSB_US_DEVICE_BLOCK_SIZE];         /* DeviceId while active, else 0 */
+    VUSB_US_DEVICE_SLOT Slots[VUSB_US_DEVICE_BLOCK_SIZE];
+    VUSB_US_COMPLETIONS Completions[VUSB_US_DEVICE_BLOCK_SIZE];
+    PVUSB_US_DEVICE     Devices[VUSB_US_DEVICE_BLOCK_SIZE];     /* Allocated on first use, then kept */
+} VUSB_US_DEVICE_BLOCK, *PVUSB_US_DEVICE_BLOCK;
+
+/* Client device ID -> local device index entry */
+typedef struct _VUSB_US_REMOTE_ENTRY {
+    uint32_t            RemoteId;
+    PVUSB_US_DEVICE     Device;             /* NULL if the entry is free */
+} VUSB_US_REMOTE_ENTRY;
+
 /* Forward declarations */
 typedef struct _VUSB_US_CLIENT VUSB_US_CLIENT, *PVUSB_US_CLIENT;
 typedef struct _VUSB_US_CONTEXT VUSB_US_CONTEXT, *PVUSB_US_CONTEXT;
@@ -146,26 +251,56 @@ typedef struct _VUSB_US_CLIENT {
     uint32_t            SessionId;
     BOOL                Connected;
     BOOL                Authenticated;
+    BOOL                Local;              /* Came in on the AF_UNIX listener */
+    DWORD               ProcessId;          /* Of a local client */
     struct sockaddr_in  Address;
     char                AddressString[INET_ADDRSTRLEN];
     char                ClientName[64];
     uint32_t            ClientVersion;
-    uint32_t            Capabilities;
+    uint32_t            Capabilities;       /* Negotiated VUSB_CAP_* flags */
+    
+    /* Session resume; Parked clients have no socket and keep their devices */
+    uint8_t             ResumeToken[VUSB_RESUME_TOKEN_SIZE];
+    BOOL                Parked;
+    uint64_t            ParkedUntil;        /* Released by the expiry thread after this */
+    BOOL                Leaving;            /* Said DISCONNECT, nothing to keep */
+    
+    /* Serializes writers on Socket */
+    CRITICAL_SECTION    SendLock;
     
-    /* Devices owned by this client */
-    uint32_t            DeviceIds[VUSB_US_MAX_DEVICES];
+    /* Per-connection state owned by the reactor or RIO engine */
+    void*               IoState;
+    
+    /* Devices owned by this client, grown as needed */
+    uint32_t*           DeviceIds;
     int                 DeviceCount;
+    int                 DeviceCapacity;
+    
+    /* Open-addressed by RemoteId, kept at most half full; only the client's
+     * I/O thread touches it */
+    VUSB_US_REMOTE_ENTRY* RemoteIndex;
+    uint32_t            RemoteIndexSize;    /* Power of two */
+    
+    /* Segmented message being received, also I/O thread only */
+    VUSB_REASSEMBLY     Reassembly;
 } VUSB_US_CLIENT;
 
 /* Userspace server configuration */
 typedef struct _VUSB_US_CONFIG {
     uint16_t    Port;
-    int         MaxClients;
-    int         MaxDevices;
+    int         MaxClients;         /* Up to this many connected at once */
+    int         MaxDevices;         /* Up to VUSB_US_DEVICE_LIMIT; table grows to it */
     BOOL        EnableSimulation;   /* Allow simulated device responses */
     BOOL        EnableLogging;      /* Verbose logging */
     BOOL        EnableCapture;      /* Capture USB traffic to file */
     char        CaptureFile[MAX_PATH];
+    VUSB_US_IO_ENGINE IoEngine;     /* Client socket I/O model */
+    int         ReactorThreads;     /* Reactor/RIO threads (0 = one per CPU) */
+    char        BundleDirectory[MAX_PATH];  /* Descriptor bundles on disk, empty = memory only */
+    uint32_t    ResumeGraceMs;      /* Dropped sessions kept this long, 0 = never */
+    char        LocalSocket[UNIX_PATH_MAX];     /* AF_UNIX listener, '@' first = abstract, empty = none */
+    BOOL        LocalAnyUser;       /* Let in local clients run by other users */
+    int         Workers;            /* URB completion workers, 0 = on the receive thread */
 } VUSB_US_CONFIG, *PVUSB_US_CONFIG;
 
 /* USB traffic capture entry */
@@ -216,17 +351,25 @@ typedef struct _VUSB_US_CONTEXT {
     
     /* Network */
     SOCKET              ListenSocket;
+    SOCKET              LocalListenSocket;  /* AF_UNIX, or INVALID_SOCKET */
+    
+    /* Reactor and RIO engines */
+    HANDLE              IoPort;
+    HANDLE              ReactorThreads[VUSB_US_MAX_REACTOR_THREADS];
+    int                 ReactorThreadCount;
+    void*               RioState;           /* Registered buffers and queues */
     
     /* Client management */
     CRITICAL_SECTION    ClientLock;
-    PVUSB_US_CLIENT     Clients[VUSB_US_MAX_CLIENTS];
+    PVUSB_US_CLIENT*    Clients;            /* Config.MaxClients entries */
     int                 ClientCount;
     uint32_t            NextSessionId;
     
-    /* Device management */
-    CRITICAL_SECTION    DeviceLock;
-    VUSB_US_DEVICE      Devices[VUSB_US_MAX_DEVICES];
-    uint32_t            NextDeviceId;
+    /* Device management; no lock covers the whole table */
+    PVUSB_US_DEVICE_BLOCK* DeviceBlocks;    /* Enough for Config.MaxDevices */
+    volatile LONG       DeviceBlockCount;   /* Allocated so far */
+    CRITICAL_SECTION    DeviceGrowLock;     /* Held to add a block */
+    volatile LONG       NextDeviceId;
     
     /* Optional gadget operations for custom device emulation */
     PVUSB_US_GADGET_OPS GadgetOps;
@@ -235,10 +378,33 @@ typedef struct _VUSB_US_CONTEXT {
     HANDLE              CaptureFile;
     CRITICAL_SECTION    CaptureLock;
     
+    /* URB objects and transfer buffers, recycled instead of freed */
+    VUSB_POOL           UrbPool;
+    VUSB_BUFFER_POOL    BufferPool;
+    
+    /* Descriptor blobs seen in attach requests, by hash */
+    VUSB_BUNDLE_STORE   Bundles;
+    
     /* Statistics */
     uint64_t            TotalUrbsProcessed;
     uint64_t            TotalBytesTransferred;
     uint64_t            StartTime;
+    volatile LONG64     IoMessages;         /* Messages received from clients */
+    volatile LONG64     IoSyscalls;         /* Socket calls made to move them */
+    
+    /* URB timeout expiry */
+    HANDLE              ExpiryThread;
+    
+    /* The completion thread runs the callbacks of URBs queued on each
+     * block's Completions, so no network thread ever does. Only devices
+     * with something queued are on ReadyDevices, so it never scans. */
+    VUSB_MPSC_QUEUE     ReadyDevices;
+    HANDLE              CompletionEvent;    /* Set when ReadyDevices stops being empty */
+    HANDLE              CompletionThread;
+    volatile BOOL       StopCompletions;
+    
+    /* Complete client URB_COMPLETEs, by device, off the receive threads */
+    VUSB_WORKER_POOL    Workers;
     
     /* Event for shutdown signaling */
     HANDLE              ShutdownEvent;
@@ -275,6 +441,40 @@ int VusbUsRun(PVUSB_US_CONTEXT ctx);
  */
 void VusbUsStop(PVUSB_US_CONTEXT ctx);
 
+/* ============================================================
+ * Client Connections
+ * ============================================================ */
+
+/**
+ * VusbUsProcessMessage - Dispatch one complete message from a client
+ * @ctx: Server context
+ * @client: Client the message arrived on
+ * @header: Message header, immediately followed in memory by the payload
+ * @payload: Message payload
+ * @payloadLen: Payload length
+ */
+void VusbUsProcessMessage(PVUSB_US_CONTEXT ctx, PVUSB_US_CLIENT client,
+                          PVUSB_HEADER header, uint8_t* payload, uint32_t payloadLen);
+
+/**
+ * VusbUsSendToClient - Send a complete message to a client
+ * @client: Target client
+ * @data: Message data
+ * @length: Message length
+ * @return: 0 on success, negative if the connection failed
+ */
+int VusbUsSendToClient(PVUSB_US_CLIENT client, const void* data, uint32_t length);
+
+/**
+ * VusbUsReleaseClient - Destroy a client's devices, unlink and free it
+ * @ctx: Server context
+ * @client: Client to release (socket is closed)
+ *
+ * A client that negotiated session resume is parked instead: its devices
+ * stay until a SESSION_RESUME claims them or the grace period runs out.
+ */
+void VusbUsReleaseClient(PVUSB_US_CONTEXT ctx, PVUSB_US_CLIENT client);
+
 /* ============================================================
  * Device Management
  * ============================================================ */
@@ -312,11 +512,26 @@ PVUSB_US_DEVICE VusbUsGetDevice(PVUSB_US_CONTEXT ctx, uint32_t deviceId);
  * URB Processing
  * ============================================================ */
 
+/**
+ * VusbUsAllocateUrb - Get a zeroed URB from the context's pool
+ * @ctx: Server context
+ * @bufferLength: Transfer buffer to attach (0 = none)
+ * @return: URB with CompletionEvent reset, or NULL
+ */
+PVUSB_US_PENDING_URB VusbUsAllocateUrb(PVUSB_US_CONTEXT ctx, uint32_t bufferLength);
+
+/**
+ * VusbUsFreeUrb - Return a URB and its transfer buffer to the pool
+ * @ctx: Server context
+ * @urb: URB from VusbUsAllocateUrb, no longer pending
+ */
+void VusbUsFreeUrb(PVUSB_US_CONTEXT ctx, PVUSB_US_PENDING_URB urb);
+
 /**
  * VusbUsSubmitUrb - Submit a URB to a device
  * @ctx: Server context
  * @deviceId: Target device
- * @urb: URB to submit
+ * @urb: URB from VusbUsAllocateUrb; freed with the device if still pending
  * @return: 0 on success
  */
 int VusbUsSubmitUrb(PVUSB_US_CONTEXT ctx, uint32_t deviceId, 
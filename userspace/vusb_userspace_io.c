@@ -0,0 +1,878 @@
+/**
+ * Virtual USB Userspace Network I/O Engines
+ *
+ * Reactor engine: a fixed pool of threads multiplexes all client sockets
+ * over one I/O completion port, so the number of threads no longer grows
+ * with the number of connected clients.
+ *
+ * RIO engine: the same thread pool drains Registered I/O completion
+ * queues instead, posting and committing socket requests in batches.
+ */
+
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <windows.h>
+#include <mswsock.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "vusb_userspace.h"
+#include "vusb_userspace_io.h"
+#include "../protocol/vusb_protocol.h"
+
+/* ============================================================
+ * Receive Buffer Management
+ * ============================================================ */
+
+static int ReserveRx(PVUSB_US_CONNECTION conn, uint32_t needed)
+{
+    uint32_t capacity = conn->RxCapacity;
+    uint8_t* buffer;
+
+    if (needed <= capacity) return 0;
+
+    while (capacity < needed) {
+        capacity *= 2;
+    }
+    if (capacity > VUSB_MAX_PACKET_SIZE) {
+        capacity = VUSB_MAX_PACKET_SIZE;
+    }
+
+    buffer = (uint8_t*)realloc(conn->RxBuffer, capacity);
+    if (!buffer) return -1;
+
+    conn->RxBuffer = buffer;
+    conn->RxCapacity = capacity;
+    return 0;
+}
+
+static void ShrinkRx(PVUSB_US_CONNECTION conn)
+{
+    /* Give back the memory of a large frame once it has been consumed */
+    if (conn->RxLength == 0 && conn->RxCapacity > VUSB_US_RX_INITIAL_SIZE) {
+        uint8_t* buffer = (uint8_t*)realloc(conn->RxBuffer, VUSB_US_RX_INITIAL_SIZE);
+        if (buffer) {
+            conn->RxBuffer = buffer;
+            conn->RxCapacity = VUSB_US_RX_INITIAL_SIZE;
+        }
+    }
+}
+
+/* ============================================================
+ * Frame Parsing
+ * ============================================================ */
+
+/**
+ * ParseFrames - Dispatch every complete message in the staging buffer
+ *
+ * Messages are handled in place; a trailing partial message is moved to
+ * the front of the buffer and the buffer grown to hold it completely.
+ */
+static int ParseFrames(PVUSB_US_CONTEXT ctx, PVUSB_US_CONNECTION conn)
+{
+    PVUSB_US_CLIENT client = conn->Client;
+    uint32_t offset = 0;
+    uint32_t needed = 0;
+
+    while (conn->RxLength - offset >= sizeof(VUSB_HEADER)) {
+        PVUSB_HEADER header = (PVUSB_HEADER)(conn->RxBuffer + offset);
+        uint32_t frameLength;
+
+        if (!VusbValidateHeader(header)) {
+            fprintf(stderr, "Invalid protocol header from %s\n", client->AddressString);
+            return -1;
+        }
+
+        if (header->Length > VUSB_MAX_PACKET_SIZE - sizeof(VUSB_HEADER)) {
+            fprintf(stderr, "Payload too large: %u\n", header->Length);
+            return -1;
+        }
+
+        frameLength = sizeof(VUSB_HEADER) + header->Length;
+        if (conn->RxLength - offset < frameLength) {
+            needed = frameLength;
+            break;
+        }
+
+        VusbUsProcessMessage(ctx, client, header, (uint8_t*)(header + 1), header->Length);
+        offset += frameLength;
+
+        if (!client->Connected) {
+            return -1;
+        }
+    }
+
+    /* Keep the partial message at the start of the buffer */
+    if (offset > 0) {
+        conn->RxLength -= offset;
+        if (conn->RxLength > 0) {
+            memmove(conn->RxBuffer, conn->RxBuffer + offset, conn->RxLength);
+        }
+    }
+
+    return ReserveRx(conn, needed);
+}
+
+/**
+ * DrainConnection - Read everything the socket has buffered
+ * @return: 0 when the socket would block, negative when it must be closed
+ */
+static int DrainConnection(PVUSB_US_CONTEXT ctx, PVUSB_US_CONNECTION conn)
+{
+    SOCKET socket = conn->Client->Socket;
+
+    for (;;) {
+        if (conn->RxLength == conn->RxCapacity) {
+            return -1;
+        }
+
+        int result = recv(socket, (char*)(conn->RxBuffer + conn->RxLength),
+                          (int)(conn->RxCapacity - conn->RxLength), 0);
+        InterlockedIncrement64(&ctx->IoSyscalls);
+        if (result == 0) {
+            return -1;
+        }
+        if (result == SOCKET_ERROR) {
+            if (WSAGetLastError() == WSAEWOULDBLOCK) {
+                break;
+            }
+            return -1;
+        }
+
+        conn->RxLength += (uint32_t)result;
+
+        if (ParseFrames(ctx, conn) != 0) {
+            return -1;
+        }
+    }
+
+    ShrinkRx(conn);
+    return 0;
+}
+
+/* ============================================================
+ * Connection Lifetime
+ * ============================================================ */
+
+/**
+ * ArmConnection - Post a zero-byte receive as readiness notification
+ */
+static int ArmConnection(PVUSB_US_CONNECTION conn)
+{
+    DWORD flags = 0;
+
+    memset(&conn->Overlapped, 0, sizeof(conn->Overlapped));
+    InterlockedIncrement64(&conn->Client->Context->IoSyscalls);
+
+    if (WSARecv(conn->Client->Socket, &conn->ZeroBuffer, 1, NULL, &flags,
+                &conn->Overlapped, NULL) == SOCKET_ERROR) {
+        if (WSAGetLastError() != WSA_IO_PENDING) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static void CloseConnection(PVUSB_US_CONTEXT ctx, PVUSB_US_CONNECTION conn)
+{
+    PVUSB_US_CLIENT client = conn->Client;
+
+    client->Connected = FALSE;
+    client->IoState = NULL;
+
+    free(conn->RxBuffer);
+    free(conn);
+
+    VusbUsReleaseClient(ctx, client);
+}
+
+/* ============================================================
+ * Reactor Threads
+ * ============================================================ */
+
+static DWORD WINAPI ReactorThread(LPVOID param)
+{
+    PVUSB_US_CONTEXT ctx = (PVUSB_US_CONTEXT)param;
+
+    for (;;) {
+        DWORD bytes = 0;
+        ULONG_PTR key = 0;
+        LPOVERLAPPED overlapped = NULL;
+
+        BOOL ok = GetQueuedCompletionStatus(ctx->IoPort, &bytes, &key,
+                                            &overlapped, INFINITE);
+        if (!overlapped) {
+            /* Shutdown packet or the port itself failed */
+            break;
+        }
+
+        PVUSB_US_CONNECTION conn = (PVUSB_US_CONNECTION)overlapped;
+        InterlockedIncrement64(&ctx->IoSyscalls);
+
+        if (!ok || !ctx->Running || !conn->Client->Connected) {
+            CloseConnection(ctx, conn);
+            continue;
+        }
+
+        /* Only this thread owns the connection until it is re-armed */
+        if (DrainConnection(ctx, conn) != 0 || ArmConnection(conn) != 0) {
+            CloseConnection(ctx, conn);
+        }
+    }
+
+    return 0;
+}
+
+/* ============================================================
+ * Registered I/O Engine
+ * ============================================================ */
+
+static void RioRelease(PVUSB_US_RIO rio, PVUSB_US_RIO_CONNECTION conn)
+{
+    if (InterlockedDecrement(&conn->Refs) != 0) return;
+
+    EnterCriticalSection(&rio->Lock);
+    rio->Connections[conn->Index] = NULL;
+    LeaveCriticalSection(&rio->Lock);
+
+    free(conn->Stream.RxBuffer);
+    free(conn);
+}
+
+/**
+ * RioClose - Release the client; the connection itself lives on until
+ * every request still queued on the socket has completed
+ */
+static void RioClose(PVUSB_US_CONTEXT ctx, PVUSB_US_RIO_CONNECTION conn)
+{
+    PVUSB_US_CLIENT client = conn->Stream.Client;
+
+    if (conn->Closing) return;
+    conn->Closing = TRUE;
+
+    /* Wait out any sender still using the request queue */
+    EnterCriticalSection(&client->SendLock);
+    client->Connected = FALSE;
+    client->IoState = NULL;
+    LeaveCriticalSection(&client->SendLock);
+
+    conn->Stream.Client = NULL;
+
+    /* Closing the socket aborts the outstanding requests */
+    VusbUsReleaseClient(ctx, client);
+    RioRelease(conn->Rio, conn);
+}
+
+/**
+ * RioPostReceive - Queue one receive slot; caller holds Client->SendLock
+ */
+static BOOL RioPostReceive(PVUSB_US_RIO rio, PVUSB_US_RIO_CONNECTION conn,
+                           uint32_t slot, DWORD flags)
+{
+    RIO_BUF buffer;
+
+    buffer.BufferId = rio->BufferId;
+    buffer.Offset = conn->BufferOffset + slot * VUSB_US_RIO_SLOT_SIZE;
+    buffer.Length = VUSB_US_RIO_SLOT_SIZE;
+
+    return rio->Fn.RIOReceive(conn->Queue, &buffer, 1, flags, &conn->RecvSlots[slot]);
+}
+
+/**
+ * RioCommit - Publish every request deferred during a batch
+ */
+static void RioCommit(PVUSB_US_CONTEXT ctx, PVUSB_US_RIO_CONNECTION conn)
+{
+    PVUSB_US_RIO rio = conn->Rio;
+    PVUSB_US_CLIENT client = conn->Stream.Client;
+
+    EnterCriticalSection(&client->SendLock);
+    if (conn->RecvsDeferred) {
+        rio->Fn.RIOReceive(conn->Queue, NULL, 0, RIO_MSG_COMMIT_ONLY, NULL);
+        conn->RecvsDeferred = FALSE;
+        InterlockedIncrement64(&ctx->IoSyscalls);
+    }
+    if (conn->SendsDeferred) {
+        rio->Fn.RIOSend(conn->Queue, NULL, 0, RIO_MSG_COMMIT_ONLY, NULL);
+        conn->SendsDeferred = FALSE;
+        InterlockedIncrement64(&ctx->IoSyscalls);
+    }
+    conn->BatchThreadId = 0;
+    LeaveCriticalSection(&client->SendLock);
+}
+
+/**
+ * RioReapSends - Return send slots whose data the stack has taken
+ */
+static void RioReapSends(PVUSB_US_RIO rio)
+{
+    RIORESULT results[VUSB_US_RIO_DEQUEUE_BATCH];
+    ULONG count;
+
+    EnterCriticalSection(&rio->SendCqLock);
+    count = rio->Fn.RIODequeueCompletion(rio->SendCq, results, VUSB_US_RIO_DEQUEUE_BATCH);
+    LeaveCriticalSection(&rio->SendCqLock);
+
+    if (count == RIO_CORRUPT_CQ) return;
+
+    for (ULONG i = 0; i < count; i++) {
+        PVUSB_US_RIO_CONNECTION conn =
+            (PVUSB_US_RIO_CONNECTION)(ULONG_PTR)results[i].RequestContext;
+        InterlockedDecrement(&conn->SendsInFlight);
+        RioRelease(rio, conn);
+    }
+}
+
+/**
+ * RioConsume - Append received bytes to the staging buffer and dispatch
+ */
+static int RioConsume(PVUSB_US_CONTEXT ctx, PVUSB_US_RIO_CONNECTION conn,
+                      const uint8_t* data, uint32_t length)
+{
+    PVUSB_US_CONNECTION stream = &conn->Stream;
+
+    while (length > 0) {
+        uint32_t room = stream->RxCapacity - stream->RxLength;
+        uint32_t chunk = length < room ? length : room;
+
+        if (chunk == 0) return -1;
+
+        memcpy(stream->RxBuffer + stream->RxLength, data, chunk);
+        stream->RxLength += chunk;
+        data += chunk;
+        length -= chunk;
+
+        if (ParseFrames(ctx, stream) != 0) {
+            return -1;
+        }
+    }
+
+    ShrinkRx(stream);
+    return 0;
+}
+
+int VusbUsIoSend(PVUSB_US_CLIENT client, const uint8_t* data, uint32_t length)
+{
+    PVUSB_US_RIO_CONNECTION conn = (PVUSB_US_RIO_CONNECTION)client->IoState;
+    PVUSB_US_RIO rio;
+    BOOL defer;
+    DWORD start = GetTickCount();
+
+    if (!conn) return -1;
+
+    rio = conn->Rio;
+    defer = (conn->BatchThreadId == GetCurrentThreadId());
+
+    while (length > 0) {
+        RIO_BUF buffer;
+        uint32_t slot;
+        uint32_t chunk;
+
+        if (conn->SendsInFlight >= VUSB_US_RIO_SEND_SLOTS) {
+            /* Ring full: push out what is queued and wait for slots */
+            if (conn->SendsDeferred) {
+                rio->Fn.RIOSend(conn->Queue, NULL, 0, RIO_MSG_COMMIT_ONLY, NULL);
+                conn->SendsDeferred = FALSE;
+                InterlockedIncrement64(&client->Context->IoSyscalls);
+            }
+            RioReapSends(rio);
+            if (conn->SendsInFlight >= VUSB_US_RIO_SEND_SLOTS) {
+                if (GetTickCount() - start > 5000) return -1;
+                SwitchToThread();
+            }
+            continue;
+        }
+
+        slot = conn->SendNext;
+        conn->SendNext = (slot + 1) % VUSB_US_RIO_SEND_SLOTS;
+
+        chunk = length < VUSB_US_RIO_SLOT_SIZE ? length : VUSB_US_RIO_SLOT_SIZE;
+
+        buffer.BufferId = rio->BufferId;
+        buffer.Offset = conn->BufferOffset +
+                        (VUSB_US_RIO_RECV_SLOTS + slot) * VUSB_US_RIO_SLOT_SIZE;
+        buffer.Length = chunk;
+        memcpy(rio->Region + buffer.Offset, data, chunk);
+
+        InterlockedIncrement(&conn->SendsInFlight);
+        InterlockedIncrement(&conn->Refs);
+
+        if (!rio->Fn.RIOSend(conn->Queue, &buffer, 1, defer ? RIO_MSG_DEFER : 0, conn)) {
+            InterlockedDecrement(&conn->SendsInFlight);
+            InterlockedDecrement(&conn->Refs);
+            return -1;
+        }
+
+        if (defer) {
+            conn->SendsDeferred = TRUE;
+        } else {
+            InterlockedIncrement64(&client->Context->IoSyscalls);
+        }
+
+        data += chunk;
+        length -= chunk;
+    }
+
+    return 0;
+}
+
+static DWORD WINAPI RioThread(LPVOID param)
+{
+    PVUSB_US_CONTEXT ctx = (PVUSB_US_CONTEXT)param;
+    PVUSB_US_RIO rio = (PVUSB_US_RIO)ctx->RioState;
+    RIORESULT results[VUSB_US_RIO_DEQUEUE_BATCH];
+    PVUSB_US_RIO_CONNECTION touched[VUSB_US_RIO_DEQUEUE_BATCH];
+    DWORD self = GetCurrentThreadId();
+
+    for (;;) {
+        DWORD bytes = 0;
+        ULONG_PTR key = 0;
+        LPOVERLAPPED overlapped = NULL;
+        int touchedCount = 0;
+        ULONG count;
+
+        GetQueuedCompletionStatus(ctx->IoPort, &bytes, &key, &overlapped, INFINITE);
+        if (!overlapped) {
+            /* Shutdown packet or the port itself failed */
+            break;
+        }
+        InterlockedIncrement64(&ctx->IoSyscalls);
+
+        /* The queue stays unarmed, and so owned by this thread, until RIONotify */
+        PVUSB_US_RIO_QUEUE queue = (PVUSB_US_RIO_QUEUE)overlapped;
+
+        count = rio->Fn.RIODequeueCompletion(queue->Cq, results, VUSB_US_RIO_DEQUEUE_BATCH);
+        if (count == RIO_CORRUPT_CQ) {
+            fprintf(stderr, "[RIO] Completion queue corrupt\n");
+            break;
+        }
+
+        for (ULONG i = 0; i < count; i++) {
+            PVUSB_US_RIO_SLOT slot = (PVUSB_US_RIO_SLOT)(ULONG_PTR)results[i].RequestContext;
+            PVUSB_US_RIO_CONNECTION conn = slot->Conn;
+
+            if (!conn->Closing && ctx->Running &&
+                results[i].Status == 0 && results[i].BytesTransferred > 0) {
+                PVUSB_US_CLIENT client = conn->Stream.Client;
+                const uint8_t* data = (const uint8_t*)rio->Region + conn->BufferOffset +
+                                      slot->Index * VUSB_US_RIO_SLOT_SIZE;
+
+                /* Defer this connection's requests until the batch is done */
+                if (conn->BatchThreadId != self) {
+                    conn->BatchThreadId = self;
+                    InterlockedIncrement(&conn->Refs);
+                    touched[touchedCount++] = conn;
+                }
+
+                if (RioConsume(ctx, conn, data, results[i].BytesTransferred) == 0 &&
+                    client->Connected) {
+                    BOOL posted;
+
+                    /* The completed request's reference carries over to the repost */
+                    EnterCriticalSection(&client->SendLock);
+                    posted = RioPostReceive(rio, conn, slot->Index, RIO_MSG_DEFER);
+                    if (posted) conn->RecvsDeferred = TRUE;
+                    LeaveCriticalSection(&client->SendLock);
+
+                    if (posted) continue;
+                }
+            }
+
+            if (!conn->Closing) {
+                RioClose(ctx, conn);
+            }
+            RioRelease(rio, conn);
+        }
+
+        /* One commit per connection covers everything queued in the batch */
+        for (int i = 0; i < touchedCount; i++) {
+            if (!touched[i]->Closing) {
+                RioCommit(ctx, touched[i]);
+            }
+            RioRelease(rio, touched[i]);
+        }
+
+        RioReapSends(rio);
+
+        rio->Fn.RIONotify(queue->Cq);
+        InterlockedIncrement64(&ctx->IoSyscalls);
+    }
+
+    return 0;
+}
+
+static void RioDestroy(PVUSB_US_CONTEXT ctx)
+{
+    PVUSB_US_RIO rio = (PVUSB_US_RIO)ctx->RioState;
+
+    if (!rio) return;
+
+    for (int i = 0; i < rio->QueueCount; i++) {
+        rio->Fn.RIOCloseCompletionQueue(rio->Queues[i].Cq);
+    }
+    if (rio->SendCq != RIO_INVALID_CQ) {
+        rio->Fn.RIOCloseCompletionQueue(rio->SendCq);
+    }
+    if (rio->BufferId != RIO_INVALID_BUFFERID) {
+        rio->Fn.RIODeregisterBuffer(rio->BufferId);
+    }
+    if (rio->Region) {
+        VirtualFree(rio->Region, 0, MEM_RELEASE);
+    }
+
+    /* Connections whose aborted requests never completed */
+    for (int i = 0; i < rio->ConnectionCount; i++) {
+        if (rio->Connections[i]) {
+            free(rio->Connections[i]->Stream.RxBuffer);
+            free(rio->Connections[i]);
+        }
+    }
+    free(rio->Connections);
+
+    DeleteCriticalSection(&rio->SendCqLock);
+    DeleteCriticalSection(&rio->Lock);
+    free(rio);
+    ctx->RioState = NULL;
+}
+
+/**
+ * RioCreate - Register the buffer region and create the completion queues
+ */
+static int RioCreate(PVUSB_US_CONTEXT ctx, int queueCount)
+{
+    GUID functionTableId = WSAID_MULTIPLE_RIO;
+    DWORD bytes = 0;
+    PVUSB_US_RIO rio;
+    DWORD clients = (DWORD)ctx->Config.MaxClients;
+    DWORD regionSize = clients * VUSB_US_RIO_CONNECTION_SIZE;
+
+    rio = (PVUSB_US_RIO)calloc(1, sizeof(VUSB_US_RIO));
+    if (!rio) return -1;
+
+    /* Registered memory cannot grow, so it is sized for MaxClients up front */
+    rio->Connections = (PVUSB_US_RIO_CONNECTION*)calloc(clients, sizeof(PVUSB_US_RIO_CONNECTION));
+    if (!rio->Connections) {
+        free(rio);
+        return -1;
+    }
+    rio->ConnectionCount = (int)clients;
+
+    rio->BufferId = RIO_INVALID_BUFFERID;
+    rio->SendCq = RIO_INVALID_CQ;
+    InitializeCriticalSection(&rio->SendCqLock);
+    InitializeCriticalSection(&rio->Lock);
+    ctx->RioState = rio;
+
+    if (WSAIoctl(ctx->ListenSocket, SIO_GET_MULTIPLE_EXTENSION_FUNCTION_POINTER,
+                 &functionTableId, sizeof(GUID), &rio->Fn, sizeof(rio->Fn),
+                 &bytes, NULL, NULL) == SOCKET_ERROR) {
+        fprintf(stderr, "[RIO] Registered I/O not available: %d\n", WSAGetLastError());
+        goto fail;
+    }
+
+    rio->Region = (char*)VirtualAlloc(NULL, regionSize, MEM_COMMIT | MEM_RESERVE,
+                                      PAGE_READWRITE);
+    if (!rio->Region) goto fail;
+
+    rio->BufferId = rio->Fn.RIORegisterBuffer(rio->Region, regionSize);
+    if (rio->BufferId == RIO_INVALID_BUFFERID) {
+        fprintf(stderr, "[RIO] RIORegisterBuffer failed: %d\n", WSAGetLastError());
+        goto fail;
+    }
+
+    rio->SendCq = rio->Fn.RIOCreateCompletionQueue(
+        clients * VUSB_US_RIO_SEND_SLOTS, NULL);
+    if (rio->SendCq == RIO_INVALID_CQ) goto fail;
+
+    for (int i = 0; i < queueCount; i++) {
+        PVUSB_US_RIO_QUEUE queue = &rio->Queues[i];
+        RIO_NOTIFICATION_COMPLETION notify;
+
+        memset(&notify, 0, sizeof(notify));
+        notify.Type = RIO_IOCP_COMPLETION;
+        notify.Iocp.IocpHandle = ctx->IoPort;
+        notify.Iocp.CompletionKey = queue;
+        notify.Iocp.Overlapped = &queue->Overlapped;
+
+        queue->Cq = rio->Fn.RIOCreateCompletionQueue(
+            clients * VUSB_US_RIO_RECV_SLOTS, &notify);
+        if (queue->Cq == RIO_INVALID_CQ) {
+            fprintf(stderr, "[RIO] RIOCreateCompletionQueue failed: %d\n", WSAGetLastError());
+            goto fail;
+        }
+        rio->QueueCount++;
+
+        rio->Fn.RIONotify(queue->Cq);
+    }
+
+    return 0;
+
+fail:
+    RioDestroy(ctx);
+    return -1;
+}
+
+static int RioAttach(PVUSB_US_CONTEXT ctx, PVUSB_US_CLIENT client)
+{
+    PVUSB_US_RIO rio = (PVUSB_US_RIO)ctx->RioState;
+    PVUSB_US_RIO_CONNECTION conn;
+    PVUSB_US_RIO_QUEUE queue;
+    BOOL posted = TRUE;
+    int index = -1;
+
+    conn = (PVUSB_US_RIO_CONNECTION)calloc(1, sizeof(VUSB_US_RIO_CONNECTION));
+    if (!conn) return -1;
+
+    conn->Stream.RxBuffer = (uint8_t*)malloc(VUSB_US_RX_INITIAL_SIZE);
+    if (!conn->Stream.RxBuffer) {
+        free(conn);
+        return -1;
+    }
+    conn->Stream.RxCapacity = VUSB_US_RX_INITIAL_SIZE;
+    conn->Stream.Client = client;
+    conn->Rio = rio;
+    conn->Refs = 1;
+
+    for (uint32_t i = 0; i < VUSB_US_RIO_RECV_SLOTS; i++) {
+        conn->RecvSlots[i].Conn = conn;
+        conn->RecvSlots[i].Index = i;
+    }
+
+    EnterCriticalSection(&rio->Lock);
+    for (int i = 0; i < rio->ConnectionCount; i++) {
+        if (!rio->Connections[i]) {
+            rio->Connections[i] = conn;
+            index = i;
+            break;
+        }
+    }
+    LeaveCriticalSection(&rio->Lock);
+
+    if (index < 0) {
+        free(conn->Stream.RxBuffer);
+        free(conn);
+        return -1;
+    }
+
+    conn->Index = index;
+    conn->BufferOffset = (ULONG)index * VUSB_US_RIO_CONNECTION_SIZE;
+
+    queue = &rio->Queues[(ULONG)InterlockedIncrement(&rio->NextQueue) % (ULONG)rio->QueueCount];
+    conn->Queue = rio->Fn.RIOCreateRequestQueue(client->Socket,
+                                                VUSB_US_RIO_RECV_SLOTS, 1,
+                                                VUSB_US_RIO_SEND_SLOTS, 1,
+                                                queue->Cq, rio->SendCq, conn);
+    if (conn->Queue == RIO_INVALID_RQ) {
+        fprintf(stderr, "[RIO] RIOCreateRequestQueue failed: %d\n", WSAGetLastError());
+        conn->Closing = TRUE;
+        RioRelease(rio, conn);
+        return -1;
+    }
+
+    client->IoState = conn;
+
+    /* Keep every receive slot posted; one commit publishes them all */
+    EnterCriticalSection(&client->SendLock);
+    for (uint32_t i = 0; i < VUSB_US_RIO_RECV_SLOTS && posted; i++) {
+        InterlockedIncrement(&conn->Refs);
+        posted = RioPostReceive(rio, conn, i, RIO_MSG_DEFER);
+        if (!posted) {
+            InterlockedDecrement(&conn->Refs);
+        }
+    }
+    if (posted) {
+        posted = rio->Fn.RIOReceive(conn->Queue, NULL, 0, RIO_MSG_COMMIT_ONLY, NULL);
+        InterlockedIncrement64(&ctx->IoSyscalls);
+    }
+    LeaveCriticalSection(&client->SendLock);
+
+    if (!posted) {
+        /* Requests already queued complete with an error once the socket closes */
+        client->IoState = NULL;
+        conn->Closing = TRUE;
+        conn->Stream.Client = NULL;
+        RioRelease(rio, conn);
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * RioDrain - Collect the completions of requests aborted at shutdown
+ */
+static void RioDrain(PVUSB_US_CONTEXT ctx)
+{
+    PVUSB_US_RIO rio = (PVUSB_US_RIO)ctx->RioState;
+    RIORESULT results[VUSB_US_RIO_DEQUEUE_BATCH];
+    DWORD start = GetTickCount();
+
+    for (;;) {
+        BOOL remaining = FALSE;
+
+        for (int q = 0; q < rio->QueueCount; q++) {
+            ULONG count = rio->Fn.RIODequeueCompletion(rio->Queues[q].Cq, results,
+                                                       VUSB_US_RIO_DEQUEUE_BATCH);
+            if (count == RIO_CORRUPT_CQ) continue;
+            for (ULONG i = 0; i < count; i++) {
+                PVUSB_US_RIO_SLOT slot = (PVUSB_US_RIO_SLOT)(ULONG_PTR)results[i].RequestContext;
+                RioRelease(rio, slot->Conn);
+            }
+        }
+        RioReapSends(rio);
+
+        EnterCriticalSection(&rio->Lock);
+        for (int i = 0; i < rio->ConnectionCount; i++) {
+            if (rio->Connections[i]) remaining = TRUE;
+        }
+        LeaveCriticalSection(&rio->Lock);
+
+        if (!remaining || GetTickCount() - start > 1000) break;
+        Sleep(10);
+    }
+}
+
+/* ============================================================
+ * Engine Control
+ * ============================================================ */
+
+int VusbUsIoStart(PVUSB_US_CONTEXT ctx)
+{
+    int threadCount = ctx->Config.ReactorThreads;
+
+    if (threadCount <= 0) {
+        SYSTEM_INFO sysInfo;
+        GetSystemInfo(&sysInfo);
+        threadCount = (int)sysInfo.dwNumberOfProcessors;
+    }
+    if (threadCount < 1) threadCount = 1;
+    if (threadCount > VUSB_US_MAX_REACTOR_THREADS) {
+        threadCount = VUSB_US_MAX_REACTOR_THREADS;
+    }
+
+    ctx->IoPort = CreateIoCompletionPort(INVALID_HANDLE_VALUE, NULL, 0, (DWORD)threadCount);
+    if (!ctx->IoPort) {
+        fprintf(stderr, "CreateIoCompletionPort failed: %lu\n", GetLastError());
+        return -1;
+    }
+
+    if (ctx->Config.IoEngine == VUSB_US_IO_RIO && RioCreate(ctx, threadCount) != 0) {
+        CloseHandle(ctx->IoPort);
+        ctx->IoPort = NULL;
+        return -1;
+    }
+
+    ctx->ReactorThreadCount = 0;
+    for (int i = 0; i < threadCount; i++) {
+        HANDLE thread = CreateThread(NULL, 0,
+                                     ctx->RioState ? RioThread : ReactorThread,
+                                     ctx, 0, NULL);
+        if (!thread) break;
+        ctx->ReactorThreads[ctx->ReactorThreadCount++] = thread;
+    }
+
+    if (ctx->ReactorThreadCount == 0) {
+        RioDestroy(ctx);
+        CloseHandle(ctx->IoPort);
+        ctx->IoPort = NULL;
+        return -1;
+    }
+
+    printf("[%s] Started with %d threads\n", ctx->RioState ? "RIO" : "Reactor",
+           ctx->ReactorThreadCount);
+    return 0;
+}
+
+int VusbUsIoAttach(PVUSB_US_CONTEXT ctx, PVUSB_US_CLIENT client)
+{
+    PVUSB_US_CONNECTION conn;
+    u_long nonBlocking = 1;
+
+    if (ctx->RioState) {
+        return RioAttach(ctx, client);
+    }
+
+    conn = (PVUSB_US_CONNECTION)calloc(1, sizeof(VUSB_US_CONNECTION));
+    if (!conn) return -1;
+
+    conn->RxBuffer = (uint8_t*)malloc(VUSB_US_RX_INITIAL_SIZE);
+    if (!conn->RxBuffer) {
+        free(conn);
+        return -1;
+    }
+    conn->RxCapacity = VUSB_US_RX_INITIAL_SIZE;
+    conn->Client = client;
+
+    if (ioctlsocket(client->Socket, FIONBIO, &nonBlocking) == SOCKET_ERROR ||
+        !CreateIoCompletionPort((HANDLE)client->Socket, ctx->IoPort, 0, 0)) {
+        free(conn->RxBuffer);
+        free(conn);
+        return -1;
+    }
+
+    client->IoState = conn;
+
+    if (ArmConnection(conn) != 0) {
+        client->IoState = NULL;
+        free(conn->RxBuffer);
+        free(conn);
+        return -1;
+    }
+
+    return 0;
+}
+
+void VusbUsIoStop(PVUSB_US_CONTEXT ctx)
+{
+    if (!ctx->IoPort) return;
+
+    /* Abort outstanding receives so their connections get closed */
+    EnterCriticalSection(&ctx->ClientLock);
+    for (int i = 0; i < ctx->Config.MaxClients; i++) {
+        if (ctx->Clients[i] && ctx->Clients[i]->IoState) {
+            ctx->Clients[i]->Connected = FALSE;
+            shutdown(ctx->Clients[i]->Socket, SD_BOTH);
+        }
+    }
+    LeaveCriticalSection(&ctx->ClientLock);
+
+    for (int i = 0; i < ctx->ReactorThreadCount; i++) {
+        PostQueuedCompletionStatus(ctx->IoPort, 0, 0, NULL);
+    }
+
+    WaitForMultipleObjects((DWORD)ctx->ReactorThreadCount, ctx->ReactorThreads, TRUE, 5000);
+    for (int i = 0; i < ctx->ReactorThreadCount; i++) {
+        CloseHandle(ctx->ReactorThreads[i]);
+        ctx->ReactorThreads[i] = NULL;
+    }
+    ctx->ReactorThreadCount = 0;
+
+    /* Release connections whose close notification was never dequeued */
+    for (;;) {
+        void* state = NULL;
+
+        EnterCriticalSection(&ctx->ClientLock);
+        for (int i = 0; i < ctx->Config.MaxClients && !state; i++) {
+            if (ctx->Clients[i] && ctx->Clients[i]->IoState) {
+                state = ctx->Clients[i]->IoState;
+            }
+        }
+        LeaveCriticalSection(&ctx->ClientLock);
+
+        if (!state) break;
+        if (ctx->RioState) {
+            RioClose(ctx, (PVUSB_US_RIO_CONNECTION)state);
+        } else {
+            CloseConnection(ctx, (PVUSB_US_CONNECTION)state);
+        }
+    }
+
+    if (ctx->RioState) {
+        RioDrain(ctx);
+        RioDestroy(ctx);
+    }
+
+    CloseHandle(ctx->IoPort);
+    ctx->IoPort = NULL;
+}
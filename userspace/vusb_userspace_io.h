@@ -0,0 +1,140 @@
+/**
+ * Virtual USB Userspace Network I/O Engines
+ *
+ * The reactor engine serves every client socket from a small, fixed set
+ * of threads. Sockets are non-blocking and registered with an I/O
+ * completion port; a zero-byte overlapped receive is kept armed on each
+ * socket as a readiness notification, after which the reactor drains the
+ * socket and parses VUSB_HEADER framed messages incrementally.
+ *
+ * The RIO engine uses Windows Registered I/O. All socket buffers live in
+ * one pre-registered region, every socket keeps several receives posted
+ * at all times, and requests queued while a batch of completions is
+ * dispatched are published with a single commit per socket. Completions
+ * for many sockets are collected with one dequeue, so the number of
+ * kernel transitions per message drops well below one under load.
+ */
+
+#ifndef VUSB_USERSPACE_IO_H
+#define VUSB_USERSPACE_IO_H
+
+#include <mswsock.h>
+#include "vusb_userspace.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Per-connection reactor state */
+typedef struct _VUSB_US_CONNECTION {
+    OVERLAPPED          Overlapped;         /* Readiness notification */
+    WSABUF              ZeroBuffer;         /* Zero-byte receive buffer */
+    PVUSB_US_CLIENT     Client;
+
+    /* Receive staging buffer, holds header and payload contiguously */
+    uint8_t*            RxBuffer;
+    uint32_t            RxCapacity;
+    uint32_t            RxLength;
+} VUSB_US_CONNECTION, *PVUSB_US_CONNECTION;
+
+/* RIO engine sizing */
+#define VUSB_US_RIO_SLOT_SIZE       16384   /* Bytes per registered buffer slot */
+#define VUSB_US_RIO_RECV_SLOTS      4       /* Receives kept posted per socket */
+#define VUSB_US_RIO_SEND_SLOTS      8       /* Sends in flight per socket */
+#define VUSB_US_RIO_DEQUEUE_BATCH   128     /* Completions taken per dequeue */
+
+#define VUSB_US_RIO_CONNECTION_SIZE \
+    ((VUSB_US_RIO_RECV_SLOTS + VUSB_US_RIO_SEND_SLOTS) * VUSB_US_RIO_SLOT_SIZE)
+
+typedef struct _VUSB_US_RIO VUSB_US_RIO, *PVUSB_US_RIO;
+typedef struct _VUSB_US_RIO_CONNECTION VUSB_US_RIO_CONNECTION, *PVUSB_US_RIO_CONNECTION;
+
+/* Request context of one posted receive */
+typedef struct _VUSB_US_RIO_SLOT {
+    PVUSB_US_RIO_CONNECTION Conn;
+    uint32_t                Index;
+} VUSB_US_RIO_SLOT, *PVUSB_US_RIO_SLOT;
+
+/* Per-connection RIO state */
+struct _VUSB_US_RIO_CONNECTION {
+    VUSB_US_CONNECTION  Stream;             /* Receive staging, as in the reactor */
+    PVUSB_US_RIO        Rio;
+    RIO_RQ              Queue;              /* Guarded by Client->SendLock */
+    int                 Index;              /* Slot in the registered region */
+    ULONG               BufferOffset;       /* Region offset of the first slot */
+    volatile LONG       Refs;               /* Owner plus outstanding requests */
+    BOOL                Closing;
+
+    /* Send ring, guarded by Client->SendLock */
+    uint32_t            SendNext;
+    volatile LONG       SendsInFlight;
+    BOOL                SendsDeferred;
+    BOOL                RecvsDeferred;
+    DWORD               BatchThreadId;      /* Thread dispatching a batch, or 0 */
+
+    VUSB_US_RIO_SLOT    RecvSlots[VUSB_US_RIO_RECV_SLOTS];
+};
+
+/* Receive completion queue, drained by whichever thread it notifies */
+typedef struct _VUSB_US_RIO_QUEUE {
+    OVERLAPPED          Overlapped;         /* RIONotify completion packet */
+    RIO_CQ              Cq;
+} VUSB_US_RIO_QUEUE, *PVUSB_US_RIO_QUEUE;
+
+/* Engine-wide RIO state */
+struct _VUSB_US_RIO {
+    RIO_EXTENSION_FUNCTION_TABLE Fn;
+    char*               Region;
+    RIO_BUFFERID        BufferId;
+
+    VUSB_US_RIO_QUEUE   Queues[VUSB_US_MAX_REACTOR_THREADS];
+    int                 QueueCount;
+    volatile LONG       NextQueue;
+
+    /* Send completions are polled by whoever needs ring space */
+    RIO_CQ              SendCq;
+    CRITICAL_SECTION    SendCqLock;
+
+    CRITICAL_SECTION    Lock;
+    PVUSB_US_RIO_CONNECTION* Connections;   /* Config.MaxClients entries */
+    int                 ConnectionCount;
+};
+
+/**
+ * VusbUsIoStart - Create the completion port and engine threads
+ * @ctx: Server context, ListenSocket already created
+ * @return: 0 on success
+ */
+int VusbUsIoStart(PVUSB_US_CONTEXT ctx);
+
+/**
+ * VusbUsIoAttach - Hand an accepted client socket to the I/O engine
+ * @ctx: Server context
+ * @client: Client already linked into ctx->Clients
+ * @return: 0 on success; on failure the caller still owns the client
+ */
+int VusbUsIoAttach(PVUSB_US_CONTEXT ctx, PVUSB_US_CLIENT client);
+
+/**
+ * VusbUsIoSend - Queue a message on a RIO connection
+ * @client: Client attached to the RIO engine, Client->SendLock held
+ * @data: Message data
+ * @length: Message length
+ * @return: 0 on success, negative if the connection failed
+ *
+ * Sends issued while the calling thread is dispatching the client's
+ * receive batch are deferred and committed together when it finishes.
+ */
+int VusbUsIoSend(PVUSB_US_CLIENT client, const uint8_t* data, uint32_t length);
+
+/**
+ * VusbUsIoStop - Stop the engine threads and release remaining clients
+ * @ctx: Server context
+ */
+void VusbUsIoStop(PVUSB_US_CONTEXT ctx);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* VUSB_USERSPACE_IO_H */
@@ -53,11 +53,20 @@ static void PrintUsage(const char* progname)
     printf("\n");
     printf("Options:\n");
     printf("  --port <port>        Listen port (default: %d)\n", VUSB_DEFAULT_PORT);
-    printf("  --max-clients <n>    Maximum clients (default: %d)\n", VUSB_US_MAX_CLIENTS);
-    printf("  --max-devices <n>    Maximum devices (default: %d)\n", VUSB_US_MAX_DEVICES);
+    printf("  --max-clients <n>    Maximum clients (default: %d)\n", VUSB_US_DEFAULT_CLIENTS);
+    printf("  --max-devices <n>    Maximum devices, up to %d (default: %d)\n",
+           VUSB_US_DEVICE_LIMIT, VUSB_US_DEFAULT_DEVICES);
     printf("  --simulation         Enable device simulation mode\n");
     printf("  --verbose            Enable verbose logging\n");
     printf("  --capture <file>     Capture USB traffic to file\n");
+    printf("  --io-engine <name>   Client I/O engine: threads, reactor, rio (default: threads)\n");
+    printf("  --reactor-threads <n> Reactor/RIO threads (default: one per CPU)\n");
+    printf("  --bundle-dir <dir>   Keep attach descriptor bundles in <dir>\n");
+    printf("  --resume-grace <ms>  Keep a dropped session's devices (default: %d, 0 = off)\n",
+           VUSB_US_RESUME_GRACE_MS);
+    printf("  --local-socket <path> Also listen on an AF_UNIX socket ('@name' = abstract)\n");
+    printf("  --local-any-user     Let in local clients run by other users\n");
+    printf("  --workers <n>        URB completion threads (default: one per CPU, 0 = none)\n");
     printf("  --help, -h           Show this help\n");
     printf("\n");
     printf("Description:\n");
@@ -101,6 +110,16 @@ static void PrintStats(PVUSB_US_CONTEXT ctx)
     printf("  URBs completed:    %llu\n", stats.TotalUrbsCompleted);
     printf("  Bytes in:          %llu\n", stats.TotalBytesIn);
     printf("  Bytes out:         %llu\n", stats.TotalBytesOut);
+    printf("  Messages received: %lld\n", ctx->IoMessages);
+    printf("  Socket calls:      %lld", ctx->IoSyscalls);
+    if (ctx->IoMessages > 0) {
+        printf(" (%.2f per message)", (double)ctx->IoSyscalls / (double)ctx->IoMessages);
+    }
+    printf("\n");
+    printf("  URB pool:          %ld in use, %ld slab allocations\n",
+           ctx->UrbPool.InUse, ctx->UrbPool.SlabAllocs);
+    printf("  Buffer pool:       %u heap allocations\n",
+           VusbBufferPoolHeapAllocs(&ctx->BufferPool));
     printf("=========================\n\n");
 }
 
@@ -109,8 +128,11 @@ static void PrintStats(PVUSB_US_CONTEXT ctx)
  */
 static void PrintDevices(PVUSB_US_CONTEXT ctx)
 {
-    VUSB_DEVICE_INFO devices[VUSB_US_MAX_DEVICES];
-    int count = VusbUsListDevices(ctx, devices, VUSB_US_MAX_DEVICES);
+    VUSB_DEVICE_INFO* devices = (VUSB_DEVICE_INFO*)malloc(ctx->Config.MaxDevices *
+                                                          sizeof(VUSB_DEVICE_INFO));
+    if (!devices) return;
+    
+    int count = VusbUsListDevices(ctx, devices, ctx->Config.MaxDevices);
     
     printf("\n=== Connected Devices (%d) ===\n", count);
     for (int i = 0; i < count; i++) {
@@ -123,6 +145,8 @@ static void PrintDevices(PVUSB_US_CONTEXT ctx)
         printf("  (none)\n");
     }
     printf("==============================\n\n");
+    
+    free(devices);
 }
 
 /**
@@ -202,16 +226,22 @@ static DWORD WINAPI ConsoleThread(LPVOID param)
 int main(int argc, char* argv[])
 {
     VUSB_US_CONFIG config = {0};
+    SYSTEM_INFO systemInfo;
     int result;
     BOOL enableConsole = TRUE;
     
     /* Set defaults */
     config.Port = VUSB_DEFAULT_PORT;
-    config.MaxClients = VUSB_US_MAX_CLIENTS;
-    config.MaxDevices = VUSB_US_MAX_DEVICES;
+    config.MaxClients = VUSB_US_DEFAULT_CLIENTS;
+    config.MaxDevices = VUSB_US_DEFAULT_DEVICES;
     config.EnableSimulation = FALSE;
     config.EnableLogging = FALSE;
     config.EnableCapture = FALSE;
+    config.IoEngine = VUSB_US_IO_THREADED;
+    config.ReactorThreads = 0;
+    config.ResumeGraceMs = VUSB_US_RESUME_GRACE_MS;
+    GetSystemInfo(&systemInfo);
+    config.Workers = (int)systemInfo.dwNumberOfProcessors;
     
     /* Parse command line */
     for (int i = 1; i < argc; i++) {
@@ -228,6 +258,30 @@ int main(int argc, char* argv[])
         } else if (strcmp(argv[i], "--capture") == 0 && i + 1 < argc) {
             config.EnableCapture = TRUE;
             strncpy(config.CaptureFile, argv[++i], MAX_PATH - 1);
+        } else if (strcmp(argv[i], "--io-engine") == 0 && i + 1 < argc) {
+            const char* engine = argv[++i];
+            if (strcmp(engine, "reactor") == 0) {
+                config.IoEngine = VUSB_US_IO_REACTOR;
+            } else if (strcmp(engine, "rio") == 0) {
+                config.IoEngine = VUSB_US_IO_RIO;
+            } else if (strcmp(engine, "threads") == 0) {
+                config.IoEngine = VUSB_US_IO_THREADED;
+            } else {
+                fprintf(stderr, "Unknown I/O engine: %s\n", engine);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--reactor-threads") == 0 && i + 1 < argc) {
+            config.ReactorThreads = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--bundle-dir") == 0 && i + 1 < argc) {
+            strncpy(config.BundleDirectory, argv[++i], MAX_PATH - 1);
+        } else if (strcmp(argv[i], "--resume-grace") == 0 && i + 1 < argc) {
+            config.ResumeGraceMs = (uint32_t)atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--local-socket") == 0 && i + 1 < argc) {
+            strncpy(config.LocalSocket, argv[++i], sizeof(config.LocalSocket) - 1);
+        } else if (strcmp(argv[i], "--workers") == 0 && i + 1 < argc) {
+            config.Workers = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--local-any-user") == 0) {
+            config.LocalAnyUser = TRUE;
         } else if (strcmp(argv[i], "--no-console") == 0) {
             enableConsole = FALSE;
         } else if (strcmp(argv[i], "--help") == 0 || strcmp(argv[i], "-h") == 0) {